@@ -28,6 +28,9 @@ struct arp_value {
 	char mac_dst[6];
 };
 
-CALI_MAP(cali_v4_arp, 2, BPF_MAP_TYPE_LRU_HASH, struct arp_key, struct arp_value, 10000, 0, MAP_PIN_GLOBAL)
+/* Sized to hold the mirrored neighbour tables of the host interfaces of a
+ * large L2 domain in addition to the entries learned from tunnel packets.
+ */
+CALI_MAP(cali_v4_arp, 3, BPF_MAP_TYPE_LRU_HASH, struct arp_key, struct arp_value, 100000, 0, MAP_PIN_GLOBAL)
 
 #endif /* __CALI_ARP_H__ */
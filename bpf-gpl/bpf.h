@@ -62,19 +62,11 @@ struct bpf_map_def_extended {
 #define CALI_TC_TUNNEL		(1<<2)
 // CALI_CGROUP is set when compiling the cgroup connect-time load balancer programs.
 #define CALI_CGROUP		(1<<3)
-// CALI_TC_DSR is set when compiling programs for DSR mode.  In DSR mode, traffic to node
-// ports is encapped on the "request" leg but the response is returned directly from the
-// node with the backing workload.
-#define CALI_TC_DSR		(1<<4)
 // CALI_TC_WIREGUARD is set for the programs attached to the wireguard interface.
 #define CALI_TC_WIREGUARD	(1<<5)
 // CALI_XDP_PROG is set for programs attached to the XDP hook
 #define CALI_XDP_PROG 	(1<<6)
 
-#ifndef CALI_DROP_WORKLOAD_TO_HOST
-#define CALI_DROP_WORKLOAD_TO_HOST false
-#endif
-
 #ifndef CALI_COMPILE_FLAGS
 #define CALI_COMPILE_FLAGS 0
 #endif
@@ -102,7 +94,12 @@ struct bpf_map_def_extended {
 #define CALI_F_WG_INGRESS    (CALI_F_INGRESS && CALI_F_WIREGUARD)
 
 #define CALI_F_CGROUP	(((CALI_COMPILE_FLAGS) & CALI_CGROUP) != 0)
-#define CALI_F_DSR	(CALI_COMPILE_FLAGS & CALI_TC_DSR)
+/* DSR applies to the from-workload programs and to the programs of the host's own interfaces.
+ * In DSR mode, traffic to node ports is encapped on the "request" leg but the response is
+ * returned directly from the node with the backing workload.
+ */
+#define CALI_F_DSR	((CALI_F_FROM_WEP || (CALI_F_HEP && !CALI_F_TUNNEL && !CALI_F_WIREGUARD)) && \
+			 CALI_DSR_ENABLED)
 
 #define CALI_RES_REDIR_BACK	108 /* packet should be sent back the same iface */
 #define CALI_RES_REDIR_IFINDEX	109 /* packet should be sent straight to
@@ -112,11 +109,11 @@ struct bpf_map_def_extended {
 #error CALI_RES_ values need to be increased above TC_ACT_VALUE_MAX
 #endif
 
-#ifndef CALI_FIB_LOOKUP_ENABLED
-#define CALI_FIB_LOOKUP_ENABLED true
-#endif
-
-#define CALI_FIB_ENABLED (!CALI_F_L3 && CALI_FIB_LOOKUP_ENABLED && CALI_F_TO_HOST)
+/* CALI_FIB_APPLIES is a compile-time constant, it can be used with #if.  CALI_FIB_ENABLED is
+ * only known at load time in the production programs.
+ */
+#define CALI_FIB_APPLIES (!CALI_F_L3 && CALI_F_TO_HOST)
+#define CALI_FIB_ENABLED (CALI_FIB_APPLIES && CALI_FIB_LOOKUP_ENABLED)
 
 #define COMPILE_TIME_ASSERT(expr) {typedef char array[(expr) ? 1 : -1];}
 static CALI_BPF_INLINE void __compile_asserts(void) {
@@ -126,9 +123,8 @@ static CALI_BPF_INLINE void __compile_asserts(void) {
 	COMPILE_TIME_ASSERT(
 		CALI_COMPILE_FLAGS == 0 ||
 		!!(CALI_COMPILE_FLAGS & CALI_CGROUP) !=
-		!!(CALI_COMPILE_FLAGS & (CALI_TC_HOST_EP | CALI_TC_INGRESS | CALI_TC_TUNNEL | CALI_TC_DSR | CALI_XDP_PROG))
+		!!(CALI_COMPILE_FLAGS & (CALI_TC_HOST_EP | CALI_TC_INGRESS | CALI_TC_TUNNEL | CALI_XDP_PROG))
 	);
-	COMPILE_TIME_ASSERT(!CALI_F_DSR || (CALI_F_DSR && CALI_F_FROM_WEP) || (CALI_F_DSR && CALI_F_HEP));
 	COMPILE_TIME_ASSERT(CALI_F_TO_HOST || CALI_F_FROM_HOST);
 #pragma clang diagnostic pop
 }
@@ -208,10 +204,41 @@ enum calico_skb_mark {
 	CALI_SKB_MARK_CT_ESTABLISHED_MASK    = CALI_MARK_CALICO      | 0x08000000,
 };
 
+#ifndef barrier
+/* barrier stops the compiler from reordering or eliding memory accesses across it. */
+#define barrier() asm volatile("" ::: "memory")
+#endif
+
+/* Felix reads the per-CPU rings of records (see bpf/ring) while the programs write them, so
+ * each record is guarded by its sequence number at both ends.  cali_ring_rec_begin() clears
+ * both before the record is (over)written and cali_ring_rec_end() sets them once it is
+ * complete, the trailing one first.  Felix copies the ring from start to end, so a record that
+ * is overwritten while it is copied is caught by its trailing sequence number. */
+#define cali_ring_rec_begin(rec) do {	\
+	(rec)->seq = 0;			\
+	(rec)->seq_end = 0;		\
+	barrier();			\
+} while (0)
+
+#define cali_ring_rec_end(rec, s) do {	\
+	barrier();			\
+	(rec)->seq_end = (s);		\
+	barrier();			\
+	(rec)->seq = (s);		\
+} while (0)
+
 /* bpf_exit inserts a BPF exit instruction with the given return value. In a fully-inlined
  * BPF program this allows us to terminate early.  However(!) the exit instruction is also used
  * for function return so we need to be careful if we ever start using non-inlined
  * functions in anger. */
+#ifdef __CALI_SIM__
+/* In the userspace simulator, the run is unwound back to where it started instead (see
+ * sim/sim.c). */
+_Noreturn void sim_exit(int rc);
+static CALI_BPF_INLINE _Noreturn void bpf_exit(int rc) {
+	sim_exit(rc);
+}
+#else
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Winvalid-noreturn"
 static CALI_BPF_INLINE _Noreturn void bpf_exit(int rc) {
@@ -225,6 +252,7 @@ static CALI_BPF_INLINE _Noreturn void bpf_exit(int rc) {
 	);
 }
 #pragma clang diagnostic pop
+#endif /* __CALI_SIM__ */
 
 #define ip_is_dnf(ip) ((ip)->frag_off & bpf_htons(0x4000))
 #define ip_frag_no(ip) ((ip)->frag_off & bpf_htons(0x1fff))
@@ -242,6 +270,16 @@ static CALI_BPF_INLINE void ip_dec_ttl(struct iphdr *ip)
 
 #define ip_ttl_exceeded(ip) (CALI_F_TO_HOST && !CALI_F_TUNNEL && (ip)->ttl <= 1)
 
+#ifdef __CALI_SIM__
+/* There is no loader to patch the placeholders in the simulator, the values are read from
+ * globals that the harness sets instead. */
+#define CALI_CONFIGURABLE_DEFINE(name, pattern)							\
+extern __u32 cali_sim_##name;									\
+static CALI_BPF_INLINE __be32 cali_configurable_##name()					\
+{												\
+	return cali_sim_##name;									\
+}
+#else
 #define CALI_CONFIGURABLE_DEFINE(name, pattern)							\
 static CALI_BPF_INLINE __be32 cali_configurable_##name()					\
 {												\
@@ -249,6 +287,7 @@ static CALI_BPF_INLINE __be32 cali_configurable_##name()					\
 	asm("%0 = " #pattern ";" : "=r"(ret) /* output */ : /* no inputs */ : /* no clobber */);\
 	return ret;										\
 }
+#endif /* __CALI_SIM__ */
 
 #define CALI_CONFIGURABLE(name)	cali_configurable_##name()
 
@@ -257,12 +296,58 @@ CALI_CONFIGURABLE_DEFINE(tunnel_mtu, 0x55544d54) /* be 0x55544d54 = ASCII(TMTU)
 CALI_CONFIGURABLE_DEFINE(vxlan_port, 0x52505856) /* be 0x52505856 = ASCII(VXPR) */
 CALI_CONFIGURABLE_DEFINE(intf_ip, 0x46544e49) /*be 0x46544e49 = ASCII(INTF) */
 CALI_CONFIGURABLE_DEFINE(ext_to_svc_mark, 0x4b52414d) /*be 0x4b52414d = ASCII(MARK) */
+CALI_CONFIGURABLE_DEFINE(global_flags, 0x53474c46) /*be 0x53474c46 = ASCII(FLGS) */
 
 #define HOST_IP		CALI_CONFIGURABLE(host_ip)
 #define TUNNEL_MTU 	CALI_CONFIGURABLE(tunnel_mtu)
 #define VXLAN_PORT 	CALI_CONFIGURABLE(vxlan_port)
 #define INTF_IP		CALI_CONFIGURABLE(intf_ip)
 #define EXT_TO_SVC_MARK	CALI_CONFIGURABLE(ext_to_svc_mark)
+#define GLOBAL_FLAGS	CALI_CONFIGURABLE(global_flags)
+
+/* Bits of GLOBAL_FLAGS, the settings that Felix chooses when it loads a program rather than
+ * by picking one of several objects.  The verifier sees the patched value as a constant, so it
+ * only walks the code that the set bits enable.  The XDP and connect-time objects, to which
+ * none of the settings apply, define the CALI_*_ENABLED settings below at compile time
+ * instead, see calculate-flags.
+ *
+ * WARNING: must be kept in sync with the Globals* constants in bpf/tc/compiler.go.
+ */
+#define CALI_GLOBALS_DROP_WORKLOAD_TO_HOST	(1<<0)
+#define CALI_GLOBALS_FIB_LOOKUP			(1<<1)
+#define CALI_GLOBALS_DSR			(1<<2)
+/* The NO_* bits switch off stages that Felix knows to be unused on this node: service NAT when
+ * its kube-proxy isn't running, the reverse lookup of connect-time load balancer NAT when that
+ * is disabled and the VXLAN decap when there is neither NAT nor a VXLAN overlay.  They are
+ * negative so that a program that is loaded with no flags has all its stages.
+ */
+#define CALI_GLOBALS_NO_NAT			(1<<3)
+#define CALI_GLOBALS_NO_CTLB			(1<<4)
+#define CALI_GLOBALS_NO_VXLAN			(1<<5)
+
+#ifndef CALI_DROP_WORKLOAD_TO_HOST
+#define CALI_DROP_WORKLOAD_TO_HOST (!!(GLOBAL_FLAGS & CALI_GLOBALS_DROP_WORKLOAD_TO_HOST))
+#endif
+
+#ifndef CALI_FIB_LOOKUP_ENABLED
+#define CALI_FIB_LOOKUP_ENABLED (!!(GLOBAL_FLAGS & CALI_GLOBALS_FIB_LOOKUP))
+#endif
+
+#ifndef CALI_DSR_ENABLED
+#define CALI_DSR_ENABLED (!!(GLOBAL_FLAGS & CALI_GLOBALS_DSR))
+#endif
+
+#ifndef CALI_NAT_ENABLED
+#define CALI_NAT_ENABLED (!(GLOBAL_FLAGS & CALI_GLOBALS_NO_NAT))
+#endif
+
+#ifndef CALI_CTLB_ENABLED
+#define CALI_CTLB_ENABLED (!(GLOBAL_FLAGS & CALI_GLOBALS_NO_CTLB))
+#endif
+
+#ifndef CALI_VXLAN_ENABLED
+#define CALI_VXLAN_ENABLED (!(GLOBAL_FLAGS & CALI_GLOBALS_NO_VXLAN))
+#endif
 
 #define MAP_PIN_GLOBAL	2
 
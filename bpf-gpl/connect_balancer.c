@@ -30,6 +30,7 @@
 #include "nat.h"
 
 #include "sendrecv.h"
+#include "mapstats.h"
 
 __attribute__((section("calico_connect_v4_noop")))
 int cali_noop_v4(struct bpf_sock_addr *ctx)
@@ -40,6 +41,7 @@ int cali_noop_v4(struct bpf_sock_addr *ctx)
 
 static CALI_BPF_INLINE void do_nat_common(struct bpf_sock_addr *ctx, __u8 proto)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 	/* We do not know what the source address is yet, we only know that it
 	 * is the localhost, so we might just use 0.0.0.0. That would not
 	 * conflict with traffic from elsewhere.
@@ -75,7 +77,7 @@ static CALI_BPF_INLINE void do_nat_common(struct bpf_sock_addr *ctx, __u8 proto)
 		.ip	= ctx->user_ip4,
 		.port	= ctx->user_port,
 	};
-	int rc = cali_v4_ct_nats_update_elem(&natk, &val, 0);
+	int rc = cali_map_err(CALI_MAP_ID_CT_NATS, cali_v4_ct_nats_update_elem(&natk, &val, 0));
 	if (rc) {
 		/* if this happens things are really bad! report */
 		CALI_INFO("Failed to update ct_nats map rc=%d\n", rc);
@@ -93,7 +95,7 @@ static CALI_BPF_INLINE void do_nat_common(struct bpf_sock_addr *ctx, __u8 proto)
 			.cookie	= cookie,
 		};
 
-		if (cali_v4_srmsg_update_elem(&key, &val, 0)) {
+		if (cali_map_err(CALI_MAP_ID_SRMSG, cali_v4_srmsg_update_elem(&key, &val, 0))) {
 			/* if this happens things are really bad! report */
 			CALI_INFO("Failed to update map\n");
 			goto out;
@@ -110,6 +112,7 @@ out:
 __attribute__((section("calico_connect_v4")))
 int cali_ctlb_v4(struct bpf_sock_addr *ctx)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 	CALI_DEBUG("calico_connect_v4\n");
 
 	/* do not process anything non-TCP or non-UDP, but do not block it, will be
@@ -161,6 +164,7 @@ out:
 __attribute__((section("calico_recvmsg_v4")))
 int cali_ctlb_recvmsg_v4(struct bpf_sock_addr *ctx)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 	CALI_DEBUG("recvmsg_v4 %x:%d\n", bpf_ntohl(ctx->user_ip4), ctx_port_to_host(ctx->user_port));
 
 	if (ctx->type != SOCK_DGRAM) {
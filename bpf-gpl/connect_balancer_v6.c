@@ -41,6 +41,7 @@ int cali_ctlb_sendmsg_v6(struct bpf_sock_addr *ctx)
 __attribute__((section("calico_recvmsg_v6")))
 int cali_ctlb_recvmsg_v6(struct bpf_sock_addr *ctx)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 	__be32 ipv4;
 
 	CALI_DEBUG("recvmsg_v6 ip[0-1] %x%x\n",
@@ -23,6 +23,8 @@
 #include "bpf.h"
 #include "icmp.h"
 #include "types.h"
+#include "flow.h"
+#include "mapstats.h"
 
 // Connection tracking.
 
@@ -54,6 +56,7 @@ static CALI_BPF_INLINE void dump_ct_key(struct calico_ct_key *k)
 static CALI_BPF_INLINE int calico_ct_v4_create_tracking(struct ct_create_ctx *ct_ctx,
 							struct calico_ct_key *k)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 	__be32 ip_src = ct_ctx->src;
 	__be32 ip_dst = ct_ctx->dst;
 	__u16 sport = ct_ctx->sport;
@@ -78,8 +81,7 @@ static CALI_BPF_INLINE int calico_ct_v4_create_tracking(struct ct_create_ctx *ct
 		 * have created a conntrack entry.  Look that one up instead of
 		 * creating one.
 		 */
-		CALI_DEBUG("CT-ALL Asked to create entry but packet is marked as "
-				"from another endpoint, doing lookup\n");
+		CALI_DEBUG("CT-ALL Create: packet marked as from another endpoint, doing lookup\n");
 		bool srcLTDest = src_lt_dest(ip_src, ip_dst, sport, dport);
 		*k = ct_make_key(srcLTDest, ct_ctx->proto, ip_src, ip_dst, sport, dport);
 		struct calico_ct_value *ct_value = cali_v4_ct_lookup_elem(k);
@@ -200,7 +202,16 @@ create:
 		CALI_DEBUG("CT-ALL Whitelisted dest side - to EP\n");
 	}
 
-	err = cali_v4_ct_update_elem(k, &ct_value, 0);
+	err = cali_map_err(CALI_MAP_ID_CT, cali_v4_ct_update_elem(k, &ct_value, 0));
+	if (!err) {
+		/* The packet that creates the entry missed it in the lookup, so count it here,
+		 * under the same rule as calico_ct_v4_lookup(). */
+		__u32 len = 0;
+		if (CALI_F_TO_HOST || !skb_seen(ct_ctx->skb)) {
+			len = ct_ctx->skb->len;
+		}
+		cali_flow_start(k, &ct_value, src_to_dst->ifindex, srcLTDest, len);
+	}
 
 out:
 	CALI_VERB("CT-ALL Create result: %d.\n", err);
@@ -243,7 +254,7 @@ static CALI_BPF_INLINE int calico_ct_v4_create_nat_fwd(struct ct_create_ctx *ct_
 
 	dump_ct_key(&k);
 	ct_value.nat_rev_key = *rk;
-	int err = cali_v4_ct_update_elem(&k, &ct_value, 0);
+	int err = cali_map_err(CALI_MAP_ID_CT, cali_v4_ct_update_elem(&k, &ct_value, 0));
 	CALI_VERB("CT-%d Create result: %d.\n", ip_proto, err);
 	return err;
 }
@@ -255,6 +266,7 @@ static CALI_BPF_INLINE int calico_ct_v4_create_nat_fwd(struct ct_create_ctx *ct_
  */
 static CALI_BPF_INLINE bool skb_icmp_err_unpack(struct cali_tc_ctx *ctx, struct ct_lookup_ctx *ct_ctx)
 {
+	CALI_LOG_LEVEL_CACHE(ctx->log_level);
 	/* ICMP packet is an error, its payload should contain the full IP header and
 	 * at least the first 8 bytes of the next header. */
 
@@ -371,6 +383,7 @@ static CALI_BPF_INLINE void ct_tcp_entry_update(struct tcphdr *tcp_header,
 
 static CALI_BPF_INLINE struct calico_ct_result calico_ct_v4_lookup(struct cali_tc_ctx *tc_ctx)
 {
+	CALI_LOG_LEVEL_CACHE(tc_ctx->log_level);
 	// TODO: refactor the conntrack code to simply use the tc_ctx instead of its own.  This
 	// code is a direct translation of the pre-tc_ctx code so it has some duplication (but it
 	// needs a bit more analysis to sort out because the ct_ctx gets modified in place in
@@ -527,6 +540,11 @@ static CALI_BPF_INLINE struct calico_ct_result calico_ct_v4_lookup(struct cali_t
 
 	struct calico_ct_leg *src_to_dst, *dst_to_src;
 
+	/* The tracking entry's key and whether the packet goes from A to B in it, for the flow
+	 * counters. */
+	struct calico_ct_key *flow_key = &k;
+	bool flow_a_to_b = srcLTDest;
+
 	struct calico_ct_value *tracking_v;
 	switch (v->type) {
 	case CALI_CT_TYPE_NAT_FWD:
@@ -541,7 +559,9 @@ static CALI_BPF_INLINE struct calico_ct_result calico_ct_v4_lookup(struct cali_t
 		// Record timestamp.
 		tracking_v->last_seen = now;
 
-		if (ip_src == v->nat_rev_key.addr_a && sport == v->nat_rev_key.port_a) {
+		flow_key = &v->nat_rev_key;
+		flow_a_to_b = ip_src == v->nat_rev_key.addr_a && sport == v->nat_rev_key.port_a;
+		if (flow_a_to_b) {
 			CALI_VERB("CT-ALL FWD-REV src_to_dst A->B\n");
 			src_to_dst = &tracking_v->a_to_b;
 			dst_to_src = &tracking_v->b_to_a;
@@ -688,9 +708,16 @@ static CALI_BPF_INLINE struct calico_ct_result calico_ct_v4_lookup(struct cali_t
 			tmp = src_to_dst;
 			src_to_dst = dst_to_src;
 			dst_to_src = tmp;
+			flow_a_to_b = !flow_a_to_b;
 		}
 	}
 
+	/* Count each packet once per host: at the first program that it goes through, which
+	 * is the one towards the host unless the packet comes from the host itself. */
+	if (CALI_F_TO_HOST || !skb_seen(tc_ctx->skb)) {
+		cali_flow_count(flow_key, flow_a_to_b, tc_ctx->skb->len);
+	}
+
 	if (ret_from_tun) {
 		CALI_DEBUG("Packet returned from tunnel %x\n", bpf_ntohl(tc_ctx->state->tun_ip));
 	} else if (CALI_F_TO_HOST) {
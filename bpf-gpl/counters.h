@@ -0,0 +1,104 @@
+// Project Calico BPF dataplane programs.
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+#ifndef __CALI_BPF_COUNTERS_H__
+#define __CALI_BPF_COUNTERS_H__
+
+#include "bpf.h"
+#include "reasons.h"
+
+/* The verdict counters count the packets (and bytes) that leave the programs, by hook, by
+ * the reason that the program recorded and by verdict (allowed or dropped).  They live in a
+ * per-CPU array, indexed by ((hook * CALI_VCTR_REASONS) + reason index) * 2 + drop, that
+ * Felix exports as metrics.
+ *
+ * WARNING: must be kept in sync with the definitions in bpf/counters/verdict_map.go.
+ */
+struct cali_verdict_ctr {
+	__u64 packets;
+	__u64 bytes;
+};
+
+enum cali_vctr_hook {
+	CALI_VCTR_HOOK_FROM_HEP,
+	CALI_VCTR_HOOK_TO_HEP,
+	CALI_VCTR_HOOK_FROM_WEP,
+	CALI_VCTR_HOOK_TO_WEP,
+	CALI_VCTR_HOOK_XDP,
+
+	CALI_VCTR_HOOKS,
+};
+
+#define CALI_VCTR_REASONS 20
+
+CALI_MAP_V1(cali_v4_vctrs,
+		BPF_MAP_TYPE_PERCPU_ARRAY,
+		__u32, struct cali_verdict_ctr,
+		CALI_VCTR_HOOKS * CALI_VCTR_REASONS * 2, 0, MAP_PIN_GLOBAL)
+
+/* The hook is known at compile time. */
+#define CALI_VCTR_HOOK (CALI_F_XDP ? CALI_VCTR_HOOK_XDP : \
+			CALI_F_FROM_HEP ? CALI_VCTR_HOOK_FROM_HEP : \
+			CALI_F_TO_HEP ? CALI_VCTR_HOOK_TO_HEP : \
+			CALI_F_FROM_WEP ? CALI_VCTR_HOOK_FROM_WEP : \
+			CALI_VCTR_HOOK_TO_WEP)
+
+/* cali_reason_idx maps the (sparse) reason codes to the dense indexes of the counters.
+ * Unknown codes are counted as CALI_REASON_UNKNOWN. */
+static CALI_BPF_INLINE __u32 cali_reason_idx(enum calico_reason reason)
+{
+	switch (reason) {
+	case CALI_REASON_SHORT:			return 1;
+	case CALI_REASON_NOT_IP:		return 2;
+	case CALI_REASON_V6_WORKLOAD:		return 3;
+	case CALI_REASON_FAILSAFE:		return 4;
+	case CALI_REASON_DNT:			return 5;
+	case CALI_REASON_PREDNAT:		return 6;
+	case CALI_REASON_POL:			return 7;
+	case CALI_REASON_CT:			return 8;
+	case CALI_REASON_BYPASS:		return 9;
+	case CALI_REASON_CT_NAT:		return 10;
+	case CALI_REASON_CSUM_FAIL:		return 11;
+	case CALI_REASON_ENCAP_FAIL:		return 12;
+	case CALI_REASON_DECAP_FAIL:		return 13;
+	case CALI_REASON_ICMP_DF:		return 14;
+	case CALI_REASON_IP_OPTIONS:		return 15;
+	case CALI_REASON_IP_MALFORMED:		return 16;
+	case CALI_REASON_UNAUTH_SOURCE:		return 17;
+	case CALI_REASON_RT_UNKNOWN:		return 18;
+	case CALI_REASON_ACCEPTED_BY_XDP:	return 19;
+	default:				return 0;
+	}
+}
+
+static CALI_BPF_INLINE void cali_count_verdict(enum calico_reason reason, bool drop, __u32 len)
+{
+	__u32 key = (CALI_VCTR_HOOK * CALI_VCTR_REASONS + cali_reason_idx(reason)) * 2 + (drop ? 1 : 0);
+	struct cali_verdict_ctr *ctr = cali_v4_vctrs_lookup_elem(&key);
+
+	/* The map is per-CPU so no atomic operations are needed. */
+	if (ctr) {
+		ctr->packets++;
+		ctr->bytes += len;
+	}
+}
+
+/* cali_ctx_len returns the length of the packet of a cali_tc_ctx. */
+#define cali_ctx_len(ctx) (CALI_F_XDP ? \
+		(__u32)((long)(ctx)->xdp->data_end - (long)(ctx)->xdp->data) : (ctx)->skb->len)
+
+#endif /* __CALI_BPF_COUNTERS_H__ */
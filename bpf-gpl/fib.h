@@ -20,9 +20,13 @@
 
 #include "types.h"
 #include "skb.h"
+#include "trace.h"
+#include "counters.h"
+#include "latency.h"
+#include "sample.h"
 
-#if CALI_FIB_ENABLED
-#define fwd_fib(fwd)			((fwd)->fib)
+#if CALI_FIB_APPLIES
+#define fwd_fib(fwd)			(CALI_FIB_ENABLED && (fwd)->fib)
 #define fwd_fib_set(fwd, v)		((fwd)->fib = v)
 #define fwd_fib_set_flags(fwd, flags)	((fwd)->fib_flags = flags)
 #else
@@ -33,6 +37,7 @@
 
 static CALI_BPF_INLINE int forward_or_drop(struct cali_tc_ctx *ctx)
 {
+	CALI_LOG_LEVEL_CACHE(ctx->log_level);
 	int rc = ctx->fwd.res;
 	enum calico_reason reason = ctx->fwd.reason;
 	struct cali_tc_state *state = ctx->state;
@@ -41,6 +46,10 @@ static CALI_BPF_INLINE int forward_or_drop(struct cali_tc_ctx *ctx)
 		goto deny;
 	}
 
+	/* Only packets that get this far were accepted, denied packets count the time in the
+	 * forward stage. */
+	cali_lat_record(state, CALI_LAT_ACCEPTED);
+
 	if (rc == CALI_RES_REDIR_BACK) {
 		int redir_flags = 0;
 		if  (CALI_F_FROM_HOST) {
@@ -109,7 +118,7 @@ skip_redir_ifindex:
 		rc = TC_ACT_UNSPEC;
 	}
 
-#if CALI_FIB_ENABLED
+#if CALI_FIB_APPLIES
 	// Try a short-circuit FIB lookup.
 	if (fwd_fib(&ctx->fwd)) {
 		/* XXX we might include the tot_len in the fwd, set it once when
@@ -186,7 +195,7 @@ skip_redir_ifindex:
 	}
 
 cancel_fib:
-#endif /* CALI_FIB_ENABLED */
+#endif /* CALI_FIB_APPLIES */
 
 skip_fib:
 
@@ -218,20 +227,29 @@ skip_fib:
 		ctx->skb->mark = ctx->fwd.mark; /* make sure that each pkt has SEEN mark */
 	}
 
-	if (CALI_LOG_LEVEL >= CALI_LOG_LEVEL_INFO) {
+	/* The start time is only taken if Info logs were enabled when the program started. */
+	if (state->prog_start_time) {
 		__u64 prog_end_time = bpf_ktime_get_ns();
 		CALI_INFO("Final result=ALLOW (%d). Program execution time: %lluns\n",
 				reason, prog_end_time-state->prog_start_time);
 	}
+	CALI_TRACE(state, "Final result=ALLOW (%d) rc=%d mark=%x\n", reason, rc, ctx->skb->mark);
+	cali_count_verdict(reason, false, ctx->skb->len);
+	cali_sample_skb(ctx->skb, reason, false);
+	cali_lat_record(state, CALI_LAT_FWD);
 
 	return rc;
 
 deny:
-	if (CALI_LOG_LEVEL >= CALI_LOG_LEVEL_INFO) {
+	if (state->prog_start_time) {
 		__u64 prog_end_time = bpf_ktime_get_ns();
 		CALI_INFO("Final result=DENY (%x). Program execution time: %lluns\n",
 				reason, prog_end_time-state->prog_start_time);
 	}
+	CALI_TRACE(state, "Final result=DENY (%d)\n", reason);
+	cali_count_verdict(ctx->fwd.reason, true, ctx->skb->len);
+	cali_sample_skb(ctx->skb, ctx->fwd.reason, true);
+	cali_lat_record(state, CALI_LAT_FWD);
 
 	return TC_ACT_SHOT;
 }
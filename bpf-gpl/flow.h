@@ -0,0 +1,147 @@
+// Project Calico BPF dataplane programs.
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+#ifndef __CALI_BPF_FLOW_H__
+#define __CALI_BPF_FLOW_H__
+
+#include "bpf.h"
+#include "conntrack_types.h"
+#include "mapstats.h"
+
+/* Flow records stream the start of each conntrack flow to Felix without it having to dump
+ * cali_v4_ct.  calico_ct_v4_create_tracking() writes a record to a per-CPU ring, in the same
+ * way as the log records in log.h, and Felix writes the matching flow-end record when its
+ * conntrack scanner deletes the entry.  The packets and bytes of each leg of a flow are
+ * counted in cali_v4_flow_ctrs, keyed like the tracking entry (the reverse entry for NAT).
+ * The counters are shared between CPUs, rather than per-CPU, to keep the map at the same
+ * scale as the conntrack map.
+ *
+ * Nothing is written or counted unless Felix enables flows in cali_v4_flow_cfg.
+ *
+ * WARNING: must be kept in sync with the definitions in bpf/conntrack/flows.go.
+ */
+#define CALI_FLOW_RING_SIZE 256
+
+struct cali_flow_rec {
+	__u64 seq; /* Set once the record is complete, 0 while it is being written. */
+	__u64 created;
+	struct calico_ct_key key;
+	__be32 orig_ip;
+	__u16 orig_port;
+	__u8 type;
+	__u8 flags;
+	__u32 ifindex;
+	__u32 pad;
+	__u64 seq_end; /* Copy of seq, see cali_ring_rec_begin(). */
+};
+
+struct cali_flow_ring {
+	__u64 seq; /* Number of records written so far. */
+	struct cali_flow_rec recs[CALI_FLOW_RING_SIZE];
+};
+
+struct cali_flow_ctrs {
+	__u64 a_to_b_packets;
+	__u64 a_to_b_bytes;
+	__u64 b_to_a_packets;
+	__u64 b_to_a_bytes;
+};
+
+CALI_MAP_V1(cali_v4_flow_rb,
+		BPF_MAP_TYPE_PERCPU_ARRAY,
+		__u32, struct cali_flow_ring,
+		1, 0, MAP_PIN_GLOBAL)
+
+CALI_MAP_V1(cali_v4_flow_ctrs,
+		BPF_MAP_TYPE_LRU_HASH,
+		struct calico_ct_key, struct cali_flow_ctrs,
+		512000, 0, MAP_PIN_GLOBAL)
+
+/* Non-zero to enable flow records and counters. */
+CALI_MAP_V1(cali_v4_flow_cfg,
+		BPF_MAP_TYPE_ARRAY,
+		__u32, __u32,
+		1, 0, MAP_PIN_GLOBAL)
+
+static CALI_BPF_INLINE bool cali_flows_enabled(void)
+{
+	__u32 key = 0;
+	__u32 *enabled = cali_v4_flow_cfg_lookup_elem(&key);
+
+	return enabled && *enabled;
+}
+
+/* cali_flow_start writes the flow-start record of a new tracking entry and starts its
+ * counters with the packet that created it, len bytes on the given leg, or from zero if len
+ * is 0.  The counters are reset in case an old flow with the same key left some behind. */
+static CALI_BPF_INLINE void cali_flow_start(struct calico_ct_key *k, struct calico_ct_value *v,
+					    __u32 ifindex, bool a_to_b, __u32 len)
+{
+	if (!cali_flows_enabled()) {
+		return;
+	}
+
+	struct cali_flow_ctrs ctrs = {};
+	if (len && a_to_b) {
+		ctrs.a_to_b_packets = 1;
+		ctrs.a_to_b_bytes = len;
+	} else if (len) {
+		ctrs.b_to_a_packets = 1;
+		ctrs.b_to_a_bytes = len;
+	}
+	cali_map_err(CALI_MAP_ID_FLOW_CTRS, cali_v4_flow_ctrs_update_elem(k, &ctrs, BPF_ANY));
+
+	__u32 key = 0;
+	struct cali_flow_ring *ring = cali_v4_flow_rb_lookup_elem(&key);
+	if (!ring) {
+		return;
+	}
+	struct cali_flow_rec *rec = &ring->recs[ring->seq & (CALI_FLOW_RING_SIZE - 1)];
+	__u64 seq = ++ring->seq;
+	cali_ring_rec_begin(rec);
+	rec->created = v->created;
+	rec->key = *k;
+	rec->orig_ip = v->orig_ip;
+	rec->orig_port = v->orig_port;
+	rec->type = v->type;
+	rec->flags = v->flags;
+	rec->ifindex = ifindex;
+	rec->pad = 0;
+	cali_ring_rec_end(rec, seq);
+}
+
+/* cali_flow_count counts a packet on the given leg of the flow tracked by k. */
+static CALI_BPF_INLINE void cali_flow_count(struct calico_ct_key *k, bool a_to_b, __u32 len)
+{
+	if (!cali_flows_enabled()) {
+		return;
+	}
+
+	struct cali_flow_ctrs *ctrs = cali_v4_flow_ctrs_lookup_elem(k);
+	if (!ctrs) {
+		return;
+	}
+	if (a_to_b) {
+		__sync_fetch_and_add(&ctrs->a_to_b_packets, 1);
+		__sync_fetch_and_add(&ctrs->a_to_b_bytes, len);
+	} else {
+		__sync_fetch_and_add(&ctrs->b_to_a_packets, 1);
+		__sync_fetch_and_add(&ctrs->b_to_a_bytes, len);
+	}
+}
+
+#endif /* __CALI_BPF_FLOW_H__ */
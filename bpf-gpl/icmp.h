@@ -29,6 +29,7 @@
 static CALI_BPF_INLINE int icmp_v4_reply(struct cali_tc_ctx *ctx,
 					__u8 type, __u8 code, __be32 un)
 {
+	CALI_LOG_LEVEL_CACHE(ctx->log_level);
 	int ret;
 
 	/* ICMP is on the slow path so we may as well revalidate here to keep calling code
@@ -21,7 +21,7 @@
 #include "conntrack.h"
 #include "policy.h"
 
-CALI_MAP(cali_v4_state, 3,
+CALI_MAP(cali_v4_state, 5,
 		BPF_MAP_TYPE_PERCPU_ARRAY,
 		__u32, struct cali_tc_state,
 		1, 0, MAP_PIN_GLOBAL)
@@ -32,21 +32,35 @@ static CALI_BPF_INLINE struct cali_tc_state *state_get(void)
 	return cali_v4_state_lookup_elem(&key);
 }
 
+/* The jump map holds the programs that we tail call, including the policy program.  Felix
+ * splits large policy programs into a chain of programs, which live at
+ * PROG_INDEX_POLICY_CHAIN onwards (see bpf/polprog).  There is room for two chains so that
+ * Felix can write a new chain while the old one is in use.  For TC, Felix shares the chains
+ * between endpoints with the same policy instead: they live in a global prog array and
+ * PROG_INDEX_POLICY holds a trampoline into the endpoint's chain.
+ */
 struct bpf_map_def_extended __attribute__((section("maps"))) cali_jump = {
 	.type = BPF_MAP_TYPE_PROG_ARRAY,
 	.key_size = 4,
 	.value_size = 4,
-	.max_entries = 8,
+	.max_entries = 64,
 #ifndef __BPFTOOL_LOADER__
 	.map_id = 1,
 	.pinning_strategy = 1 /* object namespace */,
 #endif
 };
 
-/* Add new values to the end as these are program indices */
+/* Add new values after PROG_INDEX_ICMP as these are program indices, the
+ * indices from PROG_INDEX_POLICY_CHAIN onwards belong to the policy program.
+ */
 enum cali_jump_index {
 	PROG_INDEX_POLICY,
 	PROG_INDEX_ALLOWED,
 	PROG_INDEX_ICMP,
+	/* The policy program tail calls PROG_INDEX_DENIED when it denies a packet. */
+	PROG_INDEX_DENIED,
+
+	/* Must be kept in sync with jumpIdxPolicyChain in bpf/polprog. */
+	PROG_INDEX_POLICY_CHAIN = 8,
 };
 #endif /* __CALI_BPF_JUMP_H__ */
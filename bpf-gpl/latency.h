@@ -0,0 +1,123 @@
+// Project Calico BPF dataplane programs.
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+#ifndef __CALI_BPF_LATENCY_H__
+#define __CALI_BPF_LATENCY_H__
+
+#include "bpf.h"
+#include "types.h"
+
+/* Latency histograms record the time that sampled packets spend in each stage of the TC
+ * pipeline.  calico_tc() decides whether to sample a packet, according to the sample mask in
+ * cali_v4_lat_cfg, and sets CALI_ST_LAT_SAMPLE; each stage boundary then adds the time since
+ * the previous boundary to the log2 histogram of the stage that just ended.  The time of the
+ * previous boundary is carried in the state, across tail calls.  Packets that are not sampled
+ * only pay for a flag test at each boundary.
+ *
+ * WARNING: must be kept in sync with the definitions in bpf/counters/latency.go.
+ */
+enum cali_lat_stage {
+	CALI_LAT_PARSE,
+	CALI_LAT_CT,
+	CALI_LAT_NAT,
+	CALI_LAT_POLICY,
+	CALI_LAT_ACCEPTED,
+	CALI_LAT_FWD,
+
+	CALI_LAT_STAGES,
+};
+
+/* Bucket n counts the samples of [2^n, 2^(n+1)) ns; the last bucket also counts anything
+ * longer. */
+#define CALI_LAT_BUCKETS 32
+
+struct cali_lat_cfg {
+	/* A packet is sampled if its random number ANDed with sample_mask is 0. */
+	__u32 sample_mask;
+	/* Non-zero to enable sampling. */
+	__u32 enabled;
+};
+
+CALI_MAP_V1(cali_v4_lat_cfg,
+		BPF_MAP_TYPE_ARRAY,
+		__u32, struct cali_lat_cfg,
+		1, 0, MAP_PIN_GLOBAL)
+
+CALI_MAP_V1(cali_v4_lat,
+		BPF_MAP_TYPE_PERCPU_ARRAY,
+		__u32, __u64,
+		CALI_LAT_STAGES * CALI_LAT_BUCKETS, 0, MAP_PIN_GLOBAL)
+
+/* cali_lat_start decides whether to sample the packet and, if so, starts timing its first
+ * stage. */
+static CALI_BPF_INLINE void cali_lat_start(struct cali_tc_state *state)
+{
+	__u32 key = 0;
+	struct cali_lat_cfg *cfg = cali_v4_lat_cfg_lookup_elem(&key);
+
+	if (!cfg || !cfg->enabled || (bpf_get_prandom_u32() & cfg->sample_mask)) {
+		return;
+	}
+	state->flags |= CALI_ST_LAT_SAMPLE;
+	state->lat_stage_start = bpf_ktime_get_ns();
+}
+
+/* cali_log2 returns floor(log2(v)) for v > 0 and 0 for v == 0.  BPF has no instruction to
+ * count leading zeros so we do a binary search. */
+static CALI_BPF_INLINE __u32 cali_log2(__u32 v)
+{
+	__u32 r, shift;
+
+	r = (v > 0xffff) << 4; v >>= r;
+	shift = (v > 0xff) << 3; v >>= shift; r |= shift;
+	shift = (v > 0xf) << 2; v >>= shift; r |= shift;
+	shift = (v > 0x3) << 1; v >>= shift; r |= shift;
+	r |= (v >> 1);
+	return r;
+}
+
+/* cali_lat_record ends the given stage for a sampled packet and starts the next one. */
+static CALI_BPF_INLINE void cali_lat_record(struct cali_tc_state *state, enum cali_lat_stage stage)
+{
+	if (!(state->flags & CALI_ST_LAT_SAMPLE)) {
+		return;
+	}
+
+	__u64 now = bpf_ktime_get_ns();
+	__u64 delta = now - state->lat_stage_start;
+	state->lat_stage_start = now;
+
+	if (delta > 0xffffffff) {
+		delta = 0xffffffff;
+	}
+	__u32 key = stage * CALI_LAT_BUCKETS + cali_log2(delta);
+	__u64 *count = cali_v4_lat_lookup_elem(&key);
+	if (count) {
+		(*count)++;
+	}
+}
+
+/* cali_lat_skip restarts the timing of the current stage, leaving the time since the last
+ * boundary unaccounted for. */
+static CALI_BPF_INLINE void cali_lat_skip(struct cali_tc_state *state)
+{
+	if (state->flags & CALI_ST_LAT_SAMPLE) {
+		state->lat_stage_start = bpf_ktime_get_ns();
+	}
+}
+
+#endif /* __CALI_BPF_LATENCY_H__ */
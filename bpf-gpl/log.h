@@ -18,13 +18,23 @@
 #ifndef __CALI_LOG_H__
 #define __CALI_LOG_H__
 
+#include "bpf.h"
+
 #define CALI_LOG_LEVEL_OFF 0
+/* Records at CALI_LOG_LEVEL_TRACE are written whatever the level in cali_v4_log_lvl, the
+ * caller decides whether to write them (see trace.h). */
+#define CALI_LOG_LEVEL_TRACE 1
 #define CALI_LOG_LEVEL_INFO 5
 #define CALI_LOG_LEVEL_DEBUG 10
 #define CALI_LOG_LEVEL_VERB 20
 
+/* CALI_LOG_LEVEL is the highest level of the logs compiled into the programs.  There is a single
+ * object per hook and the level in the cali_v4_log_lvl map selects at runtime which of those logs
+ * are written.  CALI_LOG_LEVEL_VERB logs are only compiled in on request, and building with
+ * BPF_LOG_LEVEL=OFF (see calculate-flags) leaves out all but the trace logs, for nodes where the
+ * size of the programs matters more than being able to switch logging on. */
 #ifndef CALI_LOG_LEVEL
-#define CALI_LOG_LEVEL CALI_LOG_LEVEL_OFF
+#define CALI_LOG_LEVEL CALI_LOG_LEVEL_DEBUG
 #endif
 
 #ifndef CALI_LOG_PFX
@@ -33,10 +43,130 @@
 
 #define CALI_USE_LINUX_FIB true
 
-#define CALI_LOG(__fmt, ...) do { \
+/* Log records are written to a per-CPU ring in the cali_v4_log_rb map, or cali_v4_log_cg for
+ * the cgroup programs, rather than with bpf_trace_printk(), which is serialised across CPUs
+ * and shares the trace pipe with the rest of the system.  Felix reads the rings and decodes the records (see bpf/eventlog).  Each
+ * record holds its level, the format string, which includes the log prefix patched in at load
+ * time, and up to three arguments.  The format is as long as the ring can hold in a per-CPU
+ * value, which the kernel limits to 32KiB; longer formats are truncated.  Records are only
+ * written if their level is at most the level in the cali_v4_log_lvl map, which Felix can
+ * change at any time.
+ *
+ * Define CALI_LOG_TRACE_PIPE to log to the trace pipe instead, which is handy when running
+ * programs by hand.
+ *
+ * WARNING: must be kept in sync with the definitions in bpf/eventlog/map.go.
+ */
+#define CALI_LOG_RING_SIZE 128
+#define CALI_LOG_FMT_LEN 192
+
+struct cali_log_rec {
+	__u64 seq; /* Set once the record is complete, 0 while it is being written. */
+	__u32 level;
+	__u32 pad;
+	__u64 args[3];
+	char fmt[CALI_LOG_FMT_LEN];
+	__u64 seq_end; /* Copy of seq, see cali_ring_rec_begin(). */
+};
+
+struct cali_log_ring {
+	__u64 seq; /* Number of records written so far. */
+	struct cali_log_rec recs[CALI_LOG_RING_SIZE];
+};
+
+_Static_assert(sizeof(struct cali_log_ring) <= 32768, "log ring too big for a per-CPU value");
+
+CALI_MAP_V1(cali_v4_log_rb,
+		BPF_MAP_TYPE_PERCPU_ARRAY,
+		__u32, struct cali_log_ring,
+		1, 0, MAP_PIN_GLOBAL)
+
+/* The cgroup programs run in process context, where a TC or XDP program can interrupt them on
+ * the same CPU between reading and incrementing the ring's seq.  Both would then claim the same
+ * record and the reader would accept a mix of the two, so the cgroup programs log to rings of
+ * their own.  The kernels we support can't return the old value from an atomic add, which
+ * would otherwise let the programs share a ring. */
+CALI_MAP_V1(cali_v4_log_cg,
+		BPF_MAP_TYPE_PERCPU_ARRAY,
+		__u32, struct cali_log_ring,
+		1, 0, MAP_PIN_GLOBAL)
+
+CALI_MAP_V1(cali_v4_log_lvl,
+		BPF_MAP_TYPE_ARRAY,
+		__u32, __u32,
+		1, 0, MAP_PIN_GLOBAL)
+
+/* cali_log_level returns the level up to which logs are currently written. */
+static CALI_BPF_INLINE __u32 cali_log_level(void)
+{
+	if (CALI_LOG_LEVEL == CALI_LOG_LEVEL_OFF) {
+		return CALI_LOG_LEVEL_OFF;
+	}
+	__u32 key = 0;
+	__u32 *level = cali_v4_log_lvl_lookup_elem(&key);
+	return level ? *level : CALI_LOG_LEVEL_OFF;
+}
+
+/* cali_log_enabled returns whether the logs at the given level are currently written. */
+static CALI_BPF_INLINE bool cali_log_enabled(__u32 level)
+{
+	return cali_log_level() >= level;
+}
+
+/* Logging is off most of the time, so the log sites must be cheap when it is.  Rather than look
+ * the level up at each site, a program reads it once, when it starts, into its cali_tc_ctx, and
+ * a function that logs caches it in a local cali_log_lvl with CALI_LOG_LEVEL_CACHE().  The log
+ * macros check the innermost cali_log_lvl in scope.  Where there is none, they find the enum
+ * constant below instead and look the level up at the site. */
+#define CALI_LOG_LEVEL_UNCACHED 0xff
+enum { cali_log_lvl = CALI_LOG_LEVEL_UNCACHED };
+
+#define CALI_LOG_LEVEL_CACHE(level) \
+	const __u32 cali_log_lvl __attribute__((unused)) = (level)
+
+#define cali_log_on(level) \
+	((__builtin_constant_p(cali_log_lvl) && cali_log_lvl == CALI_LOG_LEVEL_UNCACHED) ? \
+		cali_log_enabled(level) : cali_log_lvl >= (level))
+
+/* cali_log_reserve returns the record to write a log at the given level to, or NULL if there is
+ * no ring.  The caller must have checked that the level is enabled and must call
+ * cali_ring_rec_end() with *seq once it has written the record.
+ */
+static CALI_BPF_INLINE struct cali_log_rec *cali_log_reserve(__u32 level, __u64 *seq)
+{
+	__u32 key = 0;
+	struct cali_log_ring *ring = CALI_F_CGROUP ? cali_v4_log_cg_lookup_elem(&key) :
+		cali_v4_log_rb_lookup_elem(&key);
+	if (!ring) {
+		return NULL;
+	}
+	struct cali_log_rec *rec = &ring->recs[ring->seq & (CALI_LOG_RING_SIZE - 1)];
+	*seq = ++ring->seq;
+	cali_ring_rec_begin(rec);
+	rec->level = level;
+	return rec;
+}
+
+#ifdef CALI_LOG_TRACE_PIPE
+#define CALI_LOG(level, __fmt, ...) do { \
 		char fmt[] = __fmt; \
 		bpf_trace_printk(fmt, sizeof(fmt), ## __VA_ARGS__); \
 } while (0)
+#else
+#define CALI_LOG(level, __fmt, ...) do { \
+		char fmt[] = __fmt; \
+		__u64 args[] = { 0, ## __VA_ARGS__ }; \
+		_Static_assert(sizeof(args) <= 4 * sizeof(__u64), "too many log arguments"); \
+		__u64 seq; \
+		struct cali_log_rec *rec = cali_log_reserve(level, &seq); \
+		if (rec) { \
+			__builtin_memcpy(rec->fmt, fmt, sizeof(fmt) < CALI_LOG_FMT_LEN ? \
+					sizeof(fmt) : CALI_LOG_FMT_LEN); \
+			__builtin_memcpy(rec->args, &args[1], sizeof(args) - sizeof(__u64)); \
+			cali_ring_rec_end(rec, seq); \
+		} \
+} while (0)
+#endif
 
 #define CALI_INFO_NO_FLAG(fmt, ...)  CALI_LOG_IF(CALI_LOG_LEVEL_INFO, fmt, ## __VA_ARGS__)
 #define CALI_DEBUG_NO_FLAG(fmt, ...) CALI_LOG_IF(CALI_LOG_LEVEL_DEBUG, fmt, ## __VA_ARGS__)
@@ -49,28 +179,28 @@
 	CALI_LOG_IF_FLAG(CALI_LOG_LEVEL_VERB, CALI_COMPILE_FLAGS, fmt, ## __VA_ARGS__)
 
 #define CALI_LOG_IF(level, fmt, ...) do { \
-	if (CALI_LOG_LEVEL >= (level))    \
-		CALI_LOG(fmt, ## __VA_ARGS__);          \
+	if (CALI_LOG_LEVEL >= (level) && cali_log_on(level))    \
+		CALI_LOG(level, fmt, ## __VA_ARGS__);          \
 } while (0)
 
 #define CALI_LOG_IF_FLAG(level, flags, fmt, ...) do { \
-	if (CALI_LOG_LEVEL >= (level))    \
-		CALI_LOG_FLAG(flags, fmt, ## __VA_ARGS__);          \
+	if (CALI_LOG_LEVEL >= (level) && cali_log_on(level))    \
+		CALI_LOG_FLAG(level, flags, fmt, ## __VA_ARGS__);          \
 } while (0)
 
-#define CALI_LOG_FLAG(flags, fmt, ...) do { \
+#define CALI_LOG_FLAG(level, flags, fmt, ...) do { \
 	if ((flags) & CALI_CGROUP) { \
-		CALI_LOG(XSTR(CALI_LOG_PFX) "-C: " fmt, ## __VA_ARGS__); \
+		CALI_LOG(level, XSTR(CALI_LOG_PFX) "-C: " fmt, ## __VA_ARGS__); \
 	} else if ((flags) & CALI_XDP_PROG) { \
-		CALI_LOG(XSTR(CALI_LOG_PFX) "-X: " fmt, ## __VA_ARGS__); \
+		CALI_LOG(level, XSTR(CALI_LOG_PFX) "-X: " fmt, ## __VA_ARGS__); \
 	} else if (((flags) & CALI_TC_HOST_EP) && ((flags) & CALI_TC_INGRESS)) { \
-		CALI_LOG(XSTR(CALI_LOG_PFX) "-I: " fmt, ## __VA_ARGS__); \
+		CALI_LOG(level, XSTR(CALI_LOG_PFX) "-I: " fmt, ## __VA_ARGS__); \
 	} else if ((flags) & CALI_TC_HOST_EP) { \
-		CALI_LOG(XSTR(CALI_LOG_PFX) "-E: " fmt, ## __VA_ARGS__); \
+		CALI_LOG(level, XSTR(CALI_LOG_PFX) "-E: " fmt, ## __VA_ARGS__); \
 	} else if ((flags) & CALI_TC_INGRESS) { \
-		CALI_LOG(XSTR(CALI_LOG_PFX) "-I: " fmt, ## __VA_ARGS__); \
+		CALI_LOG(level, XSTR(CALI_LOG_PFX) "-I: " fmt, ## __VA_ARGS__); \
 	} else { \
-		CALI_LOG(XSTR(CALI_LOG_PFX) "-E: " fmt, ## __VA_ARGS__); \
+		CALI_LOG(level, XSTR(CALI_LOG_PFX) "-E: " fmt, ## __VA_ARGS__); \
 	} \
 } while (0)
 
@@ -0,0 +1,61 @@
+// Project Calico BPF dataplane programs.
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+#ifndef __CALI_BPF_MAPSTATS_H__
+#define __CALI_BPF_MAPSTATS_H__
+
+#include "bpf.h"
+
+/* The programs count the failed inserts into the maps that they add entries to, which
+ * usually means that the map is full, in a per-CPU array indexed by map.  Felix exports the
+ * counts next to the occupancy of the maps.
+ *
+ * WARNING: must be kept in sync with the definitions in bpf/mapstats/map.go.
+ */
+enum cali_map_id {
+	CALI_MAP_ID_CT,
+	CALI_MAP_ID_NAT_AFF,
+	CALI_MAP_ID_ARP,
+	CALI_MAP_ID_SRMSG,
+	CALI_MAP_ID_CT_NATS,
+	CALI_MAP_ID_FLOW_CTRS,
+
+	CALI_MAP_IDS,
+};
+
+CALI_MAP_V1(cali_v4_map_errs,
+		BPF_MAP_TYPE_PERCPU_ARRAY,
+		__u32, __u64,
+		CALI_MAP_IDS, 0, MAP_PIN_GLOBAL)
+
+/* cali_map_err counts a failed insert into the given map if err is non-zero, and returns
+ * err so that it can wrap the update. */
+static CALI_BPF_INLINE int cali_map_err(enum cali_map_id map, int err)
+{
+	if (err) {
+		__u32 key = map;
+		__u64 *count = cali_v4_map_errs_lookup_elem(&key);
+
+		/* The map is per-CPU so no atomic operations are needed. */
+		if (count) {
+			(*count)++;
+		}
+	}
+	return err;
+}
+
+#endif /* __CALI_BPF_MAPSTATS_H__ */
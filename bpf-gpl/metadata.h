@@ -59,6 +59,7 @@ static CALI_BPF_INLINE int xdp2tc_set_metadata(struct xdp_md *xdp, __u32 flags)
 	 * bits to indicate that the packet has been accepted.*/
 	struct cali_tc_ctx ctx = {
 		.xdp = xdp,
+		.log_level = cali_log_level(),
 	};
 
 	if (skb_refresh_validate_ptrs(&ctx, UDP_SIZE)) {
@@ -93,6 +94,7 @@ static CALI_BPF_INLINE __u32 xdp2tc_get_metadata(struct __sk_buff *skb) {
 #else
 	struct cali_tc_ctx ctx = {
 		.skb = skb,
+		.log_level = cali_log_level(),
 	};
 
 	if (skb_refresh_validate_ptrs(&ctx, UDP_SIZE)) {
@@ -27,6 +27,7 @@
 #include "skb.h"
 #include "routes.h"
 #include "nat_types.h"
+#include "mapstats.h"
 
 #ifndef CALI_VXLAN_VNI
 #define CALI_VXLAN_VNI 0xca11c0
@@ -45,6 +46,7 @@ static CALI_BPF_INLINE int skb_nat_l4_csum_ipv4(struct __sk_buff *skb, size_t of
 						__u16 port_from, __u16 port_to,
 						__u64 flags)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 	int ret = 0;
 
 	if (ip_from != ip_to) {
@@ -71,6 +73,7 @@ static CALI_BPF_INLINE struct calico_nat_dest* calico_v4_nat_lookup2(__be32 ip_s
 								     bool from_tun,
 								     nat_lookup_result *res)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 	struct calico_nat_v4_key nat_key = {
 		.prefixlen = NAT_PREFIX_LEN_WITH_SRC_MATCH_IN_BITS,
 		.addr = ip_dst,
@@ -209,7 +212,8 @@ skip_affinity:
 		};
 
 		CALI_DEBUG("NAT: updating affinity for client %x\n", bpf_ntohl(ip_src));
-		if ((err = cali_v4_nat_aff_update_elem(&affkey, &val, BPF_ANY))) {
+		if ((err = cali_map_err(CALI_MAP_ID_NAT_AFF,
+				cali_v4_nat_aff_update_elem(&affkey, &val, BPF_ANY)))) {
 			CALI_INFO("NAT: failed to update affinity table: %d\n", err);
 			/* we do carry on, we have a good nat_lv2_val */
 		}
@@ -226,6 +230,7 @@ static CALI_BPF_INLINE struct calico_nat_dest* calico_v4_nat_lookup(__be32 ip_sr
 
 static CALI_BPF_INLINE int vxlan_v4_encap(struct cali_tc_ctx *ctx,  __be32 ip_src, __be32 ip_dst)
 {
+	CALI_LOG_LEVEL_CACHE(ctx->log_level);
 	int ret;
 	__wsum csum;
 
@@ -360,6 +365,7 @@ static CALI_BPF_INLINE bool vxlan_v4_encap_too_big(struct cali_tc_ctx *ctx)
  * -2: if the packet is VXLAN from a Calico host, to this node, but it is not the right VNI.
  */
 static CALI_BPF_INLINE int vxlan_attempt_decap(struct cali_tc_ctx *ctx) {
+	CALI_LOG_LEVEL_CACHE(ctx->log_level);
 	/* decap on host ep only if directly for the node */
 	CALI_DEBUG("VXLAN tunnel packet to %x (host IP=%x)\n",
 		bpf_ntohl(ctx->ip_header->daddr),
@@ -402,7 +408,7 @@ static CALI_BPF_INLINE int vxlan_attempt_decap(struct cali_tc_ctx *ctx) {
 	 * dst:src but the value is src:dst so it flips it automatically
 	 * when we use it on xmit.
 	 */
-	cali_v4_arp_update_elem(&ctx->arpk, ctx->eth, 0);
+	cali_map_err(CALI_MAP_ID_ARP, cali_v4_arp_update_elem(&ctx->arpk, ctx->eth, 0));
 	CALI_DEBUG("ARP update for ifindex %d ip %x\n", ctx->arpk.ifindex, bpf_ntohl(ctx->arpk.ip));
 
 	ctx->state->tun_ip = ctx->ip_header->saddr;
@@ -23,6 +23,7 @@
 #define PARSING_ALLOW_WITHOUT_ENFORCING_POLICY -2
 
 static CALI_BPF_INLINE int parse_packet_ip(struct cali_tc_ctx *ctx) {
+	CALI_LOG_LEVEL_CACHE(ctx->log_level);
 	__u16 protocol = 0;
 
 	/* We need to make a decision based on Ethernet protocol, however,
@@ -120,6 +121,7 @@ static CALI_BPF_INLINE void tc_state_fill_from_iphdr(struct cali_tc_ctx *ctx)
  * in the state (struct cali_tc_state). */
 static CALI_BPF_INLINE int tc_state_fill_from_nexthdr(struct cali_tc_ctx *ctx)
 {
+	CALI_LOG_LEVEL_CACHE(ctx->log_level);
 	switch (ctx->state->ip_proto) {
 	case IPPROTO_TCP:
 		// Re-check buffer space for TCP (has larger headers than UDP).
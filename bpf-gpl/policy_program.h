@@ -73,6 +73,7 @@ allow:
 __attribute__((section("1/0")))
 int calico_tc_norm_pol_tail(struct __sk_buff *skb)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 	CALI_DEBUG("Entering normal policy tail call\n");
 
 	struct cali_tc_state *state = state_get();
@@ -0,0 +1,120 @@
+// Project Calico BPF dataplane programs.
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+#ifndef __CALI_BPF_SAMPLE_H__
+#define __CALI_BPF_SAMPLE_H__
+
+#include "bpf.h"
+#include "counters.h"
+
+/* The packet sampler copies the headers of one packet in N, chosen at random, to a per-CPU
+ * ring in cali_v4_smpl_rb, along with the hook, the interface, the verdict and the reason,
+ * as the packet leaves the program.  The packets that the generated policy program denies
+ * are sampled by the program that it tail calls at PROG_INDEX_DENIED.  That gives sFlow-style
+ * visibility of the traffic at a bounded cost: unsampled packets only pay for a random
+ * number.  N is the rate in cali_v4_smpl_cfg, which Felix or calico-bpf can change at any
+ * time; 0 disables sampling.  The ring works like the log ring in log.h.
+ *
+ * WARNING: must be kept in sync with the definitions in bpf/sampling/map.go.
+ */
+#define CALI_SAMPLE_RING_SIZE 128
+#define CALI_SAMPLE_HDR_LEN 128
+
+struct cali_sample_rec {
+	__u64 seq; /* Set once the record is complete, 0 while it is being written. */
+	__u32 ifindex;
+	__u32 len; /* Length of the packet. */
+	__u8 hook; /* enum cali_vctr_hook */
+	__u8 reason; /* Index of the reason, as for the verdict counters. */
+	__u8 drop;
+	__u8 pad;
+	__u32 hdr_len; /* Number of bytes in hdr. */
+	__u8 hdr[CALI_SAMPLE_HDR_LEN];
+	__u64 seq_end; /* Copy of seq, see cali_ring_rec_begin(). */
+};
+
+struct cali_sample_ring {
+	__u64 seq; /* Number of records written so far. */
+	struct cali_sample_rec recs[CALI_SAMPLE_RING_SIZE];
+};
+
+CALI_MAP_V1(cali_v4_smpl_rb,
+		BPF_MAP_TYPE_PERCPU_ARRAY,
+		__u32, struct cali_sample_ring,
+		1, 0, MAP_PIN_GLOBAL)
+
+CALI_MAP_V1(cali_v4_smpl_cfg,
+		BPF_MAP_TYPE_ARRAY,
+		__u32, __u32,
+		1, 0, MAP_PIN_GLOBAL)
+
+/* cali_sample writes a sample of the packet between data and data_end, if it is picked.
+ * The headers are copied in fixed-size chunks, which the verifier can check against the
+ * end of the packet. */
+static CALI_BPF_INLINE void cali_sample(void *data, void *data_end, __u32 ifindex, __u32 len,
+					enum calico_reason reason, bool drop)
+{
+	__u32 key = 0;
+	__u32 *rate = cali_v4_smpl_cfg_lookup_elem(&key);
+
+	if (!rate || !*rate || bpf_get_prandom_u32() % *rate) {
+		return;
+	}
+
+	struct cali_sample_ring *ring = cali_v4_smpl_rb_lookup_elem(&key);
+	if (!ring) {
+		return;
+	}
+	struct cali_sample_rec *rec = &ring->recs[ring->seq & (CALI_SAMPLE_RING_SIZE - 1)];
+	__u64 seq = ++ring->seq;
+	cali_ring_rec_begin(rec);
+	rec->ifindex = ifindex;
+	rec->len = len;
+	rec->hook = CALI_VCTR_HOOK;
+	rec->reason = cali_reason_idx(reason);
+	rec->drop = drop;
+	rec->pad = 0;
+
+	if (data + CALI_SAMPLE_HDR_LEN <= data_end) {
+		__builtin_memcpy(rec->hdr, data, CALI_SAMPLE_HDR_LEN);
+		rec->hdr_len = CALI_SAMPLE_HDR_LEN;
+	} else if (data + 64 <= data_end) {
+		__builtin_memcpy(rec->hdr, data, 64);
+		rec->hdr_len = 64;
+	} else if (data + 34 <= data_end) {
+		/* Ethernet and IP headers. */
+		__builtin_memcpy(rec->hdr, data, 34);
+		rec->hdr_len = 34;
+	} else {
+		rec->hdr_len = 0;
+	}
+	cali_ring_rec_end(rec, seq);
+}
+
+static CALI_BPF_INLINE void cali_sample_skb(struct __sk_buff *skb, enum calico_reason reason, bool drop)
+{
+	cali_sample((void *)(long)skb->data, (void *)(long)skb->data_end,
+			skb->ifindex, skb->len, reason, drop);
+}
+
+static CALI_BPF_INLINE void cali_sample_xdp(struct xdp_md *xdp, enum calico_reason reason, bool drop)
+{
+	cali_sample((void *)(long)xdp->data, (void *)(long)xdp->data_end, xdp->ingress_ifindex,
+			(__u32)((long)xdp->data_end - (long)xdp->data), reason, drop);
+}
+
+#endif /* __CALI_BPF_SAMPLE_H__ */
@@ -0,0 +1,60 @@
+// Project Calico BPF dataplane programs.
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+#ifndef __CALI_SIM_BPF_HELPERS_H__
+#define __CALI_SIM_BPF_HELPERS_H__
+
+/* Stand-in for libbpf's bpf_helpers.h in the userspace simulator build, which puts this
+ * directory ahead of libbpf in the include path.  libbpf declares the helpers as pointers to
+ * their IDs, for the kernel to resolve at load time; here they are plain functions,
+ * implemented by sim.c.  Only the helpers that the programs use are declared so that using a
+ * new one fails the simulator build until it has an implementation.
+ */
+
+#define SEC(NAME) __attribute__((section(NAME), used))
+
+#ifndef __always_inline
+#define __always_inline __attribute__((always_inline))
+#endif
+
+struct __sk_buff;
+struct xdp_md;
+struct bpf_fib_lookup;
+
+void *bpf_map_lookup_elem(void *map, const void *key);
+long bpf_map_update_elem(void *map, const void *key, const void *value, __u64 flags);
+long bpf_map_delete_elem(void *map, const void *key);
+long bpf_tail_call(void *ctx, void *prog_array_map, __u32 index);
+
+__u64 bpf_ktime_get_ns(void);
+__u32 bpf_get_prandom_u32(void);
+long bpf_trace_printk(const char *fmt, __u32 fmt_size, ...);
+__u64 bpf_get_socket_cookie(void *ctx);
+
+long bpf_l3_csum_replace(struct __sk_buff *skb, __u32 offset, __u64 from, __u64 to, __u64 size);
+long bpf_l4_csum_replace(struct __sk_buff *skb, __u32 offset, __u64 from, __u64 to, __u64 flags);
+__s64 bpf_csum_diff(__be32 *from, __u32 from_size, __be32 *to, __u32 to_size, __wsum seed);
+
+long bpf_skb_pull_data(struct __sk_buff *skb, __u32 len);
+long bpf_skb_adjust_room(struct __sk_buff *skb, __s32 len_diff, __u32 mode, __u64 flags);
+long bpf_skb_change_tail(struct __sk_buff *skb, __u32 len, __u64 flags);
+long bpf_xdp_adjust_meta(struct xdp_md *xdp_md, int delta);
+
+long bpf_redirect(__u32 ifindex, __u64 flags);
+long bpf_fib_lookup(void *ctx, struct bpf_fib_lookup *params, int plen, __u32 flags);
+
+#endif /* __CALI_SIM_BPF_HELPERS_H__ */
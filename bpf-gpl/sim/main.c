@@ -0,0 +1,272 @@
+// Project Calico BPF dataplane programs.
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+/* main.c replays a packet capture through a program in the simulator, like TestPcapReplay
+ * in bpf/ut does through the kernel, and reports the verdicts and the time per packet.  The
+ * capture is replayed a number of times; the maps keep their state from one pass to the next,
+ * so the later passes mostly see established flows.
+ */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET	1
+
+#define MAX_VERDICTS 16
+
+struct pcap_file_hdr {
+	__u32 magic;
+	__u16 version_major, version_minor;
+	__s32 thiszone;
+	__u32 sigfigs, snaplen, linktype;
+};
+
+struct pcap_rec_hdr {
+	__u32 ts_sec, ts_frac, incl_len, orig_len;
+};
+
+struct pkt {
+	__u8 *data;
+	__u32 len;
+};
+
+static __u32 swap32(__u32 v, int swap)
+{
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static int read_pcap(const char *fname, struct pkt **pkts_out)
+{
+	struct pcap_file_hdr fh;
+	struct pcap_rec_hdr rh;
+	struct pkt *pkts = NULL;
+	int n = 0, cap = 0, swap;
+	FILE *f = fopen(fname, "rb");
+
+	if (!f) {
+		perror(fname);
+		return -1;
+	}
+	if (fread(&fh, sizeof(fh), 1, f) != 1) {
+		fprintf(stderr, "%s: too short for a pcap file\n", fname);
+		goto err;
+	}
+	if (fh.magic == PCAP_MAGIC || fh.magic == PCAP_MAGIC_NSEC) {
+		swap = 0;
+	} else if (fh.magic == __builtin_bswap32(PCAP_MAGIC) || fh.magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+		swap = 1;
+	} else {
+		fprintf(stderr, "%s: not a pcap file (pcapng is not supported)\n", fname);
+		goto err;
+	}
+	if (swap32(fh.linktype, swap) != PCAP_LINKTYPE_ETHERNET) {
+		fprintf(stderr, "%s: unsupported link type %u, the programs expect Ethernet frames\n",
+				fname, swap32(fh.linktype, swap));
+		goto err;
+	}
+
+	while (fread(&rh, sizeof(rh), 1, f) == 1) {
+		__u32 len = swap32(rh.incl_len, swap);
+		if (n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			pkts = realloc(pkts, cap * sizeof(*pkts));
+			if (!pkts) {
+				fprintf(stderr, "out of memory\n");
+				goto err;
+			}
+		}
+		pkts[n].data = malloc(len);
+		pkts[n].len = len;
+		if (!pkts[n].data || fread(pkts[n].data, len, 1, f) != 1) {
+			fprintf(stderr, "%s: truncated packet %d\n", fname, n);
+			goto err;
+		}
+		n++;
+	}
+	fclose(f);
+	*pkts_out = pkts;
+	return n;
+err:
+	fclose(f);
+	return -1;
+}
+
+/* parse_route parses <cidr>=<type>[:<ifindex>], for example 10.65.0.2/32=workload:5. */
+static int parse_route(char *arg)
+{
+	char *type = strchr(arg, '='), *slash, *colon;
+	__u32 prefixlen = 32, ifindex = 0;
+	struct in_addr addr;
+
+	if (!type) {
+		return -1;
+	}
+	*type++ = '\0';
+	if ((colon = strchr(type, ':'))) {
+		*colon++ = '\0';
+		ifindex = strtoul(colon, NULL, 0);
+	}
+	if ((slash = strchr(arg, '/'))) {
+		*slash++ = '\0';
+		prefixlen = strtoul(slash, NULL, 0);
+	}
+	if (!inet_aton(arg, &addr) || prefixlen > 32) {
+		return -1;
+	}
+	return sim_prog_add_route(addr.s_addr, prefixlen, type, ifindex);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] <capture.pcap>\n"
+		"  -n <passes>         times to replay the capture (default 100)\n"
+		"  -p allow|deny|none  policy program (default allow)\n"
+		"  -i <ifindex>        interface that the packets are on (default 1)\n"
+		"  -f <ifindex>        interface that FIB lookups resolve to, 0 to fail them (default 2)\n"
+		"  -H <ip>             IP of the host, also added as a local host route (default 10.10.0.1)\n"
+		"  -g <flags>          GLOBAL_FLAGS bits from bpf.h (default 0x%x, FIB lookups only)\n"
+		"  -r <cidr>=<type>[:<ifindex>]\n"
+		"                      add a route, type is host, workload or remote-host\n"
+		"  -t                  print bpf_trace_printk() output\n",
+		prog, cali_sim_global_flags);
+	exit(2);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	struct { int rc; __u64 count; } verdicts[MAX_VERDICTS] = {};
+	int num_verdicts = 0, passes = 100, errors = 0, opt, n;
+	const char *policy = "allow", *host_ip = "10.10.0.1";
+	__u32 ifindex = 1;
+	struct pkt *pkts;
+	struct in_addr addr;
+
+	sim_config.fib_ifindex = 2;
+
+	while ((opt = getopt(argc, argv, "n:p:i:f:H:g:r:t")) != -1) {
+		switch (opt) {
+		case 'n':
+			passes = atoi(optarg);
+			break;
+		case 'p':
+			policy = optarg;
+			break;
+		case 'i':
+			ifindex = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			sim_config.fib_ifindex = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			host_ip = optarg;
+			break;
+		case 'g':
+			cali_sim_global_flags = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			if (parse_route(optarg)) {
+				fprintf(stderr, "bad route: %s\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 't':
+			sim_config.trace_printk = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || passes < 1) {
+		usage(argv[0]);
+	}
+
+	if (!inet_aton(host_ip, &addr)) {
+		fprintf(stderr, "bad host IP: %s\n", host_ip);
+		usage(argv[0]);
+	}
+	cali_sim_host_ip = addr.s_addr;
+	sim_prog_add_route(addr.s_addr, 32, "host", 0);
+
+	if (sim_prog_init(policy)) {
+		fprintf(stderr, "bad policy: %s\n", policy);
+		usage(argv[0]);
+	}
+
+	n = read_pcap(argv[optind], &pkts);
+	if (n < 0) {
+		return 1;
+	}
+	if (n == 0) {
+		fprintf(stderr, "%s: no packets\n", argv[optind]);
+		return 1;
+	}
+
+	double start = now_ns();
+	for (int pass = 0; pass < passes; pass++) {
+		for (int i = 0; i < n; i++) {
+			int rc, v;
+			if (sim_prog_run(pkts[i].data, pkts[i].len, ifindex, &rc)) {
+				errors += !pass;
+				continue;
+			}
+			if (pass) {
+				continue;
+			}
+			for (v = 0; v < num_verdicts && verdicts[v].rc != rc; v++) {
+			}
+			if (v == MAX_VERDICTS) {
+				continue;
+			}
+			if (v == num_verdicts) {
+				verdicts[num_verdicts++].rc = rc;
+			}
+			verdicts[v].count++;
+		}
+	}
+	double elapsed = now_ns() - start;
+	__u64 runs = (__u64)passes * n;
+
+	printf("%s: %d packets, %d passes, %d errors\n", argv[0], n, passes, errors);
+	printf("  verdicts (first pass):");
+	for (int v = 0; v < num_verdicts; v++) {
+		printf(" %s=%llu", sim_prog_verdict(verdicts[v].rc), (unsigned long long)verdicts[v].count);
+	}
+	printf("\n  %.1f ns/packet\n", elapsed / runs);
+	printf("  per packet: %.2f map lookups, %.2f map updates, %.2f tail calls, %.2f FIB lookups, %.2f redirects\n",
+			(double)sim_stats.map_lookups / runs, (double)sim_stats.map_updates / runs,
+			(double)sim_stats.tail_calls / runs, (double)sim_stats.fib_lookups / runs,
+			(double)sim_stats.redirects / runs);
+	printf("  ");
+	sim_prog_report(stdout);
+	return 0;
+}
@@ -0,0 +1,213 @@
+// Project Calico BPF dataplane programs.
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+/* prog.c wraps one of the datapath programs for the simulator.  It is compiled with the flags
+ * that calculate-flags gives for that program and it includes its source, so that it can
+ * get at the program's entrypoints and at the types of its maps.
+ */
+
+#include <string.h>
+
+#include "sim.h"
+#include "bpf.h"
+
+#if CALI_F_XDP
+#include "xdp.c"
+#else
+#include "tc.c"
+#endif
+
+#if CALI_F_XDP
+#define SIM_VERDICT_DROP XDP_DROP
+
+static int sim_prog_main(void *ctx)
+{
+	return xdp_calico_entry(ctx);
+}
+
+static int sim_prog_accepted(void *ctx)
+{
+	return calico_xdp_accepted_entrypoint(ctx);
+}
+
+static int sim_prog_denied(void *ctx)
+{
+	return calico_xdp_denied_entrypoint(ctx);
+}
+#else
+#define SIM_VERDICT_DROP TC_ACT_SHOT
+
+static int sim_prog_main(void *ctx)
+{
+	return tc_calico_entry(ctx);
+}
+
+static int sim_prog_accepted(void *ctx)
+{
+	return calico_tc_skb_accepted_entrypoint(ctx);
+}
+
+static int sim_prog_denied(void *ctx)
+{
+	return calico_tc_skb_denied_entrypoint(ctx);
+}
+
+static int sim_prog_icmp(void *ctx)
+{
+	return calico_tc_skb_send_icmp_replies(ctx);
+}
+#endif
+
+/* Stand-ins for the policy program that Felix generates, which sets the policy result in the
+ * state and tail calls the accepted or the denied program.
+ */
+
+static int sim_policy_allow(void *ctx)
+{
+	struct cali_tc_state *state = state_get();
+	state->pol_rc = CALI_POL_ALLOW;
+	bpf_tail_call(ctx, &cali_jump, PROG_INDEX_ALLOWED);
+	return SIM_VERDICT_DROP;
+}
+
+static int sim_policy_deny(void *ctx)
+{
+	struct cali_tc_state *state = state_get();
+	state->pol_rc = CALI_POL_DENY;
+	bpf_tail_call(ctx, &cali_jump, PROG_INDEX_DENIED);
+	return SIM_VERDICT_DROP;
+}
+
+/* sim_prog_init fills in the jump map.  The policy is "allow", "deny" or "none", in which
+ * case there is no policy program, as before Felix has programmed the endpoint.
+ */
+int sim_prog_init(const char *policy)
+{
+	if (!strcmp(policy, "allow")) {
+		sim_prog_array_set(&cali_jump, PROG_INDEX_POLICY, sim_policy_allow);
+	} else if (!strcmp(policy, "deny")) {
+		sim_prog_array_set(&cali_jump, PROG_INDEX_POLICY, sim_policy_deny);
+	} else if (strcmp(policy, "none")) {
+		return -1;
+	}
+	sim_prog_array_set(&cali_jump, PROG_INDEX_ALLOWED, sim_prog_accepted);
+	sim_prog_array_set(&cali_jump, PROG_INDEX_DENIED, sim_prog_denied);
+#if !CALI_F_XDP
+	sim_prog_array_set(&cali_jump, PROG_INDEX_ICMP, sim_prog_icmp);
+#endif
+	return 0;
+}
+
+/* sim_prog_run runs an Ethernet frame through the program, as received on (or sent from)
+ * the interface with the given index, and stores the verdict.  Programs for L3 devices get
+ * the frame without its Ethernet header.  Returns -1 if the frame can't be run.
+ */
+int sim_prog_run(const void *pkt, __u32 len, __u32 ifindex, int *verdict)
+{
+	if (CALI_F_L3) {
+		if (len < ETH_HLEN) {
+			return -1;
+		}
+		pkt += ETH_HLEN;
+		len -= ETH_HLEN;
+	}
+
+	__u8 *data = sim_pkt_load(pkt, len);
+	if (!data) {
+		return -1;
+	}
+
+#if CALI_F_XDP
+	struct xdp_md xdp = {
+		.data = (__u32)(unsigned long)data,
+		.data_end = (__u32)(unsigned long)(data + len),
+		.data_meta = (__u32)(unsigned long)data,
+		.ingress_ifindex = ifindex,
+	};
+	*verdict = sim_run(sim_prog_main, &xdp);
+#else
+	struct __sk_buff skb = {
+		.len = len,
+		.protocol = bpf_htons(ETH_P_IP),
+		.ifindex = ifindex,
+		.ingress_ifindex = ifindex,
+		.data = (__u32)(unsigned long)data,
+		.data_end = (__u32)(unsigned long)(data + len),
+		.data_meta = (__u32)(unsigned long)data,
+	};
+	*verdict = sim_run(sim_prog_main, &skb);
+#endif
+	return 0;
+}
+
+const char *sim_prog_verdict(int rc)
+{
+	static char buf[16];
+
+	switch (rc) {
+#if CALI_F_XDP
+	case XDP_ABORTED: return "XDP_ABORTED";
+	case XDP_DROP: return "XDP_DROP";
+	case XDP_PASS: return "XDP_PASS";
+	case XDP_TX: return "XDP_TX";
+	case XDP_REDIRECT: return "XDP_REDIRECT";
+#else
+	case TC_ACT_UNSPEC: return "TC_ACT_UNSPEC";
+	case TC_ACT_OK: return "TC_ACT_OK";
+	case TC_ACT_SHOT: return "TC_ACT_SHOT";
+	case TC_ACT_REDIRECT: return "TC_ACT_REDIRECT";
+#endif
+	}
+	snprintf(buf, sizeof(buf), "%d", rc);
+	return buf;
+}
+
+/* sim_prog_add_route adds a route of the given type: "host" or "workload" for the local host
+ * and its workloads, which are reached through the interface with the given index, or
+ * "remote-host".
+ */
+int sim_prog_add_route(__be32 addr, __u32 prefixlen, const char *type, __u32 ifindex)
+{
+	union cali_rt_lpm_key k = {
+		.key = {
+			.prefixlen = prefixlen,
+			.addr = addr,
+		},
+	};
+	struct cali_rt v = {};
+
+	if (!strcmp(type, "host")) {
+		v.flags = CALI_RT_LOCAL | CALI_RT_HOST;
+	} else if (!strcmp(type, "workload")) {
+		v.flags = CALI_RT_LOCAL | CALI_RT_WORKLOAD | CALI_RT_IN_POOL;
+		v.if_index = ifindex;
+	} else if (!strcmp(type, "remote-host")) {
+		v.flags = CALI_RT_HOST;
+	} else {
+		return -1;
+	}
+	return cali_v4_routes_update_elem(&k, &v, BPF_ANY);
+}
+
+void sim_prog_report(FILE *f)
+{
+	fprintf(f, "map entries: ct=%u nat_aff=%u arp=%u flow_ctrs=%u\n",
+			sim_map_entries(&cali_v4_ct2),
+			sim_map_entries(&cali_v4_nat_aff),
+			sim_map_entries(&cali_v4_arp3),
+			sim_map_entries(&cali_v4_flow_ctrs));
+}
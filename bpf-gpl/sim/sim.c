@@ -0,0 +1,661 @@
+// Project Calico BPF dataplane programs.
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+#include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_cls.h>
+
+#include "bpf.h"
+#include "sim.h"
+
+__u32 cali_sim_host_ip;
+__u32 cali_sim_tunnel_mtu = 1410;
+__u32 cali_sim_vxlan_port = 4789;
+__u32 cali_sim_intf_ip;
+__u32 cali_sim_ext_to_svc_mark;
+__u32 cali_sim_global_flags = CALI_GLOBALS_FIB_LOOKUP;
+
+struct sim_config sim_config;
+struct sim_stats sim_stats;
+
+/* Maps.
+ *
+ * The programs refer to their maps by the address of their definitions, so the simulator
+ * keeps its state for each map in a table indexed by that address.  Entries are created the
+ * first time that a program uses the map.  The per-CPU maps hold a single value since there
+ * is a single CPU.
+ *
+ * Hash maps chain their entries.  LRU hash maps evict the oldest entry when they are full,
+ * which is cruder than the kernel's LRU but keeps them bounded in the same way.  LPM tries are
+ * hash maps with an entry per prefix, looked up from the longest prefix length that is in use
+ * down, and so their cost depends on the number of distinct prefix lengths rather than on the
+ * depth of a trie.
+ */
+
+#define SIM_MAX_MAPS 64
+#define SIM_MAX_KEY_SIZE 64
+#define SIM_MAX_TAIL_CALLS 32
+
+struct sim_entry {
+	struct sim_entry *next;		/* In the hash bucket. */
+	struct sim_entry *older, *newer;	/* In insertion order, for LRU eviction. */
+	__u64 hash;
+	__u8 data[] __attribute__((aligned(8)));	/* Key, then value at val_off. */
+};
+
+struct sim_map {
+	const struct bpf_map_def_extended *def;
+	__u32 val_off;
+	__u8 *values;			/* Array maps. */
+	sim_prog_fn *progs;		/* Prog array maps. */
+	struct sim_entry **buckets;	/* Hash maps and LPM tries. */
+	__u32 mask;
+	__u32 count;
+	struct sim_entry *oldest, *newest;
+	__u32 max_prefixlen;		/* LPM tries. */
+	__u32 *prefixlen_count;
+};
+
+static struct sim_map sim_maps[SIM_MAX_MAPS];
+
+static void *sim_calloc(size_t n, size_t size)
+{
+	void *p = calloc(n, size);
+	if (!p) {
+		fprintf(stderr, "sim: out of memory\n");
+		abort();
+	}
+	return p;
+}
+
+static void sim_map_init(struct sim_map *m, const struct bpf_map_def_extended *def)
+{
+	m->def = def;
+	m->val_off = (def->key_size + 7) & ~7;
+	switch (def->type) {
+	case BPF_MAP_TYPE_ARRAY:
+	case BPF_MAP_TYPE_PERCPU_ARRAY:
+		m->values = sim_calloc(def->max_entries, def->value_size);
+		return;
+	case BPF_MAP_TYPE_PROG_ARRAY:
+		m->progs = sim_calloc(def->max_entries, sizeof(sim_prog_fn));
+		return;
+	case BPF_MAP_TYPE_LPM_TRIE:
+		if (def->key_size > SIM_MAX_KEY_SIZE) {
+			fprintf(stderr, "sim: LPM key too large: %u\n", def->key_size);
+			abort();
+		}
+		m->max_prefixlen = (def->key_size - sizeof(__u32)) * 8;
+		m->prefixlen_count = sim_calloc(m->max_prefixlen + 1, sizeof(__u32));
+		break;
+	case BPF_MAP_TYPE_HASH:
+	case BPF_MAP_TYPE_PERCPU_HASH:
+	case BPF_MAP_TYPE_LRU_HASH:
+	case BPF_MAP_TYPE_LRU_PERCPU_HASH:
+		break;
+	default:
+		fprintf(stderr, "sim: unsupported map type %u\n", def->type);
+		abort();
+	}
+
+	__u32 buckets = 1024;
+	while (buckets < def->max_entries && buckets < (1 << 20)) {
+		buckets <<= 1;
+	}
+	m->buckets = sim_calloc(buckets, sizeof(*m->buckets));
+	m->mask = buckets - 1;
+}
+
+static struct sim_map *sim_map_get(const void *map)
+{
+	__u32 idx = ((uintptr_t)map >> 3) % SIM_MAX_MAPS;
+	for (int i = 0; i < SIM_MAX_MAPS; i++) {
+		struct sim_map *m = &sim_maps[(idx + i) % SIM_MAX_MAPS];
+		if (m->def == map) {
+			return m;
+		}
+		if (!m->def) {
+			sim_map_init(m, map);
+			return m;
+		}
+	}
+	fprintf(stderr, "sim: too many maps\n");
+	abort();
+}
+
+static __u64 sim_hash(const void *key, __u32 len)
+{
+	const __u8 *p = key;
+	__u64 h = 0xcbf29ce484222325ULL;
+	for (__u32 i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static struct sim_entry *sim_hash_find(struct sim_map *m, const void *key, __u64 hash)
+{
+	struct sim_entry *e;
+	for (e = m->buckets[hash & m->mask]; e; e = e->next) {
+		if (e->hash == hash && !memcmp(e->data, key, m->def->key_size)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void sim_hash_remove(struct sim_map *m, struct sim_entry *e)
+{
+	struct sim_entry **pp = &m->buckets[e->hash & m->mask];
+	while (*pp != e) {
+		pp = &(*pp)->next;
+	}
+	*pp = e->next;
+
+	if (e->older) {
+		e->older->newer = e->newer;
+	} else {
+		m->oldest = e->newer;
+	}
+	if (e->newer) {
+		e->newer->older = e->older;
+	} else {
+		m->newest = e->older;
+	}
+
+	if (m->prefixlen_count) {
+		m->prefixlen_count[*(__u32 *)e->data]--;
+	}
+	m->count--;
+	free(e);
+}
+
+static long sim_hash_update(struct sim_map *m, const void *key, const void *value, __u64 flags)
+{
+	__u64 hash = sim_hash(key, m->def->key_size);
+	struct sim_entry *e = sim_hash_find(m, key, hash);
+
+	if (e) {
+		if (flags == BPF_NOEXIST) {
+			return -EEXIST;
+		}
+		memcpy(e->data + m->val_off, value, m->def->value_size);
+		return 0;
+	}
+	if (flags == BPF_EXIST) {
+		return -ENOENT;
+	}
+	if (m->count >= m->def->max_entries) {
+		if (m->def->type != BPF_MAP_TYPE_LRU_HASH && m->def->type != BPF_MAP_TYPE_LRU_PERCPU_HASH) {
+			return -E2BIG;
+		}
+		sim_hash_remove(m, m->oldest);
+	}
+
+	e = sim_calloc(1, sizeof(*e) + m->val_off + m->def->value_size);
+	e->hash = hash;
+	memcpy(e->data, key, m->def->key_size);
+	memcpy(e->data + m->val_off, value, m->def->value_size);
+
+	e->next = m->buckets[hash & m->mask];
+	m->buckets[hash & m->mask] = e;
+	e->older = m->newest;
+	if (m->newest) {
+		m->newest->newer = e;
+	} else {
+		m->oldest = e;
+	}
+	m->newest = e;
+
+	if (m->prefixlen_count) {
+		m->prefixlen_count[*(__u32 *)key]++;
+	}
+	m->count++;
+	return 0;
+}
+
+/* sim_lpm_mask copies an LPM key with the given prefix length, zeroing the bits past it. */
+static void sim_lpm_mask(struct sim_map *m, __u8 *dst, const struct bpf_lpm_trie_key *key, __u32 prefixlen)
+{
+	__u32 full = prefixlen / 8, rem = prefixlen % 8;
+
+	memset(dst, 0, m->def->key_size);
+	*(__u32 *)dst = prefixlen;
+	memcpy(dst + sizeof(__u32), key->data, full);
+	if (rem) {
+		dst[sizeof(__u32) + full] = key->data[full] & (__u8)(0xff << (8 - rem));
+	}
+}
+
+static struct sim_entry *sim_lpm_lookup(struct sim_map *m, const struct bpf_lpm_trie_key *key)
+{
+	__u8 masked[SIM_MAX_KEY_SIZE];
+	__u32 prefixlen = key->prefixlen < m->max_prefixlen ? key->prefixlen : m->max_prefixlen;
+
+	for (__s32 len = prefixlen; len >= 0; len--) {
+		if (!m->prefixlen_count[len]) {
+			continue;
+		}
+		sim_lpm_mask(m, masked, key, len);
+		struct sim_entry *e = sim_hash_find(m, masked, sim_hash(masked, m->def->key_size));
+		if (e) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+void *bpf_map_lookup_elem(void *map, const void *key)
+{
+	struct sim_map *m = sim_map_get(map);
+	struct sim_entry *e;
+	__u32 idx;
+
+	sim_stats.map_lookups++;
+	switch (m->def->type) {
+	case BPF_MAP_TYPE_ARRAY:
+	case BPF_MAP_TYPE_PERCPU_ARRAY:
+		idx = *(__u32 *)key;
+		if (idx >= m->def->max_entries) {
+			return NULL;
+		}
+		return m->values + (size_t)idx * m->def->value_size;
+	case BPF_MAP_TYPE_PROG_ARRAY:
+		return NULL;
+	case BPF_MAP_TYPE_LPM_TRIE:
+		e = sim_lpm_lookup(m, key);
+		break;
+	default:
+		e = sim_hash_find(m, key, sim_hash(key, m->def->key_size));
+	}
+	return e ? e->data + m->val_off : NULL;
+}
+
+long bpf_map_update_elem(void *map, const void *key, const void *value, __u64 flags)
+{
+	struct sim_map *m = sim_map_get(map);
+	__u8 masked[SIM_MAX_KEY_SIZE];
+	__u32 idx;
+
+	sim_stats.map_updates++;
+	switch (m->def->type) {
+	case BPF_MAP_TYPE_ARRAY:
+	case BPF_MAP_TYPE_PERCPU_ARRAY:
+		idx = *(__u32 *)key;
+		if (idx >= m->def->max_entries) {
+			return -E2BIG;
+		}
+		if (flags == BPF_NOEXIST) {
+			return -EEXIST;
+		}
+		memcpy(m->values + (size_t)idx * m->def->value_size, value, m->def->value_size);
+		return 0;
+	case BPF_MAP_TYPE_PROG_ARRAY:
+		return -EINVAL;
+	case BPF_MAP_TYPE_LPM_TRIE:
+		if (((struct bpf_lpm_trie_key *)key)->prefixlen > m->max_prefixlen) {
+			return -EINVAL;
+		}
+		sim_lpm_mask(m, masked, key, ((struct bpf_lpm_trie_key *)key)->prefixlen);
+		return sim_hash_update(m, masked, value, flags);
+	default:
+		return sim_hash_update(m, key, value, flags);
+	}
+}
+
+long bpf_map_delete_elem(void *map, const void *key)
+{
+	struct sim_map *m = sim_map_get(map);
+	__u8 masked[SIM_MAX_KEY_SIZE];
+	struct sim_entry *e;
+
+	switch (m->def->type) {
+	case BPF_MAP_TYPE_ARRAY:
+	case BPF_MAP_TYPE_PERCPU_ARRAY:
+	case BPF_MAP_TYPE_PROG_ARRAY:
+		return -EINVAL;
+	case BPF_MAP_TYPE_LPM_TRIE:
+		if (((struct bpf_lpm_trie_key *)key)->prefixlen > m->max_prefixlen) {
+			return -EINVAL;
+		}
+		sim_lpm_mask(m, masked, key, ((struct bpf_lpm_trie_key *)key)->prefixlen);
+		key = masked;
+		/* fallthrough */
+	default:
+		e = sim_hash_find(m, key, sim_hash(key, m->def->key_size));
+		if (!e) {
+			return -ENOENT;
+		}
+		sim_hash_remove(m, e);
+		return 0;
+	}
+}
+
+__u32 sim_map_entries(void *map)
+{
+	return sim_map_get(map)->count;
+}
+
+/* Running programs.
+ *
+ * bpf_exit() and successful tail calls don't return to the program, so the simulator
+ * unwinds them with a longjmp() back to sim_run().  The programs are fully inlined, there
+ * are no frames of theirs to skip over.
+ */
+
+static jmp_buf *sim_run_env;
+static int sim_run_rc;
+static int sim_run_tail_calls;
+
+int sim_run(sim_prog_fn prog, void *ctx)
+{
+	jmp_buf env;
+
+	sim_run_env = &env;
+	sim_run_tail_calls = 0;
+	if (setjmp(env)) {
+		return sim_run_rc;
+	}
+	return prog(ctx);
+}
+
+_Noreturn void sim_exit(int rc)
+{
+	sim_run_rc = rc;
+	longjmp(*sim_run_env, 1);
+}
+
+void sim_prog_array_set(void *map, __u32 index, sim_prog_fn prog)
+{
+	struct sim_map *m = sim_map_get(map);
+	if (m->def->type != BPF_MAP_TYPE_PROG_ARRAY || index >= m->def->max_entries) {
+		fprintf(stderr, "sim: bad prog array slot %u\n", index);
+		abort();
+	}
+	m->progs[index] = prog;
+}
+
+long bpf_tail_call(void *ctx, void *prog_array_map, __u32 index)
+{
+	struct sim_map *m = sim_map_get(prog_array_map);
+
+	/* Like the kernel, fall through to the next instruction if the slot is empty or if
+	 * the program has made too many tail calls. */
+	if (index >= m->def->max_entries || !m->progs[index] ||
+			sim_run_tail_calls >= SIM_MAX_TAIL_CALLS) {
+		return -ENOENT;
+	}
+	sim_run_tail_calls++;
+	sim_stats.tail_calls++;
+	sim_exit(m->progs[index](ctx));
+}
+
+/* Packets.
+ *
+ * There is a single packet buffer, allocated below 4GiB where it is available so that the
+ * 32-bit data fields of __sk_buff and xdp_md can hold pointers into it.  The packet is
+ * always linear.
+ */
+
+#define SIM_PKT_HEADROOM 256
+#define SIM_PKT_BUF_SIZE (SIM_PKT_HEADROOM + 65536)
+
+static __u8 *sim_pkt_buf;
+
+void *sim_pkt_load(const void *data, __u32 len)
+{
+	if (!sim_pkt_buf) {
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_32BIT
+		flags |= MAP_32BIT;
+#endif
+		void *buf = mmap(NULL, SIM_PKT_BUF_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (buf == MAP_FAILED || (uintptr_t)buf + SIM_PKT_BUF_SIZE > UINT32_MAX) {
+			fprintf(stderr, "sim: failed to map the packet buffer below 4GiB\n");
+			abort();
+		}
+		sim_pkt_buf = buf;
+	}
+	if (len > SIM_PKT_BUF_SIZE - SIM_PKT_HEADROOM) {
+		return NULL;
+	}
+	memcpy(sim_pkt_buf + SIM_PKT_HEADROOM, data, len);
+	return sim_pkt_buf + SIM_PKT_HEADROOM;
+}
+
+#define sim_ptr(field) ((__u8 *)(uintptr_t)(field))
+#define sim_u32(ptr) ((__u32)(uintptr_t)(ptr))
+
+long bpf_skb_pull_data(struct __sk_buff *skb, __u32 len)
+{
+	return len <= skb->len ? 0 : -ENOMEM;
+}
+
+long bpf_skb_adjust_room(struct __sk_buff *skb, __s32 len_diff, __u32 mode, __u64 flags)
+{
+	__u8 *data = sim_ptr(skb->data), *new_data = data - len_diff;
+
+	/* Only room after the MAC header, which is what encap and decap use. */
+	if (mode != BPF_ADJ_ROOM_MAC) {
+		return -ENOTSUP;
+	}
+	if (new_data < sim_pkt_buf || (len_diff < 0 && skb->len < ETH_HLEN - len_diff)) {
+		return -ENOMEM;
+	}
+	memmove(new_data, data, ETH_HLEN);
+	if (len_diff > 0) {
+		memset(new_data + ETH_HLEN, 0, len_diff);
+	}
+	skb->data = skb->data_meta = sim_u32(new_data);
+	skb->len += len_diff;
+	return 0;
+}
+
+long bpf_skb_change_tail(struct __sk_buff *skb, __u32 len, __u64 flags)
+{
+	__u8 *data = sim_ptr(skb->data);
+
+	if (flags || data + len > sim_pkt_buf + SIM_PKT_BUF_SIZE) {
+		return -EINVAL;
+	}
+	if (len > skb->len) {
+		memset(data + skb->len, 0, len - skb->len);
+	}
+	skb->len = len;
+	skb->data_end = sim_u32(data + len);
+	return 0;
+}
+
+long bpf_xdp_adjust_meta(struct xdp_md *xdp_md, int delta)
+{
+	__u8 *meta = sim_ptr(xdp_md->data_meta) + delta, *data = sim_ptr(xdp_md->data);
+
+	if (meta < sim_pkt_buf || meta > data || (data - meta) > 32 || (data - meta) % 4) {
+		return -EINVAL;
+	}
+	xdp_md->data_meta = sim_u32(meta);
+	return 0;
+}
+
+/* Checksums, with the same arithmetic as the kernel's csum_replace*() for a packet that
+ * isn't CHECKSUM_PARTIAL.
+ */
+
+static __u32 sim_csum_add(__u32 a, __u32 b)
+{
+	a += b;
+	return a + (a < b);
+}
+
+static __u16 sim_csum_fold(__u32 sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+static __u8 *sim_csum_ptr(struct __sk_buff *skb, __u32 offset)
+{
+	if (offset + sizeof(__u16) > skb->len) {
+		return NULL;
+	}
+	return sim_ptr(skb->data) + offset;
+}
+
+static long sim_csum_replace(__u8 *ptr, __u64 from, __u64 to, __u32 size)
+{
+	__u16 sum;
+	__u32 tmp;
+
+	memcpy(&sum, ptr, sizeof(sum));
+	switch (size) {
+	case 0:
+		if (from) {
+			return -EINVAL;
+		}
+		sum = sim_csum_fold(sim_csum_add(to, ~(__u32)sum));
+		break;
+	case 2:
+	case 4:
+		tmp = sim_csum_add(~(__u32)sum, ~(__u32)from);
+		sum = sim_csum_fold(sim_csum_add(tmp, to));
+		break;
+	default:
+		return -EINVAL;
+	}
+	memcpy(ptr, &sum, sizeof(sum));
+	return 0;
+}
+
+long bpf_l3_csum_replace(struct __sk_buff *skb, __u32 offset, __u64 from, __u64 to, __u64 size)
+{
+	__u8 *ptr = sim_csum_ptr(skb, offset);
+	if (!ptr) {
+		return -EFAULT;
+	}
+	return sim_csum_replace(ptr, from, to, size & BPF_F_HDR_FIELD_MASK);
+}
+
+long bpf_l4_csum_replace(struct __sk_buff *skb, __u32 offset, __u64 from, __u64 to, __u64 flags)
+{
+	bool mangled_0 = flags & BPF_F_MARK_MANGLED_0;
+	__u8 *ptr = sim_csum_ptr(skb, offset);
+	__u16 sum;
+	long rc;
+
+	if (!ptr) {
+		return -EFAULT;
+	}
+	memcpy(&sum, ptr, sizeof(sum));
+	if (mangled_0 && !sum) {
+		return 0;
+	}
+	rc = sim_csum_replace(ptr, from, to, flags & BPF_F_HDR_FIELD_MASK);
+	memcpy(&sum, ptr, sizeof(sum));
+	if (mangled_0 && !sum) {
+		sum = 0xffff;
+		memcpy(ptr, &sum, sizeof(sum));
+	}
+	return rc;
+}
+
+__s64 bpf_csum_diff(__be32 *from, __u32 from_size, __be32 *to, __u32 to_size, __wsum seed)
+{
+	__u32 sum = seed;
+
+	if (from_size % 4 || to_size % 4 || from_size + to_size > 512) {
+		return -EINVAL;
+	}
+	for (__u32 i = 0; i < from_size / 4; i++) {
+		sum = sim_csum_add(sum, ~from[i]);
+	}
+	for (__u32 i = 0; i < to_size / 4; i++) {
+		sum = sim_csum_add(sum, to[i]);
+	}
+	return sum;
+}
+
+/* Forwarding.  There is no kernel FIB to consult, lookups resolve to the interface in the
+ * config, with made up MACs.
+ */
+
+long bpf_redirect(__u32 ifindex, __u64 flags)
+{
+	sim_stats.redirects++;
+	sim_stats.last_redirect_ifindex = ifindex;
+	return TC_ACT_REDIRECT;
+}
+
+long bpf_fib_lookup(void *ctx, struct bpf_fib_lookup *params, int plen, __u32 flags)
+{
+	static const __u8 smac[ETH_ALEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+	static const __u8 dmac[ETH_ALEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+
+	sim_stats.fib_lookups++;
+	if (!sim_config.fib_ifindex) {
+		return BPF_FIB_LKUP_RET_NOT_FWDED;
+	}
+	params->ifindex = sim_config.fib_ifindex;
+	memcpy(params->smac, smac, ETH_ALEN);
+	memcpy(params->dmac, dmac, ETH_ALEN);
+	return BPF_FIB_LKUP_RET_SUCCESS;
+}
+
+/* Everything else. */
+
+__u64 bpf_ktime_get_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+__u32 bpf_get_prandom_u32(void)
+{
+	/* A fixed seed keeps runs repeatable. */
+	static __u32 state = 0x9e3779b9;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+long bpf_trace_printk(const char *fmt, __u32 fmt_size, ...)
+{
+	va_list ap;
+	int n;
+
+	if (!sim_config.trace_printk) {
+		return 0;
+	}
+	va_start(ap, fmt_size);
+	n = vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	return n;
+}
+
+__u64 bpf_get_socket_cookie(void *ctx)
+{
+	return 0;
+}
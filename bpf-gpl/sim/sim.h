@@ -0,0 +1,99 @@
+// Project Calico BPF dataplane programs.
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+#ifndef __CALI_SIM_H__
+#define __CALI_SIM_H__
+
+/* The userspace simulator runs the datapath programs as native code, so that they can be
+ * benchmarked and profiled without root or a BPF-capable kernel.  sim.c implements the
+ * helpers that the programs call on top of in-process maps, prog.c wraps one of the
+ * programs and main.c replays packet captures through it.
+ *
+ * The simulator is single threaded, it models a single CPU.  It is meant for comparing the
+ * cost of the program logic from one change to the next, not for predicting the cost in the
+ * kernel:
+ *
+ * - the maps are simple in-process hash tables (see sim.c), so their costs differ from the
+ *   kernel's, especially for the LPM tries;
+ * - the programs are compiled for the host rather than JITed from BPF and nothing is verified;
+ * - Felix's generated policy program is replaced by one that allows or denies everything;
+ * - FIB lookups resolve to a fixed interface and redirects are only counted;
+ * - the time per packet includes copying the packet into the packet buffer.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <linux/types.h>
+
+/* Values of the configurables that the loader patches into the programs (see
+ * CALI_CONFIGURABLE in bpf.h), in the byte order that the loader uses: host_ip and intf_ip
+ * in network order, the rest in host order.
+ */
+extern __u32 cali_sim_host_ip;
+extern __u32 cali_sim_tunnel_mtu;
+extern __u32 cali_sim_vxlan_port;
+extern __u32 cali_sim_intf_ip;
+extern __u32 cali_sim_ext_to_svc_mark;
+extern __u32 cali_sim_global_flags;
+
+struct sim_config {
+	/* Interface that FIB lookups resolve to, they fail with BPF_FIB_LKUP_RET_NOT_FWDED
+	 * if it is 0. */
+	__u32 fib_ifindex;
+	/* Print bpf_trace_printk() output to stderr. */
+	bool trace_printk;
+};
+
+extern struct sim_config sim_config;
+
+struct sim_stats {
+	__u64 tail_calls;
+	__u64 map_lookups;
+	__u64 map_updates;
+	__u64 fib_lookups;
+	__u64 redirects;
+	__u32 last_redirect_ifindex;
+};
+
+extern struct sim_stats sim_stats;
+
+typedef int (*sim_prog_fn)(void *ctx);
+
+/* sim_prog_array_set puts a program in a BPF_MAP_TYPE_PROG_ARRAY map for bpf_tail_call(). */
+void sim_prog_array_set(void *map, __u32 index, sim_prog_fn prog);
+
+/* sim_run runs a program to completion, through any tail calls, and returns its verdict. */
+int sim_run(sim_prog_fn prog, void *ctx);
+
+/* sim_pkt_load copies a packet into the simulator's packet buffer, which is below 4GiB so
+ * that it can be addressed by the 32-bit data fields of the program context, and returns
+ * where it starts.  The buffer has headroom for encapsulation and metadata.  Returns NULL if
+ * the packet does not fit.
+ */
+void *sim_pkt_load(const void *data, __u32 len);
+
+/* sim_map_entries returns the number of entries in a hash or LPM map. */
+__u32 sim_map_entries(void *map);
+
+/* Implemented by prog.c for the program that it is compiled with. */
+int sim_prog_init(const char *policy);
+int sim_prog_run(const void *pkt, __u32 len, __u32 ifindex, int *verdict);
+const char *sim_prog_verdict(int rc);
+int sim_prog_add_route(__be32 addr, __u32 prefixlen, const char *type, __u32 ifindex);
+void sim_prog_report(FILE *f);
+
+#endif /* __CALI_SIM_H__ */
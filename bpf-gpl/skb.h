@@ -28,6 +28,18 @@
 #include "types.h"
 #include "log.h"
 
+#ifdef __CALI_SIM__
+/* The userspace simulator maps packets below 4GiB, so the 32-bit fields hold the whole
+ * pointer and there is no verifier to satisfy.
+ */
+static CALI_BPF_INLINE void *skb_start_ptr(struct __sk_buff *skb) {
+	return (void *)(unsigned long)skb->data;
+}
+
+static CALI_BPF_INLINE void *skb_end_ptr(struct __sk_buff *skb) {
+	return (void *)(unsigned long)skb->data_end;
+}
+#else
 /* skb_start_ptr is equivalent to (void*)((__u64)skb->data); the read is done
  * in a way that is acceptable to the verifier and it is done as a volatile read
  * ensuring that a fresh value is returned and the compiler cannot
@@ -61,6 +73,7 @@ static CALI_BPF_INLINE void *skb_end_ptr(struct __sk_buff *skb) {
 	 );
 	return ptr;
 }
+#endif /* __CALI_SIM__ */
 
 /* skb_refresh_start_end refreshes the data_start and data_end pointers in the context.
  * Fresh values are loaded using skb_start/end_ptr.
@@ -126,6 +139,7 @@ static CALI_BPF_INLINE void skb_refresh_hdr_ptrs(struct cali_tc_ctx *ctx)
  * - ctx->nh/tcp_header/udp_header/icmp_header.
  */
 static CALI_BPF_INLINE int skb_refresh_validate_ptrs(struct cali_tc_ctx *ctx, long nh_len) {
+	CALI_LOG_LEVEL_CACHE(ctx->log_level);
 	int min_size = skb_iphdr_offset() + IP_SIZE;
 	skb_refresh_start_end(ctx);
 	if (ctx->data_start + (min_size + nh_len) > ctx->data_end) {
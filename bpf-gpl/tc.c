@@ -48,6 +48,9 @@
 #include "policy_program.h"
 #include "parsing.h"
 #include "failsafe.h"
+#include "trace.h"
+#include "latency.h"
+#include "sample.h"
 #include "metadata.h"
 
 /* calico_tc is the main function used in all of the tc programs.  It is specialised
@@ -55,6 +58,7 @@
  */
 static CALI_BPF_INLINE int calico_tc(struct __sk_buff *skb)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 #ifdef CALI_SET_SKB_MARK
 	/* UT-only workaround to allow us to run the program with BPF_TEST_PROG_RUN
 	 * and simulate a specific mark
@@ -67,6 +71,8 @@ static CALI_BPF_INLINE int calico_tc(struct __sk_buff *skb)
 	 * skip all processing. */
 	if (!CALI_F_TO_HOST && skb->mark == CALI_SKB_MARK_BYPASS) {
 		CALI_INFO("Final result=ALLOW (%d). Bypass mark bit set.\n", CALI_REASON_BYPASS);
+		cali_count_verdict(CALI_REASON_BYPASS, false, skb->len);
+		cali_sample_skb(skb, CALI_REASON_BYPASS, false);
 		return TC_ACT_UNSPEC;
 	}
 
@@ -75,6 +81,8 @@ static CALI_BPF_INLINE int calico_tc(struct __sk_buff *skb)
 	if (CALI_F_FROM_HEP) {
 		if (xdp2tc_get_metadata(skb) & CALI_META_ACCEPTED_BY_XDP) {
 			CALI_INFO("Final result=ALLOW (%d). Accepted by XDP.\n", CALI_REASON_ACCEPTED_BY_XDP);
+			cali_count_verdict(CALI_REASON_ACCEPTED_BY_XDP, false, skb->len);
+			cali_sample_skb(skb, CALI_REASON_ACCEPTED_BY_XDP, false);
 			return TC_ACT_UNSPEC;
 		}
 	}
@@ -83,6 +91,7 @@ static CALI_BPF_INLINE int calico_tc(struct __sk_buff *skb)
 	 * we use to pass data from one program to the next via tail calls. */
 	struct cali_tc_ctx ctx = {
 		.state = state_get(),
+		.log_level = cali_log_lvl,
 		.skb = skb,
 		.fwd = {
 			.res = TC_ACT_UNSPEC,
@@ -91,13 +100,15 @@ static CALI_BPF_INLINE int calico_tc(struct __sk_buff *skb)
 	};
 	if (!ctx.state) {
 		CALI_DEBUG("State map lookup failed: DROP\n");
+		cali_count_verdict(CALI_REASON_UNKNOWN, true, skb->len);
 		return TC_ACT_SHOT;
 	}
 	__builtin_memset(ctx.state, 0, sizeof(*ctx.state));
 
-	if (CALI_LOG_LEVEL >= CALI_LOG_LEVEL_INFO) {
+	if (CALI_LOG_LEVEL >= CALI_LOG_LEVEL_INFO && cali_log_lvl >= CALI_LOG_LEVEL_INFO) {
 		ctx.state->prog_start_time = bpf_ktime_get_ns();
 	}
+	cali_lat_start(ctx.state);
 
 	/* We only try a FIB lookup and redirect for packets that are towards the host.
 	 * For packets that are leaving the host namespace, routing has already been done. */
@@ -163,6 +174,7 @@ static CALI_BPF_INLINE int calico_tc(struct __sk_buff *skb)
 	/* Now we've got as far as the UDP header, check if this is one of our VXLAN packets, which we
 	 * use to forward traffic for node ports. */
 	if (dnat_should_decap() /* Compile time: is this a BPF program that should decap packets? */ &&
+			CALI_VXLAN_ENABLED /* Load time: can there be VXLAN packets? */ &&
 			is_vxlan_tunnel(ctx.ip_header) /* Is this a VXLAN packet? */ ) {
 		/* Decap it; vxlan_attempt_decap will revalidate the packet if needed. */
 		switch (vxlan_attempt_decap(&ctx)) {
@@ -188,11 +200,20 @@ static CALI_BPF_INLINE int calico_tc(struct __sk_buff *skb)
 		goto allow;
 	}
 
+	cali_lat_record(ctx.state, CALI_LAT_PARSE);
+	cali_trace_check(ctx.state);
+	CALI_TRACE(ctx.state, "New packet proto=%d src=%x dst=%x\n",
+			ctx.state->ip_proto, bpf_ntohl(ctx.state->ip_src), bpf_ntohl(ctx.state->ip_dst));
+	CALI_TRACE(ctx.state, "sport=%d dport=%d ifindex=%d\n",
+			ctx.state->sport, ctx.state->dport, skb->ifindex);
+
 	ctx.state->pol_rc = CALI_POL_NO_MATCH;
 
 	/* Do conntrack lookup before anything else */
 	ctx.state->ct_result = calico_ct_v4_lookup(&ctx);
 	CALI_DEBUG("conntrack entry flags 0x%x\n", ctx.state->ct_result.flags);
+	CALI_TRACE(ctx.state, "CT rc=%d flags=%x\n", ctx.state->ct_result.rc, ctx.state->ct_result.flags);
+	cali_lat_record(ctx.state, CALI_LAT_CT);
 
 	/* Check if someone is trying to spoof a tunnel packet */
 	if (CALI_F_FROM_HEP && ct_result_tun_src_changed(ctx.state->ct_result.rc)) {
@@ -254,9 +275,12 @@ static CALI_BPF_INLINE int calico_tc(struct __sk_buff *skb)
 
 	/* No conntrack entry, check if we should do NAT */
 	nat_lookup_result nat_res = NAT_LOOKUP_ALLOW;
-	ctx.nat_dest = calico_v4_nat_lookup2(ctx.state->ip_src, ctx.state->ip_dst,
-					     ctx.state->ip_proto, ctx.state->dport,
-					     ctx.state->tun_ip != 0, &nat_res);
+	if (CALI_NAT_ENABLED) {
+		ctx.nat_dest = calico_v4_nat_lookup2(ctx.state->ip_src, ctx.state->ip_dst,
+						     ctx.state->ip_proto, ctx.state->dport,
+						     ctx.state->tun_ip != 0, &nat_res);
+	}
+	cali_lat_record(ctx.state, CALI_LAT_NAT);
 
 	if (nat_res == NAT_FE_LOOKUP_DROP) {
 		CALI_DEBUG("Packet is from an unauthorised source: DROP\n");
@@ -266,6 +290,8 @@ static CALI_BPF_INLINE int calico_tc(struct __sk_buff *skb)
 	if (ctx.nat_dest != NULL) {
 		ctx.state->post_nat_ip_dst = ctx.nat_dest->addr;
 		ctx.state->post_nat_dport = ctx.nat_dest->port;
+		CALI_TRACE(ctx.state, "DNAT to %x:%d\n",
+				bpf_ntohl(ctx.state->post_nat_ip_dst), ctx.state->post_nat_dport);
 	} else if (nat_res == NAT_NO_BACKEND) {
 		/* send icmp port unreachable if there is no backend for a service */
 		ctx.state->icmp_type = ICMP_DEST_UNREACH;
@@ -346,7 +372,7 @@ static CALI_BPF_INLINE int calico_tc(struct __sk_buff *skb)
 	// sending socket's cookie, so we can reverse a DNAT that the CTLB may have done.
 	// This allows us to give the policy program the pre-DNAT destination as well as
 	// the post-DNAT destination in all cases.
-	__u64 cookie = bpf_get_socket_cookie(ctx.skb);
+	__u64 cookie = CALI_CTLB_ENABLED ? bpf_get_socket_cookie(ctx.skb) : 0;
 	if (cookie) {
 		CALI_DEBUG("Socket cookie: %x\n", cookie);
 		struct ct_nats_key ct_nkey = {
@@ -386,6 +412,8 @@ static CALI_BPF_INLINE int calico_tc(struct __sk_buff *skb)
 	}
 
 	CALI_DEBUG("About to jump to policy program.\n");
+	CALI_TRACE(ctx.state, "Jumping to policy, flags=%x\n", ctx.state->flags);
+	cali_lat_skip(ctx.state);
 	bpf_tail_call(skb, &cali_jump, PROG_INDEX_POLICY);
 	if (CALI_F_HEP) {
 		CALI_DEBUG("HEP with no policy, allow.\n");
@@ -424,11 +452,13 @@ deny:
 __attribute__((section("1/1")))
 int calico_tc_skb_accepted_entrypoint(struct __sk_buff *skb)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 	CALI_DEBUG("Entering calico_tc_skb_accepted_entrypoint\n");
 	/* Initialise the context, which is stored on the stack, and the state, which
 	 * we use to pass data from one program to the next via tail calls. */
 	struct cali_tc_ctx ctx = {
 		.state = state_get(),
+		.log_level = cali_log_lvl,
 		.skb = skb,
 		.fwd = {
 			.res = TC_ACT_UNSPEC,
@@ -440,6 +470,8 @@ int calico_tc_skb_accepted_entrypoint(struct __sk_buff *skb)
 		return TC_ACT_SHOT;
 	}
 
+	cali_lat_record(ctx.state, CALI_LAT_POLICY);
+
 	if (skb_refresh_validate_ptrs(&ctx, UDP_SIZE)) {
 		ctx.fwd.reason = CALI_REASON_SHORT;
 		CALI_DEBUG("Too short\n");
@@ -451,7 +483,7 @@ int calico_tc_skb_accepted_entrypoint(struct __sk_buff *skb)
 		.addr=ctx.state->nat_dest.addr,
 		.port=ctx.state->nat_dest.port,
 	};
-	if (ctx.state->nat_dest.addr != 0) {
+	if (CALI_NAT_ENABLED && ctx.state->nat_dest.addr != 0) {
 		nat_dest = &nat_dest_2;
 	}
 
@@ -465,6 +497,7 @@ deny:
 static CALI_BPF_INLINE struct fwd calico_tc_skb_accepted(struct cali_tc_ctx *ctx,
 							 struct calico_nat_dest *nat_dest)
 {
+	CALI_LOG_LEVEL_CACHE(ctx->log_level);
 	CALI_DEBUG("Entering calico_tc_skb_accepted\n");
 	struct __sk_buff *skb = ctx->skb;
 	struct cali_tc_state *state = ctx->state;
@@ -484,6 +517,7 @@ static CALI_BPF_INLINE struct fwd calico_tc_skb_accepted(struct cali_tc_ctx *ctx
 	CALI_DEBUG("pol_rc=%d\n", state->pol_rc);
 	CALI_DEBUG("sport=%d\n", state->sport);
 	CALI_DEBUG("flags=%x\n", state->flags);
+	CALI_TRACE(state, "Accepted pol_rc=%d CT rc=%d\n", state->pol_rc, state->ct_result.rc);
 	CALI_DEBUG("ct_rc=%d\n", ct_rc);
 	CALI_DEBUG("ct_related=%d\n", ct_related);
 
@@ -1040,6 +1074,7 @@ deny:
 __attribute__((section("1/2")))
 int calico_tc_skb_send_icmp_replies(struct __sk_buff *skb)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 	__u32 fib_flags = 0;
 
 	CALI_DEBUG("Entering calico_tc_skb_send_icmp_replies\n");
@@ -1048,6 +1083,7 @@ int calico_tc_skb_send_icmp_replies(struct __sk_buff *skb)
 	 * we use to pass data from one program to the next via tail calls. */
 	struct cali_tc_ctx ctx = {
 		.state = state_get(),
+		.log_level = cali_log_lvl,
 		.skb = skb,
 		.fwd = {
 			.res = TC_ACT_UNSPEC,
@@ -1091,6 +1127,16 @@ deny:
 	return TC_ACT_SHOT;
 }
 
+/* The policy program tail calls this program when it denies a packet so that the packet is
+ * sampled like the ones that the C code drops.  The policy program has already counted it. */
+__attribute__((section("1/3")))
+int calico_tc_skb_denied_entrypoint(struct __sk_buff *skb)
+{
+	CALI_DEBUG("Entering calico_tc_skb_denied_entrypoint\n");
+	cali_sample_skb(skb, CALI_REASON_POL, true);
+	return TC_ACT_SHOT;
+}
+
 #ifndef CALI_ENTRYPOINT_NAME
 #define CALI_ENTRYPOINT_NAME calico_entrypoint
 #endif
@@ -0,0 +1,98 @@
+// Project Calico BPF dataplane programs.
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+#ifndef __CALI_BPF_TRACE_H__
+#define __CALI_BPF_TRACE_H__
+
+#include "bpf.h"
+#include "types.h"
+#include "log.h"
+
+/* Packet tracing lets us follow a single flow in detail without loading the debug
+ * programs.  Felix (or calico-bpf) writes a filter to the cali_v4_trace map; calico_tc()
+ * checks each packet against it once, after parsing, and sets CALI_ST_TRACE in the state
+ * of the packets that match.  The CALI_TRACE() trace points then write records for those
+ * packets only, to the log ring (see log.h), regardless of the log level of the program.
+ *
+ * WARNING: must be kept in sync with the definitions in bpf/eventlog/trace.go.
+ */
+struct cali_trace_filter {
+	/* Flags from enum cali_trace_flags; the filter matches nothing unless
+	 * CALI_TRACE_ENABLED is set. */
+	__u32 flags;
+	__be32 src_net;
+	__be32 src_mask;
+	__be32 dst_net;
+	__be32 dst_mask;
+	/* Ports in host byte order, 0 matches any port. */
+	__u16 sport;
+	__u16 dport;
+	/* IP protocol, 0 matches any protocol. */
+	__u8 ip_proto;
+	__u8 pad[3];
+};
+
+enum cali_trace_flags {
+	CALI_TRACE_ENABLED	= 0x01,
+	/* CALI_TRACE_BOTH_DIRS makes the filter also match the packets of the reverse
+	 * direction, with the source and destination swapped. */
+	CALI_TRACE_BOTH_DIRS	= 0x02,
+};
+
+CALI_MAP_V1(cali_v4_trace,
+		BPF_MAP_TYPE_ARRAY,
+		__u32, struct cali_trace_filter,
+		1, 0, MAP_PIN_GLOBAL)
+
+static CALI_BPF_INLINE bool cali_trace_match_dir(struct cali_trace_filter *f,
+						 __be32 src, __be32 dst,
+						 __u16 sport, __u16 dport)
+{
+	return (src & f->src_mask) == f->src_net &&
+		(dst & f->dst_mask) == f->dst_net &&
+		(!f->sport || f->sport == sport) &&
+		(!f->dport || f->dport == dport);
+}
+
+/* cali_trace_check sets CALI_ST_TRACE if the packet described by the state matches the
+ * trace filter.  It must be called once the ports have been filled in. */
+static CALI_BPF_INLINE void cali_trace_check(struct cali_tc_state *state)
+{
+	__u32 key = 0;
+	struct cali_trace_filter *f = cali_v4_trace_lookup_elem(&key);
+
+	if (!f || !(f->flags & CALI_TRACE_ENABLED)) {
+		return;
+	}
+	if (f->ip_proto && f->ip_proto != state->ip_proto) {
+		return;
+	}
+	if (cali_trace_match_dir(f, state->ip_src, state->ip_dst, state->sport, state->dport) ||
+			((f->flags & CALI_TRACE_BOTH_DIRS) &&
+			 cali_trace_match_dir(f, state->ip_dst, state->ip_src, state->dport, state->sport))) {
+		state->flags |= CALI_ST_TRACE;
+	}
+}
+
+/* CALI_TRACE writes a record to the log ring if the packet is being traced. */
+#define CALI_TRACE(state, fmt, ...) do { \
+	if ((state)->flags & CALI_ST_TRACE) { \
+		CALI_LOG(CALI_LOG_LEVEL_TRACE, XSTR(CALI_LOG_PFX) "-T: " fmt, ## __VA_ARGS__); \
+	} \
+} while (0)
+
+#endif /* __CALI_BPF_TRACE_H__ */
@@ -86,6 +86,17 @@ struct cali_tc_state {
 	/* Result of the NAT calculation.  Zeroed if there is no DNAT. */
 	struct calico_nat_dest nat_dest;
 	__u64 prog_start_time;
+	/* Start time of the current stage of a packet that is sampled for the latency
+	 * histograms, see latency.h. */
+	__u64 lat_stage_start;
+	/* Set by the policy program entry point of an endpoint whose policy program chain is
+	 * shared with other endpoints; the slot of the shared program array that the chain tail
+	 * calls to return to the endpoint's own programs. */
+	__u32 pol_ret_idx;
+	/* Set by the first program of a policy program chain, or by the entry point to a shared
+	 * chain; the programs of the chain are at consecutive indexes of their prog array from
+	 * this one, see polprog.WithChainSlotSet. */
+	__u32 pol_chain_base;
 };
 
 enum cali_state_flags {
@@ -101,13 +112,18 @@ enum cali_state_flags {
 	/* CALI_ST_SRC_IS_HOST is set if the packet is heading away from the host namespace and the source
 	 * belongs to the host. */
 	CALI_ST_SRC_IS_HOST	  = 0x08,
+	/* CALI_ST_TRACE is set if the packet matches the trace filter, see trace.h. */
+	CALI_ST_TRACE		  = 0x10,
+	/* CALI_ST_LAT_SAMPLE is set if the packet is sampled for the latency histograms, see
+	 * latency.h. */
+	CALI_ST_LAT_SAMPLE	  = 0x20,
 };
 
 struct fwd {
 	int res;
 	__u32 mark;
 	enum calico_reason reason;
-#if CALI_FIB_ENABLED
+#if CALI_FIB_APPLIES
 	__u32 fib_flags;
 	bool fib;
 #endif
@@ -137,6 +153,9 @@ struct cali_tc_ctx {
   struct calico_nat_dest *nat_dest;
   struct arp_key arpk;
   struct fwd fwd;
+
+  /* The level up to which this program run logs, read once when it starts, see log.h. */
+  __u32 log_level;
 };
 
 #endif /* __CALI_BPF_TYPES_H__ */
@@ -23,6 +23,7 @@ static CALI_BPF_INLINE int calico_unittest_entry (struct __sk_buff *skb)
 {
 	struct cali_tc_ctx ctx = {
 		.skb = skb,
+		.log_level = cali_log_level(),
 	};
 
 	if (skb_refresh_validate_ptrs(&ctx, UDP_SIZE)) {
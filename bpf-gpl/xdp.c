@@ -41,14 +41,18 @@
 #include "failsafe.h"
 #include "jump.h"
 #include "metadata.h"
+#include "counters.h"
+#include "sample.h"
 
 /* calico_xdp is the main function used in all of the xdp programs */
 static CALI_BPF_INLINE int calico_xdp(struct xdp_md *xdp)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 	/* Initialise the context, which is stored on the stack, and the state, which
 	 * we use to pass data from one program to the next via tail calls. */
 	struct cali_tc_ctx ctx = {
 		.state = state_get(),
+		.log_level = cali_log_lvl,
 		.xdp = xdp,
 		.fwd = {
 			.res = XDP_PASS, // TODO: Adjust based on the design
@@ -63,7 +67,7 @@ static CALI_BPF_INLINE int calico_xdp(struct xdp_md *xdp)
 
 	__builtin_memset(ctx.state, 0, sizeof(*ctx.state));
 
-	if (CALI_LOG_LEVEL >= CALI_LOG_LEVEL_INFO) {
+	if (CALI_LOG_LEVEL >= CALI_LOG_LEVEL_INFO && cali_log_lvl >= CALI_LOG_LEVEL_INFO) {
 		ctx.state->prog_start_time = bpf_ktime_get_ns();
 	}
 
@@ -95,15 +99,21 @@ static CALI_BPF_INLINE int calico_xdp(struct xdp_md *xdp)
 	bpf_tail_call(xdp, &cali_jump, PROG_INDEX_POLICY);
 
 allow:
+	cali_count_verdict(ctx.fwd.reason, false, cali_ctx_len(&ctx));
+	cali_sample_xdp(xdp, ctx.fwd.reason, false);
 	return XDP_PASS;
 
 allow_with_metadata:
 	if (xdp2tc_set_metadata(xdp, CALI_META_ACCEPTED_BY_XDP)) {
 		CALI_DEBUG("Failed to set metadata for TC\n");
 	}
+	cali_count_verdict(CALI_REASON_FAILSAFE, false, cali_ctx_len(&ctx));
+	cali_sample_xdp(xdp, CALI_REASON_FAILSAFE, false);
 	return XDP_PASS;
 
 deny:
+	cali_count_verdict(ctx.fwd.reason, true, cali_ctx_len(&ctx));
+	cali_sample_xdp(xdp, ctx.fwd.reason, true);
 	return XDP_DROP;
 }
 
@@ -121,14 +131,27 @@ int calico_xdp_norm_pol_tail(struct xdp_md *xdp)
 __attribute__((section("1/1")))
 int calico_xdp_accepted_entrypoint(struct xdp_md *xdp)
 {
+	CALI_LOG_LEVEL_CACHE(cali_log_level());
 	CALI_DEBUG("Entring calico_xdp_accepted_entrypoint\n");
 	// Share with TC the packet is already accepted and accept it there too.
 	if (xdp2tc_set_metadata(xdp, CALI_META_ACCEPTED_BY_XDP)) {
 		CALI_DEBUG("Failed to set metadata for TC\n");
 	}
+	cali_count_verdict(CALI_REASON_POL, false, (__u32)((long)xdp->data_end - (long)xdp->data));
+	cali_sample_xdp(xdp, CALI_REASON_POL, false);
 	return XDP_PASS;
 }
 
+/* The policy program tail calls this program when it denies a packet so that the packet is
+ * sampled like the ones that the C code drops.  The policy program has already counted it. */
+__attribute__((section("1/3")))
+int calico_xdp_denied_entrypoint(struct xdp_md *xdp)
+{
+	CALI_DEBUG("Entering calico_xdp_denied_entrypoint\n");
+	cali_sample_xdp(xdp, CALI_REASON_POL, true);
+	return XDP_DROP;
+}
+
 #ifndef CALI_ENTRYPOINT_NAME_XDP
 #define CALI_ENTRYPOINT_NAME_XDP calico_entrypoint_xdp
 #endif
@@ -29,9 +29,9 @@ var MapParams = bpf.MapParameters{
 	Type:       "lru_hash",
 	KeySize:    KeySize,
 	ValueSize:  ValueSize,
-	MaxEntries: 10000, // max number of nodes that can forward nodeports to a single node
+	MaxEntries: 100000, // mirrored neighbours of the host interfaces plus nodes forwarding nodeports to us
 	Name:       "cali_v4_arp",
-	Version:    2,
+	Version:    3,
 }
 
 func Map(mc *bpf.MapContext) bpf.Map {
@@ -0,0 +1,309 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package arp
+
+import (
+	"bytes"
+	"net"
+	"regexp"
+	"sync"
+	"time"
+
+	log "github.com/sirupsen/logrus"
+	"github.com/vishvananda/netlink"
+	"golang.org/x/sys/unix"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/jitter"
+)
+
+// NeighResyncPeriod determines how often we do a full resync of the kernel
+// neighbour table into the ARP map.  Netlink updates keep the map in sync in
+// between; the resync recovers from missed messages and from entries that the
+// LRU evicted.
+const NeighResyncPeriod = 60 * time.Second
+
+// usableNeighStates are the NUD states in which the kernel has a MAC that it
+// would use to transmit to the neighbour.
+const usableNeighStates = netlink.NUD_REACHABLE | netlink.NUD_STALE | netlink.NUD_DELAY |
+	netlink.NUD_PROBE | netlink.NUD_PERMANENT
+
+type neighNetlink interface {
+	NeighSubscribe(updates chan netlink.NeighUpdate, done chan struct{}) error
+	NeighList() ([]netlink.Neigh, error)
+	LinkByIndex(ifIndex int) (netlink.Link, error)
+}
+
+type neighNetlinkReal struct{}
+
+func (neighNetlinkReal) NeighSubscribe(updates chan netlink.NeighUpdate, done chan struct{}) error {
+	return netlink.NeighSubscribeWithOptions(updates, done, netlink.NeighSubscribeOptions{
+		ErrorCallback: func(err error) {
+			// Not necessarily fatal (can be an unexpected message, which the library will drop).
+			log.WithError(err).Warn("Netlink reported an error.")
+		},
+	})
+}
+
+func (neighNetlinkReal) NeighList() ([]netlink.Neigh, error) {
+	return netlink.NeighList(0, netlink.FAMILY_V4)
+}
+
+func (neighNetlinkReal) LinkByIndex(ifIndex int) (netlink.Link, error) {
+	return netlink.LinkByIndex(ifIndex)
+}
+
+// NeighMirror mirrors the kernel's IPv4 neighbour table for the host interfaces
+// that match the given regexp into the ARP map.  That allows the BPF programs
+// to redirect packets directly to a neighbour on a host interface from the
+// very first packet, instead of falling back to the kernel until an entry is
+// learned from the datapath.
+//
+// The mirror only ever overwrites or removes entries that it wrote itself,
+// entries learned by the BPF programs are left alone.
+type NeighMirror struct {
+	arpMap     bpf.Map
+	ifaceRegex *regexp.Regexp
+	nl         neighNetlink
+
+	// ifaceMACs caches the MAC of the interfaces we mirror, nil for interfaces
+	// that we ignore.
+	ifaceMACs map[int]net.HardwareAddr
+	// mirrored contains the entries that we wrote to the map.
+	mirrored map[Key]Value
+
+	wg       sync.WaitGroup
+	stopCh   chan struct{}
+	stopOnce sync.Once
+}
+
+// NewNeighMirror returns a NeighMirror that maintains the given ARP map for
+// interfaces matching ifaceRegex.
+func NewNeighMirror(arpMap bpf.Map, ifaceRegex *regexp.Regexp) *NeighMirror {
+	return newNeighMirrorWithShim(arpMap, ifaceRegex, neighNetlinkReal{})
+}
+
+func newNeighMirrorWithShim(arpMap bpf.Map, ifaceRegex *regexp.Regexp, nl neighNetlink) *NeighMirror {
+	return &NeighMirror{
+		arpMap:     arpMap,
+		ifaceRegex: ifaceRegex,
+		nl:         nl,
+		ifaceMACs:  map[int]net.HardwareAddr{},
+		mirrored:   map[Key]Value{},
+		stopCh:     make(chan struct{}),
+	}
+}
+
+// Start the mirroring thread.
+func (m *NeighMirror) Start() {
+	m.wg.Add(1)
+	go func() {
+		defer m.wg.Done()
+
+		log.Info("Neighbour mirror thread started")
+		defer log.Info("Neighbour mirror thread stopped")
+
+		ticker := jitter.NewTicker(NeighResyncPeriod, NeighResyncPeriod/10)
+		defer ticker.Stop()
+
+		// Reconnection loop.
+		for {
+			updates := make(chan netlink.NeighUpdate, 100)
+			done := make(chan struct{})
+			if err := m.nl.NeighSubscribe(updates, done); err != nil {
+				log.WithError(err).Error("Failed to subscribe to neighbour updates, retrying")
+				close(done)
+				select {
+				case <-time.After(time.Second):
+					continue
+				case <-m.stopCh:
+					return
+				}
+			}
+
+			// Resync after subscribing so that we do not miss updates that
+			// happen in between the list and the subscription.
+			if err := m.Resync(); err != nil {
+				log.WithError(err).Warn("Failed to resync neighbour table")
+			}
+
+		readLoop:
+			for {
+				select {
+				case u, ok := <-updates:
+					if !ok {
+						log.Warn("Neighbour update channel closed, reconnecting to netlink")
+						break readLoop
+					}
+					m.onNeighUpdate(u)
+				case <-ticker.C:
+					if err := m.Resync(); err != nil {
+						log.WithError(err).Warn("Failed to resync neighbour table")
+					}
+				case <-m.stopCh:
+					close(done)
+					return
+				}
+			}
+			close(done)
+		}
+	}()
+}
+
+// Stop stops the mirroring thread and waits for it to finish.
+func (m *NeighMirror) Stop() {
+	m.stopOnce.Do(func() {
+		close(m.stopCh)
+		m.wg.Wait()
+	})
+}
+
+// Resync lists the kernel neighbour table and brings the map in sync with it.
+// Every desired entry is checked because the map is an LRU and the kernel
+// may have evicted some of them.
+func (m *NeighMirror) Resync() error {
+	neighs, err := m.nl.NeighList()
+	if err != nil {
+		return err
+	}
+
+	// Interfaces may have been renamed or changed their MAC since we last
+	// looked.
+	m.ifaceMACs = map[int]net.HardwareAddr{}
+
+	desired := map[Key]Value{}
+	for i := range neighs {
+		if k, v, ok := m.neighToEntry(&neighs[i]); ok {
+			desired[k] = v
+		}
+	}
+
+	for k, v := range desired {
+		m.updateEntry(k, v)
+	}
+	for k := range m.mirrored {
+		if _, ok := desired[k]; !ok {
+			m.deleteEntry(k)
+		}
+	}
+
+	log.WithField("numEntries", len(m.mirrored)).Debug("Resynced neighbour table")
+	return nil
+}
+
+func (m *NeighMirror) onNeighUpdate(u netlink.NeighUpdate) {
+	if u.Family != netlink.FAMILY_V4 {
+		return
+	}
+
+	k, v, ok := m.neighToEntry(&u.Neigh)
+	if u.Type == unix.RTM_NEWNEIGH && ok {
+		if old, known := m.mirrored[k]; !known || old != v {
+			m.updateEntry(k, v)
+		}
+		return
+	}
+
+	// Either RTM_DELNEIGH or the neighbour became unusable, e.g. failed.
+	ip := u.IP.To4()
+	if ip == nil {
+		return
+	}
+	k = NewKey(ip, uint32(u.LinkIndex))
+	if _, known := m.mirrored[k]; known {
+		m.deleteEntry(k)
+	}
+}
+
+func (m *NeighMirror) neighToEntry(n *netlink.Neigh) (Key, Value, bool) {
+	if n.State&usableNeighStates == 0 || len(n.HardwareAddr) != 6 {
+		return Key{}, Value{}, false
+	}
+	ip := n.IP.To4()
+	if ip == nil {
+		return Key{}, Value{}, false
+	}
+	ifaceMAC := m.ifaceMAC(n.LinkIndex)
+	if ifaceMAC == nil {
+		return Key{}, Value{}, false
+	}
+	return NewKey(ip, uint32(n.LinkIndex)), NewValue(ifaceMAC, n.HardwareAddr), true
+}
+
+func (m *NeighMirror) ifaceMAC(ifIndex int) net.HardwareAddr {
+	if mac, ok := m.ifaceMACs[ifIndex]; ok {
+		return mac
+	}
+
+	var mac net.HardwareAddr
+	link, err := m.nl.LinkByIndex(ifIndex)
+	if err != nil {
+		log.WithError(err).WithField("ifindex", ifIndex).Debug("Failed to look up interface")
+		// Do not cache, the interface may just not be fully set up yet.
+		return nil
+	}
+	attrs := link.Attrs()
+	if m.ifaceRegex.MatchString(attrs.Name) && len(attrs.HardwareAddr) == 6 {
+		mac = attrs.HardwareAddr
+	}
+	m.ifaceMACs[ifIndex] = mac
+	return mac
+}
+
+// updateEntry writes the entry to the map, unless the map holds an entry for
+// the key that we didn't write, or that the BPF programs overwrote since.
+func (m *NeighMirror) updateEntry(k Key, v Value) {
+	cur, err := m.arpMap.Get(k[:])
+	if err == nil {
+		old, ours := m.mirrored[k]
+		if !ours || !bytes.Equal(cur, old[:]) {
+			log.WithField("key", k).Debug("ARP entry learned by the datapath, leaving it alone")
+			delete(m.mirrored, k)
+			return
+		}
+		if old == v {
+			return
+		}
+	} else if !bpf.IsNotExists(err) {
+		log.WithError(err).WithField("key", k).Warn("Failed to read ARP map")
+		return
+	}
+
+	if err := m.arpMap.Update(k[:], v[:]); err != nil {
+		log.WithError(err).WithField("key", k).Warn("Failed to update ARP map")
+		return
+	}
+	log.WithFields(log.Fields{"key": k, "value": v}).Debug("Mirrored neighbour to ARP map")
+	m.mirrored[k] = v
+}
+
+// deleteEntry removes an entry that we wrote from the map, unless the BPF
+// programs overwrote it since.
+func (m *NeighMirror) deleteEntry(k Key) {
+	old := m.mirrored[k]
+	cur, err := m.arpMap.Get(k[:])
+	if err == nil && !bytes.Equal(cur, old[:]) {
+		log.WithField("key", k).Debug("ARP entry relearned by the datapath, leaving it alone")
+		delete(m.mirrored, k)
+		return
+	}
+	err = m.arpMap.Delete(k[:])
+	if err != nil && !bpf.IsNotExists(err) {
+		log.WithError(err).WithField("key", k).Warn("Failed to delete from ARP map")
+		return
+	}
+	log.WithField("key", k).Debug("Removed mirrored neighbour from ARP map")
+	delete(m.mirrored, k)
+}
@@ -0,0 +1,125 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package arp
+
+import (
+	"net"
+	"regexp"
+	"testing"
+
+	. "github.com/onsi/gomega"
+	"github.com/vishvananda/netlink"
+	"golang.org/x/sys/unix"
+
+	"github.com/projectcalico/felix/bpf/mock"
+)
+
+type mockNeighNetlink struct {
+	links  map[int]netlink.Link
+	neighs []netlink.Neigh
+}
+
+func (nl *mockNeighNetlink) NeighSubscribe(updates chan netlink.NeighUpdate, done chan struct{}) error {
+	return nil
+}
+
+func (nl *mockNeighNetlink) NeighList() ([]netlink.Neigh, error) {
+	return nl.neighs, nil
+}
+
+func (nl *mockNeighNetlink) LinkByIndex(ifIndex int) (netlink.Link, error) {
+	l, ok := nl.links[ifIndex]
+	if !ok {
+		return nil, unix.ENODEV
+	}
+	return l, nil
+}
+
+var (
+	eth0MAC  = net.HardwareAddr{0x02, 0, 0, 0, 0, 0x01}
+	caliMAC  = net.HardwareAddr{0xee, 0xee, 0xee, 0xee, 0xee, 0xee}
+	neighMAC = net.HardwareAddr{0x02, 0, 0, 0, 0, 0x02}
+)
+
+func neigh(ifIndex int, ip string, state int) netlink.Neigh {
+	return netlink.Neigh{
+		LinkIndex:    ifIndex,
+		Family:       netlink.FAMILY_V4,
+		State:        state,
+		IP:           net.ParseIP(ip),
+		HardwareAddr: neighMAC,
+	}
+}
+
+func TestNeighMirror(t *testing.T) {
+	RegisterTestingT(t)
+
+	nl := &mockNeighNetlink{
+		links: map[int]netlink.Link{
+			2: &netlink.Device{LinkAttrs: netlink.LinkAttrs{Name: "eth0", Index: 2, HardwareAddr: eth0MAC}},
+			3: &netlink.Veth{LinkAttrs: netlink.LinkAttrs{Name: "cali12345", Index: 3, HardwareAddr: caliMAC}},
+		},
+		neighs: []netlink.Neigh{
+			neigh(2, "10.0.0.2", netlink.NUD_REACHABLE),
+			neigh(2, "10.0.0.3", netlink.NUD_FAILED),
+			neigh(3, "192.168.0.1", netlink.NUD_REACHABLE),
+		},
+	}
+
+	arpMap := mock.NewMockMap(MapParams)
+	learned := NewKey(net.ParseIP("10.0.0.100"), 2)
+	arpMap.Contents[string(learned[:])] = string(make([]byte, ValueSize))
+
+	m := newNeighMirrorWithShim(arpMap, regexp.MustCompile("^eth"), nl)
+	Expect(m.Resync()).NotTo(HaveOccurred())
+
+	k := NewKey(net.ParseIP("10.0.0.2"), 2)
+	v := NewValue(eth0MAC, neighMAC)
+	Expect(arpMap.Contents).To(HaveLen(2), "only usable neighbours on matching interfaces should be mirrored")
+	Expect(arpMap.Contents).To(HaveKeyWithValue(string(k[:]), string(v[:])))
+
+	// Removing the entry when the neighbour fails.
+	m.onNeighUpdate(netlink.NeighUpdate{Type: unix.RTM_NEWNEIGH, Neigh: neigh(2, "10.0.0.2", netlink.NUD_FAILED)})
+	Expect(arpMap.Contents).NotTo(HaveKey(string(k[:])))
+
+	// Adding the entry back when the neighbour becomes reachable.
+	m.onNeighUpdate(netlink.NeighUpdate{Type: unix.RTM_NEWNEIGH, Neigh: neigh(2, "10.0.0.2", netlink.NUD_REACHABLE)})
+	Expect(arpMap.Contents).To(HaveKeyWithValue(string(k[:]), string(v[:])))
+
+	// Removing the entry on RTM_DELNEIGH.
+	m.onNeighUpdate(netlink.NeighUpdate{Type: unix.RTM_DELNEIGH, Neigh: neigh(2, "10.0.0.2", netlink.NUD_NONE)})
+	Expect(arpMap.Contents).NotTo(HaveKey(string(k[:])))
+
+	// Not overwriting entries learned by the datapath.
+	learnedV := NewValue(eth0MAC, net.HardwareAddr{0x02, 0, 0, 0, 0, 0x03})
+	arpMap.Contents[string(k[:])] = string(learnedV[:])
+	m.onNeighUpdate(netlink.NeighUpdate{Type: unix.RTM_NEWNEIGH, Neigh: neigh(2, "10.0.0.2", netlink.NUD_REACHABLE)})
+	Expect(arpMap.Contents).To(HaveKeyWithValue(string(k[:]), string(learnedV[:])))
+	delete(arpMap.Contents, string(k[:]))
+
+	// Not removing an entry that the datapath overwrote since we wrote it.
+	m.onNeighUpdate(netlink.NeighUpdate{Type: unix.RTM_NEWNEIGH, Neigh: neigh(2, "10.0.0.2", netlink.NUD_REACHABLE)})
+	Expect(arpMap.Contents).To(HaveKeyWithValue(string(k[:]), string(v[:])))
+	arpMap.Contents[string(k[:])] = string(learnedV[:])
+	m.onNeighUpdate(netlink.NeighUpdate{Type: unix.RTM_DELNEIGH, Neigh: neigh(2, "10.0.0.2", netlink.NUD_NONE)})
+	Expect(arpMap.Contents).To(HaveKeyWithValue(string(k[:]), string(learnedV[:])))
+	delete(arpMap.Contents, string(k[:]))
+
+	// Keeping entries learned by the datapath.
+	nl.neighs = nil
+	Expect(m.Resync()).NotTo(HaveOccurred())
+	Expect(arpMap.Contents).To(HaveLen(1))
+	Expect(arpMap.Contents).To(HaveKey(string(learned[:])))
+}
@@ -19,6 +19,7 @@ package asm
 import (
 	"encoding/binary"
 	"fmt"
+	"sort"
 	"strings"
 
 	log "github.com/sirupsen/logrus"
@@ -446,6 +447,10 @@ func (b *Block) MovImm32(dst Reg, imm int32) {
 	b.add(MovImm32, dst, 0, 0, imm)
 }
 
+func (b *Block) Add64(dst, src Reg) {
+	b.add(Add64, dst, src, 0, 0)
+}
+
 func (b *Block) AddImm64(dst Reg, imm int32) {
 	b.add(AddImm64, dst, 0, 0, imm)
 }
@@ -570,6 +575,26 @@ func (b *Block) TargetIsUsed(label string) bool {
 	return b.inUseJumpTargets.Contains(label)
 }
 
+// NumInsns returns the number of (reachable) instructions emitted so far.
+func (b *Block) NumInsns() int {
+	return len(b.insns)
+}
+
+// UnresolvedTargets returns the labels that are used as jump targets but that have
+// not been defined (yet), in sorted order.
+func (b *Block) UnresolvedTargets() []string {
+	var labels []string
+	b.inUseJumpTargets.Iter(func(item interface{}) error {
+		label := item.(string)
+		if _, ok := b.labelToInsnIdx[label]; !ok {
+			labels = append(labels, label)
+		}
+		return nil
+	})
+	sort.Strings(labels)
+	return labels
+}
+
 func (b *Block) Assemble() (Insns, error) {
 	for _, f := range b.fixUps {
 		labelIdx, ok := b.labelToInsnIdx[f.label]
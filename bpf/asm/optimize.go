@@ -0,0 +1,686 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package asm
+
+import (
+	"sort"
+
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/libcalico-go/lib/set"
+)
+
+// OptimizeStats reports what Block.Optimize did.
+type OptimizeStats struct {
+	InsnsBefore int
+	InsnsAfter  int
+	// PromotedLoads is the number of memory locations that were cached in registers.
+	PromotedLoads int
+}
+
+// Optimize rewrites the block to make it smaller and faster without changing its
+// behaviour.  It must be called once all the instructions have been added, just before
+// Assemble.  The passes are:
+//
+//   - Load promotion: values that are loaded repeatedly from a map value that the program
+//     never writes are loaded once into an unused callee-saved register.
+//   - Copy propagation: uses of a copy of a promoted register use the register directly.
+//   - Dead code elimination: instructions whose result is never used are removed.
+//   - Jump threading: jumps to unconditional jumps go straight to the final target and
+//     jumps to the next instruction are removed.
+//   - Unreachable code and unused labels are removed.
+//
+// The passes rely on the block only jumping forwards, which is the case for the programs
+// that we generate.  If the block contains anything that the optimizer doesn't
+// understand, it is left as is.
+func (b *Block) Optimize() OptimizeStats {
+	stats := OptimizeStats{InsnsBefore: len(b.insns), InsnsAfter: len(b.insns)}
+
+	o, ok := newOptimizer(b)
+	if !ok {
+		return stats
+	}
+
+	stats.PromotedLoads = o.promoteLoads()
+	if stats.PromotedLoads > 0 {
+		o.propagateCopies()
+	}
+	for i := 0; i < 4; i++ {
+		changed := o.removeDeadInsns()
+		changed = o.threadJumps() || changed
+		changed = o.removeUnreachable() || changed
+		if !changed {
+			break
+		}
+	}
+	o.writeTo(b)
+
+	stats.InsnsAfter = len(b.insns)
+	log.WithField("stats", stats).Debug("Optimized block")
+	return stats
+}
+
+type optInsn struct {
+	insn Insn
+	// hi is the second half of a LoadImm64.
+	hi     Insn
+	labels []string
+	target string
+}
+
+func (n *optInsn) op() OpCode {
+	return n.insn.OpCode()
+}
+
+type optimizer struct {
+	insns []optInsn
+	// tailLabels are the labels after the last instruction.
+	tailLabels []string
+	// promoted is a bitmask of the registers that hold promoted loads.
+	promoted uint16
+}
+
+func newOptimizer(b *Block) (*optimizer, bool) {
+	targets := map[int]string{}
+	for _, f := range b.fixUps {
+		targets[f.origInsnIdx] = f.label
+	}
+
+	o := &optimizer{}
+	for i := 0; i < len(b.insns); i++ {
+		n := optInsn{
+			insn:   b.insns[i],
+			labels: b.insnIdxToLabels[i],
+			target: targets[i],
+		}
+		if n.op() == LoadImm64 {
+			if i+1 >= len(b.insns) {
+				return nil, false
+			}
+			i++
+			n.hi = b.insns[i]
+		}
+		if _, _, ok := n.regUsage(); !ok {
+			log.WithField("insn", n.insn).Debug("Optimizer doesn't know instruction, skipping optimization")
+			return nil, false
+		}
+		o.insns = append(o.insns, n)
+	}
+	o.tailLabels = b.insnIdxToLabels[len(b.insns)]
+
+	// Check that all jumps are forwards and that all labels are defined.
+	labelIdx := o.labelIndex()
+	for i, n := range o.insns {
+		if n.target == "" {
+			continue
+		}
+		t, ok := labelIdx[n.target]
+		if !ok || t <= i {
+			return nil, false
+		}
+	}
+	return o, true
+}
+
+func (o *optimizer) writeTo(b *Block) {
+	used := o.usedTargets()
+	keepUsed := func(labels []string) (out []string) {
+		for _, l := range labels {
+			if used.Contains(l) {
+				out = append(out, l)
+			}
+		}
+		return
+	}
+
+	b.insns = nil
+	b.fixUps = nil
+	b.labelToInsnIdx = map[string]int{}
+	b.insnIdxToLabels = map[int][]string{}
+	b.inUseJumpTargets = used
+	label := func(labels []string) {
+		for _, l := range keepUsed(labels) {
+			b.labelToInsnIdx[l] = len(b.insns)
+			b.insnIdxToLabels[len(b.insns)] = append(b.insnIdxToLabels[len(b.insns)], l)
+		}
+	}
+	for _, n := range o.insns {
+		label(n.labels)
+		if n.target != "" {
+			b.fixUps = append(b.fixUps, fixUp{label: n.target, origInsnIdx: len(b.insns)})
+		}
+		b.insns = append(b.insns, n.insn)
+		if n.op() == LoadImm64 {
+			b.insns = append(b.insns, n.hi)
+		}
+	}
+	label(o.tailLabels)
+}
+
+func (o *optimizer) labelIndex() map[string]int {
+	idx := map[string]int{}
+	for i, n := range o.insns {
+		for _, l := range n.labels {
+			idx[l] = i
+		}
+	}
+	for _, l := range o.tailLabels {
+		idx[l] = len(o.insns)
+	}
+	return idx
+}
+
+func (o *optimizer) usedTargets() set.Set {
+	used := set.New()
+	for _, n := range o.insns {
+		if n.target != "" {
+			used.Add(n.target)
+		}
+	}
+	return used
+}
+
+// compact removes the deleted instructions, moving their labels to the next instruction.
+func (o *optimizer) compact(deleted []bool) {
+	var out []optInsn
+	var pendingLabels []string
+	for i, n := range o.insns {
+		if deleted[i] {
+			pendingLabels = append(pendingLabels, n.labels...)
+			continue
+		}
+		if len(pendingLabels) > 0 {
+			n.labels = append(pendingLabels, n.labels...)
+			pendingLabels = nil
+		}
+		out = append(out, n)
+	}
+	o.tailLabels = append(pendingLabels, o.tailLabels...)
+	o.insns = out
+}
+
+func regBit(r Reg) uint16 {
+	return 1 << uint(r)
+}
+
+const (
+	regsHelperArgs  = 1<<1 | 1<<2 | 1<<3 | 1<<4 | 1<<5
+	regsCallerSaved = 1<<0 | regsHelperArgs
+)
+
+func isALU(op OpCode) bool {
+	class := op & 0b111
+	return class == OpClassALU32 || class == OpClassALU64
+}
+
+func isCondJump(op OpCode) bool {
+	class := op & 0b111
+	if class != OpClassJump64 && class != OpClassJump32 {
+		return false
+	}
+	return op != JumpA && op != Call && op != Exit
+}
+
+func isLoad(op OpCode) bool {
+	switch op {
+	case LoadReg8, LoadReg16, LoadReg32, LoadReg64:
+		return true
+	}
+	return false
+}
+
+func isStoreReg(op OpCode) bool {
+	switch op {
+	case StoreReg8, StoreReg16, StoreReg32, StoreReg64:
+		return true
+	}
+	return false
+}
+
+func memOpSize(op OpCode) int16 {
+	switch op & 0b000_11_000 {
+	case MemOpSize8:
+		return 1
+	case MemOpSize16:
+		return 2
+	case MemOpSize32:
+		return 4
+	default:
+		return 8
+	}
+}
+
+// regUsage returns the registers that the instruction reads and writes as bitmasks.
+func (n *optInsn) regUsage() (uses, defs uint16, ok bool) {
+	op := n.op()
+	dst, src := n.insn.Dst(), n.insn.Src()
+	switch {
+	case op == LoadImm64:
+		return 0, regBit(dst), true
+	case isLoad(op):
+		return regBit(src), regBit(dst), true
+	case isStoreReg(op):
+		return regBit(dst) | regBit(src), 0, true
+	case op == StoreImm8 || op == StoreImm16 || op == StoreImm32 || op == StoreImm64:
+		return regBit(dst), 0, true
+	case isALU(op):
+		aluOp := op & 0b1111_0_000
+		switch aluOp {
+		case ALUOpMov:
+			if op&ALUSrcReg != 0 {
+				uses = regBit(src)
+			}
+		case ALUOpNegate, ALUOpEndian:
+			// For these, the source bit doesn't select a source register.
+			uses = regBit(dst)
+		default:
+			uses = regBit(dst)
+			if op&ALUSrcReg != 0 {
+				uses |= regBit(src)
+			}
+		}
+		return uses, regBit(dst), true
+	case op == JumpA:
+		return 0, 0, true
+	case op == Call:
+		return regsHelperArgs, regsCallerSaved, true
+	case op == Exit:
+		return regBit(R0), 0, true
+	case isCondJump(op):
+		uses = regBit(dst)
+		if op&ALUSrcReg != 0 {
+			uses |= regBit(src)
+		}
+		return uses, 0, true
+	}
+	return 0, 0, false
+}
+
+func (n *optInsn) fallsThrough() bool {
+	op := n.op()
+	return op != JumpA && op != Exit
+}
+
+// hasSideEffects returns true if the instruction does more than setting its destination
+// register.
+func (n *optInsn) hasSideEffects() bool {
+	op := n.op()
+	return !(op == LoadImm64 || isLoad(op) || isALU(op))
+}
+
+type memLoc struct {
+	op     OpCode
+	ptr    Reg
+	offset int16
+}
+
+// promoteLoads caches values that are loaded more than once from a map value in unused
+// callee-saved registers.  To be sure that the register always holds the value of the
+// map value, we only promote loads from a pointer register that is set once, from the
+// (null-checked) result of a map lookup, and if the program doesn't write to the value.
+// It returns the number of promoted loads.
+func (o *optimizer) promoteLoads() int {
+	var usedRegs uint16
+	defCount := map[Reg]int{}
+	defIdx := map[Reg]int{}
+	safeCalls := true
+	for i := range o.insns {
+		n := &o.insns[i]
+		uses, defs, _ := n.regUsage()
+		usedRegs |= uses | defs
+		for r := R0; r <= R10; r++ {
+			if defs&regBit(r) != 0 {
+				defCount[r]++
+				defIdx[r] = i
+			}
+		}
+		if n.op() == Call {
+			switch Helper(n.insn.Imm()) {
+			case HelperMapLookupElem, HelperTailCall:
+			default:
+				// Other helpers may write to map values.
+				safeCalls = false
+			}
+		}
+	}
+	if !safeCalls {
+		return 0
+	}
+
+	var freeRegs []Reg
+	for r := R6; r <= R9; r++ {
+		if usedRegs&regBit(r) == 0 {
+			freeRegs = append(freeRegs, r)
+		}
+	}
+	if len(freeRegs) == 0 {
+		return 0
+	}
+
+	type candidate struct {
+		loc   memLoc
+		count int
+		defAt int
+	}
+	var candidates []candidate
+	for ptr := R6; ptr <= R9; ptr++ {
+		if defCount[ptr] != 1 {
+			continue
+		}
+		d := defIdx[ptr]
+		if !o.isNullCheckedMapValue(d) {
+			continue
+		}
+		ptrMap, ptrMapKnown := o.lookupMapFD(d - 2)
+
+		counts := map[memLoc]int{}
+		var written [][2]int16
+		ok := true
+		for i, n := range o.insns {
+			op := n.op()
+			switch {
+			case isLoad(op) && n.insn.Src() == ptr:
+				if i < d {
+					ok = false
+				}
+				counts[memLoc{op: op, ptr: ptr, offset: n.insn.Off()}]++
+			case isStoreReg(op) || op == StoreImm8 || op == StoreImm16 || op == StoreImm32 || op == StoreImm64:
+				switch n.insn.Dst() {
+				case R10:
+					// The stack can't alias a map value.
+				case ptr:
+					written = append(written, [2]int16{n.insn.Off(), n.insn.Off() + memOpSize(op)})
+				default:
+					// May alias the map value, unless it points to a value of another map.
+					if m, known := o.mapOfPointer(i, n.insn.Dst()); !ptrMapKnown || !known || m == ptrMap {
+						ok = false
+					}
+				}
+			}
+		}
+		if !ok {
+			continue
+		}
+	locLoop:
+		for loc, count := range counts {
+			if count < 2 {
+				continue
+			}
+			start, end := loc.offset, loc.offset+memOpSize(loc.op)
+			for _, w := range written {
+				if start < w[1] && w[0] < end {
+					continue locLoop
+				}
+			}
+			candidates = append(candidates, candidate{loc: loc, count: count, defAt: d})
+		}
+	}
+	if len(candidates) == 0 {
+		return 0
+	}
+
+	sort.Slice(candidates, func(i, j int) bool {
+		if candidates[i].count != candidates[j].count {
+			return candidates[i].count > candidates[j].count
+		}
+		if candidates[i].loc.ptr != candidates[j].loc.ptr {
+			return candidates[i].loc.ptr < candidates[j].loc.ptr
+		}
+		if candidates[i].loc.offset != candidates[j].loc.offset {
+			return candidates[i].loc.offset < candidates[j].loc.offset
+		}
+		return candidates[i].loc.op < candidates[j].loc.op
+	})
+	if len(candidates) > len(freeRegs) {
+		candidates = candidates[:len(freeRegs)]
+	}
+
+	promotedTo := map[memLoc]Reg{}
+	inserts := map[int][]optInsn{}
+	for i, c := range candidates {
+		r := freeRegs[i]
+		promotedTo[c.loc] = r
+		o.promoted |= regBit(r)
+		inserts[c.defAt] = append(inserts[c.defAt], optInsn{insn: MakeInsn(c.loc.op, r, c.loc.ptr, c.loc.offset, 0)})
+	}
+
+	var out []optInsn
+	for i, n := range o.insns {
+		if isLoad(n.op()) {
+			loc := memLoc{op: n.op(), ptr: n.insn.Src(), offset: n.insn.Off()}
+			if r, ok := promotedTo[loc]; ok {
+				n.insn = MakeInsn(Mov64, n.insn.Dst(), r, 0, 0)
+			}
+		}
+		out = append(out, n)
+		out = append(out, inserts[i]...)
+	}
+	o.insns = out
+	return len(candidates)
+}
+
+// isNullCheckedMapValue returns true if the instruction at idx copies the result of a map
+// lookup that was just checked for NULL, i.e. the pattern:
+//
+//	call map_lookup_elem
+//	if r0 == 0 goto ...
+//	rX = r0
+func (o *optimizer) isNullCheckedMapValue(idx int) bool {
+	if idx < 2 {
+		return false
+	}
+	mov, check, call := &o.insns[idx], &o.insns[idx-1], &o.insns[idx-2]
+	return mov.op() == Mov64 && mov.insn.Src() == R0 && len(mov.labels) == 0 &&
+		check.op() == JumpEqImm64 && check.insn.Dst() == R0 && check.insn.Imm() == 0 && len(check.labels) == 0 &&
+		call.op() == Call && Helper(call.insn.Imm()) == HelperMapLookupElem
+}
+
+// lookupMapFD returns the FD of the map that the map lookup call at callIdx looks up, if the
+// FD is loaded into R1 by a LoadMapFD in the same basic block.
+func (o *optimizer) lookupMapFD(callIdx int) (int32, bool) {
+	for j := callIdx - 1; j >= 0; j-- {
+		if len(o.insns[j+1].labels) > 0 {
+			// Control flow may merge, R1 may come from elsewhere.
+			return 0, false
+		}
+		n := &o.insns[j]
+		_, defs, _ := n.regUsage()
+		if defs&regBit(R1) != 0 {
+			if n.op() != LoadImm64 || n.insn.Src() != RPseudoMapFD {
+				return 0, false
+			}
+			return n.insn.Imm(), true
+		}
+	}
+	return 0, false
+}
+
+// mapOfPointer returns the FD of the map whose value the register r points to at the
+// instruction idx, if r is (a copy of) the result of a map lookup in the same basic block.
+func (o *optimizer) mapOfPointer(idx int, r Reg) (int32, bool) {
+	for j := idx - 1; j >= 0; j-- {
+		if len(o.insns[j+1].labels) > 0 {
+			return 0, false
+		}
+		n := &o.insns[j]
+		_, defs, _ := n.regUsage()
+		if defs&regBit(r) == 0 {
+			continue
+		}
+		switch {
+		case n.op() == Call && r == R0 && Helper(n.insn.Imm()) == HelperMapLookupElem:
+			return o.lookupMapFD(j)
+		case n.op() == Mov64:
+			r = n.insn.Src()
+		default:
+			return 0, false
+		}
+	}
+	return 0, false
+}
+
+// propagateCopies replaces the uses of a copy of a promoted register with the promoted
+// register, until the copy is overwritten or control flow merges.  The copies are then
+// typically removed by removeDeadInsns.
+func (o *optimizer) propagateCopies() {
+	targets := o.usedTargets()
+	isMergePoint := func(n *optInsn) bool {
+		for _, l := range n.labels {
+			if targets.Contains(l) {
+				return true
+			}
+		}
+		return false
+	}
+
+	for i := range o.insns {
+		n := &o.insns[i]
+		if n.op() != Mov64 || o.promoted&regBit(n.insn.Src()) == 0 {
+			continue
+		}
+		copyReg, promReg := n.insn.Dst(), n.insn.Src()
+		for j := i + 1; j < len(o.insns); j++ {
+			m := &o.insns[j]
+			if isMergePoint(m) {
+				break
+			}
+			op := m.op()
+			dst, src, off, imm := m.insn.Dst(), m.insn.Src(), m.insn.Off(), m.insn.Imm()
+			switch {
+			case isCondJump(op):
+				if dst == copyReg {
+					dst = promReg
+				}
+				if op&ALUSrcReg != 0 && src == copyReg {
+					src = promReg
+				}
+			case isALU(op) && op&ALUSrcReg != 0:
+				aluOp := op & 0b1111_0_000
+				if aluOp != ALUOpNegate && aluOp != ALUOpEndian && src == copyReg {
+					src = promReg
+				}
+			case isStoreReg(op):
+				if src == copyReg {
+					src = promReg
+				}
+			}
+			m.insn = MakeInsn(op, dst, src, off, imm)
+
+			uses, defs, _ := m.regUsage()
+			if (uses|defs)&regBit(copyReg) != 0 || !m.fallsThrough() || op == Call {
+				break
+			}
+		}
+	}
+}
+
+// removeDeadInsns removes the instructions without side effects whose result is never
+// used.  Since all jumps go forwards, a single backwards pass computes the liveness of
+// the registers.
+func (o *optimizer) removeDeadInsns() bool {
+	labelIdx := o.labelIndex()
+	liveIn := make([]uint16, len(o.insns)+1)
+	deleted := make([]bool, len(o.insns))
+	changed := false
+	for i := len(o.insns) - 1; i >= 0; i-- {
+		n := &o.insns[i]
+		var liveOut uint16
+		if n.fallsThrough() {
+			liveOut |= liveIn[i+1]
+		}
+		if n.target != "" {
+			liveOut |= liveIn[labelIdx[n.target]]
+		}
+		uses, defs, _ := n.regUsage()
+		if !n.hasSideEffects() && defs&liveOut == 0 {
+			deleted[i] = true
+			changed = true
+			liveIn[i] = liveOut
+			continue
+		}
+		liveIn[i] = uses | (liveOut &^ defs)
+	}
+	if changed {
+		o.compact(deleted)
+	}
+	return changed
+}
+
+// threadJumps makes jumps to unconditional jumps go to the final target and removes jumps
+// to the next instruction.
+func (o *optimizer) threadJumps() bool {
+	changed := false
+	labelIdx := o.labelIndex()
+	for i := range o.insns {
+		n := &o.insns[i]
+		for hops := 0; n.target != "" && hops < 16; hops++ {
+			t := labelIdx[n.target]
+			if t >= len(o.insns) || o.insns[t].op() != JumpA {
+				break
+			}
+			n.target = o.insns[t].target
+			changed = true
+		}
+	}
+
+	deleted := make([]bool, len(o.insns))
+	removed := false
+	for i := range o.insns {
+		n := &o.insns[i]
+		if n.target == "" || n.op() == Call {
+			continue
+		}
+		if labelIdx[n.target] == i+1 {
+			// Jumps (conditional or not) to the next instruction do nothing.
+			deleted[i] = true
+			removed = true
+		}
+	}
+	if removed {
+		o.compact(deleted)
+	}
+	return changed || removed
+}
+
+// removeUnreachable removes the instructions that can't be reached.
+func (o *optimizer) removeUnreachable() bool {
+	targeted := set.New()
+	deleted := make([]bool, len(o.insns))
+	changed := false
+	prevFallsThrough := true
+	for i := range o.insns {
+		n := &o.insns[i]
+		reachable := prevFallsThrough
+		for _, l := range n.labels {
+			if targeted.Contains(l) {
+				reachable = true
+			}
+		}
+		if !reachable {
+			deleted[i] = true
+			changed = true
+			// prevFallsThrough stays false.
+			continue
+		}
+		if n.target != "" {
+			targeted.Add(n.target)
+		}
+		prevFallsThrough = n.fallsThrough()
+	}
+	if changed {
+		o.compact(deleted)
+	}
+	return changed
+}
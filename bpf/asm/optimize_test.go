@@ -0,0 +1,234 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package asm
+
+import (
+	"testing"
+
+	. "github.com/onsi/gomega"
+)
+
+func assemble(b *Block) Insns {
+	insns, err := b.Assemble()
+	Expect(err).NotTo(HaveOccurred())
+	return insns
+}
+
+func TestOptimize_ThreadsJumps(t *testing.T) {
+	RegisterTestingT(t)
+	b := NewBlock()
+	b.JumpEqImm64(R1, 0, "hop")
+	b.MovImm64(R0, 1)
+	b.Exit()
+	b.LabelNextInsn("hop")
+	b.Jump("exit")
+	b.LabelNextInsn("exit")
+	b.MovImm64(R0, 2)
+	b.Exit()
+
+	stats := b.Optimize()
+	Expect(stats.InsnsBefore).To(Equal(6))
+	Expect(stats.InsnsAfter).To(Equal(5))
+
+	expected := NewBlock()
+	expected.JumpEqImm64(R1, 0, "exit")
+	expected.MovImm64(R0, 1)
+	expected.Exit()
+	expected.LabelNextInsn("exit")
+	expected.MovImm64(R0, 2)
+	expected.Exit()
+	Expect(assemble(b)).To(Equal(assemble(expected)))
+}
+
+func TestOptimize_RemovesJumpToNextInsn(t *testing.T) {
+	RegisterTestingT(t)
+	b := NewBlock()
+	b.JumpEqImm64(R1, 0, "next")
+	b.LabelNextInsn("next")
+	b.MovImm64(R0, 2)
+	b.Exit()
+
+	b.Optimize()
+
+	expected := NewBlock()
+	expected.MovImm64(R0, 2)
+	expected.Exit()
+	Expect(assemble(b)).To(Equal(assemble(expected)))
+}
+
+func TestOptimize_RemovesDeadInsns(t *testing.T) {
+	RegisterTestingT(t)
+	b := NewBlock()
+	b.Load32(R1, R6, 4) // Overwritten before use.
+	b.MovImm64(R2, 7)   // Never used.
+	b.Load32(R1, R6, 8)
+	b.Store32(R6, R1, 0)
+	b.MovImm64(R0, 2)
+	b.Exit()
+
+	stats := b.Optimize()
+	Expect(stats.InsnsAfter).To(Equal(4))
+
+	expected := NewBlock()
+	expected.Load32(R1, R6, 8)
+	expected.Store32(R6, R1, 0)
+	expected.MovImm64(R0, 2)
+	expected.Exit()
+	Expect(assemble(b)).To(Equal(assemble(expected)))
+}
+
+// writeStateLookup writes a preamble similar to the policy program's: it looks up the state
+// and keeps the pointer to it in R9.
+func writeStateLookup(b *Block) {
+	b.MovImm64(R1, 0)
+	b.StoreStack32(R1, -4)
+	b.Mov64(R2, R10)
+	b.AddImm64(R2, -4)
+	b.LoadMapFD(R1, 5)
+	b.Call(HelperMapLookupElem)
+	b.JumpEqImm64(R0, 0, "exit")
+	b.Mov64(R9, R0)
+}
+
+func TestOptimize_PromotesRepeatedLoads(t *testing.T) {
+	RegisterTestingT(t)
+	b := NewBlock()
+	writeStateLookup(b)
+	for i := 0; i < 3; i++ {
+		b.Load8(R1, R9, 32)
+		b.JumpNEImm64(R1, int32(6+i), "exit")
+	}
+	b.MovImm64(R0, 1)
+	b.Exit()
+	b.LabelNextInsn("exit")
+	b.MovImm64(R0, 2)
+	b.Exit()
+
+	stats := b.Optimize()
+	Expect(stats.PromotedLoads).To(Equal(1))
+
+	// R6 is the first free callee-saved register.
+	expected := NewBlock()
+	writeStateLookup(expected)
+	expected.Load8(R6, R9, 32)
+	for i := 0; i < 3; i++ {
+		expected.JumpNEImm64(R6, int32(6+i), "exit")
+	}
+	expected.MovImm64(R0, 1)
+	expected.Exit()
+	expected.LabelNextInsn("exit")
+	expected.MovImm64(R0, 2)
+	expected.Exit()
+	Expect(assemble(b)).To(Equal(assemble(expected)))
+}
+
+func TestOptimize_DoesNotPromoteWrittenLoads(t *testing.T) {
+	RegisterTestingT(t)
+	b := NewBlock()
+	writeStateLookup(b)
+	b.Load8(R1, R9, 32)
+	b.JumpNEImm64(R1, 6, "exit")
+	b.MovImm64(R1, 17)
+	b.Store8(R9, R1, 32)
+	b.Load8(R1, R9, 32)
+	b.JumpNEImm64(R1, 17, "exit")
+	b.MovImm64(R0, 1)
+	b.Exit()
+	b.LabelNextInsn("exit")
+	b.MovImm64(R0, 2)
+	b.Exit()
+
+	stats := b.Optimize()
+	Expect(stats.PromotedLoads).To(Equal(0))
+	Expect(stats.InsnsAfter).To(Equal(stats.InsnsBefore))
+}
+
+func TestOptimize_PromotesLoadsDespiteWritesToOtherMaps(t *testing.T) {
+	RegisterTestingT(t)
+	b := NewBlock()
+	writeStateLookup(b)
+	for i := 0; i < 2; i++ {
+		b.Load8(R1, R9, 32)
+		b.JumpNEImm64(R1, int32(6+i), "exit")
+
+		// Increment a counter in another map.
+		b.MovImm64(R1, int32(i))
+		b.StoreStack32(R1, -8)
+		b.Mov64(R2, R10)
+		b.AddImm64(R2, -8)
+		b.LoadMapFD(R1, 6)
+		b.Call(HelperMapLookupElem)
+		b.JumpEqImm64(R0, 0, "exit")
+		b.Load64(R1, R0, 0)
+		b.AddImm64(R1, 1)
+		b.Store64(R0, R1, 0)
+	}
+	b.MovImm64(R0, 1)
+	b.Exit()
+	b.LabelNextInsn("exit")
+	b.MovImm64(R0, 2)
+	b.Exit()
+
+	stats := b.Optimize()
+	Expect(stats.PromotedLoads).To(Equal(1))
+}
+
+func TestOptimize_DoesNotPromoteWithWritesToSameMap(t *testing.T) {
+	RegisterTestingT(t)
+	b := NewBlock()
+	writeStateLookup(b)
+	b.Load8(R1, R9, 32)
+	b.JumpNEImm64(R1, 6, "exit")
+
+	// Look up the same map again, the pointer may alias the first one.
+	b.MovImm64(R1, 0)
+	b.StoreStack32(R1, -8)
+	b.Mov64(R2, R10)
+	b.AddImm64(R2, -8)
+	b.LoadMapFD(R1, 5)
+	b.Call(HelperMapLookupElem)
+	b.JumpEqImm64(R0, 0, "exit")
+	b.MovImm64(R1, 17)
+	b.Store8(R0, R1, 32)
+
+	b.Load8(R1, R9, 32)
+	b.JumpNEImm64(R1, 17, "exit")
+	b.MovImm64(R0, 1)
+	b.Exit()
+	b.LabelNextInsn("exit")
+	b.MovImm64(R0, 2)
+	b.Exit()
+
+	stats := b.Optimize()
+	Expect(stats.PromotedLoads).To(Equal(0))
+}
+
+func TestOptimize_SkipsBackwardJumps(t *testing.T) {
+	RegisterTestingT(t)
+	b := NewBlock()
+	b.LabelNextInsn("loop")
+	b.AddImm64(R1, 1)
+	b.JumpLEImm64(R1, 10, "loop")
+	b.Jump("next")
+	b.LabelNextInsn("next")
+	b.MovImm64(R0, 2)
+	b.Exit()
+
+	before := NewBlock()
+	before.insns = append(before.insns, b.insns...)
+	stats := b.Optimize()
+	Expect(stats.InsnsAfter).To(Equal(stats.InsnsBefore))
+	Expect(b.insns).To(Equal(before.insns))
+}
@@ -139,6 +139,12 @@ func (b *Binary) PatchExtToServiceConnmark(mark uint32) {
 	b.patchU32Placeholder("MARK", uint32(mark))
 }
 
+// PatchGlobalFlags replaces the FLGS placeholder with the global flags.
+func (b *Binary) PatchGlobalFlags(flags uint32) {
+	logrus.WithField("flags", flags).Debug("Patching global flags")
+	b.patchU32Placeholder("FLGS", flags)
+}
+
 // patchU32Placeholder replaces a placeholder with the given value.
 func (b *Binary) patchU32Placeholder(from string, to uint32) {
 	toBytes := make([]byte, 4)
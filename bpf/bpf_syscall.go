@@ -15,6 +15,7 @@
 package bpf
 
 import (
+	"fmt"
 	"reflect"
 	"runtime"
 	"strings"
@@ -39,13 +40,23 @@ func SyscallSupport() bool {
 
 func GetMapFDByPin(filename string) (MapFD, error) {
 	log.Debugf("GetMapFDByPin(%v)", filename)
+	return getMapFDByPin(filename, 0)
+}
+
+// GetMapFDByPinReadOnly opens the map pinned at the given path for reading only.
+func GetMapFDByPinReadOnly(filename string) (MapFD, error) {
+	log.Debugf("GetMapFDByPinReadOnly(%v)", filename)
+	return getMapFDByPin(filename, C.uint(C.BPF_F_RDONLY))
+}
+
+func getMapFDByPin(filename string, flags C.uint) (MapFD, error) {
 	bpfAttr := C.bpf_attr_alloc()
 	defer C.free(unsafe.Pointer(bpfAttr))
 
 	cFilename := C.CString(filename)
 	defer C.free(unsafe.Pointer(cFilename))
 
-	C.bpf_attr_setup_obj_get(bpfAttr, cFilename, 0)
+	C.bpf_attr_setup_obj_get(bpfAttr, cFilename, flags)
 	fd, _, errno := unix.Syscall(unix.SYS_BPF, unix.BPF_OBJ_GET, uintptr(unsafe.Pointer(bpfAttr)), C.sizeof_union_bpf_attr)
 	if errno != 0 {
 		return 0, errno
@@ -54,6 +65,24 @@ func GetMapFDByPin(filename string) (MapFD, error) {
 	return MapFD(fd), nil
 }
 
+// GetProgFDByPin opens the program pinned at the given path.
+func GetProgFDByPin(filename string) (ProgFD, error) {
+	log.Debugf("GetProgFDByPin(%v)", filename)
+	bpfAttr := C.bpf_attr_alloc()
+	defer C.free(unsafe.Pointer(bpfAttr))
+
+	cFilename := C.CString(filename)
+	defer C.free(unsafe.Pointer(cFilename))
+
+	C.bpf_attr_setup_obj_get(bpfAttr, cFilename, 0)
+	fd, _, errno := unix.Syscall(unix.SYS_BPF, unix.BPF_OBJ_GET, uintptr(unsafe.Pointer(bpfAttr)), C.sizeof_union_bpf_attr)
+	if errno != 0 {
+		return 0, errno
+	}
+
+	return ProgFD(fd), nil
+}
+
 func GetMapFDByID(mapID int) (MapFD, error) {
 	log.Debugf("GetMapFDByID(%v)", mapID)
 	bpfAttr := C.bpf_attr_alloc()
@@ -68,6 +97,22 @@ func GetMapFDByID(mapID int) (MapFD, error) {
 	return MapFD(fd), nil
 }
 
+// GetProgFDByID returns a new FD for the program with the given ID, for example, to put the
+// program that is in one slot of a prog array in another slot.
+func GetProgFDByID(progID uint32) (ProgFD, error) {
+	log.Debugf("GetProgFDByID(%v)", progID)
+	bpfAttr := C.bpf_attr_alloc()
+	defer C.free(unsafe.Pointer(bpfAttr))
+
+	C.bpf_attr_setup_obj_get_id(bpfAttr, C.uint(progID), 0)
+	fd, _, errno := unix.Syscall(unix.SYS_BPF, unix.BPF_PROG_GET_FD_BY_ID, uintptr(unsafe.Pointer(bpfAttr)), C.sizeof_union_bpf_attr)
+	if errno != 0 {
+		return 0, errno
+	}
+
+	return ProgFD(fd), nil
+}
+
 const defaultLogSize = 1024 * 1024
 const maxLogSize = 128 * 1024 * 1024
 
@@ -192,7 +237,7 @@ func RunBPFProgram(fd ProgFD, dataIn []byte, repeat int) (pr ProgResult, err err
 
 	pr.RC = int32(C.bpf_attr_prog_run_retval(bpfAttr))
 	dataOutSize := C.bpf_attr_prog_run_data_out_size(bpfAttr)
-	pr.Duration = time.Duration(C.bpf_attr_prog_run_data_out_size(bpfAttr))
+	pr.Duration = time.Duration(C.bpf_attr_prog_run_duration(bpfAttr))
 	pr.DataOut = C.GoBytes(cDataOut, C.int(dataOutSize))
 	return
 }
@@ -220,6 +265,29 @@ func UpdateMapEntry(mapFD MapFD, k, v []byte) error {
 	if err != nil {
 		return err
 	}
+	return updateMapEntry(mapFD, k, v)
+}
+
+// UpdatePerCPUMapEntry updates an entry of a per-CPU map.  v must hold the value for each
+// possible CPU, in the format returned by GetPerCPUMapEntry.
+func UpdatePerCPUMapEntry(mapFD MapFD, k, v []byte, valueSize int) error {
+	log.Debugf("UpdatePerCPUMapEntry(%v, %v, %v)", mapFD, k, v)
+
+	err := checkMapIfDebug(mapFD, len(k), valueSize)
+	if err != nil {
+		return err
+	}
+	numCPUs, err := NumPossibleCPUs()
+	if err != nil {
+		return err
+	}
+	if len(v) != align64(valueSize)*numCPUs {
+		return fmt.Errorf("per-CPU value has length %d, expected %d", len(v), align64(valueSize)*numCPUs)
+	}
+	return updateMapEntry(mapFD, k, v)
+}
+
+func updateMapEntry(mapFD MapFD, k, v []byte) error {
 
 	bpfAttr := C.bpf_attr_alloc()
 	defer C.free(unsafe.Pointer(bpfAttr))
@@ -258,6 +326,61 @@ func GetMapEntry(mapFD MapFD, k []byte, valueSize int) ([]byte, error) {
 	return val, nil
 }
 
+// GetPerCPUMapEntry looks up an entry of a per-CPU map.  It returns the value for each
+// possible CPU, one after the other, each padded to a multiple of 8 bytes.
+func GetPerCPUMapEntry(mapFD MapFD, k []byte, valueSize int) ([]byte, error) {
+	log.Debugf("GetPerCPUMapEntry(%v, %v, %v)", mapFD, k, valueSize)
+
+	err := checkMapIfDebug(mapFD, len(k), valueSize)
+	if err != nil {
+		return nil, err
+	}
+	numCPUs, err := NumPossibleCPUs()
+	if err != nil {
+		return nil, err
+	}
+
+	val := make([]byte, align64(valueSize)*numCPUs)
+
+	errno := C.bpf_map_call(unix.BPF_MAP_LOOKUP_ELEM, C.uint(mapFD),
+		unsafe.Pointer(&k[0]), unsafe.Pointer(&val[0]), 0)
+	if errno != 0 {
+		return nil, unix.Errno(errno)
+	}
+
+	return val, nil
+}
+
+// UpdateMapEntries updates count entries of a map with a single BPF_MAP_UPDATE_BATCH call.
+// keys and values hold the keys and the values one after the other.  It returns the number
+// of entries that were updated, which is less than count if the call failed part way.
+func UpdateMapEntries(mapFD MapFD, keys, values []byte, count int) (int, error) {
+	log.Debugf("UpdateMapEntries(%v, %v entries)", mapFD, count)
+
+	n := C.__u32(count)
+	errno := C.bpf_map_batch_call(unix.BPF_MAP_UPDATE_BATCH, C.uint(mapFD),
+		unsafe.Pointer(&keys[0]), unsafe.Pointer(&values[0]), &n, unix.BPF_ANY)
+	if errno != 0 {
+		return int(n), unix.Errno(errno)
+	}
+	return int(n), nil
+}
+
+// DeleteMapEntries deletes count entries of a map with a single BPF_MAP_DELETE_BATCH call.
+// keys holds the keys one after the other.  It returns the number of entries that were
+// deleted, which is less than count if the call failed part way.
+func DeleteMapEntries(mapFD MapFD, keys []byte, count int) (int, error) {
+	log.Debugf("DeleteMapEntries(%v, %v entries)", mapFD, count)
+
+	n := C.__u32(count)
+	errno := C.bpf_map_batch_call(unix.BPF_MAP_DELETE_BATCH, C.uint(mapFD),
+		unsafe.Pointer(&keys[0]), nil, &n, 0)
+	if errno != 0 {
+		return int(n), unix.Errno(errno)
+	}
+	return int(n), nil
+}
+
 func checkMapIfDebug(mapFD MapFD, keySize, valueSize int) error {
 	if log.GetLevel() >= log.DebugLevel {
 		mapInfo, err := GetMapInfo(mapFD)
@@ -132,6 +132,32 @@ int bpf_map_call(int cmd, __u32 map_fd, void *pointer_to_key, void *pointer_to_v
    return syscall(SYS_bpf, cmd, &attr, sizeof(attr)) == 0 ? 0 : errno;
 }
 
+// bpf_map_batch_call makes a BPF_MAP_UPDATE_BATCH or BPF_MAP_DELETE_BATCH call for *count
+// keys (and values) stored one after the other.  It returns 0 or the errno and, either way,
+// stores the number of entries that the kernel processed in *count.  The kernel only writes
+// the count back once it has started processing the batch; if it rejects the command outright
+// (EINVAL before 5.6, ENOTSUPP for map types without batch ops) the count is left as it was,
+// which means that no entries were processed.
+int bpf_map_batch_call(int cmd, __u32 map_fd, void *keys, void *values, __u32 *count, __u64 elem_flags) {
+   union bpf_attr attr = {};
+
+   attr.batch.map_fd = map_fd;
+   attr.batch.keys = (__u64)(unsigned long)keys;
+   attr.batch.values = (__u64)(unsigned long)values;
+   attr.batch.count = *count;
+   attr.batch.elem_flags = elem_flags;
+
+   int rc = syscall(SYS_bpf, cmd, &attr, sizeof(attr));
+   if (rc != 0 && attr.batch.count == *count) {
+      // A failed batch that got through all the entries would have succeeded, so the
+      // kernel didn't write the count back.
+      *count = 0;
+   } else {
+      *count = attr.batch.count;
+   }
+   return rc == 0 ? 0 : errno;
+}
+
 int bpf_map_load_multi(__u32 map_fd,
                        void *current_key,
                        int max_num,
@@ -30,10 +30,22 @@ func GetMapFDByPin(filename string) (MapFD, error) {
 	panic("BPF syscall stub")
 }
 
+func GetMapFDByPinReadOnly(filename string) (MapFD, error) {
+	panic("BPF syscall stub")
+}
+
+func GetProgFDByPin(filename string) (ProgFD, error) {
+	panic("BPF syscall stub")
+}
+
 func GetMapFDByID(mapID int) (MapFD, error) {
 	panic("BPF syscall stub")
 }
 
+func GetProgFDByID(progID uint32) (ProgFD, error) {
+	panic("BPF syscall stub")
+}
+
 func LoadBPFProgramFromInsns(insns asm.Insns, license string, progType uint32) (ProgFD, error) {
 	panic("BPF syscall stub")
 }
@@ -54,6 +66,22 @@ func GetMapEntry(mapFD MapFD, k []byte, valueSize int) ([]byte, error) {
 	panic("BPF syscall stub")
 }
 
+func UpdatePerCPUMapEntry(mapFD MapFD, k, v []byte, valueSize int) error {
+	panic("BPF syscall stub")
+}
+
+func GetPerCPUMapEntry(mapFD MapFD, k []byte, valueSize int) ([]byte, error) {
+	panic("BPF syscall stub")
+}
+
+func UpdateMapEntries(mapFD MapFD, keys, values []byte, count int) (int, error) {
+	panic("BPF syscall stub")
+}
+
+func DeleteMapEntries(mapFD MapFD, keys []byte, count int) (int, error) {
+	panic("BPF syscall stub")
+}
+
 func GetMapInfo(fd MapFD) (*MapInfo, error) {
 	panic("BPF syscall stub")
 }
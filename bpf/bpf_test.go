@@ -794,3 +794,23 @@ func TestVersionParse(t *testing.T) {
 		Expect(ver1.Compare(ver2)).To(Equal(test.expected))
 	}
 }
+
+func TestParseCPURanges(t *testing.T) {
+	RegisterTestingT(t)
+
+	for s, expected := range map[string]int{
+		"0":        1,
+		"0-7":      8,
+		"0-3,5":    5,
+		"0,2-3,64": 4,
+	} {
+		n, err := parseCPURanges(s)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(n).To(Equal(expected), s)
+	}
+
+	for _, s := range []string{"", "a-3", "3-1"} {
+		_, err := parseCPURanges(s)
+		Expect(err).To(HaveOccurred(), s)
+	}
+}
@@ -0,0 +1,403 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package conntrack
+
+import (
+	"encoding/binary"
+	"fmt"
+	"net"
+	"sync"
+	"time"
+
+	"github.com/prometheus/client_golang/prometheus"
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/ring"
+	"github.com/projectcalico/felix/jitter"
+)
+
+// The BPF programs write a flow-start record to a per-CPU ring in the flow ring map when they
+// create a tracking entry, and count the packets and bytes of each leg of the flow in the flow
+// counters map, under the key of the tracking entry.  The FlowLog reads the rings and writes
+// the flow-end records, with the final counts, when the Scanner deletes tracking entries.
+//
+// WARNING: must be kept in sync with the definitions in bpf-gpl/flow.h.
+const (
+	FlowRingSize      = 256
+	FlowRecordSize    = 56
+	FlowRingValueSize = 8 + FlowRingSize*FlowRecordSize
+	FlowCountersSize  = 32
+
+	// FlowLogBufferSize is the number of records that the FlowLog buffers for its consumer.
+	FlowLogBufferSize = 4096
+)
+
+// FlowPollPeriod is how often the FlowLog reads the rings.  At that rate, a CPU can start
+// FlowRingSize flows per FlowPollPeriod before records are lost.
+var FlowPollPeriod = 100 * time.Millisecond
+
+var FlowRingMapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_flow_rb",
+	Type:       "percpu_array",
+	KeySize:    4,
+	ValueSize:  FlowRingValueSize,
+	MaxEntries: 1,
+	Name:       "cali_v4_flow_rb",
+}
+
+var FlowCountersMapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_flow_ctrs",
+	Type:       "lru_hash",
+	KeySize:    KeySize,
+	ValueSize:  FlowCountersSize,
+	MaxEntries: MaxEntries,
+	Name:       "cali_v4_flow_ctrs",
+}
+
+var FlowCfgMapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_flow_cfg",
+	Type:       "array",
+	KeySize:    4,
+	ValueSize:  4,
+	MaxEntries: 1,
+	Name:       "cali_v4_flow_cfg",
+}
+
+func FlowRingMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(FlowRingMapParams)
+}
+
+func FlowCountersMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(FlowCountersMapParams)
+}
+
+func FlowCfgMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(FlowCfgMapParams)
+}
+
+// SetFlowsEnabled turns the flow records and counters of the BPF programs on or off.
+func SetFlowsEnabled(cfgMap bpf.Map, enabled bool) error {
+	v := []byte{0, 0, 0, 0}
+	if enabled {
+		v[0] = 1
+	}
+	return cfgMap.Update([]byte{0, 0, 0, 0}, v)
+}
+
+var (
+	counterFlowRecordsLost = prometheus.NewCounter(prometheus.CounterOpts{
+		Name: "felix_bpf_flow_records_lost",
+		Help: "Number of BPF flow-start records that were overwritten before Felix read them.",
+	})
+	counterFlowRecordsDropped = prometheus.NewCounter(prometheus.CounterOpts{
+		Name: "felix_bpf_flow_records_dropped",
+		Help: "Number of BPF flow records that were dropped because their consumer fell behind.",
+	})
+
+	counterFlowsStarted = prometheus.NewCounter(prometheus.CounterOpts{
+		Name: "felix_bpf_flows_started",
+		Help: "Number of flows that the BPF programs started tracking.",
+	})
+	counterFlowsEnded = prometheus.NewCounter(prometheus.CounterOpts{
+		Name: "felix_bpf_flows_ended",
+		Help: "Number of flows whose BPF conntrack entries were deleted.",
+	})
+	counterFlowPackets = prometheus.NewCounter(prometheus.CounterOpts{
+		Name: "felix_bpf_flow_packets",
+		Help: "Number of packets, in both directions, of the flows that ended.",
+	})
+	counterFlowBytes = prometheus.NewCounter(prometheus.CounterOpts{
+		Name: "felix_bpf_flow_bytes",
+		Help: "Number of bytes, in both directions, of the flows that ended.",
+	})
+)
+
+func init() {
+	prometheus.MustRegister(counterFlowRecordsLost, counterFlowRecordsDropped)
+	prometheus.MustRegister(counterFlowsStarted, counterFlowsEnded, counterFlowPackets, counterFlowBytes)
+}
+
+// FlowCounters are the packets and bytes seen on each leg of a flow.
+type FlowCounters struct {
+	PacketsAToB, BytesAToB uint64
+	PacketsBToA, BytesBToA uint64
+}
+
+func FlowCountersFromBytes(b []byte) FlowCounters {
+	return FlowCounters{
+		PacketsAToB: binary.LittleEndian.Uint64(b[0:8]),
+		BytesAToB:   binary.LittleEndian.Uint64(b[8:16]),
+		PacketsBToA: binary.LittleEndian.Uint64(b[16:24]),
+		BytesBToA:   binary.LittleEndian.Uint64(b[24:32]),
+	}
+}
+
+// FlowRecord is the start or the end of a flow, as tracked by a normal or reverse-NAT
+// conntrack entry.
+type FlowRecord struct {
+	End bool
+	Key Key
+	// Created is the kernel time at which the flow started.
+	Created int64
+	Type    uint8
+	Flags   uint8
+	// OrigIP and OrigPort are the pre-DNAT destination of a NATted flow.
+	OrigIP   net.IP
+	OrigPort uint16
+	// IfIndex is the interface that the first packet came from, 0 if it came from the host.
+	// Only set for flow-start records.
+	IfIndex uint32
+	// LastSeen and Counters are only set for flow-end records.
+	LastSeen int64
+	Counters FlowCounters
+}
+
+func (r FlowRecord) String() string {
+	if r.End {
+		return fmt.Sprintf("flow end %s type=%d flags=%#x duration=%s a->b=%d/%dB b->a=%d/%dB",
+			r.Key, r.Type, r.Flags, time.Duration(r.LastSeen-r.Created),
+			r.Counters.PacketsAToB, r.Counters.BytesAToB, r.Counters.PacketsBToA, r.Counters.BytesBToA)
+	}
+	return fmt.Sprintf("flow start %s type=%d flags=%#x orig=%s:%d ifindex=%d",
+		r.Key, r.Type, r.Flags, r.OrigIP, r.OrigPort, r.IfIndex)
+}
+
+func flowRecordFromBytes(b []byte) FlowRecord {
+	return FlowRecord{
+		Created:  int64(binary.LittleEndian.Uint64(b[8:16])),
+		Key:      KeyFromBytes(b[16 : 16+KeySize]),
+		OrigIP:   net.IP(append([]byte(nil), b[32:36]...)),
+		OrigPort: binary.LittleEndian.Uint16(b[36:38]),
+		Type:     b[38],
+		Flags:    b[39],
+		IfIndex:  binary.LittleEndian.Uint32(b[40:44]),
+	}
+}
+
+// FlowLog streams the flow records to its consumer through the channel returned by Records.
+// It reads the flow-start records from the per-CPU rings periodically and, as an
+// EntryScanner of the conntrack Scanner, writes the flow-end records of the tracking entries
+// that the Scanner deletes.  Records are dropped, and counted, rather than blocking if the
+// consumer falls behind.
+type FlowLog struct {
+	ringMap     bpf.Map
+	countersMap bpf.Map
+	records     chan FlowRecord
+	rings       *ring.Reader
+
+	wg       sync.WaitGroup
+	stopCh   chan struct{}
+	stopOnce sync.Once
+}
+
+func NewFlowLog(ringMap, countersMap bpf.Map) *FlowLog {
+	return &FlowLog{
+		ringMap:     ringMap,
+		countersMap: countersMap,
+		records:     make(chan FlowRecord, FlowLogBufferSize),
+		rings:       ring.NewReader(FlowRingSize, FlowRecordSize),
+		stopCh:      make(chan struct{}),
+	}
+}
+
+// Records returns the channel that the FlowLog writes the records to.
+func (f *FlowLog) Records() <-chan FlowRecord {
+	return f.records
+}
+
+func (f *FlowLog) emit(r FlowRecord) {
+	select {
+	case f.records <- r:
+	default:
+		counterFlowRecordsDropped.Inc()
+	}
+}
+
+// Check implements EntryScanner, the FlowLog never deletes entries.
+func (f *FlowLog) Check(Key, Value, EntryGet) ScanVerdict {
+	return ScanVerdictOK
+}
+
+// EntryDeleted implements EntryDeleteObserver, it writes the flow-end record of a tracking
+// entry and releases its counters.
+func (f *FlowLog) EntryDeleted(k Key, v Value) {
+	if v.Type() == TypeNATForward {
+		// The flow is tracked by the reverse entry.
+		return
+	}
+
+	r := FlowRecord{
+		End:      true,
+		Key:      k,
+		Created:  v.Created(),
+		LastSeen: v.LastSeen(),
+		Type:     v.Type(),
+		Flags:    v.Flags(),
+	}
+	if v.Type() == TypeNATReverse {
+		r.OrigIP = v.OrigIP()
+		r.OrigPort = v.OrigPort()
+	}
+	c, err := f.countersMap.Get(k.AsBytes())
+	if err == nil {
+		r.Counters = FlowCountersFromBytes(c)
+		err = f.countersMap.Delete(k.AsBytes())
+	}
+	if err != nil && !bpf.IsNotExists(err) {
+		log.WithError(err).WithField("key", k).Debug("Failed to read flow counters.")
+	}
+	f.emit(r)
+}
+
+// SkipToEnd discards the flow-start records that are currently in the rings.
+func (f *FlowLog) SkipToEnd() error {
+	v, err := f.ringMap.Get([]byte{0, 0, 0, 0})
+	if err != nil {
+		return err
+	}
+	f.rings.SkipToEnd(v)
+	return nil
+}
+
+// Read reads the complete flow-start records that were written since the last call.  It
+// returns the number of records read.
+func (f *FlowLog) Read() (int, error) {
+	v, err := f.ringMap.Get([]byte{0, 0, 0, 0})
+	if err != nil {
+		return 0, err
+	}
+
+	numRead, numLost := f.rings.Read(v, func(_ int, rec []byte) {
+		f.emit(flowRecordFromBytes(rec))
+	})
+	counterFlowRecordsLost.Add(float64(numLost))
+	return numRead, nil
+}
+
+// Start starts reading the rings periodically.
+func (f *FlowLog) Start() {
+	if err := f.SkipToEnd(); err != nil {
+		log.WithError(err).Warn("Failed to read BPF flow ring.")
+	}
+
+	f.wg.Add(1)
+	go func() {
+		defer f.wg.Done()
+
+		log.Debug("BPF flow log thread started")
+		defer log.Debug("BPF flow log thread stopped")
+
+		ticker := jitter.NewTicker(FlowPollPeriod, FlowPollPeriod/10)
+		defer ticker.Stop()
+
+		for {
+			select {
+			case <-ticker.C:
+				if _, err := f.Read(); err != nil {
+					log.WithError(err).Warn("Failed to read BPF flow ring.")
+				}
+			case <-f.stopCh:
+				return
+			}
+		}
+	}()
+}
+
+// Stop stops the FlowLog and waits for it finishing.
+func (f *FlowLog) Stop() {
+	f.stopOnce.Do(func() {
+		close(f.stopCh)
+		f.wg.Wait()
+	})
+}
+
+// FlowTotals are the totals that a FlowStats has seen.
+type FlowTotals struct {
+	Started, Ended uint64
+	Packets, Bytes uint64
+}
+
+// FlowStats consumes the records of a FlowLog and exports the number of flows that started
+// and ended, and the traffic of the flows that ended, as Prometheus metrics.  It logs each
+// record at debug level.
+type FlowStats struct {
+	records <-chan FlowRecord
+
+	lock   sync.Mutex
+	totals FlowTotals
+
+	wg       sync.WaitGroup
+	stopCh   chan struct{}
+	stopOnce sync.Once
+}
+
+func NewFlowStats(records <-chan FlowRecord) *FlowStats {
+	return &FlowStats{
+		records: records,
+		stopCh:  make(chan struct{}),
+	}
+}
+
+// Totals returns the totals of the records seen so far.
+func (s *FlowStats) Totals() FlowTotals {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	return s.totals
+}
+
+func (s *FlowStats) observe(r FlowRecord) {
+	log.Debug("BPF: ", r)
+
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	if !r.End {
+		s.totals.Started++
+		counterFlowsStarted.Inc()
+		return
+	}
+	packets := r.Counters.PacketsAToB + r.Counters.PacketsBToA
+	bytes := r.Counters.BytesAToB + r.Counters.BytesBToA
+	s.totals.Ended++
+	s.totals.Packets += packets
+	s.totals.Bytes += bytes
+	counterFlowsEnded.Inc()
+	counterFlowPackets.Add(float64(packets))
+	counterFlowBytes.Add(float64(bytes))
+}
+
+// Start starts consuming the records.
+func (s *FlowStats) Start() {
+	s.wg.Add(1)
+	go func() {
+		defer s.wg.Done()
+		for {
+			select {
+			case r := <-s.records:
+				s.observe(r)
+			case <-s.stopCh:
+				return
+			}
+		}
+	}()
+}
+
+// Stop stops the FlowStats and waits for it finishing.
+func (s *FlowStats) Stop() {
+	s.stopOnce.Do(func() {
+		close(s.stopCh)
+		s.wg.Wait()
+	})
+}
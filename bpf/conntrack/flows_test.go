@@ -0,0 +1,134 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package conntrack_test
+
+import (
+	"encoding/binary"
+	"time"
+
+	. "github.com/onsi/ginkgo"
+	. "github.com/onsi/gomega"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/conntrack"
+	"github.com/projectcalico/felix/bpf/mock"
+	"github.com/projectcalico/felix/timeshim/mocktime"
+)
+
+var _ = Describe("BPF flow log", func() {
+	var (
+		ctMap, ringMap, countersMap *mock.Map
+		flowLog                     *conntrack.FlowLog
+		scanner                     *conntrack.Scanner
+	)
+
+	BeforeEach(func() {
+		ctMap = mock.NewMockMap(conntrack.MapParams)
+		ringMap = mock.NewMockMap(conntrack.FlowRingMapParams)
+		countersMap = mock.NewMockMap(conntrack.FlowCountersMapParams)
+		flowLog = conntrack.NewFlowLog(ringMap, countersMap)
+		lc := conntrack.NewLivenessScanner(timeouts, false, conntrack.WithTimeShim(mocktime.New()))
+		scanner = conntrack.NewScanner(ctMap, lc, flowLog)
+	})
+
+	It("should write a flow-end record with the counters of a deleted entry", func() {
+		Expect(ctMap.Update(udpKey.AsBytes(), udpTimedOut.AsBytes())).To(Succeed())
+		Expect(ctMap.Update(tcpKey.AsBytes(), tcpEstablished.AsBytes())).To(Succeed())
+		counters := make([]byte, conntrack.FlowCountersSize)
+		binary.LittleEndian.PutUint64(counters[0:], 3)
+		binary.LittleEndian.PutUint64(counters[8:], 300)
+		binary.LittleEndian.PutUint64(counters[16:], 2)
+		binary.LittleEndian.PutUint64(counters[24:], 200)
+		Expect(countersMap.Update(udpKey.AsBytes(), counters)).To(Succeed())
+
+		scanner.Scan()
+
+		Expect(flowLog.Records()).To(HaveLen(1))
+		r := <-flowLog.Records()
+		Expect(r.End).To(BeTrue())
+		Expect(r.Key).To(Equal(udpKey))
+		Expect(time.Duration(r.LastSeen - r.Created)).To(Equal(59 * time.Second))
+		Expect(r.Counters).To(Equal(conntrack.FlowCounters{
+			PacketsAToB: 3, BytesAToB: 300, PacketsBToA: 2, BytesBToA: 200,
+		}))
+		_, err := countersMap.Get(udpKey.AsBytes())
+		Expect(bpf.IsNotExists(err)).To(BeTrue())
+	})
+
+	It("should read the flow-start records from the rings", func() {
+		const numCPUs = 2
+		params := conntrack.FlowRingMapParams
+		params.ValueSize = numCPUs * conntrack.FlowRingValueSize
+		ringMap = mock.NewMockMap(params)
+		flowLog = conntrack.NewFlowLog(ringMap, countersMap)
+		ring := make([]byte, numCPUs*conntrack.FlowRingValueSize)
+		writeRec := func(cpu int, seq uint64) {
+			v := ring[cpu*conntrack.FlowRingValueSize:]
+			binary.LittleEndian.PutUint64(v, seq)
+			rec := v[8+int((seq-1)%conntrack.FlowRingSize)*conntrack.FlowRecordSize:]
+			binary.LittleEndian.PutUint64(rec[0:], seq)
+			binary.LittleEndian.PutUint64(rec[8:], uint64(now))
+			copy(rec[16:], tcpKey.AsBytes())
+			binary.LittleEndian.PutUint32(rec[40:], 7)
+			binary.LittleEndian.PutUint64(rec[48:], seq)
+		}
+		writeRec(0, 1)
+		writeRec(1, 1)
+		writeRec(1, 2)
+		Expect(ringMap.Update([]byte{0, 0, 0, 0}, ring)).To(Succeed())
+
+		n, err := flowLog.Read()
+		Expect(err).NotTo(HaveOccurred())
+		Expect(n).To(Equal(3))
+		r := <-flowLog.Records()
+		Expect(r.End).To(BeFalse())
+		Expect(r.Key).To(Equal(tcpKey))
+		Expect(r.Created).To(Equal(int64(now)))
+		Expect(r.IfIndex).To(Equal(uint32(7)))
+
+		// Only new records are read.
+		writeRec(0, 2)
+		Expect(ringMap.Update([]byte{0, 0, 0, 0}, ring)).To(Succeed())
+		n, err = flowLog.Read()
+		Expect(err).NotTo(HaveOccurred())
+		Expect(n).To(Equal(1))
+	})
+
+	It("should drop records rather than block when its consumer falls behind", func() {
+		for i := 0; i < conntrack.FlowLogBufferSize+1; i++ {
+			flowLog.EntryDeleted(udpKey, udpTimedOut)
+		}
+		Expect(flowLog.Records()).To(HaveLen(conntrack.FlowLogBufferSize))
+	})
+
+	It("should count the flows and their traffic", func() {
+		Expect(ctMap.Update(udpKey.AsBytes(), udpTimedOut.AsBytes())).To(Succeed())
+		counters := make([]byte, conntrack.FlowCountersSize)
+		binary.LittleEndian.PutUint64(counters[0:], 3)
+		binary.LittleEndian.PutUint64(counters[8:], 300)
+		binary.LittleEndian.PutUint64(counters[16:], 2)
+		binary.LittleEndian.PutUint64(counters[24:], 200)
+		Expect(countersMap.Update(udpKey.AsBytes(), counters)).To(Succeed())
+
+		stats := conntrack.NewFlowStats(flowLog.Records())
+		stats.Start()
+		defer stats.Stop()
+		scanner.Scan()
+
+		Eventually(stats.Totals).Should(Equal(conntrack.FlowTotals{
+			Ended: 1, Packets: 5, Bytes: 500,
+		}))
+	})
+})
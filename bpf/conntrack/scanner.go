@@ -53,6 +53,13 @@ type EntryScannerSynced interface {
 	IterationEnd()
 }
 
+// EntryDeleteObserver is an EntryScanner that is told about every entry that the Scanner
+// deletes, whichever EntryScanner decided to delete it.
+type EntryDeleteObserver interface {
+	EntryScanner
+	EntryDeleted(Key, Value)
+}
+
 // Scanner iterates over a provided conntrack map and call a set of EntryScanner
 // functions on each entry in the order as they were passed to NewScanner. If
 // any of the EntryScanner returns ScanVerdictDelete, it deletes the entry, does
@@ -105,6 +112,7 @@ func (s *Scanner) Scan() {
 				if debug {
 					log.Debug("Deleting conntrack entry.")
 				}
+				s.entryDeleted(ctKey, ctVal)
 				return bpf.IterDelete
 			}
 		}
@@ -168,6 +176,14 @@ func (s *Scanner) iterEnd() {
 	}
 }
 
+func (s *Scanner) entryDeleted(k Key, v Value) {
+	for _, scanner := range s.scanners {
+		if observer, ok := scanner.(EntryDeleteObserver); ok {
+			observer.EntryDeleted(k, v)
+		}
+	}
+}
+
 // Stop stops the Scanner and waits for it finishing.
 func (s *Scanner) Stop() {
 	s.stopOnce.Do(func() {
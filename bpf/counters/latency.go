@@ -0,0 +1,163 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package counters
+
+import (
+	"encoding/binary"
+	"math"
+
+	"github.com/prometheus/client_golang/prometheus"
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/felix/bpf"
+)
+
+// The latency map is a per-CPU array of log2 histograms of the time that the sampled packets
+// spend in each stage of the TC programs: entry stage*LatencyBuckets+n counts the samples
+// that took [2^n, 2^(n+1)) ns.  Sampling is controlled by the latency config map.
+//
+// WARNING: must be kept in sync with the definitions in bpf-gpl/latency.h.
+const (
+	LatencyBuckets    = 32
+	LatencyKeySize    = 4
+	LatencyValueSize  = 8
+	LatencyCfgSize    = 8
+	MaxLatencySamples = 1 << 20
+)
+
+// Stages of the TC programs.
+const (
+	LatencyStageParse = iota
+	LatencyStageConntrack
+	LatencyStageNAT
+	LatencyStagePolicy
+	LatencyStageAccepted
+	LatencyStageForward
+
+	NumLatencyStages
+)
+
+var latencyStageNames = [NumLatencyStages]string{"parse", "conntrack", "nat", "policy", "accepted", "forward"}
+
+var LatencyMapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_lat",
+	Type:       "percpu_array",
+	KeySize:    LatencyKeySize,
+	ValueSize:  LatencyValueSize,
+	MaxEntries: NumLatencyStages * LatencyBuckets,
+	Name:       "cali_v4_lat",
+}
+
+var LatencyCfgMapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_lat_cfg",
+	Type:       "array",
+	KeySize:    4,
+	ValueSize:  LatencyCfgSize,
+	MaxEntries: 1,
+	Name:       "cali_v4_lat_cfg",
+}
+
+func LatencyMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(LatencyMapParams)
+}
+
+func LatencyCfgMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(LatencyCfgMapParams)
+}
+
+// LatencySampleMask returns the mask that makes the programs sample (roughly) one packet in
+// rate.  The rate is rounded up to a power of 2 so that sampling is a single AND.
+func LatencySampleMask(rate int) uint32 {
+	mask := uint32(0)
+	for int(mask) < rate-1 && mask < MaxLatencySamples-1 {
+		mask = mask<<1 | 1
+	}
+	return mask
+}
+
+// SetLatencySampling makes the programs sample one packet in rate for the latency
+// histograms, or disables sampling if rate is 0.
+func SetLatencySampling(cfgMap bpf.Map, rate int) error {
+	v := make([]byte, LatencyCfgSize)
+	if rate > 0 {
+		binary.LittleEndian.PutUint32(v[0:4], LatencySampleMask(rate))
+		binary.LittleEndian.PutUint32(v[4:8], 1)
+	}
+	return cfgMap.Update([]byte{0, 0, 0, 0}, v)
+}
+
+var latencyDesc = prometheus.NewDesc(
+	"felix_bpf_stage_latency_seconds",
+	"Time that the sampled packets spent in each stage of the BPF TC programs.  The sum is "+
+		"estimated from the buckets.",
+	[]string{"stage"}, nil,
+)
+
+// LatencyHistograms exports the latency map as Prometheus histograms.
+type LatencyHistograms struct {
+	latencyMap bpf.Map
+}
+
+func NewLatencyHistograms(latencyMap bpf.Map) *LatencyHistograms {
+	return &LatencyHistograms{
+		latencyMap: latencyMap,
+	}
+}
+
+// Describe implements prometheus.Collector.
+func (h *LatencyHistograms) Describe(ch chan<- *prometheus.Desc) {
+	ch <- latencyDesc
+}
+
+// Collect implements prometheus.Collector.
+func (h *LatencyHistograms) Collect(ch chan<- prometheus.Metric) {
+	for stage := 0; stage < NumLatencyStages; stage++ {
+		count, sum, buckets, err := h.histogram(stage)
+		if err != nil {
+			log.WithError(err).Debug("Failed to read latency histogram.")
+			return
+		}
+		ch <- prometheus.MustNewConstHistogram(latencyDesc, count, sum, buckets, latencyStageNames[stage])
+	}
+}
+
+// histogram sums the given stage's histogram over all CPUs and returns it in the form that
+// prometheus.MustNewConstHistogram takes, with cumulative bucket counts keyed by their upper
+// bound in seconds.
+func (h *LatencyHistograms) histogram(stage int) (count uint64, sum float64, buckets map[float64]uint64, err error) {
+	buckets = map[float64]uint64{}
+	for n := 0; n < LatencyBuckets; n++ {
+		var v []byte
+		v, err = h.latencyMap.Get(latencyKey(stage*LatencyBuckets + n))
+		if err != nil {
+			return
+		}
+		var samples uint64
+		for ; len(v) >= LatencyValueSize; v = v[LatencyValueSize:] {
+			samples += binary.LittleEndian.Uint64(v)
+		}
+		count += samples
+		// Use the middle of the bucket for the sum.
+		sum += float64(samples) * 1.5 * math.Ldexp(1, n) / 1e9
+		buckets[math.Ldexp(1, n+1)/1e9] = count
+	}
+	return
+}
+
+func latencyKey(k int) []byte {
+	b := make([]byte, LatencyKeySize)
+	binary.LittleEndian.PutUint32(b, uint32(k))
+	return b
+}
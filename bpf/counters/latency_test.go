@@ -0,0 +1,73 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package counters
+
+import (
+	"encoding/binary"
+	"testing"
+
+	. "github.com/onsi/gomega"
+
+	"github.com/projectcalico/felix/bpf/mock"
+)
+
+func TestLatencySampleMask(t *testing.T) {
+	RegisterTestingT(t)
+
+	Expect(LatencySampleMask(1)).To(Equal(uint32(0)))
+	Expect(LatencySampleMask(2)).To(Equal(uint32(1)))
+	Expect(LatencySampleMask(100)).To(Equal(uint32(127)))
+	Expect(LatencySampleMask(128)).To(Equal(uint32(127)))
+	Expect(LatencySampleMask(1 << 30)).To(Equal(uint32(MaxLatencySamples - 1)))
+
+	m := mock.NewMockMap(LatencyCfgMapParams)
+	Expect(SetLatencySampling(m, 100)).To(Succeed())
+	v, err := m.Get([]byte{0, 0, 0, 0})
+	Expect(err).NotTo(HaveOccurred())
+	Expect(binary.LittleEndian.Uint32(v[0:4])).To(Equal(uint32(127)))
+	Expect(binary.LittleEndian.Uint32(v[4:8])).To(Equal(uint32(1)))
+}
+
+func TestLatencyHistograms(t *testing.T) {
+	RegisterTestingT(t)
+
+	params := LatencyMapParams
+	params.ValueSize = 2 * LatencyValueSize
+	m := mock.NewMockMap(params)
+	for k := 0; k < params.MaxEntries; k++ {
+		Expect(m.Update(latencyKey(k), make([]byte, params.ValueSize))).To(Succeed())
+	}
+	// 3 samples of ~1us (bucket 10) on one CPU and 1 on the other for the NAT stage.
+	v := make([]byte, params.ValueSize)
+	binary.LittleEndian.PutUint64(v[0:], 3)
+	binary.LittleEndian.PutUint64(v[8:], 1)
+	Expect(m.Update(latencyKey(LatencyStageNAT*LatencyBuckets+10), v)).To(Succeed())
+
+	h := NewLatencyHistograms(m)
+	for stage := 0; stage < NumLatencyStages; stage++ {
+		count, sum, buckets, err := h.histogram(stage)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(buckets).To(HaveLen(LatencyBuckets))
+		if stage == LatencyStageNAT {
+			Expect(count).To(Equal(uint64(4)))
+			Expect(sum).To(BeNumerically("~", 4*1536e-9, 1e-12))
+			Expect(buckets[1024e-9]).To(BeZero())
+			Expect(buckets[2048e-9]).To(Equal(uint64(4)))
+			Expect(buckets[4096e-9]).To(Equal(uint64(4)))
+		} else {
+			Expect(count).To(BeZero())
+		}
+	}
+}
@@ -0,0 +1,215 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package counters
+
+import (
+	"sync"
+
+	"github.com/prometheus/client_golang/prometheus"
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/felix/bpf"
+)
+
+var (
+	rulePacketsDesc = prometheus.NewDesc(
+		"felix_bpf_policy_rule_packets_total",
+		"Number of packets that matched a policy rule in the BPF dataplane.",
+		[]string{"policy", "direction", "rule_id"}, nil,
+	)
+	ruleBytesDesc = prometheus.NewDesc(
+		"felix_bpf_policy_rule_bytes_total",
+		"Number of bytes of the packets that matched a policy rule in the BPF dataplane "+
+			"(not counted by XDP programs).",
+		[]string{"policy", "direction", "rule_id"}, nil,
+	)
+)
+
+// RuleInfo describes a counted rule, for the labels of its metrics.
+type RuleInfo struct {
+	// Policy is the name of the policy or profile that contains the rule.
+	Policy string
+	// Direction is "inbound" or "outbound".
+	Direction string
+	// ID is the rule ID, as calculated by the calculation graph.
+	ID string
+}
+
+type ruleCounter struct {
+	info RuleInfo
+	idx  uint32
+	refs int
+}
+
+// RuleCounters allocates the entries of the rule counter map to the rules of the active
+// policies and profiles, and exports the counters as Prometheus metrics.  The indexes are
+// allocated by the BPF endpoint manager, through SetRules, before it builds the policy
+// programs, which look them up through RuleCounterIndex.  Collect may be called
+// concurrently, from the Prometheus HTTP handler.
+type RuleCounters struct {
+	lock sync.Mutex
+
+	ruleMap bpf.Map
+	rules   map[string]*ruleCounter
+	// rulesByOwner records the IDs of the rules that SetRules was called with for each
+	// owner (policy or profile).
+	rulesByOwner map[interface{}][]string
+	// quarantinedIdxs are no longer allocated but may still be incremented by the programs
+	// that were built with them, until those are replaced.
+	quarantinedIdxs []uint32
+	freeIdxs        []uint32
+	nextIdx         uint32
+	fullLogged      bool
+}
+
+func NewRuleCounters(ruleMap bpf.Map) *RuleCounters {
+	return &RuleCounters{
+		ruleMap:      ruleMap,
+		rules:        map[string]*ruleCounter{},
+		rulesByOwner: map[interface{}][]string{},
+	}
+}
+
+// SetRules replaces the counted rules of the given owner, typically a policy or profile ID.
+// Counters of rules that are no longer used by any owner are quarantined until
+// ReleaseQuarantinedIdxs is called and counters of new rules start from zero.
+func (c *RuleCounters) SetRules(owner interface{}, rules []RuleInfo) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+
+	var ids []string
+	for _, r := range rules {
+		if r.ID == "" {
+			continue
+		}
+		rc := c.rules[r.ID]
+		if rc == nil {
+			idx, ok := c.allocIdx()
+			if !ok {
+				continue
+			}
+			rc = &ruleCounter{info: r, idx: idx}
+			c.rules[r.ID] = rc
+		}
+		rc.refs++
+		ids = append(ids, r.ID)
+	}
+
+	for _, id := range c.rulesByOwner[owner] {
+		rc := c.rules[id]
+		rc.refs--
+		if rc.refs == 0 {
+			delete(c.rules, id)
+			c.quarantinedIdxs = append(c.quarantinedIdxs, rc.idx)
+		}
+	}
+
+	if len(ids) > 0 {
+		c.rulesByOwner[owner] = ids
+	} else {
+		delete(c.rulesByOwner, owner)
+	}
+}
+
+// ReleaseQuarantinedIdxs makes the counters of the rules that were removed since the last call
+// available for reuse.  It must only be called once all the policy programs that were built
+// before those rules were removed have been replaced.
+func (c *RuleCounters) ReleaseQuarantinedIdxs() {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+
+	if len(c.quarantinedIdxs) == 0 {
+		return
+	}
+	log.WithField("num", len(c.quarantinedIdxs)).Debug("Releasing quarantined rule counters.")
+	c.freeIdxs = append(c.freeIdxs, c.quarantinedIdxs...)
+	c.quarantinedIdxs = nil
+}
+
+func (c *RuleCounters) allocIdx() (uint32, bool) {
+	var idx uint32
+	if n := len(c.freeIdxs); n > 0 {
+		idx = c.freeIdxs[n-1]
+		c.freeIdxs = c.freeIdxs[:n-1]
+	} else if c.nextIdx < MaxRuleCounters {
+		idx = c.nextIdx
+		c.nextIdx++
+	} else {
+		if !c.fullLogged {
+			log.Warnf("More than %d policy rules, some rules will not be counted.", MaxRuleCounters)
+			c.fullLogged = true
+		}
+		return 0, false
+	}
+
+	// The entry may hold the counts of a rule that used it before, or that of a previous
+	// run of Felix.
+	numCPUs, err := bpf.NumPossibleCPUs()
+	if err == nil {
+		err = c.ruleMap.Update(RuleKey(idx), make([]byte, RuleValueSize*numCPUs))
+	}
+	if err != nil {
+		log.WithError(err).WithField("idx", idx).Warn("Failed to reset rule counters.")
+	}
+	return idx, true
+}
+
+// MapFD returns the FD of the rule counter map, for the policy programs to update.
+func (c *RuleCounters) MapFD() bpf.MapFD {
+	return c.ruleMap.MapFD()
+}
+
+// RuleCounterIndex returns the index of the counters of the rule with the given ID, false if
+// the rule is not counted.
+func (c *RuleCounters) RuleCounterIndex(ruleID string) (uint32, bool) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+
+	rc := c.rules[ruleID]
+	if rc == nil {
+		return 0, false
+	}
+	return rc.idx, true
+}
+
+// Describe implements prometheus.Collector.
+func (c *RuleCounters) Describe(ch chan<- *prometheus.Desc) {
+	ch <- rulePacketsDesc
+	ch <- ruleBytesDesc
+}
+
+// Collect implements prometheus.Collector, it reads the counters of each counted rule.
+func (c *RuleCounters) Collect(ch chan<- prometheus.Metric) {
+	// Reading the per-CPU entries can take a while with many rules, don't hold up the
+	// policy program builder, which needs the lock for RuleCounterIndex, meanwhile.
+	c.lock.Lock()
+	rules := make([]ruleCounter, 0, len(c.rules))
+	for _, rc := range c.rules {
+		rules = append(rules, *rc)
+	}
+	c.lock.Unlock()
+
+	for _, rc := range rules {
+		v, err := c.ruleMap.Get(RuleKey(rc.idx))
+		if err != nil {
+			log.WithError(err).WithField("rule", rc.info.ID).Debug("Failed to read rule counters.")
+			continue
+		}
+		sum := RuleValueFromPerCPUBytes(v)
+		labels := []string{rc.info.Policy, rc.info.Direction, rc.info.ID}
+		ch <- prometheus.MustNewConstMetric(rulePacketsDesc, prometheus.CounterValue, float64(sum.Packets), labels...)
+		ch <- prometheus.MustNewConstMetric(ruleBytesDesc, prometheus.CounterValue, float64(sum.Bytes), labels...)
+	}
+}
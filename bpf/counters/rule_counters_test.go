@@ -0,0 +1,109 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package counters
+
+import (
+	"encoding/binary"
+	"testing"
+
+	. "github.com/onsi/gomega"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/mock"
+)
+
+func TestRuleCountersAllocation(t *testing.T) {
+	RegisterTestingT(t)
+
+	numCPUs, err := bpf.NumPossibleCPUs()
+	Expect(err).NotTo(HaveOccurred())
+	params := RuleMapParams
+	params.ValueSize = RuleValueSize * numCPUs
+	m := mock.NewMockMap(params)
+	rc := NewRuleCounters(m)
+
+	rc.SetRules("pol1", []RuleInfo{{Policy: "pol1", ID: "a"}, {Policy: "pol1", ID: "b"}, {Policy: "pol1"}})
+	idxA, ok := rc.RuleCounterIndex("a")
+	Expect(ok).To(BeTrue())
+	idxB, ok := rc.RuleCounterIndex("b")
+	Expect(ok).To(BeTrue())
+	Expect(idxA).NotTo(Equal(idxB))
+	_, ok = rc.RuleCounterIndex("")
+	Expect(ok).To(BeFalse())
+
+	// A counter that was in use is zeroed when it is reallocated.
+	v := make([]byte, params.ValueSize)
+	binary.LittleEndian.PutUint64(v[RuleValueOffPackets:], 10)
+	Expect(m.Update(RuleKey(idxB), v)).To(Succeed())
+
+	rc.SetRules("pol1", []RuleInfo{{Policy: "pol1", ID: "a"}})
+	_, ok = rc.RuleCounterIndex("b")
+	Expect(ok).To(BeFalse())
+
+	// The programs may still count into a freed counter until they are replaced.
+	rc.SetRules("pol2", []RuleInfo{{Policy: "pol2", ID: "d"}})
+	idxD, ok := rc.RuleCounterIndex("d")
+	Expect(ok).To(BeTrue())
+	Expect(idxD).NotTo(Equal(idxB))
+	v, err = m.Get(RuleKey(idxB))
+	Expect(err).NotTo(HaveOccurred())
+	Expect(RuleValueFromPerCPUBytes(v).Packets).To(Equal(uint64(10)))
+
+	rc.ReleaseQuarantinedIdxs()
+	rc.SetRules("pol2", []RuleInfo{{Policy: "pol2", ID: "d"}, {Policy: "pol2", ID: "c"}})
+	idxC, ok := rc.RuleCounterIndex("c")
+	Expect(ok).To(BeTrue())
+	Expect(idxC).To(Equal(idxB))
+	v, err = m.Get(RuleKey(idxC))
+	Expect(err).NotTo(HaveOccurred())
+	Expect(RuleValueFromPerCPUBytes(v)).To(Equal(RuleValue{}))
+
+	// Removing an owner releases its counters.
+	rc.SetRules("pol1", nil)
+	_, ok = rc.RuleCounterIndex("a")
+	Expect(ok).To(BeFalse())
+	_, ok = rc.RuleCounterIndex("c")
+	Expect(ok).To(BeTrue())
+}
+
+func TestRuleValueFromPerCPUBytes(t *testing.T) {
+	RegisterTestingT(t)
+
+	b := make([]byte, RuleValueSize*3)
+	for cpu := 0; cpu < 3; cpu++ {
+		binary.LittleEndian.PutUint64(b[cpu*RuleValueSize+RuleValueOffPackets:], uint64(cpu+1))
+		binary.LittleEndian.PutUint64(b[cpu*RuleValueSize+RuleValueOffBytes:], uint64(100*(cpu+1)))
+	}
+	Expect(RuleValueFromPerCPUBytes(b)).To(Equal(RuleValue{Packets: 6, Bytes: 600}))
+}
+
+func TestVerdictIndex(t *testing.T) {
+	RegisterTestingT(t)
+
+	seen := map[uint32]bool{}
+	for hook := Hook(0); int(hook) < NumHooks; hook++ {
+		for reason := 0; reason < NumReasons; reason++ {
+			for _, drop := range []bool{false, true} {
+				idx := VerdictIndex(hook, reason, drop)
+				Expect(idx).To(BeNumerically("<", MaxVerdictCounters))
+				Expect(seen[idx]).To(BeFalse())
+				seen[idx] = true
+			}
+		}
+	}
+	Expect(VerdictIndex(HookToWEP, ReasonPolicy, true)).To(Equal(uint32((3*NumReasons+7)*2 + 1)))
+	Expect(HookXDP.String()).To(Equal("xdp"))
+	Expect(ReasonName(ReasonRTUnknown)).To(Equal("route_unknown"))
+}
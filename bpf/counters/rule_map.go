@@ -0,0 +1,72 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package counters
+
+import (
+	"encoding/binary"
+
+	"github.com/projectcalico/felix/bpf"
+)
+
+// The rule counter map is a per-CPU array of packet and byte counters, indexed by a counter
+// index that Felix allocates for each policy rule.  The generated policy programs increment
+// the counters of a rule when it matches.
+const (
+	RuleKeySize   = 4
+	RuleValueSize = 16
+
+	// MaxRuleCounters is the number of rules that can be counted at once.
+	MaxRuleCounters = 16384
+
+	// Offsets within the value.
+	// WARNING: must be kept in sync with the policy program generator in bpf/polprog.
+	RuleValueOffPackets = 0
+	RuleValueOffBytes   = 8
+)
+
+var RuleMapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_rctrs",
+	Type:       "percpu_array",
+	KeySize:    RuleKeySize,
+	ValueSize:  RuleValueSize,
+	MaxEntries: MaxRuleCounters,
+	Name:       "cali_v4_rctrs",
+}
+
+func RuleMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(RuleMapParams)
+}
+
+func RuleKey(idx uint32) []byte {
+	k := make([]byte, RuleKeySize)
+	binary.LittleEndian.PutUint32(k, idx)
+	return k
+}
+
+type RuleValue struct {
+	Packets uint64
+	Bytes   uint64
+}
+
+// RuleValueFromPerCPUBytes sums the per-CPU values of an entry of the map, as returned by
+// bpf.Map.Get.
+func RuleValueFromPerCPUBytes(b []byte) RuleValue {
+	var v RuleValue
+	for ; len(b) >= RuleValueSize; b = b[RuleValueSize:] {
+		v.Packets += binary.LittleEndian.Uint64(b[RuleValueOffPackets:])
+		v.Bytes += binary.LittleEndian.Uint64(b[RuleValueOffBytes:])
+	}
+	return v
+}
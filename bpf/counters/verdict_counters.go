@@ -0,0 +1,86 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package counters
+
+import (
+	"github.com/prometheus/client_golang/prometheus"
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/felix/bpf"
+)
+
+var (
+	verdictPacketsDesc = prometheus.NewDesc(
+		"felix_bpf_verdict_packets_total",
+		"Number of packets that the BPF programs allowed or dropped, by hook and reason.",
+		[]string{"hook", "reason", "verdict"}, nil,
+	)
+	verdictBytesDesc = prometheus.NewDesc(
+		"felix_bpf_verdict_bytes_total",
+		"Number of bytes of the packets that the BPF programs allowed or dropped, by hook "+
+			"and reason.",
+		[]string{"hook", "reason", "verdict"}, nil,
+	)
+)
+
+// VerdictCounters exports the verdict counter map as Prometheus metrics.  Only the counters
+// that are non-zero are reported.
+type VerdictCounters struct {
+	verdictMap bpf.Map
+}
+
+func NewVerdictCounters(verdictMap bpf.Map) *VerdictCounters {
+	return &VerdictCounters{
+		verdictMap: verdictMap,
+	}
+}
+
+// MapFD returns the FD of the verdict counter map, for the policy programs to update.
+func (c *VerdictCounters) MapFD() bpf.MapFD {
+	return c.verdictMap.MapFD()
+}
+
+// Describe implements prometheus.Collector.
+func (c *VerdictCounters) Describe(ch chan<- *prometheus.Desc) {
+	ch <- verdictPacketsDesc
+	ch <- verdictBytesDesc
+}
+
+// Collect implements prometheus.Collector.
+func (c *VerdictCounters) Collect(ch chan<- prometheus.Metric) {
+	for hook := Hook(0); int(hook) < NumHooks; hook++ {
+		for reason := 0; reason < NumReasons; reason++ {
+			for _, drop := range []bool{false, true} {
+				idx := VerdictIndex(hook, reason, drop)
+				v, err := c.verdictMap.Get(VerdictKey(idx))
+				if err != nil {
+					log.WithError(err).WithField("idx", idx).Debug("Failed to read verdict counters.")
+					return
+				}
+				sum := RuleValueFromPerCPUBytes(v)
+				if sum.Packets == 0 {
+					continue
+				}
+				verdict := "allow"
+				if drop {
+					verdict = "drop"
+				}
+				labels := []string{hook.String(), ReasonName(reason), verdict}
+				ch <- prometheus.MustNewConstMetric(verdictPacketsDesc, prometheus.CounterValue, float64(sum.Packets), labels...)
+				ch <- prometheus.MustNewConstMetric(verdictBytesDesc, prometheus.CounterValue, float64(sum.Bytes), labels...)
+			}
+		}
+	}
+}
@@ -0,0 +1,142 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package counters
+
+import (
+	"encoding/binary"
+
+	"github.com/projectcalico/felix/bpf"
+)
+
+// The verdict counter map is a per-CPU array of packet and byte counters, indexed by hook,
+// reason and verdict, that the BPF programs increment as packets leave them.  The values
+// have the same layout as those of the rule counter map.
+//
+// WARNING: must be kept in sync with the definitions in bpf-gpl/counters.h.
+
+// Hook is the hook of the program that counted a packet.
+type Hook int
+
+const (
+	HookFromHEP Hook = iota
+	HookToHEP
+	HookFromWEP
+	HookToWEP
+	HookXDP
+
+	NumHooks = int(HookXDP) + 1
+)
+
+var hookNames = [NumHooks]string{"from_hep", "to_hep", "from_wep", "to_wep", "xdp"}
+
+func (h Hook) String() string {
+	if int(h) < 0 || int(h) >= NumHooks {
+		return "unknown"
+	}
+	return hookNames[h]
+}
+
+// Reason indexes, in the order of cali_reason_idx() in bpf-gpl/counters.h.
+const (
+	ReasonUnknown = iota
+	ReasonShort
+	ReasonNotIP
+	ReasonV6Workload
+	ReasonFailsafe
+	ReasonDNT
+	ReasonPreDNAT
+	ReasonPolicy
+	ReasonCT
+	ReasonBypass
+	ReasonCTNAT
+	ReasonCSumFail
+	ReasonEncapFail
+	ReasonDecapFail
+	ReasonICMPDF
+	ReasonIPOptions
+	ReasonIPMalformed
+	ReasonUnauthSource
+	ReasonRTUnknown
+	ReasonAcceptedByXDP
+
+	NumReasons
+)
+
+var reasonNames = [NumReasons]string{
+	"unknown",
+	"short",
+	"not_ip",
+	"v6_workload",
+	"failsafe",
+	"do_not_track",
+	"pre_dnat",
+	"policy",
+	"conntrack",
+	"bypass",
+	"conntrack_nat",
+	"checksum_fail",
+	"encap_fail",
+	"decap_fail",
+	"icmp_df",
+	"ip_options",
+	"ip_malformed",
+	"unauthorised_source",
+	"route_unknown",
+	"accepted_by_xdp",
+}
+
+// ReasonName returns the name of the reason with the given index, for metric labels.
+func ReasonName(reason int) string {
+	if reason < 0 || reason >= NumReasons {
+		return "unknown"
+	}
+	return reasonNames[reason]
+}
+
+const (
+	VerdictKeySize   = 4
+	VerdictValueSize = RuleValueSize
+
+	MaxVerdictCounters = NumHooks * NumReasons * 2
+)
+
+var VerdictMapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_vctrs",
+	Type:       "percpu_array",
+	KeySize:    VerdictKeySize,
+	ValueSize:  VerdictValueSize,
+	MaxEntries: MaxVerdictCounters,
+	Name:       "cali_v4_vctrs",
+}
+
+func VerdictMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(VerdictMapParams)
+}
+
+// VerdictIndex returns the index of the counters of the packets that the programs at the
+// given hook allowed (or dropped) for the given reason.
+func VerdictIndex(hook Hook, reason int, drop bool) uint32 {
+	idx := (uint32(hook)*NumReasons + uint32(reason)) * 2
+	if drop {
+		idx++
+	}
+	return idx
+}
+
+func VerdictKey(idx uint32) []byte {
+	k := make([]byte, VerdictKeySize)
+	binary.LittleEndian.PutUint32(k, idx)
+	return k
+}
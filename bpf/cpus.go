@@ -0,0 +1,69 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package bpf
+
+import (
+	"fmt"
+	"io/ioutil"
+	"strconv"
+	"strings"
+	"sync"
+)
+
+const possibleCPUsFile = "/sys/devices/system/cpu/possible"
+
+var (
+	numPossibleCPUsOnce sync.Once
+	numPossibleCPUs     int
+	numPossibleCPUsErr  error
+)
+
+// NumPossibleCPUs returns the number of CPUs that the kernel may bring online, which is the
+// number of values that the kernel reads and writes for each entry of a per-CPU map.
+func NumPossibleCPUs() (int, error) {
+	numPossibleCPUsOnce.Do(func() {
+		var data []byte
+		data, numPossibleCPUsErr = ioutil.ReadFile(possibleCPUsFile)
+		if numPossibleCPUsErr != nil {
+			return
+		}
+		numPossibleCPUs, numPossibleCPUsErr = parseCPURanges(strings.TrimSpace(string(data)))
+	})
+	return numPossibleCPUs, numPossibleCPUsErr
+}
+
+// parseCPURanges counts the CPUs of a CPU list in the kernel's format, for example "0-3,5".
+func parseCPURanges(s string) (int, error) {
+	n := 0
+	for _, r := range strings.Split(s, ",") {
+		parts := strings.SplitN(r, "-", 2)
+		first, err := strconv.Atoi(parts[0])
+		if err != nil {
+			return 0, fmt.Errorf("failed to parse CPU list %q: %w", s, err)
+		}
+		last := first
+		if len(parts) == 2 {
+			last, err = strconv.Atoi(parts[1])
+			if err != nil {
+				return 0, fmt.Errorf("failed to parse CPU list %q: %w", s, err)
+			}
+		}
+		if last < first {
+			return 0, fmt.Errorf("failed to parse CPU list %q: bad range %q", s, r)
+		}
+		n += last - first + 1
+	}
+	return n, nil
+}
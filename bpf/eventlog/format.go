@@ -0,0 +1,94 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package eventlog
+
+import (
+	"fmt"
+	"strings"
+)
+
+// Format formats a log record the way bpf_trace_printk() would.  It supports the
+// conversions that bpf_trace_printk() supports for integers: %d, %i, %u and %x, with
+// optional flags, width and the l and ll length modifiers.  Missing arguments are
+// formatted as 0.
+func Format(format string, args []uint64) string {
+	var sb strings.Builder
+	argIdx := 0
+	nextArg := func() uint64 {
+		if argIdx >= len(args) {
+			return 0
+		}
+		argIdx++
+		return args[argIdx-1]
+	}
+
+	for i := 0; i < len(format); i++ {
+		c := format[i]
+		if c != '%' {
+			sb.WriteByte(c)
+			continue
+		}
+		if i+1 < len(format) && format[i+1] == '%' {
+			sb.WriteByte('%')
+			i++
+			continue
+		}
+
+		// Flags and width are passed through to Go, which interprets them the same way.
+		start := i
+		i++
+		for i < len(format) && strings.IndexByte("-+ #0123456789", format[i]) >= 0 {
+			i++
+		}
+		flagsAndWidth := format[start+1 : i]
+		long := false
+		for i < len(format) && format[i] == 'l' {
+			long = true
+			i++
+		}
+		if i >= len(format) {
+			sb.WriteString(format[start:])
+			break
+		}
+
+		arg := nextArg()
+		switch format[i] {
+		case 'd', 'i':
+			if long {
+				sb.WriteString(fmt.Sprintf("%"+flagsAndWidth+"d", int64(arg)))
+			} else {
+				sb.WriteString(fmt.Sprintf("%"+flagsAndWidth+"d", int32(arg)))
+			}
+		case 'u':
+			if long {
+				sb.WriteString(fmt.Sprintf("%"+flagsAndWidth+"d", arg))
+			} else {
+				sb.WriteString(fmt.Sprintf("%"+flagsAndWidth+"d", uint32(arg)))
+			}
+		case 'x', 'X':
+			if long {
+				sb.WriteString(fmt.Sprintf("%"+flagsAndWidth+string(format[i]), arg))
+			} else {
+				sb.WriteString(fmt.Sprintf("%"+flagsAndWidth+string(format[i]), uint32(arg)))
+			}
+		case 'p':
+			sb.WriteString(fmt.Sprintf("0x%x", arg))
+		default:
+			// Not something that we can format, leave it as is.
+			sb.WriteString(format[start : i+1])
+		}
+	}
+	return sb.String()
+}
@@ -0,0 +1,130 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Package eventlog reads the log records that the BPF programs write to per-CPU rings, in
+// place of bpf_trace_printk(), and controls the level of the logs that they write.
+package eventlog
+
+import (
+	"encoding/binary"
+
+	"github.com/projectcalico/felix/bpf"
+)
+
+// WARNING: must be kept in sync with the definitions in bpf-gpl/log.h.
+//
+// The ring map has a single per-CPU entry:
+//
+// uint64 seq                 8   Number of records written so far.
+// record recs[RingSize]          Record n (counting from 1) is at index (n-1) % RingSize.
+//
+// Each record is:
+//
+// uint64 seq                 8   n once the record is complete.
+// uint32 level              +4
+// uint32 pad                +4
+// uint64 args[NumArgs]      +24
+// char fmt[FmtLen]         +192  Format string, NUL-terminated unless truncated.
+// uint64 seq_end            +8   n once the record is complete.
+const (
+	RingSize      = 128
+	NumArgs       = 3
+	FmtLen        = 192
+	RecordSize    = 16 + NumArgs*8 + FmtLen + 8
+	RingValueSize = 8 + RingSize*RecordSize
+)
+
+// Log levels, as in bpf-gpl/log.h.  Records at LevelTrace are written for the packets that
+// match the trace filter, whatever the level.
+const (
+	LevelOff   uint32 = 0
+	LevelTrace uint32 = 1
+	LevelInfo  uint32 = 5
+	LevelDebug uint32 = 10
+	LevelVerb  uint32 = 20
+)
+
+// LevelFromString converts the value of the BPFLogLevel config parameter to a log level.
+func LevelFromString(level string) uint32 {
+	switch level {
+	case "info":
+		return LevelInfo
+	case "debug":
+		return LevelDebug
+	default:
+		return LevelOff
+	}
+}
+
+var MapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_log_rb",
+	Type:       "percpu_array",
+	KeySize:    4,
+	ValueSize:  RingValueSize,
+	MaxEntries: 1,
+	Name:       "cali_v4_log_rb",
+}
+
+// CgroupMapParams are the parameters of the rings of the cgroup programs of the connect-time
+// load balancer.  Those run in process context, where a TC or XDP program can interrupt them
+// on the same CPU while they claim a record, so they don't share the rings of the other
+// programs.
+var CgroupMapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_log_cg",
+	Type:       "percpu_array",
+	KeySize:    4,
+	ValueSize:  RingValueSize,
+	MaxEntries: 1,
+	Name:       "cali_v4_log_cg",
+}
+
+var LevelMapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_log_lvl",
+	Type:       "array",
+	KeySize:    4,
+	ValueSize:  4,
+	MaxEntries: 1,
+	Name:       "cali_v4_log_lvl",
+}
+
+func Map(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(MapParams)
+}
+
+func CgroupMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(CgroupMapParams)
+}
+
+func LevelMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(LevelMapParams)
+}
+
+var zeroKey = []byte{0, 0, 0, 0}
+
+// SetLevel sets the level up to which the BPF programs write log records.  It takes effect
+// immediately; the programs are compiled with the logs of every level up to LevelDebug.
+func SetLevel(levelMap bpf.Map, level uint32) error {
+	v := make([]byte, 4)
+	binary.LittleEndian.PutUint32(v, level)
+	return levelMap.Update(zeroKey, v)
+}
+
+// GetLevel returns the level up to which the BPF programs write log records.
+func GetLevel(levelMap bpf.Map) (uint32, error) {
+	v, err := levelMap.Get(zeroKey)
+	if err != nil {
+		return 0, err
+	}
+	return binary.LittleEndian.Uint32(v), nil
+}
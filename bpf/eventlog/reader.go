@@ -0,0 +1,274 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package eventlog
+
+import (
+	"bytes"
+	"encoding/binary"
+	"sync"
+	"time"
+
+	"github.com/prometheus/client_golang/prometheus"
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/ring"
+)
+
+// PollPeriod is how often the Reader drains the rings when the programs log little.  When a
+// CPU fills half of its ring between two reads, the Reader polls faster, down to
+// MinPollPeriod, at which rate a CPU can write RingSize records per MinPollPeriod before
+// records are lost.  (The ring can't simply be made bigger for debug logging: it is a
+// per-CPU value, which the kernel limits to 32KiB.)
+var (
+	PollPeriod    = 100 * time.Millisecond
+	MinPollPeriod = 10 * time.Millisecond
+)
+
+var (
+	counterRecordsLost = prometheus.NewCounter(prometheus.CounterOpts{
+		Name: "felix_bpf_log_records_lost",
+		Help: "Number of BPF log records that were overwritten before Felix read them.",
+	})
+	gaugePollPeriod = prometheus.NewGauge(prometheus.GaugeOpts{
+		Name: "felix_bpf_log_poll_period_seconds",
+		Help: "Current period at which Felix reads the BPF log rings.",
+	})
+)
+
+func init() {
+	prometheus.MustRegister(counterRecordsLost)
+	prometheus.MustRegister(gaugePollPeriod)
+}
+
+// Record is a log record written by a BPF program.
+type Record struct {
+	CPU   int
+	Seq   uint64
+	Level uint32
+	Fmt   string
+	Args  [NumArgs]uint64
+}
+
+func (r Record) String() string {
+	return Format(r.Fmt, r.Args[:])
+}
+
+// Reader reads the log records from the per-CPU rings of one or more ring maps.
+type Reader struct {
+	rings    []logRings
+	levelMap bpf.Map
+	traceMap bpf.Map
+	handler  func(Record)
+	// pollPeriod is the time until the next read, adjusted to the rate of the logs by Read.
+	pollPeriod time.Duration
+	// wasActive is whether the programs could write records at the previous poll.
+	wasActive bool
+
+	wg       sync.WaitGroup
+	stopCh   chan struct{}
+	stopOnce sync.Once
+}
+
+// logRings is a ring map and the read position in each of its per-CPU rings.
+type logRings struct {
+	m bpf.Map
+	r *ring.Reader
+}
+
+// NewReader creates a Reader that passes the records of the rings in ringMaps to handler.  If
+// handler is nil, the records are logged.  Once started, the Reader only reads the rings while
+// the level in levelMap or the filter in traceMap let the programs write records.
+func NewReader(ringMaps []bpf.Map, levelMap, traceMap bpf.Map, handler func(Record)) *Reader {
+	if handler == nil {
+		handler = LogRecord
+	}
+	r := &Reader{
+		levelMap:   levelMap,
+		traceMap:   traceMap,
+		handler:    handler,
+		pollPeriod: PollPeriod,
+		stopCh:     make(chan struct{}),
+	}
+	for _, m := range ringMaps {
+		r.rings = append(r.rings, logRings{m: m, r: ring.NewReader(RingSize, RecordSize)})
+	}
+	return r
+}
+
+// LogRecord logs a record at the logrus level that matches its BPF level.  The records of
+// traced packets are logged at Info level, like the BPF Info logs, since they are only
+// written when someone asked for them.
+func LogRecord(r Record) {
+	logCxt := log.WithField("cpu", r.CPU)
+	switch {
+	case r.Level <= LevelInfo:
+		logCxt.Info("BPF: ", r.String())
+	default:
+		logCxt.Debug("BPF: ", r.String())
+	}
+}
+
+// PollPeriod returns how long to wait before the next call to Read, given the rate at which
+// the programs logged until the last one.
+func (r *Reader) PollPeriod() time.Duration {
+	return r.pollPeriod
+}
+
+// SkipToEnd discards the records that are currently in the rings, for example the ones
+// written before Felix started.
+func (r *Reader) SkipToEnd() error {
+	for _, lr := range r.rings {
+		v, err := lr.m.Get(zeroKey)
+		if err != nil {
+			return err
+		}
+		lr.r.SkipToEnd(v)
+	}
+	return nil
+}
+
+// Read reads the complete records that were written since the last call and passes them to
+// the handler, in order for each CPU of each ring map.  It returns the number of records read.
+func (r *Reader) Read() (int, error) {
+	total := 0
+	backlog := 0
+	for _, lr := range r.rings {
+		n, err := r.readRings(lr)
+		if err != nil {
+			return total, err
+		}
+		total += n
+		if b := lr.r.Backlog(); b > backlog {
+			backlog = b
+		}
+	}
+	r.pollPeriod = nextPollPeriod(r.pollPeriod, backlog)
+	gaugePollPeriod.Set(r.pollPeriod.Seconds())
+	return total, nil
+}
+
+func (r *Reader) readRings(lr logRings) (int, error) {
+	v, err := lr.m.Get(zeroKey)
+	if err != nil {
+		return 0, err
+	}
+
+	numRead, numLost := lr.r.Read(v, func(cpu int, rec []byte) {
+		record := Record{
+			CPU:   cpu,
+			Seq:   binary.LittleEndian.Uint64(rec),
+			Level: binary.LittleEndian.Uint32(rec[8:]),
+		}
+		for i := 0; i < NumArgs; i++ {
+			record.Args[i] = binary.LittleEndian.Uint64(rec[16+8*i:])
+		}
+		fmtBytes := rec[16+8*NumArgs : 16+8*NumArgs+FmtLen]
+		if i := bytes.IndexByte(fmtBytes, 0); i >= 0 {
+			fmtBytes = fmtBytes[:i]
+		}
+		record.Fmt = string(fmtBytes)
+		r.handler(record)
+	})
+	counterRecordsLost.Add(float64(numLost))
+	return numRead, nil
+}
+
+// Active returns whether the programs may currently write records, that is whether logging is
+// on or a trace filter is set.
+func (r *Reader) Active() (bool, error) {
+	level, err := GetLevel(r.levelMap)
+	if err != nil {
+		return false, err
+	}
+	if level > LevelOff {
+		return true, nil
+	}
+	_, tracing, err := GetTraceFilter(r.traceMap)
+	return tracing, err
+}
+
+// poll reads the rings if the programs may have written records since the previous poll.
+// Reading copies the whole ring of every CPU, so it is skipped while logging is off and no
+// packets are traced, which is the common case.
+func (r *Reader) poll() {
+	active, err := r.Active()
+	if err != nil {
+		log.WithError(err).Warn("Failed to read BPF log level, reading the log ring anyway.")
+		active = true
+	}
+	// Read once more after the programs stop logging, for the records written since the
+	// previous poll.
+	if active || r.wasActive {
+		if _, err := r.Read(); err != nil {
+			log.WithError(err).Warn("Failed to read BPF log ring.")
+		}
+	}
+	r.wasActive = active
+}
+
+// nextPollPeriod halves the poll period when a CPU filled at least half of its ring since
+// the previous read, and doubles it back when all CPUs filled less than a quarter.
+func nextPollPeriod(period time.Duration, backlog int) time.Duration {
+	switch {
+	case backlog >= RingSize/2:
+		period /= 2
+	case backlog < RingSize/4:
+		period *= 2
+	}
+	if period < MinPollPeriod {
+		period = MinPollPeriod
+	}
+	if period > PollPeriod {
+		period = PollPeriod
+	}
+	return period
+}
+
+// Start starts draining the rings periodically.
+func (r *Reader) Start() {
+	if err := r.SkipToEnd(); err != nil {
+		log.WithError(err).Warn("Failed to read BPF log ring.")
+	}
+
+	r.wg.Add(1)
+	go func() {
+		defer r.wg.Done()
+
+		log.Debug("BPF log reader thread started")
+		defer log.Debug("BPF log reader thread stopped")
+
+		timer := time.NewTimer(r.PollPeriod())
+		defer timer.Stop()
+
+		for {
+			select {
+			case <-timer.C:
+				r.poll()
+				timer.Reset(r.PollPeriod())
+			case <-r.stopCh:
+				return
+			}
+		}
+	}()
+}
+
+// Stop stops the Reader and waits for it finishing.
+func (r *Reader) Stop() {
+	r.stopOnce.Do(func() {
+		close(r.stopCh)
+		r.wg.Wait()
+	})
+}
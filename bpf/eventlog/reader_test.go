@@ -0,0 +1,211 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package eventlog
+
+import (
+	"encoding/binary"
+	"net"
+	"strings"
+	"testing"
+
+	. "github.com/onsi/gomega"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/mock"
+)
+
+// writeRecord emulates CALI_LOG at Debug level on the given CPU's ring in a per-CPU value.
+func writeRecord(v []byte, cpu int, format string, args ...uint64) {
+	writeRecordAtLevel(v, cpu, LevelDebug, format, args...)
+}
+
+func writeRecordAtLevel(v []byte, cpu int, level uint32, format string, args ...uint64) {
+	ring := v[cpu*RingValueSize : (cpu+1)*RingValueSize]
+	seq := binary.LittleEndian.Uint64(ring)
+	off := 8 + int(seq%RingSize)*RecordSize
+	seq++
+	binary.LittleEndian.PutUint64(ring, seq)
+	rec := ring[off : off+RecordSize]
+	for i := range rec {
+		rec[i] = 0
+	}
+	binary.LittleEndian.PutUint32(rec[8:], level)
+	for i, a := range args {
+		binary.LittleEndian.PutUint64(rec[16+8*i:], a)
+	}
+	copy(rec[16+8*NumArgs:16+8*NumArgs+FmtLen], format)
+	binary.LittleEndian.PutUint64(rec[RecordSize-8:], seq)
+	binary.LittleEndian.PutUint64(rec, seq)
+}
+
+func TestReader(t *testing.T) {
+	RegisterTestingT(t)
+
+	params := MapParams
+	params.ValueSize = 2 * RingValueSize
+	m := mock.NewMockMap(params)
+	v := make([]byte, params.ValueSize)
+
+	var got []string
+	r := NewReader([]bpf.Map{m}, nil, nil, func(rec Record) {
+		got = append(got, rec.String())
+	})
+
+	writeRecord(v, 0, "old")
+	Expect(m.Update(zeroKey, v)).To(Succeed())
+	Expect(r.SkipToEnd()).To(Succeed())
+
+	writeRecord(v, 0, "a %d", 1)
+	writeRecord(v, 1, "b %d %x", 2, 0xab)
+	writeRecord(v, 0, "c")
+	Expect(m.Update(zeroKey, v)).To(Succeed())
+	n, err := r.Read()
+	Expect(err).NotTo(HaveOccurred())
+	Expect(n).To(Equal(3))
+	Expect(got).To(Equal([]string{"a 1", "c", "b 2 ab"}))
+
+	// A record that is still being written is picked up by the next read.
+	got = nil
+	writeRecord(v, 1, "d")
+	binary.LittleEndian.PutUint64(v[RingValueSize+8+RecordSize:], 0)
+	Expect(m.Update(zeroKey, v)).To(Succeed())
+	n, err = r.Read()
+	Expect(err).NotTo(HaveOccurred())
+	Expect(n).To(Equal(0))
+	binary.LittleEndian.PutUint64(v[RingValueSize+8+RecordSize:], 2)
+	Expect(m.Update(zeroKey, v)).To(Succeed())
+	_, err = r.Read()
+	Expect(err).NotTo(HaveOccurred())
+	Expect(got).To(Equal([]string{"d"}))
+
+	// Records carry their level, and a format that filled the record isn't read past its end.
+	var recs []Record
+	r.handler = func(rec Record) {
+		recs = append(recs, rec)
+	}
+	long := strings.Repeat("x", FmtLen)
+	writeRecordAtLevel(v, 1, LevelTrace, long)
+	Expect(m.Update(zeroKey, v)).To(Succeed())
+	_, err = r.Read()
+	Expect(err).NotTo(HaveOccurred())
+	Expect(recs).To(HaveLen(1))
+	Expect(recs[0].Level).To(Equal(LevelTrace))
+	Expect(recs[0].Fmt).To(Equal(long))
+	r.handler = func(rec Record) {
+		got = append(got, rec.String())
+	}
+
+	// When the ring wraps, only the records that are still in it are read.
+	got = nil
+	for i := 0; i < RingSize+10; i++ {
+		writeRecord(v, 0, "e %d", uint64(i))
+	}
+	Expect(m.Update(zeroKey, v)).To(Succeed())
+	n, err = r.Read()
+	Expect(err).NotTo(HaveOccurred())
+	Expect(n).To(Equal(RingSize))
+	Expect(got[0]).To(Equal("e 10"))
+	Expect(got[RingSize-1]).To(Equal("e 137"))
+}
+
+func TestReaderOnlyReadsWhileActive(t *testing.T) {
+	RegisterTestingT(t)
+
+	ringMap := mock.NewMockMap(MapParams)
+	levelMap := mock.NewMockMap(LevelMapParams)
+	traceMap := mock.NewMockMap(TraceMapParams)
+	Expect(ringMap.Update(zeroKey, make([]byte, RingValueSize))).To(Succeed())
+	Expect(SetLevel(levelMap, LevelOff)).To(Succeed())
+	Expect(ClearTraceFilter(traceMap)).To(Succeed())
+
+	cgroupMap := mock.NewMockMap(CgroupMapParams)
+	Expect(cgroupMap.Update(zeroKey, make([]byte, RingValueSize))).To(Succeed())
+
+	r := NewReader([]bpf.Map{ringMap, cgroupMap}, levelMap, traceMap, func(Record) {})
+
+	// Logging off and nothing traced: the rings aren't read.
+	r.poll()
+	Expect(ringMap.GetCount).To(Equal(0))
+
+	// A trace filter makes the programs write records...
+	Expect(SetTraceFilter(traceMap, TraceFilter{DstPort: 80})).To(Succeed())
+	r.poll()
+	Expect(ringMap.GetCount).To(Equal(1))
+	Expect(cgroupMap.GetCount).To(Equal(1))
+
+	// ...as does a log level.
+	Expect(ClearTraceFilter(traceMap)).To(Succeed())
+	Expect(SetLevel(levelMap, LevelInfo)).To(Succeed())
+	r.poll()
+	Expect(ringMap.GetCount).To(Equal(2))
+
+	// Once logging is switched off, the rings are read once more for the records written
+	// before, then no more.
+	Expect(SetLevel(levelMap, LevelOff)).To(Succeed())
+	r.poll()
+	r.poll()
+	Expect(ringMap.GetCount).To(Equal(3))
+}
+
+func TestPollPeriod(t *testing.T) {
+	RegisterTestingT(t)
+
+	// Polls faster while the rings fill up...
+	period := nextPollPeriod(PollPeriod, RingSize/2)
+	Expect(period).To(Equal(PollPeriod / 2))
+	for i := 0; i < 10; i++ {
+		period = nextPollPeriod(period, RingSize)
+	}
+	Expect(period).To(Equal(MinPollPeriod))
+
+	// ...holds the rate while they're moderately busy...
+	Expect(nextPollPeriod(period, RingSize/4)).To(Equal(MinPollPeriod))
+
+	// ...and slows down again once they're quiet.
+	for i := 0; i < 10; i++ {
+		period = nextPollPeriod(period, 0)
+	}
+	Expect(period).To(Equal(PollPeriod))
+}
+
+func TestFormat(t *testing.T) {
+	RegisterTestingT(t)
+
+	Expect(Format("CALI-I: ct %d %x %llu", []uint64{0xffffffff, 0x1f, 1 << 40})).To(Equal("CALI-I: ct -1 1f 1099511627776"))
+	Expect(Format("%u%% %08x", []uint64{7, 0xab})).To(Equal("7% 000000ab"))
+	Expect(Format("missing %d", nil)).To(Equal("missing 0"))
+	Expect(Format("bad %s", []uint64{1})).To(Equal("bad %s"))
+}
+
+func TestTraceFilterRoundTrip(t *testing.T) {
+	RegisterTestingT(t)
+
+	m := mock.NewMockMap(TraceMapParams)
+	Expect(ClearTraceFilter(m)).To(Succeed())
+	_, ok, err := GetTraceFilter(m)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(ok).To(BeFalse())
+
+	_, src, _ := net.ParseCIDR("10.65.0.0/16")
+	f := TraceFilter{Src: src, DstPort: 8080, Proto: 6, BothDirections: true}
+	Expect(SetTraceFilter(m, f)).To(Succeed())
+	got, ok, err := GetTraceFilter(m)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(ok).To(BeTrue())
+	Expect(got.String()).To(Equal("src=10.65.0.0/16:0 dst=any:8080 proto=6 both-directions"))
+
+	_, v6, _ := net.ParseCIDR("fd00::/64")
+	Expect(SetTraceFilter(m, TraceFilter{Dst: v6})).NotTo(Succeed())
+}
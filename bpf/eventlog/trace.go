@@ -0,0 +1,172 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package eventlog
+
+import (
+	"encoding/binary"
+	"fmt"
+	"net"
+
+	"github.com/projectcalico/felix/bpf"
+)
+
+// WARNING: must be kept in sync with the definitions in bpf-gpl/trace.h.
+//
+// The trace map has a single entry, the trace filter:
+//
+// uint32 flags              4
+// be32   src_net           +4
+// be32   src_mask          +4
+// be32   dst_net           +4
+// be32   dst_mask          +4
+// uint16 sport             +2  Host byte order, 0 for any.
+// uint16 dport             +2  Host byte order, 0 for any.
+// uint8  ip_proto          +1  0 for any.
+// uint8  pad[3]            +3
+const (
+	TraceFilterSize = 28
+
+	traceFlagEnabled  = 0x01
+	traceFlagBothDirs = 0x02
+)
+
+var TraceMapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_trace",
+	Type:       "array",
+	KeySize:    4,
+	ValueSize:  TraceFilterSize,
+	MaxEntries: 1,
+	Name:       "cali_v4_trace",
+}
+
+func TraceMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(TraceMapParams)
+}
+
+// TraceFilter selects the packets that the TC programs trace, whatever their log level.
+// The records of the traced packets are written to the log rings.
+type TraceFilter struct {
+	// Src and Dst match the source and destination IPs, nil matches any IP.
+	Src, Dst *net.IPNet
+	// SrcPort and DstPort match the ports, 0 matches any port.
+	SrcPort, DstPort uint16
+	// Proto matches the IP protocol, 0 matches any protocol.
+	Proto uint8
+	// BothDirections also matches the packets of the reverse direction.
+	BothDirections bool
+}
+
+func (f TraceFilter) String() string {
+	s := fmt.Sprintf("src=%s:%d dst=%s:%d proto=%d", ipNetString(f.Src), f.SrcPort,
+		ipNetString(f.Dst), f.DstPort, f.Proto)
+	if f.BothDirections {
+		s += " both-directions"
+	}
+	return s
+}
+
+func ipNetString(n *net.IPNet) string {
+	if n == nil {
+		return "any"
+	}
+	return n.String()
+}
+
+// AsBytes returns the value of the trace map entry that enables the filter.
+func (f TraceFilter) AsBytes() ([]byte, error) {
+	b := make([]byte, TraceFilterSize)
+	flags := uint32(traceFlagEnabled)
+	if f.BothDirections {
+		flags |= traceFlagBothDirs
+	}
+	binary.LittleEndian.PutUint32(b[0:4], flags)
+	if err := putIPNet(b[4:12], f.Src); err != nil {
+		return nil, err
+	}
+	if err := putIPNet(b[12:20], f.Dst); err != nil {
+		return nil, err
+	}
+	binary.LittleEndian.PutUint16(b[20:22], f.SrcPort)
+	binary.LittleEndian.PutUint16(b[22:24], f.DstPort)
+	b[24] = f.Proto
+	return b, nil
+}
+
+func putIPNet(b []byte, n *net.IPNet) error {
+	if n == nil {
+		return nil
+	}
+	ip := n.IP.To4()
+	if ip == nil || len(n.Mask) != net.IPv4len {
+		return fmt.Errorf("trace filter only supports IPv4, not %s", n)
+	}
+	for i := 0; i < net.IPv4len; i++ {
+		b[i] = ip[i] & n.Mask[i]
+		b[4+i] = n.Mask[i]
+	}
+	return nil
+}
+
+// TraceFilterFromBytes decodes a trace map entry, it returns false if tracing is disabled.
+func TraceFilterFromBytes(b []byte) (TraceFilter, bool) {
+	var f TraceFilter
+	flags := binary.LittleEndian.Uint32(b[0:4])
+	if flags&traceFlagEnabled == 0 {
+		return f, false
+	}
+	f.BothDirections = flags&traceFlagBothDirs != 0
+	f.Src = getIPNet(b[4:12])
+	f.Dst = getIPNet(b[12:20])
+	f.SrcPort = binary.LittleEndian.Uint16(b[20:22])
+	f.DstPort = binary.LittleEndian.Uint16(b[22:24])
+	f.Proto = b[24]
+	return f, true
+}
+
+func getIPNet(b []byte) *net.IPNet {
+	n := &net.IPNet{
+		IP:   net.IP(append([]byte(nil), b[0:4]...)),
+		Mask: net.IPMask(append([]byte(nil), b[4:8]...)),
+	}
+	if ones, _ := n.Mask.Size(); ones == 0 {
+		return nil
+	}
+	return n
+}
+
+// SetTraceFilter starts tracing the packets that match the filter, replacing any previous
+// filter.
+func SetTraceFilter(traceMap bpf.Map, f TraceFilter) error {
+	v, err := f.AsBytes()
+	if err != nil {
+		return err
+	}
+	return traceMap.Update(zeroKey, v)
+}
+
+// ClearTraceFilter stops tracing.
+func ClearTraceFilter(traceMap bpf.Map) error {
+	return traceMap.Update(zeroKey, make([]byte, TraceFilterSize))
+}
+
+// GetTraceFilter returns the current trace filter, false if tracing is disabled.
+func GetTraceFilter(traceMap bpf.Map) (TraceFilter, bool, error) {
+	v, err := traceMap.Get(zeroKey)
+	if err != nil {
+		return TraceFilter{}, false, err
+	}
+	f, ok := TraceFilterFromBytes(v)
+	return f, ok, nil
+}
@@ -48,10 +48,24 @@ type bpfIPSets struct {
 
 	ipSetIDAllocator *idalloc.IDAllocator
 
-	bpfMap bpf.Map
+	// bpfMap is the LPM trie that holds the CIDR members of the IP sets, hashMap holds the
+	// exact-match members.
+	bpfMap  bpf.Map
+	hashMap bpf.Map
+
+	// memberKindsChanged contains the string IDs of the IP sets that gained a kind of
+	// member (exact-match or CIDR) that MemberKinds didn't report before.  The policy
+	// programs that use them need to be rebuilt because they only look up the maps that may
+	// hold members of the set.
+	memberKindsChanged set.Set
 
 	dirtyIPSetIDs   set.Set
 	resyncScheduled bool
+	// dataplaneKnown is true if we know the contents of the map: each IP set's pending adds
+	// and removes are then exactly the difference between its desired entries and the map,
+	// in effect an in-memory shadow of the map.  A resync then only needs to re-read the map
+	// if we lost track of it, at start of day or after a failure.
+	dataplaneKnown bool
 
 	opRecorder logutils.OpRecorder
 }
@@ -60,16 +74,19 @@ func NewBPFIPSets(
 	ipVersionConfig *ipsets.IPVersionConfig,
 	ipSetIDAllocator *idalloc.IDAllocator,
 	ipSetsMap bpf.Map,
+	ipSetsHashMap bpf.Map,
 	opRecorder logutils.OpRecorder,
 ) *bpfIPSets {
 	return &bpfIPSets{
-		IPVersionConfig:  ipVersionConfig,
-		ipSets:           map[uint64]*bpfIPSet{},
-		dirtyIPSetIDs:    set.New(), /*set entries are uint64 IDs */
-		bpfMap:           ipSetsMap,
-		resyncScheduled:  true,
-		ipSetIDAllocator: ipSetIDAllocator,
-		opRecorder:       opRecorder,
+		IPVersionConfig:    ipVersionConfig,
+		ipSets:             map[uint64]*bpfIPSet{},
+		dirtyIPSetIDs:      set.New(), /*set entries are uint64 IDs */
+		bpfMap:             ipSetsMap,
+		hashMap:            ipSetsHashMap,
+		memberKindsChanged: set.New(), /*set entries are string IDs */
+		resyncScheduled:    true,
+		ipSetIDAllocator:   ipSetIDAllocator,
+		opRecorder:         opRecorder,
 	}
 }
 
@@ -103,6 +120,8 @@ func (m *bpfIPSets) getOrCreateIPSet(setID string) *bpfIPSet {
 			DesiredEntries: set.New(),
 			PendingAdds:    set.New(),
 			PendingRemoves: set.New(),
+			lastExact:      true,
+			lastCIDR:       true,
 		}
 		m.ipSets[id] = ipSet
 	} else {
@@ -128,7 +147,9 @@ func (m *bpfIPSets) AddOrReplaceIPSet(setMetadata ipsets.IPSetMetadata, members
 	ipSet := m.getOrCreateIPSet(setMetadata.SetID)
 	ipSet.Type = setMetadata.Type
 	log.WithFields(log.Fields{"stringID": setMetadata.SetID, "uint64ID": ipSet.ID}).Info("IP set added")
+	exact, cidr := ipSet.MemberKinds()
 	ipSet.ReplaceMembers(members)
+	m.checkMemberKinds(ipSet, exact, cidr)
 	m.markIPSetDirty(ipSet)
 }
 
@@ -144,8 +165,10 @@ func (m *bpfIPSets) RemoveIPSet(setID string) {
 		log.WithField("setID", setID).Panic("Received deletion for already-deleted IP set")
 		return
 	}
+	exact, cidr := ipSet.MemberKinds()
 	ipSet.RemoveAll()
 	ipSet.Deleted = true
+	m.checkMemberKinds(ipSet, exact, cidr)
 	m.markIPSetDirty(ipSet)
 }
 
@@ -166,12 +189,14 @@ func (m *bpfIPSets) AddMembers(setID string, newMembers []string) {
 		"uint64ID": ipSet.ID,
 		"added":    len(newMembers),
 	}).Info("IP delta update (adding)")
+	exact, cidr := ipSet.MemberKinds()
 	for _, member := range newMembers {
 		entry := ProtoIPSetMemberToBPFEntry(ipSet.ID, member)
 		if entry != nil {
 			ipSet.AddMember(*entry)
 		}
 	}
+	m.checkMemberKinds(ipSet, exact, cidr)
 	m.markIPSetDirty(ipSet)
 }
 
@@ -192,12 +217,14 @@ func (m *bpfIPSets) RemoveMembers(setID string, removedMembers []string) {
 		"uint64ID": ipSet.ID,
 		"removed":  len(removedMembers),
 	}).Info("IP delta update (removing)")
+	exact, cidr := ipSet.MemberKinds()
 	for _, member := range removedMembers {
 		entry := ProtoIPSetMemberToBPFEntry(ipSet.ID, member)
 		if entry != nil {
 			ipSet.RemoveMember(*entry)
 		}
 	}
+	m.checkMemberKinds(ipSet, exact, cidr)
 	m.markIPSetDirty(ipSet)
 }
 
@@ -219,6 +246,39 @@ func (m *bpfIPSets) GetTypeOf(setID string) (ipsets.IPSetType, error) {
 	return ipSet.Type, nil
 }
 
+// MemberKinds returns whether the IP set may have exact-match (/32 or named port) members
+// and whether it may have CIDR members, so whether its members are in the hash map, in the
+// LPM trie or in both.  An empty set reports the kinds that it last had, or both if it never
+// had any members, so that it can fill up again without a rebuild of the policy programs.
+func (m *bpfIPSets) MemberKinds(setID string) (exact, cidr bool) {
+	ipSet := m.getExistingIPSetString(setID)
+	if ipSet == nil {
+		return true, true
+	}
+	return ipSet.MemberKinds()
+}
+
+// TakeMemberKindChanges returns the IDs of the IP sets for which MemberKinds gained a kind
+// since the last call.  Losing a kind doesn't make the programs that look up the set wrong,
+// they pick up the narrower kinds the next time they are rebuilt.
+func (m *bpfIPSets) TakeMemberKindChanges() []string {
+	var setIDs []string
+	m.memberKindsChanged.Iter(func(item interface{}) error {
+		setIDs = append(setIDs, item.(string))
+		return set.RemoveItem
+	})
+	return setIDs
+}
+
+func (m *bpfIPSets) checkMemberKinds(ipSet *bpfIPSet, oldExact, oldCIDR bool) {
+	ipSet.recordMemberKinds()
+	if exact, cidr := ipSet.MemberKinds(); exact && !oldExact || cidr && !oldCIDR {
+		log.WithFields(log.Fields{"setID": ipSet.OriginalID, "exact": exact, "cidr": cidr}).Debug(
+			"IP set member kinds changed")
+		m.memberKindsChanged.Add(ipSet.OriginalID)
+	}
+}
+
 func (m *bpfIPSets) GetMembers(setID string) (set.Set, error) {
 	// GetMembers is only called from XDPState, and XDPState does not coexist with
 	// config.BPFEnabled.
@@ -229,16 +289,20 @@ func (m *bpfIPSets) ApplyUpdates() {
 	var numAdds, numDels uint
 	startTime := time.Now()
 
-	err := m.bpfMap.EnsureExists()
-	if err != nil {
-		log.WithError(err).Panic("Failed to create IP set map")
-	}
+	m.ensureMapsExist()
 
 	debug := log.GetLevel() >= log.DebugLevel
+	if m.resyncScheduled && m.dataplaneKnown {
+		// The pending adds and removes of the IP sets already hold the difference between
+		// the desired state and the maps, there is no need to re-read the maps.
+		log.Debug("BPF IP sets maps are in sync with their shadow, skipping re-read")
+		m.resyncScheduled = false
+	}
 	if m.resyncScheduled {
-		log.Debug("Doing full resync of BPF IP sets map")
+		log.Debug("Doing full resync of BPF IP sets maps")
 		m.opRecorder.RecordOperation("resync-bpf-ipsets")
 		m.resyncScheduled = false
+		m.dataplaneKnown = true
 
 		m.dirtyIPSetIDs.Clear()
 
@@ -249,20 +313,28 @@ func (m *bpfIPSets) ApplyUpdates() {
 			ipSet.PendingRemoves.Clear()
 		}
 
-		var unknownEntries []IPSetEntry
-		err := m.bpfMap.Iter(func(k, v []byte) bpf.IteratorAction {
-			var entry IPSetEntry
-			copy(entry[:], k)
+		var unknownEntries ipSetEntryBatch
+		var misplacedKeys [][]byte
+		checkEntry := func(entry IPSetEntry, inHashMap bool) {
 			setID := entry.SetID()
 			if debug {
 				log.WithFields(log.Fields{"setID": setID,
 					"addr":      entry.Addr(),
-					"prefixLen": entry.PrefixLen()}).Debug("Found entry in dataplane")
+					"prefixLen": entry.PrefixLen(),
+					"inHashMap": inHashMap}).Debug("Found entry in dataplane")
+			}
+			if entry.IsExact() != inHashMap {
+				// An exact-match entry in the LPM trie, left over from before exact-match
+				// members moved to the hash map.  The programs no longer look for it there so
+				// it doesn't count as present: remove it and leave it in the pending adds so
+				// that it gets written to the hash map.
+				misplacedKeys = append(misplacedKeys, entry[:])
+				return
 			}
 			ipSet := m.ipSets[setID]
 			if ipSet == nil {
 				// Found en entry from an unknown IP set.  Mark it for deletion at the end.
-				unknownEntries = append(unknownEntries, entry)
+				unknownEntries.add(nil, entry)
 			} else {
 				// Entry is from a known IP set.  Check if the entry is wanted.
 				if ipSet.DesiredEntries.Contains(entry) {
@@ -271,18 +343,43 @@ func (m *bpfIPSets) ApplyUpdates() {
 					ipSet.PendingRemoves.Add(entry)
 				}
 			}
+		}
+		err := m.bpfMap.Iter(func(k, v []byte) bpf.IteratorAction {
+			var entry IPSetEntry
+			copy(entry[:], k)
+			checkEntry(entry, false)
 			return bpf.IterNone
 		})
+		if err == nil {
+			err = m.hashMap.Iter(func(k, v []byte) bpf.IteratorAction {
+				checkEntry(IPSetEntryFromHashKey(k), true)
+				return bpf.IterNone
+			})
+		}
 		if err != nil {
 			log.WithError(err).Error("Failed to iterate over BPF map; IP sets may be out of sync")
 			m.resyncScheduled = true
+			m.dataplaneKnown = false
 		}
 
-		for _, entry := range unknownEntries {
-			err := m.bpfMap.Delete(entry[:])
-			if err != nil {
-				log.WithError(err).WithField("key", entry).Error("Failed to remove unexpected IP set entry")
+		m.deleteEntries(&unknownEntries, "Failed to remove unexpected IP set entry", nil)
+		if len(misplacedKeys) > 0 {
+			log.WithField("numEntries", len(misplacedKeys)).Info(
+				"Moving exact-match IP set entries from the LPM trie to the hash map")
+			for len(misplacedKeys) > 0 {
+				n, err := bpf.DeleteBatch(m.bpfMap, misplacedKeys)
+				if err == nil {
+					break
+				}
+				if n >= len(misplacedKeys) {
+					n = 0
+				}
+				log.WithError(err).WithField("entry", misplacedKeys[n]).Error(
+					"Failed to remove exact-match IP set entry from the LPM trie")
 				m.resyncScheduled = true
+				m.dataplaneKnown = false
+				// Carry on past the failed entry so that it doesn't hold up the rest.
+				misplacedKeys = misplacedKeys[n+1:]
 			}
 		}
 
@@ -293,50 +390,45 @@ func (m *bpfIPSets) ApplyUpdates() {
 		}
 	}
 
+	// Collect the pending changes of all the dirty IP sets so that we can apply them with
+	// a few batch operations rather than a syscall per entry.
+	var removes, adds ipSetEntryBatch
+	var dirtySets []*bpfIPSet
 	m.dirtyIPSetIDs.Iter(func(item interface{}) error {
 		setID := item.(uint64)
-		leaveDirty := false
 		ipSet := m.getExistingIPSet(setID)
 		if ipSet == nil {
 			log.WithField("id", setID).Warn("Couldn't find IP set that was marked as dirty.")
 			m.resyncScheduled = true
+			m.dataplaneKnown = false
 			return set.RemoveItem
 		}
+		dirtySets = append(dirtySets, ipSet)
+		removes.addAll(ipSet, ipSet.PendingRemoves)
+		adds.addAll(ipSet, ipSet.PendingAdds)
+		return nil
+	})
 
-		ipSet.PendingRemoves.Iter(func(item interface{}) error {
-			entry := item.(IPSetEntry)
-			if debug {
-				log.WithFields(log.Fields{"setID": setID, "entry": entry}).Debug("Removing entry from IP set")
-			}
-			err := m.bpfMap.Delete(entry[:])
-			if err != nil {
-				log.WithFields(log.Fields{"setID": setID, "entry": entry}).WithError(err).Error("Failed to remove IP set entry")
-				leaveDirty = true
-				return nil
-			}
-			numDels++
-			return set.RemoveItem
-		})
-
-		ipSet.PendingAdds.Iter(func(item interface{}) error {
-			entry := item.(IPSetEntry)
-			if debug {
-				log.WithFields(log.Fields{"setID": setID, "entry": entry}).Debug("Adding entry to IP set")
-			}
-			err := m.bpfMap.Update(entry[:], DummyValue)
-			if err != nil {
-				log.WithFields(log.Fields{"setID": setID, "entry": entry}).WithError(err).Error("Failed to add IP set entry")
-				leaveDirty = true
-				return nil
-			}
-			numAdds++
-			return set.RemoveItem
-		})
+	// Remove first, to make room in the maps.
+	numDels = m.deleteEntries(&removes, "Failed to remove IP set entry", func(ipSet *bpfIPSet, entry IPSetEntry) {
+		if debug {
+			log.WithFields(log.Fields{"setID": ipSet.ID, "entry": entry}).Debug("Removed entry from IP set")
+		}
+		ipSet.PendingRemoves.Discard(entry)
+	})
+	numAdds = m.addEntries(&adds, func(ipSet *bpfIPSet, entry IPSetEntry) {
+		if debug {
+			log.WithFields(log.Fields{"setID": ipSet.ID, "entry": entry}).Debug("Added entry to IP set")
+		}
+		ipSet.PendingAdds.Discard(entry)
+	})
 
-		if leaveDirty {
-			log.WithField("setID", setID).Debug("IP set still dirty, queueing resync")
+	for _, ipSet := range dirtySets {
+		if ipSet.PendingRemoves.Len() > 0 || ipSet.PendingAdds.Len() > 0 {
+			log.WithField("setID", ipSet.ID).Debug("IP set still dirty, queueing resync")
 			m.resyncScheduled = true
-			return nil
+			m.dataplaneKnown = false
+			continue
 		}
 
 		if ipSet.Deleted {
@@ -344,9 +436,9 @@ func (m *bpfIPSets) ApplyUpdates() {
 			m.deleteIPSetAndReleaseID(ipSet)
 		}
 
-		log.WithField("setID", setID).Debug("IP set is now clean")
-		return set.RemoveItem
-	})
+		log.WithField("setID", ipSet.ID).Debug("IP set is now clean")
+		m.dirtyIPSetIDs.Discard(ipSet.ID)
+	}
 
 	duration := time.Since(startTime)
 	if numDels > 0 || numAdds > 0 {
@@ -360,12 +452,169 @@ func (m *bpfIPSets) ApplyUpdates() {
 	bpfIPSetsGauge.Set(float64(len(m.ipSets)))
 }
 
+// ApplyAdds writes the pending additions of the dirty IP sets to the maps, leaving the
+// removals, and any resync, to ApplyUpdates.  The BPF endpoint manager calls it before it
+// attaches new policy programs so that the sets that the programs match on already have their
+// members: a negated match on a set that is still empty would match every packet.
+func (m *bpfIPSets) ApplyAdds() {
+	m.ensureMapsExist()
+
+	var adds ipSetEntryBatch
+	m.dirtyIPSetIDs.Iter(func(item interface{}) error {
+		if ipSet := m.getExistingIPSet(item.(uint64)); ipSet != nil {
+			adds.addAll(ipSet, ipSet.PendingAdds)
+		}
+		return nil
+	})
+	numAdds := m.addEntries(&adds, func(ipSet *bpfIPSet, entry IPSetEntry) {
+		ipSet.PendingAdds.Discard(entry)
+	})
+	if numAdds > 0 {
+		log.WithField("numAdds", numAdds).Debug("Added entries to BPF IP sets ahead of the policy programs.")
+	}
+}
+
+func (m *bpfIPSets) ensureMapsExist() {
+	err := m.bpfMap.EnsureExists()
+	if err != nil {
+		log.WithError(err).Panic("Failed to create IP set map")
+	}
+	err = m.hashMap.EnsureExists()
+	if err != nil {
+		log.WithError(err).Panic("Failed to create IP set hash map")
+	}
+}
+
 // ApplyDeletions tries to delete any IP sets that are no longer needed.
 // Failures are ignored, deletions will be retried the next time we do a resync.
 func (m *bpfIPSets) ApplyDeletions() {
 	// No-op.
 }
 
+// ipSetEntryBatch collects the entries of batch operations on the maps along with the IP set
+// that each entry belongs to.  The exact-match entries and the CIDR entries are kept apart
+// since they go to different maps.
+type ipSetEntryBatch struct {
+	exact, cidr ipSetEntries
+}
+
+type ipSetEntries struct {
+	entries []IPSetEntry
+	ipSets  []*bpfIPSet
+}
+
+func (b *ipSetEntryBatch) add(ipSet *bpfIPSet, entry IPSetEntry) {
+	es := &b.cidr
+	if entry.IsExact() {
+		es = &b.exact
+	}
+	es.entries = append(es.entries, entry)
+	es.ipSets = append(es.ipSets, ipSet)
+}
+
+func (b *ipSetEntryBatch) addAll(ipSet *bpfIPSet, entries set.Set) {
+	entries.Iter(func(item interface{}) error {
+		b.add(ipSet, item.(IPSetEntry))
+		return nil
+	})
+}
+
+func (es *ipSetEntries) keys(exact bool) [][]byte {
+	ks := make([][]byte, len(es.entries))
+	for i, entry := range es.entries {
+		if exact {
+			ks[i] = entry.HashKey()
+		} else {
+			ks[i] = entry[:]
+		}
+	}
+	return ks
+}
+
+// apply runs op, which applies the entries from the given index onwards and returns how
+// many of them it applied before it failed, until it has been through every entry.  An
+// entry that op fails on is logged and stays pending while apply carries on with the ones
+// after it, so that one bad entry doesn't hold up the rest until the next resync.
+// onApplied, if not nil, is called for each applied entry.  Returns the number of applied
+// entries and whether any entry failed.
+func (es *ipSetEntries) apply(
+	op func(from int) (int, error),
+	errMsg string,
+	onApplied func(ipSet *bpfIPSet, entry IPSetEntry),
+) (uint, bool) {
+	var total uint
+	failed := false
+	for from := 0; from < len(es.entries); {
+		n, err := op(from)
+		remaining := len(es.entries) - from
+		if n > remaining {
+			n = remaining
+		}
+		if err != nil && n == remaining {
+			// The map can't have applied every entry and failed, don't drop the pending
+			// changes on the strength of a bogus count.
+			n = 0
+		}
+		if onApplied != nil {
+			for i := from; i < from+n; i++ {
+				onApplied(es.ipSets[i], es.entries[i])
+			}
+		}
+		total += uint(n)
+		if err == nil {
+			break
+		}
+		log.WithError(err).WithField("entry", es.entries[from+n]).Error(errMsg)
+		failed = true
+		from += n + 1
+	}
+	return total, failed
+}
+
+// deleteEntries removes the entries of the batch from the maps and returns the number of
+// entries that it removed.  If any entry fails, it schedules a resync.
+func (m *bpfIPSets) deleteEntries(b *ipSetEntryBatch, errMsg string, onApplied func(ipSet *bpfIPSet, entry IPSetEntry)) uint {
+	var total uint
+	for _, exact := range []bool{true, false} {
+		es, bpfMap := &b.cidr, m.bpfMap
+		if exact {
+			es, bpfMap = &b.exact, m.hashMap
+		}
+		keys := es.keys(exact)
+		n, failed := es.apply(func(from int) (int, error) {
+			return bpf.DeleteBatch(bpfMap, keys[from:])
+		}, errMsg, onApplied)
+		if failed {
+			m.resyncScheduled = true
+			m.dataplaneKnown = false
+		}
+		total += n
+	}
+	return total
+}
+
+// addEntries adds the entries of the batch to the maps and returns the number of entries
+// that it added.  Entries that fail stay pending.
+func (m *bpfIPSets) addEntries(b *ipSetEntryBatch, onApplied func(ipSet *bpfIPSet, entry IPSetEntry)) uint {
+	var total uint
+	for _, exact := range []bool{true, false} {
+		es, bpfMap := &b.cidr, m.bpfMap
+		if exact {
+			es, bpfMap = &b.exact, m.hashMap
+		}
+		keys := es.keys(exact)
+		values := make([][]byte, len(keys))
+		for i := range values {
+			values[i] = DummyValue
+		}
+		n, _ := es.apply(func(from int) (int, error) {
+			return bpf.UpdateBatch(bpfMap, keys[from:], values[from:])
+		}, "Failed to add IP set entry", onApplied)
+		total += n
+	}
+	return total
+}
+
 func (m *bpfIPSets) markIPSetDirty(data *bpfIPSet) {
 	m.dirtyIPSetIDs.Add(data.ID)
 }
@@ -382,11 +631,42 @@ type bpfIPSet struct {
 	// dataplane into sync with DesiredEntries.
 	PendingRemoves set.Set /* of IPSetEntry */
 
+	// numExactMembers and numCIDRMembers count the DesiredEntries that belong in the hash
+	// map and in the LPM trie respectively.
+	numExactMembers int
+	numCIDRMembers  int
+	// lastExact and lastCIDR are the member kinds of the set when it was last non-empty.
+	lastExact, lastCIDR bool
+
 	Deleted bool
 
 	Type ipsets.IPSetType
 }
 
+// MemberKinds returns whether the set has exact-match members and whether it has CIDR
+// members or, if it is empty, the kinds of members that it last had.
+func (m *bpfIPSet) MemberKinds() (exact, cidr bool) {
+	if m.numExactMembers == 0 && m.numCIDRMembers == 0 {
+		return m.lastExact, m.lastCIDR
+	}
+	return m.numExactMembers > 0, m.numCIDRMembers > 0
+}
+
+func (m *bpfIPSet) recordMemberKinds() {
+	if m.numExactMembers == 0 && m.numCIDRMembers == 0 {
+		return
+	}
+	m.lastExact, m.lastCIDR = m.numExactMembers > 0, m.numCIDRMembers > 0
+}
+
+func (m *bpfIPSet) countMember(entry IPSetEntry, delta int) {
+	if entry.IsExact() {
+		m.numExactMembers += delta
+	} else {
+		m.numCIDRMembers += delta
+	}
+}
+
 func (m *bpfIPSet) ReplaceMembers(members []string) {
 	m.RemoveAll()
 	m.AddMembers(members)
@@ -415,6 +695,7 @@ func (m *bpfIPSet) AddMember(entry IPSetEntry) {
 		return
 	}
 	m.DesiredEntries.Add(entry)
+	m.countMember(entry, 1)
 	if m.PendingRemoves.Contains(entry) {
 		m.PendingRemoves.Discard(entry)
 	} else {
@@ -429,6 +710,7 @@ func (m *bpfIPSet) RemoveMember(entry IPSetEntry) {
 		return
 	}
 	m.DesiredEntries.Discard(entry)
+	m.countMember(entry, -1)
 	if m.PendingAdds.Contains(entry) {
 		m.PendingAdds.Discard(entry)
 	} else {
@@ -0,0 +1,193 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package ipsets
+
+import (
+	"testing"
+
+	. "github.com/onsi/gomega"
+	"golang.org/x/sys/unix"
+
+	"github.com/projectcalico/felix/bpf/mock"
+	"github.com/projectcalico/felix/idalloc"
+	"github.com/projectcalico/felix/ipsets"
+	"github.com/projectcalico/felix/logutils"
+)
+
+func newTestIPSets() (*bpfIPSets, *mock.BatchMap, *mock.BatchMap) {
+	lpmMap := mock.NewMockBatchMap(MapParameters)
+	hashMap := mock.NewMockBatchMap(HashMapParameters)
+	m := NewBPFIPSets(
+		ipsets.NewIPVersionConfig(ipsets.IPFamilyV4, "cali", nil, nil),
+		idalloc.New(),
+		lpmMap,
+		hashMap,
+		logutils.NewSummarizer("test"),
+	)
+	return m, lpmMap, hashMap
+}
+
+var testMeta = ipsets.IPSetMetadata{SetID: "s:abcdef", Type: ipsets.IPSetTypeHashNet}
+
+func TestBatchFailureKeepsPendingChanges(t *testing.T) {
+	RegisterTestingT(t)
+
+	m, _, hashMap := newTestIPSets()
+	m.ApplyUpdates()
+
+	// A failed batch that claims to have processed every entry mustn't drop the pending
+	// adds or index past the end of the batch.
+	hashMap.BatchErr = unix.EINVAL
+	hashMap.BatchErrCount = 2
+	m.AddOrReplaceIPSet(testMeta, []string{"10.0.0.1", "10.0.0.2"})
+	Expect(m.ApplyUpdates).NotTo(Panic())
+	ipSet := m.getExistingIPSetString(testMeta.SetID)
+	Expect(ipSet.PendingAdds.Len()).To(Equal(2))
+	Expect(hashMap.Contents).To(BeEmpty())
+	Expect(m.resyncScheduled).To(BeTrue())
+
+	hashMap.BatchErr = nil
+	m.ApplyUpdates()
+	Expect(ipSet.PendingAdds.Len()).To(Equal(0))
+	Expect(hashMap.Contents).To(HaveLen(2))
+}
+
+func TestFailedEntryDoesNotBlockTheRest(t *testing.T) {
+	RegisterTestingT(t)
+
+	m, _, hashMap := newTestIPSets()
+	m.ApplyUpdates()
+
+	id := m.ipSetIDAllocator.GetOrAlloc(testMeta.SetID)
+	members := []string{"10.0.0.1", "10.0.0.2", "10.0.0.3", "10.0.0.4"}
+	bad := ProtoIPSetMemberToBPFEntry(id, "10.0.0.2")
+	hashMap.KeyErrs = map[string]error{string(bad.HashKey()): unix.E2BIG}
+
+	// Whichever position the bad entry has in the batch, the entries after it still get
+	// added and only the bad one stays pending.
+	m.AddOrReplaceIPSet(testMeta, members)
+	m.ApplyUpdates()
+	ipSet := m.getExistingIPSetString(testMeta.SetID)
+	Expect(ipSet.PendingAdds.Len()).To(Equal(1))
+	Expect(ipSet.PendingAdds.Contains(*bad)).To(BeTrue())
+	Expect(hashMap.Contents).To(HaveLen(3))
+	Expect(hashMap.Contents).NotTo(HaveKey(string(bad.HashKey())))
+	Expect(m.resyncScheduled).To(BeTrue())
+
+	hashMap.KeyErrs = nil
+	m.ApplyUpdates()
+	Expect(ipSet.PendingAdds.Len()).To(Equal(0))
+	Expect(hashMap.Contents).To(HaveLen(4))
+
+	// Same for removals.
+	hashMap.KeyErrs = map[string]error{string(bad.HashKey()): unix.EBUSY}
+	m.AddOrReplaceIPSet(testMeta, nil)
+	m.ApplyUpdates()
+	Expect(ipSet.PendingRemoves.Len()).To(Equal(1))
+	Expect(ipSet.PendingRemoves.Contains(*bad)).To(BeTrue())
+	Expect(hashMap.Contents).To(Equal(map[string]string{string(bad.HashKey()): string(DummyValue)}))
+	Expect(m.resyncScheduled).To(BeTrue())
+}
+
+func TestApplyAddsLeavesRemovalsToApplyUpdates(t *testing.T) {
+	RegisterTestingT(t)
+
+	m, lpmMap, hashMap := newTestIPSets()
+	m.AddOrReplaceIPSet(testMeta, []string{"10.0.0.1"})
+	m.ApplyUpdates()
+
+	id := m.ipSetIDAllocator.GetOrAlloc(testMeta.SetID)
+	oldEntry := ProtoIPSetMemberToBPFEntry(id, "10.0.0.1")
+	newExact := ProtoIPSetMemberToBPFEntry(id, "10.0.0.2")
+	newCIDR := ProtoIPSetMemberToBPFEntry(id, "10.1.0.0/16")
+
+	m.AddOrReplaceIPSet(testMeta, []string{"10.0.0.2", "10.1.0.0/16"})
+	m.ApplyAdds()
+	Expect(hashMap.Contents).To(Equal(map[string]string{
+		string(oldEntry.HashKey()): string(DummyValue),
+		string(newExact.HashKey()): string(DummyValue),
+	}))
+	Expect(lpmMap.Contents).To(Equal(map[string]string{string(newCIDR[:]): string(DummyValue)}))
+	ipSet := m.getExistingIPSetString(testMeta.SetID)
+	Expect(ipSet.PendingAdds.Len()).To(Equal(0))
+	Expect(ipSet.Dirty()).To(BeTrue())
+
+	m.ApplyUpdates()
+	Expect(hashMap.Contents).To(Equal(map[string]string{string(newExact.HashKey()): string(DummyValue)}))
+	Expect(lpmMap.Contents).To(HaveLen(1))
+	Expect(ipSet.Dirty()).To(BeFalse())
+}
+
+func TestResyncMovesExactEntriesOutOfLPM(t *testing.T) {
+	RegisterTestingT(t)
+
+	m, lpmMap, hashMap := newTestIPSets()
+
+	// Before the hash map existed, all the members were in the LPM trie.
+	id := m.ipSetIDAllocator.GetOrAlloc(testMeta.SetID)
+	exact := ProtoIPSetMemberToBPFEntry(id, "10.0.0.1")
+	cidr := ProtoIPSetMemberToBPFEntry(id, "10.1.0.0/16")
+	stale := ProtoIPSetMemberToBPFEntry(id, "10.0.0.2")
+	for _, e := range []*IPSetEntry{exact, cidr, stale} {
+		lpmMap.Contents[string(e[:])] = string(DummyValue)
+	}
+
+	m.AddOrReplaceIPSet(testMeta, []string{"10.0.0.1", "10.1.0.0/16"})
+	m.ApplyUpdates()
+
+	Expect(lpmMap.Contents).To(Equal(map[string]string{string(cidr[:]): string(DummyValue)}))
+	Expect(hashMap.Contents).To(Equal(map[string]string{string(exact.HashKey()): string(DummyValue)}))
+	ipSet := m.getExistingIPSetString(testMeta.SetID)
+	Expect(ipSet.Dirty()).To(BeFalse())
+}
+
+func TestMemberKindChanges(t *testing.T) {
+	RegisterTestingT(t)
+
+	m, _, _ := newTestIPSets()
+	kinds := func() []bool {
+		exact, cidr := m.MemberKinds(testMeta.SetID)
+		return []bool{exact, cidr}
+	}
+
+	// A new set reports both kinds until it has members, so filling it needs no rebuild.
+	m.AddOrReplaceIPSet(testMeta, nil)
+	Expect(kinds()).To(Equal([]bool{true, true}))
+	m.AddMembers(testMeta.SetID, []string{"10.0.0.1"})
+	Expect(kinds()).To(Equal([]bool{true, false}))
+	Expect(m.TakeMemberKindChanges()).To(BeEmpty())
+
+	// Gaining a kind needs a rebuild.
+	m.AddMembers(testMeta.SetID, []string{"10.1.0.0/16"})
+	Expect(kinds()).To(Equal([]bool{true, true}))
+	Expect(m.TakeMemberKindChanges()).To(Equal([]string{testMeta.SetID}))
+	Expect(m.TakeMemberKindChanges()).To(BeEmpty())
+
+	// Losing one doesn't.
+	m.RemoveMembers(testMeta.SetID, []string{"10.1.0.0/16"})
+	Expect(kinds()).To(Equal([]bool{true, false}))
+	Expect(m.TakeMemberKindChanges()).To(BeEmpty())
+
+	// Emptying the set and refilling it with the same kind doesn't either.
+	m.RemoveMembers(testMeta.SetID, []string{"10.0.0.1"})
+	Expect(kinds()).To(Equal([]bool{true, false}))
+	m.AddMembers(testMeta.SetID, []string{"10.0.0.2"})
+	Expect(m.TakeMemberKindChanges()).To(BeEmpty())
+
+	// Refilling it with the other kind does.
+	m.AddOrReplaceIPSet(testMeta, []string{"10.2.0.0/16"})
+	Expect(kinds()).To(Equal([]bool{false, true}))
+	Expect(m.TakeMemberKindChanges()).To(Equal([]string{testMeta.SetID}))
+}
@@ -40,16 +40,71 @@ const IPSetEntrySize = 20
 
 type IPSetEntry [IPSetEntrySize]byte
 
+var MapParameters = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_ip_sets",
+	Type:       "lpm_trie",
+	KeySize:    IPSetEntrySize,
+	ValueSize:  4,
+	MaxEntries: 1024 * 1024,
+	Name:       "cali_v4_ip_sets",
+	Flags:      unix.BPF_F_NO_PREALLOC,
+}
+
 func Map(mc *bpf.MapContext) bpf.Map {
-	return mc.NewPinnedMap(bpf.MapParameters{
-		Filename:   "/sys/fs/bpf/tc/globals/cali_v4_ip_sets",
-		Type:       "lpm_trie",
-		KeySize:    IPSetEntrySize,
-		ValueSize:  4,
-		MaxEntries: 1024 * 1024,
-		Name:       "cali_v4_ip_sets",
-		Flags:      unix.BPF_F_NO_PREALLOC,
-	})
+	return mc.NewPinnedMap(MapParameters)
+}
+
+// IPSetHashKeySize is the size of the keys of the hash map, which holds the exact-match
+// members of the IP sets: /32s and named ports.  The key is the IPSetEntry without its
+// prefix length.
+const IPSetHashKeySize = IPSetEntrySize - 4
+
+var HashMapParameters = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_ip_hset",
+	Type:       "hash",
+	KeySize:    IPSetHashKeySize,
+	ValueSize:  4,
+	MaxEntries: 1024 * 1024,
+	Name:       "cali_v4_ip_hset",
+	Flags:      unix.BPF_F_NO_PREALLOC,
+}
+
+// HashMap returns the map of the exact-match IP set members.  Only CIDR members are stored
+// in the LPM trie returned by Map, so that the policy programs can look up most members
+// with a (cheaper) hash lookup.
+func HashMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(HashMapParameters)
+}
+
+// Prefix lengths of the entries of single addresses (ID and IP) and of named ports (ID, IP,
+// port and protocol).
+const (
+	prefixLenExact     = 64 + 32
+	prefixLenNamedPort = 64 + 32 + 16 + 8
+)
+
+// IPSetEntryFromHashKey returns the entry of the given key of the hash map.
+func IPSetEntryFromHashKey(k []byte) IPSetEntry {
+	var entry IPSetEntry
+	copy(entry[4:], k)
+	if entry.Protocol() == 0 {
+		binary.LittleEndian.PutUint32(entry[0:4], prefixLenExact)
+	} else {
+		binary.LittleEndian.PutUint32(entry[0:4], prefixLenNamedPort)
+	}
+	return entry
+}
+
+// IsExact returns true if the entry matches a single address (or address and port), so it
+// belongs in the hash map rather than in the LPM trie.
+func (e IPSetEntry) IsExact() bool {
+	prefixLen := e.PrefixLen()
+	return prefixLen == prefixLenExact || prefixLen == prefixLenNamedPort
+}
+
+// HashKey returns the key of the entry in the hash map.
+func (e IPSetEntry) HashKey() []byte {
+	return e[4:]
 }
 
 func (e IPSetEntry) SetID() uint64 {
@@ -80,7 +135,7 @@ func MakeBPFIPSetEntry(setID uint64, cidr ip.V4CIDR, port uint16, proto uint8) *
 		binary.LittleEndian.PutUint32(entry[0:4], uint32(64 /* ID */ +cidr.Prefix()))
 	} else {
 		// Named port lookup, use full length of key.
-		binary.LittleEndian.PutUint32(entry[0:4], 64 /* ID */ +32 /* IP */ +16 /* Port */ +8 /* protocol */)
+		binary.LittleEndian.PutUint32(entry[0:4], prefixLenNamedPort)
 	}
 	binary.BigEndian.PutUint64(entry[4:12], setID)
 	binary.BigEndian.PutUint32(entry[12:16], cidr.Addr().(ip.V4Addr).AsUint32())
@@ -1,4 +1,4 @@
-// Copyright (c) 2020 Tigera, Inc. All rights reserved.
+// Copyright (c) 2020-2021 Tigera, Inc. All rights reserved.
 
 // Licensed under the Apache License, Version 2.0 (the "License");
 // you may not use this file except in compliance with the License.
@@ -24,7 +24,23 @@ func MapForTest(mc *bpf.MapContext) bpf.Map {
 		Type:       "prog_array",
 		KeySize:    4,
 		ValueSize:  4,
-		MaxEntries: 8,
+		MaxEntries: 64,
 		Name:       "cali_jump",
 	})
 }
+
+// PolicyProgsMapParameters describes the prog array that holds the policy programs that are
+// shared between endpoints, see polprog.WithSharedProgArray.  It holds the programs of each
+// distinct policy program chain and a return trampoline per endpoint.
+var PolicyProgsMapParameters = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_polprog",
+	Type:       "prog_array",
+	KeySize:    4,
+	ValueSize:  4,
+	MaxEntries: 8192,
+	Name:       "cali_v4_polprog",
+}
+
+func PolicyProgsMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(PolicyProgsMapParameters)
+}
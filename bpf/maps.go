@@ -96,6 +96,23 @@ func (c *MapContext) NewPinnedMap(params MapParameters) Map {
 	return m
 }
 
+// OpenPinnedMapReadOnly opens, for reading only, the map that is pinned at the path of the
+// given parameters.  Unlike Open, it neither repins nor creates the map, it fails if the map
+// isn't pinned yet.  It gives a reader that runs alongside the map's owner, such as a metrics
+// collector, a handle of its own.
+func OpenPinnedMapReadOnly(params MapParameters) (Map, error) {
+	fd, err := GetMapFDByPinReadOnly(params.versionedFilename())
+	if err != nil {
+		return nil, err
+	}
+	return &PinnedMap{
+		MapParameters: params,
+		fdLoaded:      true,
+		fd:            fd,
+		perCPU:        strings.Contains(params.Type, "percpu"),
+	}, nil
+}
+
 type PinnedMap struct {
 	context *MapContext
 	MapParameters
@@ -103,6 +120,9 @@ type PinnedMap struct {
 	fdLoaded bool
 	fd       MapFD
 	perCPU   bool
+	// noBatchOps is set once the kernel has refused a batch operation on the map, batch
+	// updates and deletes then fall back to an operation per entry.
+	noBatchOps bool
 }
 
 func (b *PinnedMap) GetName() string {
@@ -244,18 +264,20 @@ func (b *PinnedMap) Iter(f IterCallback) error {
 	}
 }
 
+// Update updates an entry of the map.  For a per-CPU map, v must hold the value for each
+// possible CPU, see GetPerCPUMapEntry.
 func (b *PinnedMap) Update(k, v []byte) error {
 	if b.perCPU {
-		// Per-CPU maps need a buffer of value-size * num-CPUs.
-		logrus.Panic("Per-CPU operations not implemented")
+		return UpdatePerCPUMapEntry(b.fd, k, v, b.ValueSize)
 	}
 	return UpdateMapEntry(b.fd, k, v)
 }
 
+// Get looks up an entry of the map.  For a per-CPU map, it returns the value for each
+// possible CPU, see GetPerCPUMapEntry.
 func (b *PinnedMap) Get(k []byte) ([]byte, error) {
 	if b.perCPU {
-		// Per-CPU maps need a buffer of value-size * num-CPUs.
-		logrus.Panic("Per-CPU operations not implemented")
+		return GetPerCPUMapEntry(b.fd, k, b.ValueSize)
 	}
 	return GetMapEntry(b.fd, k, b.ValueSize)
 }
@@ -267,6 +289,129 @@ func (b *PinnedMap) Delete(k []byte) error {
 	return DeleteMapEntry(b.fd, k, b.ValueSize)
 }
 
+// BatchMap is implemented by maps that can update or delete many entries at once.  Both
+// methods stop at the first entry that fails and return the number of entries that were
+// processed before it.
+type BatchMap interface {
+	UpdateBatch(ks, vs [][]byte) (int, error)
+	DeleteBatch(ks [][]byte) (int, error)
+}
+
+// maxBatchSize limits the number of entries passed to the kernel in one batch operation.
+const maxBatchSize = 4096
+
+// UpdateBatch updates the given entries of the map with BPF_MAP_UPDATE_BATCH, or with an
+// update per entry if the kernel or the map type doesn't support batch operations.
+func (b *PinnedMap) UpdateBatch(ks, vs [][]byte) (int, error) {
+	if b.perCPU || b.noBatchOps {
+		return updateEach(b, ks, vs)
+	}
+	done := 0
+	for done < len(ks) {
+		end := done + maxBatchSize
+		if end > len(ks) {
+			end = len(ks)
+		}
+		keys := make([]byte, 0, (end-done)*b.KeySize)
+		values := make([]byte, 0, (end-done)*b.ValueSize)
+		for i := done; i < end; i++ {
+			keys = append(keys, ks[i]...)
+			values = append(values, vs[i]...)
+		}
+		n, err := UpdateMapEntries(b.fd, keys, values, end-done)
+		if err != nil && n >= end-done {
+			// Defensive: a failed call can't have processed the whole batch.
+			n = 0
+		}
+		if err != nil && done == 0 && n == 0 && isBatchUnsupported(err) {
+			logrus.WithField("map", b.versionedName()).Debug("Batch operations not supported, updating entries one by one.")
+			b.noBatchOps = true
+			return updateEach(b, ks, vs)
+		}
+		done += n
+		if err != nil {
+			return done, err
+		}
+	}
+	return done, nil
+}
+
+// DeleteBatch deletes the given entries of the map with BPF_MAP_DELETE_BATCH, or with a
+// delete per entry if the kernel or the map type doesn't support batch operations.
+func (b *PinnedMap) DeleteBatch(ks [][]byte) (int, error) {
+	if b.perCPU || b.noBatchOps {
+		return deleteEach(b, ks)
+	}
+	done := 0
+	for done < len(ks) {
+		end := done + maxBatchSize
+		if end > len(ks) {
+			end = len(ks)
+		}
+		keys := make([]byte, 0, (end-done)*b.KeySize)
+		for i := done; i < end; i++ {
+			keys = append(keys, ks[i]...)
+		}
+		n, err := DeleteMapEntries(b.fd, keys, end-done)
+		if err != nil && n >= end-done {
+			// Defensive: a failed call can't have processed the whole batch.
+			n = 0
+		}
+		if err != nil && done == 0 && n == 0 && isBatchUnsupported(err) {
+			logrus.WithField("map", b.versionedName()).Debug("Batch operations not supported, deleting entries one by one.")
+			b.noBatchOps = true
+			return deleteEach(b, ks)
+		}
+		done += n
+		if err != nil {
+			return done, err
+		}
+	}
+	return done, nil
+}
+
+// isBatchUnsupported returns true if the error means that the kernel doesn't know the batch
+// commands (EINVAL) or that the map type doesn't implement them (EOPNOTSUPP/ENOTSUPP).  Which
+// map types support batch operations depends on the kernel version.
+func isBatchUnsupported(err error) bool {
+	const errnoENOTSUPP = unix.Errno(524) // Kernel-internal, not in the unix package.
+	return err == unix.EINVAL || err == unix.EOPNOTSUPP || err == errnoENOTSUPP
+}
+
+// UpdateBatch updates the given entries of the map, in batches if the map supports it.
+func UpdateBatch(m Map, ks, vs [][]byte) (int, error) {
+	if bm, ok := m.(BatchMap); ok {
+		return bm.UpdateBatch(ks, vs)
+	}
+	return updateEach(m, ks, vs)
+}
+
+// DeleteBatch deletes the given entries of the map, in batches if the map supports it.
+func DeleteBatch(m Map, ks [][]byte) (int, error) {
+	if bm, ok := m.(BatchMap); ok {
+		return bm.DeleteBatch(ks)
+	}
+	return deleteEach(m, ks)
+}
+
+func updateEach(m Map, ks, vs [][]byte) (int, error) {
+	for i := range ks {
+		if err := m.Update(ks[i], vs[i]); err != nil {
+			return i, err
+		}
+	}
+	return len(ks), nil
+}
+
+func deleteEach(m Map, ks [][]byte) (int, error) {
+	for i := range ks {
+		if err := m.Delete(ks[i]); err != nil {
+			return i, err
+		}
+	}
+	return len(ks), nil
+}
+
 func (b *PinnedMap) Open() error {
 	if b.fdLoaded {
 		return nil
@@ -0,0 +1,258 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package mapstats
+
+import (
+	"io"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/prometheus/client_golang/prometheus"
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/jitter"
+)
+
+// ScanPeriod is how often the Collector counts the entries of the maps.  Counting means
+// iterating over the maps, so it is kept well below the scrape rate.
+var ScanPeriod = 30 * time.Second
+
+var (
+	entriesDesc = prometheus.NewDesc(
+		"felix_bpf_map_entries",
+		"Number of entries in a BPF map, as of the last scan.",
+		[]string{"map"}, nil,
+	)
+	maxEntriesDesc = prometheus.NewDesc(
+		"felix_bpf_map_max_entries",
+		"Capacity of a BPF map.",
+		[]string{"map"}, nil,
+	)
+	insertFailuresDesc = prometheus.NewDesc(
+		"felix_bpf_map_insert_failures_total",
+		"Number of entries that the BPF programs failed to insert into a map, usually because it "+
+			"was full.",
+		[]string{"map"}, nil,
+	)
+)
+
+type watchedMap struct {
+	name       string
+	params     bpf.MapParameters
+	maxEntries int
+	// lru is set for the LRU maps, which evict entries rather than fill up.
+	lru bool
+
+	entries int
+	scanned bool
+	// aboveWatermark is set once we have warned that the map is above the high watermark.
+	aboveWatermark bool
+}
+
+// Collector counts the entries of the watched maps periodically, and reads the insert
+// failure counters, and exports both as Prometheus metrics.  It logs a warning when a map
+// goes above the high watermark, so that it can be resized before the programs start to
+// fail to insert entries, and when the programs fail to insert entries.
+//
+// The Collector scans from its own goroutine so it opens its own read-only handles on the
+// maps, by their pins, rather than share the dataplane's.  It reopens them on every scan, so
+// that it follows a map that has been replaced and re-pinned, for example to resize it,
+// rather than keep counting the old one.
+type Collector struct {
+	lock sync.Mutex
+
+	highWatermark float64
+	maps          []*watchedMap
+	openMap       func(bpf.MapParameters) (bpf.Map, error)
+	startAfter    <-chan struct{}
+
+	insertFailures map[string]uint64
+
+	wg       sync.WaitGroup
+	stopCh   chan struct{}
+	stopOnce sync.Once
+}
+
+// NewCollector creates a Collector that warns when a map is fuller than highWatermark, a
+// ratio between 0 and 1.
+func NewCollector(highWatermark float64) *Collector {
+	return &Collector{
+		highWatermark:  highWatermark,
+		insertFailures: map[string]uint64{},
+		openMap:        bpf.OpenPinnedMapReadOnly,
+		stopCh:         make(chan struct{}),
+	}
+}
+
+// AddMap adds a map to watch, before the Collector is started.  The map does not need to
+// exist yet; it is skipped until it does.  LRU maps are counted but, since they evict their
+// oldest entries rather than fail inserts, they don't trigger the high watermark warning.
+func (c *Collector) AddMap(params bpf.MapParameters) {
+	c.maps = append(c.maps, &watchedMap{
+		name:       params.Name,
+		params:     params,
+		maxEntries: params.MaxEntries,
+		lru:        strings.HasPrefix(params.Type, "lru_"),
+	})
+}
+
+// StartAfter makes the Collector wait, once started, for the given channel to be closed before
+// its first scan.  The dataplane closes it once it has created the maps.
+func (c *Collector) StartAfter(ch <-chan struct{}) {
+	c.startAfter = ch
+}
+
+// Scan counts the entries of the maps and reads the insert failure counters.
+func (c *Collector) Scan() {
+	for _, wm := range c.maps {
+		m, err := c.openMap(wm.params)
+		if err != nil {
+			log.WithError(err).WithField("map", wm.name).Debug("BPF map not available.")
+			continue
+		}
+		entries := 0
+		err = m.Iter(func(_, _ []byte) bpf.IteratorAction {
+			entries++
+			return bpf.IterNone
+		})
+		closeMap(m)
+		if err != nil {
+			log.WithError(err).WithField("map", wm.name).Warn("Failed to count BPF map entries.")
+			continue
+		}
+		c.lock.Lock()
+		wm.entries = entries
+		wm.scanned = true
+		c.lock.Unlock()
+		c.checkWatermark(wm)
+	}
+
+	errMap, err := c.openMap(ErrMapParams)
+	if err != nil {
+		log.WithError(err).Debug("BPF map insert failures map not available.")
+		return
+	}
+	failures, err := readInsertFailures(errMap)
+	closeMap(errMap)
+	if err != nil {
+		log.WithError(err).Warn("Failed to read BPF map insert failures.")
+		return
+	}
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	for name, n := range failures {
+		if prev := c.insertFailures[name]; n > prev {
+			log.WithFields(log.Fields{
+				"map":      name,
+				"failures": n - prev,
+			}).Warn("BPF programs failed to insert entries into a map, it is probably full.")
+		}
+		c.insertFailures[name] = n
+	}
+}
+
+func closeMap(m bpf.Map) {
+	if closer, ok := m.(io.Closer); ok {
+		if err := closer.Close(); err != nil {
+			log.WithError(err).WithField("map", m.GetName()).Warn("Failed to close BPF map.")
+		}
+	}
+}
+
+// checkWatermark warns once when the map goes above the high watermark, and notes when it
+// goes back below it, with some hysteresis so that a map hovering around the watermark
+// does not flood the log.
+func (c *Collector) checkWatermark(wm *watchedMap) {
+	if wm.maxEntries <= 0 || wm.lru {
+		return
+	}
+	ratio := float64(wm.entries) / float64(wm.maxEntries)
+	logCxt := log.WithFields(log.Fields{
+		"map":        wm.name,
+		"entries":    wm.entries,
+		"maxEntries": wm.maxEntries,
+	})
+	if !wm.aboveWatermark && ratio >= c.highWatermark {
+		logCxt.Warn("BPF map is nearly full, it needs to be resized before the BPF programs " +
+			"fail to insert entries.")
+		wm.aboveWatermark = true
+	} else if wm.aboveWatermark && ratio < c.highWatermark*0.9 {
+		logCxt.Info("BPF map is back below its high watermark.")
+		wm.aboveWatermark = false
+	}
+}
+
+// Start starts scanning the maps periodically.
+func (c *Collector) Start() {
+	c.wg.Add(1)
+	go func() {
+		defer c.wg.Done()
+
+		if c.startAfter != nil {
+			select {
+			case <-c.startAfter:
+			case <-c.stopCh:
+				return
+			}
+		}
+
+		ticker := jitter.NewTicker(ScanPeriod, ScanPeriod/10)
+		defer ticker.Stop()
+
+		for {
+			c.Scan()
+
+			select {
+			case <-ticker.C:
+			case <-c.stopCh:
+				return
+			}
+		}
+	}()
+}
+
+// Stop stops the Collector and waits for it finishing.
+func (c *Collector) Stop() {
+	c.stopOnce.Do(func() {
+		close(c.stopCh)
+		c.wg.Wait()
+	})
+}
+
+// Describe implements prometheus.Collector.
+func (c *Collector) Describe(ch chan<- *prometheus.Desc) {
+	ch <- entriesDesc
+	ch <- maxEntriesDesc
+	ch <- insertFailuresDesc
+}
+
+// Collect implements prometheus.Collector, it reports the results of the last scan.
+func (c *Collector) Collect(ch chan<- prometheus.Metric) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+
+	for _, wm := range c.maps {
+		if !wm.scanned {
+			continue
+		}
+		ch <- prometheus.MustNewConstMetric(entriesDesc, prometheus.GaugeValue, float64(wm.entries), wm.name)
+		ch <- prometheus.MustNewConstMetric(maxEntriesDesc, prometheus.GaugeValue, float64(wm.maxEntries), wm.name)
+	}
+	for name, n := range c.insertFailures {
+		ch <- prometheus.MustNewConstMetric(insertFailuresDesc, prometheus.CounterValue, float64(n), name)
+	}
+}
@@ -0,0 +1,144 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package mapstats
+
+import (
+	"encoding/binary"
+	"fmt"
+	"sync"
+	"testing"
+
+	. "github.com/onsi/gomega"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/mock"
+)
+
+func TestCollector(t *testing.T) {
+	RegisterTestingT(t)
+
+	params := bpf.MapParameters{
+		Name:       "cali_v4_test",
+		Type:       "hash",
+		KeySize:    4,
+		ValueSize:  4,
+		MaxEntries: 100,
+	}
+	m := mock.NewMockMap(params)
+	missingParams := params
+	missingParams.Name = "cali_v4_missing"
+	lruParams := params
+	lruParams.Name = "cali_v4_lru"
+	lruParams.Type = "lru_hash"
+	lru := mock.NewMockMap(lruParams)
+
+	errParams := ErrMapParams
+	errParams.ValueSize = 2 * 8
+	errMap := mock.NewMockMap(errParams)
+	for id := 0; id < NumMapIDs; id++ {
+		Expect(errMap.Update(errKey(id), make([]byte, errParams.ValueSize))).To(Succeed())
+	}
+
+	c := NewCollector(0.8)
+	pinned := map[string]bpf.Map{params.Name: m, errParams.Name: errMap}
+	c.openMap = func(p bpf.MapParameters) (bpf.Map, error) {
+		if m := pinned[p.Name]; m != nil {
+			return m, nil
+		}
+		return nil, fmt.Errorf("no such map")
+	}
+	c.AddMap(params)
+	c.AddMap(missingParams)
+	c.AddMap(lruParams)
+
+	for i := 0; i < 85; i++ {
+		Expect(m.Update([]byte{byte(i), 0, 0, 0}, []byte{0, 0, 0, 0})).To(Succeed())
+	}
+	for i := 0; i < 100; i++ {
+		Expect(lru.Update([]byte{byte(i), 0, 0, 0}, []byte{0, 0, 0, 0})).To(Succeed())
+	}
+	v := make([]byte, errParams.ValueSize)
+	binary.LittleEndian.PutUint64(v[0:], 2)
+	binary.LittleEndian.PutUint64(v[8:], 3)
+	Expect(errMap.Update(errKey(MapIDCT), v)).To(Succeed())
+
+	c.Scan()
+	Expect(c.maps[0].scanned).To(BeTrue())
+	Expect(c.maps[0].entries).To(Equal(85))
+	Expect(c.maps[0].aboveWatermark).To(BeTrue())
+	Expect(c.maps[1].scanned).To(BeFalse())
+	Expect(c.maps[2].scanned).To(BeFalse(), "the LRU map isn't pinned yet")
+	Expect(c.insertFailures["cali_v4_ct"]).To(Equal(uint64(5)))
+	Expect(c.insertFailures["cali_v4_arp"]).To(BeZero())
+
+	// Just below the watermark is not enough to clear it.
+	for i := 0; i < 10; i++ {
+		Expect(m.Delete([]byte{byte(i), 0, 0, 0})).To(Succeed())
+	}
+	c.Scan()
+	Expect(c.maps[0].aboveWatermark).To(BeTrue())
+	for i := 10; i < 15; i++ {
+		Expect(m.Delete([]byte{byte(i), 0, 0, 0})).To(Succeed())
+	}
+	c.Scan()
+	Expect(c.maps[0].entries).To(Equal(70))
+	Expect(c.maps[0].aboveWatermark).To(BeFalse())
+
+	// Once the map is created, it is picked up; being full is normal for an LRU map.
+	pinned[lruParams.Name] = lru
+	c.Scan()
+	Expect(c.maps[2].scanned).To(BeTrue())
+	Expect(c.maps[2].entries).To(Equal(100))
+	Expect(c.maps[2].aboveWatermark).To(BeFalse())
+
+	// When the map is replaced and re-pinned, the new one is counted.
+	resized := mock.NewMockMap(params)
+	for i := 0; i < 3; i++ {
+		Expect(resized.Update([]byte{byte(i), 0, 0, 0}, []byte{0, 0, 0, 0})).To(Succeed())
+	}
+	pinned[params.Name] = resized
+	c.Scan()
+	Expect(c.maps[0].entries).To(Equal(3))
+}
+
+func TestCollectorWaitsForMaps(t *testing.T) {
+	RegisterTestingT(t)
+
+	params := bpf.MapParameters{Name: "cali_v4_test", Type: "hash", KeySize: 4, ValueSize: 4, MaxEntries: 100}
+	c := NewCollector(0.8)
+	var lock sync.Mutex
+	opened := 0
+	c.openMap = func(p bpf.MapParameters) (bpf.Map, error) {
+		lock.Lock()
+		defer lock.Unlock()
+		opened++
+		return mock.NewMockMap(p), nil
+	}
+	c.AddMap(params)
+	created := make(chan struct{})
+	c.StartAfter(created)
+	c.Start()
+	defer c.Stop()
+
+	numOpened := func() int {
+		lock.Lock()
+		defer lock.Unlock()
+		return opened
+	}
+	Consistently(numOpened, "100ms", "10ms").Should(BeZero())
+	close(created)
+	// The map and the insert failures map.
+	Eventually(numOpened).Should(Equal(2))
+}
@@ -0,0 +1,84 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Package mapstats exports the occupancy of the BPF maps and the number of entries that the
+// BPF programs failed to insert into them, and warns when a map is nearly full.
+package mapstats
+
+import (
+	"encoding/binary"
+
+	"github.com/projectcalico/felix/bpf"
+)
+
+// The insert failure map is a per-CPU array of counters, indexed by the IDs below, that the
+// programs increment when they fail to insert an entry into a map.
+//
+// WARNING: must be kept in sync with the definitions in bpf-gpl/mapstats.h.
+const (
+	MapIDCT = iota
+	MapIDNATAffinity
+	MapIDARP
+	MapIDSendRecvMsg
+	MapIDCTNATs
+	MapIDFlowCounters
+
+	NumMapIDs
+)
+
+// mapIDNames are the (unversioned) names of the maps with insert failure counters.
+var mapIDNames = [NumMapIDs]string{
+	"cali_v4_ct",
+	"cali_v4_nat_aff",
+	"cali_v4_arp",
+	"cali_v4_srmsg",
+	"cali_v4_ct_nats",
+	"cali_v4_flow_ctrs",
+}
+
+var ErrMapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_map_errs",
+	Type:       "percpu_array",
+	KeySize:    4,
+	ValueSize:  8,
+	MaxEntries: NumMapIDs,
+	Name:       "cali_v4_map_errs",
+}
+
+func ErrMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(ErrMapParams)
+}
+
+func errKey(id int) []byte {
+	k := make([]byte, 4)
+	binary.LittleEndian.PutUint32(k, uint32(id))
+	return k
+}
+
+// readInsertFailures returns the insert failures of each map, summed over all CPUs.
+func readInsertFailures(errMap bpf.Map) (map[string]uint64, error) {
+	failures := map[string]uint64{}
+	for id := 0; id < NumMapIDs; id++ {
+		v, err := errMap.Get(errKey(id))
+		if err != nil {
+			return nil, err
+		}
+		var sum uint64
+		for ; len(v) >= 8; v = v[8:] {
+			sum += binary.LittleEndian.Uint64(v)
+		}
+		failures[mapIDNames[id]] = sum
+	}
+	return failures, nil
+}
@@ -35,6 +35,8 @@ type Map struct {
 	IterErr   error
 	UpdateErr error
 	DeleteErr error
+	// KeyErrs makes Update and Delete of the keys in it fail with the given error.
+	KeyErrs map[string]error
 }
 
 func (m *Map) MapFD() bpf.MapFD {
@@ -80,6 +82,9 @@ func (m *Map) Update(k, v []byte) error {
 	if m.UpdateErr != nil {
 		return m.UpdateErr
 	}
+	if err := m.KeyErrs[string(k)]; err != nil {
+		return err
+	}
 
 	if len(k) != m.KeySize {
 		m.logCxt.Panicf("Key had wrong size (%d)", len(k))
@@ -107,6 +112,9 @@ func (m *Map) Delete(k []byte) error {
 	if m.DeleteErr != nil {
 		return m.DeleteErr
 	}
+	if err := m.KeyErrs[string(k)]; err != nil {
+		return err
+	}
 
 	if len(k) != m.KeySize {
 		m.logCxt.Panicf("Key had wrong size (%d)", len(k))
@@ -141,6 +149,50 @@ func NewMockMap(params bpf.MapParameters) *Map {
 
 var _ bpf.Map = (*Map)(nil)
 
+// BatchMap is a Map that implements the batch operations.  If BatchErr is set, they fail
+// without touching the map and report BatchErrCount entries as processed, like a broken
+// kernel binding would.
+type BatchMap struct {
+	*Map
+
+	BatchCount int
+
+	BatchErr      error
+	BatchErrCount int
+}
+
+func (m *BatchMap) UpdateBatch(ks, vs [][]byte) (int, error) {
+	m.BatchCount++
+	if m.BatchErr != nil {
+		return m.BatchErrCount, m.BatchErr
+	}
+	for i := range ks {
+		if err := m.Update(ks[i], vs[i]); err != nil {
+			return i, err
+		}
+	}
+	return len(ks), nil
+}
+
+func (m *BatchMap) DeleteBatch(ks [][]byte) (int, error) {
+	m.BatchCount++
+	if m.BatchErr != nil {
+		return m.BatchErrCount, m.BatchErr
+	}
+	for i := range ks {
+		if err := m.Delete(ks[i]); err != nil {
+			return i, err
+		}
+	}
+	return len(ks), nil
+}
+
+func NewMockBatchMap(params bpf.MapParameters) *BatchMap {
+	return &BatchMap{Map: NewMockMap(params)}
+}
+
+var _ bpf.BatchMap = (*BatchMap)(nil)
+
 type DummyMap struct{}
 
 func (*DummyMap) GetName() string {
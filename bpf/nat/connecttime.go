@@ -16,7 +16,6 @@ package nat
 
 import (
 	"encoding/json"
-	"fmt"
 	"os"
 	"os/exec"
 	"path"
@@ -27,6 +26,8 @@ import (
 	log "github.com/sirupsen/logrus"
 
 	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/eventlog"
+	"github.com/projectcalico/felix/bpf/mapstats"
 )
 
 type cgroupProgs struct {
@@ -84,7 +85,7 @@ func RemoveConnectTimeLoadBalancer(cgroupv2 string) error {
 	return nil
 }
 
-func installProgram(name, ipver, bpfMount, cgroupPath, logLevel string, maps ...bpf.Map) error {
+func installProgram(name, ipver, bpfMount, cgroupPath string, maps ...bpf.Map) error {
 
 	progPinDir := path.Join(bpfMount, "calico_connect4")
 	_ = os.RemoveAll(progPinDir)
@@ -92,9 +93,9 @@ func installProgram(name, ipver, bpfMount, cgroupPath, logLevel string, maps ...
 	var filename string
 
 	if ipver == "6" {
-		filename = path.Join(bpf.ObjectDir, ProgFileName(logLevel, 6))
+		filename = path.Join(bpf.ObjectDir, ProgFileName(6))
 	} else {
-		filename = path.Join(bpf.ObjectDir, ProgFileName(logLevel, 4))
+		filename = path.Join(bpf.ObjectDir, ProgFileName(4))
 	}
 	args := []string{"prog", "loadall", filename, progPinDir, "type", "cgroup/" + name + ipver}
 	for _, m := range maps {
@@ -127,7 +128,7 @@ out:
 	return nil
 }
 
-func InstallConnectTimeLoadBalancer(frontendMap, backendMap, rtMap bpf.Map, cgroupv2 string, logLevel string) error {
+func InstallConnectTimeLoadBalancer(frontendMap, backendMap, rtMap bpf.Map, cgroupv2 string) error {
 	bpfMount, err := bpf.MaybeMountBPFfs()
 	if err != nil {
 		log.WithError(err).Error("Failed to mount bpffs, unable to do connect-time load balancing")
@@ -159,29 +160,59 @@ func InstallConnectTimeLoadBalancer(frontendMap, backendMap, rtMap bpf.Map, cgro
 		return errors.WithMessage(err, "failed to create all-NATs BPF Map")
 	}
 
-	maps := []bpf.Map{frontendMap, backendMap, rtMap, sendrecvMap, allNATsMap}
+	logMap := eventlog.Map(&bpf.MapContext{
+		RepinningEnabled: repin,
+	})
+	err = logMap.EnsureExists()
+	if err != nil {
+		return errors.WithMessage(err, "failed to create log BPF Map")
+	}
+	cgroupLogMap := eventlog.CgroupMap(&bpf.MapContext{
+		RepinningEnabled: repin,
+	})
+	err = cgroupLogMap.EnsureExists()
+	if err != nil {
+		return errors.WithMessage(err, "failed to create cgroup log BPF Map")
+	}
+	logLevelMap := eventlog.LevelMap(&bpf.MapContext{
+		RepinningEnabled: repin,
+	})
+	err = logLevelMap.EnsureExists()
+	if err != nil {
+		return errors.WithMessage(err, "failed to create log level BPF Map")
+	}
+
+	mapErrMap := mapstats.ErrMap(&bpf.MapContext{
+		RepinningEnabled: repin,
+	})
+	err = mapErrMap.EnsureExists()
+	if err != nil {
+		return errors.WithMessage(err, "failed to create map insert failures BPF Map")
+	}
+
+	maps := []bpf.Map{frontendMap, backendMap, rtMap, sendrecvMap, allNATsMap, logMap, cgroupLogMap, logLevelMap, mapErrMap}
 
-	err = installProgram("connect", "4", bpfMount, cgroupPath, logLevel, maps...)
+	err = installProgram("connect", "4", bpfMount, cgroupPath, maps...)
 	if err != nil {
 		return err
 	}
 
-	err = installProgram("sendmsg", "4", bpfMount, cgroupPath, logLevel, maps...)
+	err = installProgram("sendmsg", "4", bpfMount, cgroupPath, maps...)
 	if err != nil {
 		return err
 	}
 
-	err = installProgram("recvmsg", "4", bpfMount, cgroupPath, logLevel, maps...)
+	err = installProgram("recvmsg", "4", bpfMount, cgroupPath, maps...)
 	if err != nil {
 		return err
 	}
 
-	err = installProgram("sendmsg", "6", bpfMount, cgroupPath, logLevel)
+	err = installProgram("sendmsg", "6", bpfMount, cgroupPath, logMap, cgroupLogMap, logLevelMap)
 	if err != nil {
 		return err
 	}
 
-	err = installProgram("recvmsg", "6", bpfMount, cgroupPath, logLevel, sendrecvMap)
+	err = installProgram("recvmsg", "6", bpfMount, cgroupPath, sendrecvMap, logMap, cgroupLogMap, logLevelMap)
 	if err != nil {
 		return err
 	}
@@ -189,17 +220,12 @@ func InstallConnectTimeLoadBalancer(frontendMap, backendMap, rtMap bpf.Map, cgro
 	return nil
 }
 
-func ProgFileName(logLevel string, ipver int) string {
-	logLevel = strings.ToLower(logLevel)
-	if logLevel == "off" {
-		logLevel = "no_log"
-	}
-
+func ProgFileName(ipver int) string {
 	switch ipver {
 	case 4:
-		return fmt.Sprintf("connect_time_%s_v4.o", logLevel)
+		return "connect_time_v4.o"
 	case 6:
-		return fmt.Sprintf("connect_time_%s_v6.o", logLevel)
+		return "connect_time_v6.o"
 	}
 
 	log.WithField("ipver", ipver).Fatal("Invalid IP version")
@@ -0,0 +1,60 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package polprog
+
+import (
+	"crypto/sha256"
+	"encoding/base64"
+	"sort"
+	"strings"
+
+	"github.com/projectcalico/felix/proto"
+	"github.com/projectcalico/felix/rules"
+)
+
+// cidrSetIDPrefix is the prefix of the IDs of the synthetic IP sets that hold spilled CIDR
+// lists.  It doesn't clash with the prefixes used by the calculation graph.
+const cidrSetIDPrefix = "cidrs:"
+
+// CIDRSetID returns the ID of the synthetic IP set that holds the given list of CIDRs.  The ID
+// depends only on the content of the list so rules that use the same list share the set.
+func CIDRSetID(cidrs []string) string {
+	sorted := make([]string, len(cidrs))
+	copy(sorted, cidrs)
+	sort.Strings(sorted)
+	hash := sha256.Sum224([]byte(strings.Join(sorted, ",")))
+	return cidrSetIDPrefix + base64.RawURLEncoding.EncodeToString(hash[:])
+}
+
+// SpilledCIDRLists returns the IPv4 CIDR lists of the rule that a builder configured with
+// WithCIDRSetThreshold(threshold) matches with an IP set lookup.  The IP sets (named by
+// CIDRSetID) must be programmed before the policy program is loaded.
+func SpilledCIDRLists(r *proto.Rule, threshold int) [][]string {
+	if threshold <= 0 {
+		return nil
+	}
+	rule := rules.FilterRuleToIPVersion(4, r)
+	if rule == nil {
+		return nil
+	}
+
+	var lists [][]string
+	for _, cidrs := range [][]string{rule.SrcNet, rule.NotSrcNet, rule.DstNet, rule.NotDstNet} {
+		if len(cidrs) > threshold {
+			lists = append(lists, cidrs)
+		}
+	}
+	return lists
+}
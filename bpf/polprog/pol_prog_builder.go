@@ -18,11 +18,13 @@ import (
 	"fmt"
 	"math"
 	"math/bits"
+	"sort"
 	"strings"
 
 	"github.com/projectcalico/felix/bpf/ipsets"
 
 	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/counters"
 
 	log "github.com/sirupsen/logrus"
 
@@ -44,19 +46,196 @@ type Builder struct {
 	ipSetMapFD bpf.MapFD
 	stateMapFD bpf.MapFD
 	jumpMapFD  bpf.MapFD
+
+	// ipSetHashMapFD is the hash map of the exact-match IP set members, only used if
+	// ipSetMemberKinds is set, see WithIPSetHashMap.
+	ipSetHashMapFD   bpf.MapFD
+	ipSetMemberKinds ipSetMemberKinds
+
+	// ruleCounterMapFD is the per-CPU array of rule counters, only used if
+	// ruleCounterIdxProvider is set, see WithRuleCounters.
+	ruleCounterMapFD       bpf.MapFD
+	ruleCounterIdxProvider ruleCounterIdxProvider
+
+	// verdictCounterMapFD is the per-CPU array of verdict counters, only used if
+	// countVerdicts is set, see WithVerdictCounters.
+	verdictCounterMapFD bpf.MapFD
+	verdictHook         counters.Hook
+	countVerdicts       bool
+
+	// flatRules disables the grouping of rules into a decision tree, each rule is then
+	// evaluated on its own.
+	flatRules bool
+	// noOptimizer disables the optimization of the generated bytecode, see Block.Optimize.
+	noOptimizer bool
+	// cidrSetThreshold is the number of CIDRs above which a CIDR match is done with a lookup
+	// in a synthetic IP set rather than inline, 0 to always match inline.
+	cidrSetThreshold int
+	groupID          int
+	// groupLabelPrefix is set while emitting the shared match criteria of a group of rules,
+	// match criteria then jump to the end of the group (rather than the end of the rule)
+	// if they do not match.
+	groupLabelPrefix string
+
+	// maxInsnsPerProgram is the (soft) limit on the size of each program of the policy
+	// program chain, 0 to always emit a single program.
+	maxInsnsPerProgram int
+	// programPerTier makes each tier, and the profiles, start a new program of the chain.
+	programPerTier bool
+	forXDP         bool
+	// chainSlotSet is the set of jump map slots that the programs of the chain after the
+	// first one go in, see WithChainSlotSet.
+	chainSlotSet int
+	// sharedProgArrayFD is the prog array that the programs of a chain that is shared between
+	// endpoints are in, only used if sharedProgs is set, see WithSharedProgArray.
+	sharedProgArrayFD bpf.MapFD
+	sharedProgs       bool
+	// blocks holds the completed programs of the chain, b is the program being written.
+	blocks []*Block
+	// progStartInsns is the number of instructions in b before any policy was written to it.
+	progStartInsns int
+	// labelProgIdx maps the labels that may be the target of a jump from an earlier program
+	// of the chain to the index of the program that defines them.
+	labelProgIdx map[string]int
 }
 
 type ipSetIDProvider interface {
 	GetNoAlloc(ipSetID string) uint64
 }
 
-func NewBuilder(ipSetIDProvider ipSetIDProvider, ipsetMapFD, stateMapFD, jumpMapFD bpf.MapFD) *Builder {
+type ipSetMemberKinds interface {
+	// MemberKinds returns whether the IP set may have exact-match members, which are in the
+	// hash map, and whether it may have CIDR members, which are in the LPM trie.
+	MemberKinds(ipSetID string) (exact, cidr bool)
+}
+
+type ruleCounterIdxProvider interface {
+	// RuleCounterIndex returns the index of the counters of the rule with the given ID in
+	// the rule counter map, false if the rule is not counted.
+	RuleCounterIndex(ruleID string) (uint32, bool)
+}
+
+type Option func(b *Builder)
+
+// WithFlatRules makes the builder emit each rule as an independent sequence of checks,
+// without grouping rules that share match criteria.
+func WithFlatRules() Option {
+	return func(b *Builder) {
+		b.flatRules = true
+	}
+}
+
+// WithoutOptimizer makes the builder emit the bytecode as generated, without running the
+// optimizer over it.
+func WithoutOptimizer() Option {
+	return func(b *Builder) {
+		b.noOptimizer = true
+	}
+}
+
+// WithCIDRSetThreshold makes the builder match lists of more than threshold CIDRs against the
+// synthetic IP set named by CIDRSetID, instead of emitting a comparison per CIDR.  The caller
+// is responsible for creating the IP sets, see SpilledCIDRLists.
+func WithCIDRSetThreshold(threshold int) Option {
+	return func(b *Builder) {
+		b.cidrSetThreshold = threshold
+	}
+}
+
+// WithMaxInsnsPerProgram makes the builder split the policy program into a chain of programs
+// of (roughly) at most maxInsns instructions each, see Programs.
+func WithMaxInsnsPerProgram(maxInsns int) Option {
+	return func(b *Builder) {
+		b.maxInsnsPerProgram = maxInsns
+	}
+}
+
+// WithRuleCounters makes the builder emit code that, when a rule matches, increments the
+// packet and byte counters of the rule in the given per-CPU array map (see bpf/counters).
+// The index of the counters of each rule comes from idxProvider.  Log rules, which are
+// otherwise skipped, are then emitted too so that they can be counted.
+func WithRuleCounters(mapFD bpf.MapFD, idxProvider ruleCounterIdxProvider) Option {
+	return func(b *Builder) {
+		b.ruleCounterMapFD = mapFD
+		b.ruleCounterIdxProvider = idxProvider
+	}
+}
+
+// WithVerdictCounters makes the builder emit code that counts the packets that the policy
+// program drops (and, for XDP, the packets that it passes) in the verdict counter map (see
+// bpf/counters), as the programs of the given hook would.  Packets that the policy allows
+// are counted by the program that the policy program tail calls.
+func WithVerdictCounters(mapFD bpf.MapFD, hook counters.Hook) Option {
+	return func(b *Builder) {
+		b.verdictCounterMapFD = mapFD
+		b.verdictHook = hook
+		b.countVerdicts = true
+	}
+}
+
+// WithIPSetHashMap tells the builder that the exact-match members of the IP sets (/32s and
+// named ports) are in the given hash map, and only their CIDR members are in the LPM trie.
+// An IP set match then looks up the hash map and/or the LPM trie, according to the kinds of
+// members that the set has when the program is built; the caller must rebuild the programs
+// that use a set when its member kinds change.
+func WithIPSetHashMap(mapFD bpf.MapFD, memberKinds ipSetMemberKinds) Option {
+	return func(b *Builder) {
+		b.ipSetHashMapFD = mapFD
+		b.ipSetMemberKinds = memberKinds
+	}
+}
+
+// WithProgramPerTier makes the builder start a new program of the policy program chain for
+// each tier and for the profiles.  A change to the policies of one tier then only changes the
+// program(s) of that tier, so, if the caller skips loading unchanged programs, only those
+// have to go through the verifier again.  If that would make the chain longer than
+// MaxPolicyChainLen, the builder packs the tiers as usual instead.
+func WithProgramPerTier() Option {
+	return func(b *Builder) {
+		b.programPerTier = true
+	}
+}
+
+// WithChainSlotSet makes the builder put the programs of the chain after the first one in
+// the given set of jump map slots, 0 to PolicyChainSlotSets-1.  The first program always
+// goes in the policy slot, which the main program tail calls.  Updating a chain that is in
+// one set by writing the new chain to the other one and then replacing the first program
+// switches the whole chain at once.
+//
+// Only the first program depends on the slot set: it records the set's base index in the
+// state and the other programs tail call relative to it, so a program that is unchanged can
+// be moved to the other set as it is, without loading it again.
+func WithChainSlotSet(slotSet int) Option {
+	return func(b *Builder) {
+		b.chainSlotSet = slotSet
+	}
+}
+
+// WithSharedProgArray makes the builder emit a chain of programs that doesn't depend on the
+// endpoint, so that the endpoints that have the same rules can share it.  The programs of the
+// chain go at consecutive indexes of the given prog array (rather than in the endpoint's
+// jump map) and the chain enters, and returns to, the endpoint's own programs through the
+// trampolines returned by EntryTrampoline and ReturnTrampoline.  The programs don't depend on
+// where the chain is either, so the chains of two sets of rules are the same if, and only
+// if, their programs are, and a program that two chains have in common can be in both
+// without being loaded twice.  Only for TC programs.
+func WithSharedProgArray(mapFD bpf.MapFD) Option {
+	return func(b *Builder) {
+		b.sharedProgArrayFD = mapFD
+		b.sharedProgs = true
+	}
+}
+
+func NewBuilder(ipSetIDProvider ipSetIDProvider, ipsetMapFD, stateMapFD, jumpMapFD bpf.MapFD, opts ...Option) *Builder {
 	b := &Builder{
 		ipSetIDProvider: ipSetIDProvider,
 		ipSetMapFD:      ipsetMapFD,
 		stateMapFD:      stateMapFD,
 		jumpMapFD:       jumpMapFD,
 	}
+	for _, o := range opts {
+		o(b)
+	}
 	return b
 }
 
@@ -82,6 +261,7 @@ var (
 	offStateKey    = nextOffset(4, 4)
 	offSrcIPSetKey = nextOffset(ipsets.IPSetEntrySize, 8)
 	offDstIPSetKey = nextOffset(ipsets.IPSetEntrySize, 8)
+	offRuleCtrKey  = nextOffset(counters.RuleKeySize, 4)
 
 	// Offsets within the cal_tc_state struct.
 	// WARNING: must be kept in sync with the definitions in bpf/include/jump.h.
@@ -100,6 +280,8 @@ var (
 	stateOffPostNATDstPort int16 = stateEventHdrSize + 30
 	stateOffIPProto        int16 = stateEventHdrSize + 32
 	stateOffFlags          int16 = stateEventHdrSize + 33
+	stateOffPolRetIdx      int16 = stateEventHdrSize + 88
+	stateOffPolChainBase   int16 = stateEventHdrSize + 92
 
 	// Compile-time check that IPSetEntrySize hasn't changed; if it changes, the code will need to change.
 	_ = [1]struct{}{{}}[20-ipsets.IPSetEntrySize]
@@ -114,6 +296,9 @@ var (
 	ipsKeyProto  int16 = 18
 	ipsKeyPad    int16 = 19
 
+	// Offsets within struct __sk_buff, the context of a TC program.
+	skbOffLen int16 = 0
+
 	// Bits in the state flags field.
 	FlagDestIsHost uint8 = 1 << 2
 	FlagSrcIsHost  uint8 = 1 << 3
@@ -175,9 +360,44 @@ const (
 	TierEndPass  TierEndAction = "pass"
 )
 
+// Instructions returns the policy program for the given rules.  It fails if the builder
+// was configured to split the program and the rules do not fit in a single program.
 func (p *Builder) Instructions(rules Rules) (Insns, error) {
+	progs, err := p.Programs(rules)
+	if err != nil {
+		return nil, err
+	}
+	if len(progs) != 1 {
+		return nil, fmt.Errorf("policy program split into %d programs", len(progs))
+	}
+	return progs[0], nil
+}
+
+// Programs returns the policy program for the given rules as a chain of programs.  Unless
+// the builder was given a limit with WithMaxInsnsPerProgram, the chain has a single
+// program.  Program i of the chain must be installed in the jump map at index
+// PolicyChainJumpIndex(i, slotSet), where slotSet is the one given to WithChainSlotSet;
+// the programs pass control to each other with tail calls and
+// share their state through the state map.
+func (p *Builder) Programs(rules Rules) ([]Insns, error) {
+	p.writeChain(rules)
+	if p.programPerTier && len(p.blocks) > MaxPolicyChainLen {
+		log.Debugf("A program per tier needs %d programs, packing the tiers instead", len(p.blocks))
+		p.programPerTier = false
+		defer func() { p.programPerTier = true }()
+		p.writeChain(rules)
+	}
+	return p.assembleChain()
+}
+
+// writeChain writes the blocks of the policy program chain for the given rules.
+func (p *Builder) writeChain(rules Rules) {
 	p.b = NewBlock()
+	p.blocks = nil
+	p.labelProgIdx = map[string]int{}
+	p.forXDP = rules.ForXDP
 	p.writeProgramHeader()
+	p.progStartInsns = p.b.NumInsns()
 
 	if rules.ForXDP {
 		// For an XDP program HostNormalTiers continues the untracked policy to enforce;
@@ -220,7 +440,7 @@ func (p *Builder) Instructions(rules Rules) (Insns, error) {
 normalPolicy:
 	if !rules.SuppressNormalHostPolicy {
 		// "Normal" host policy, i.e. for non-forwarded traffic.
-		p.b.LabelNextInsn("to_or_from_host")
+		p.labelTarget("to_or_from_host")
 		if rules.ForXDP {
 			p.writeTiers(rules.HostNormalTiers, legDestPreNAT, "allowed_by_host_policy")
 			p.b.Jump("xdp_pass")
@@ -231,7 +451,7 @@ normalPolicy:
 	}
 
 	// End of host policy.
-	p.b.LabelNextInsn("allowed_by_host_policy")
+	p.labelTarget("allowed_by_host_policy")
 
 	if rules.ForHostInterface {
 		// On a host interface there is no workload policy, so we are now done.
@@ -243,12 +463,13 @@ normalPolicy:
 	}
 
 	p.writeProgramFooter(rules.ForXDP)
-	return p.b.Assemble()
+	p.blocks = append(p.blocks, p.b)
 }
 
 // writeProgramHeader emits instructions to load the state from the state map, leaving
 // R6 = program context
 // R9 = pointer to state map
+// The rest of the program doesn't use R7 and R8, the optimizer caches promoted loads in them.
 func (p *Builder) writeProgramHeader() {
 	// Preamble to the policy program.
 	p.b.LabelNextInsn("start")
@@ -270,15 +491,46 @@ func (p *Builder) writeProgramHeader() {
 	p.b.LabelNextInsn("policy")
 }
 
+// WARNING: must be kept in sync with the definitions in bpf-gpl/jump.h.
 const (
 	jumpIdxPolicy = iota
 	jumpIdxAllowed
 	jumpIdxICMP
+	jumpIdxDenied
 
-	_ = jumpIdxPolicy
 	_ = jumpIdxICMP
+
+	jumpIdxPolicyChain = 8
 )
 
+// MaxPolicyChainLen is the maximum number of programs in a policy program chain.  Together
+// with the tail calls from the main program into the chain and from the chain to the
+// allowed program (and, for a shared chain, through the trampolines, see EntryTrampoline),
+// the chain must stay within the kernel's limit of 32 tail calls.
+const MaxPolicyChainLen = 25
+
+// PolicyChainSlotSets is the number of sets of jump map slots for the programs of the chain
+// after the first one.  With two sets, a new chain can be written next to the one in use,
+// see WithChainSlotSet.  Together they must fit in the jump map (cali_jump in
+// bpf-gpl/jump.h).
+const PolicyChainSlotSets = 2
+
+// PolicyChainJumpIndex returns the jump map index of program i of the policy program chain
+// when the chain is in the given slot set.
+func PolicyChainJumpIndex(i, slotSet int) int {
+	if i == 0 {
+		return jumpIdxPolicy
+	}
+	return policyChainBase(slotSet) + i
+}
+
+// policyChainBase returns the index that the programs of the chain in the given slot set
+// are at an offset from.  Program 0, which is outside the slot set, is never tail called
+// through it.
+func policyChainBase(slotSet int) int {
+	return jumpIdxPolicyChain + slotSet*(MaxPolicyChainLen-1) - 1
+}
+
 func (p *Builder) writeJumpIfToOrFromHost(label string) {
 	// Load state flags.
 	p.b.Load8(R1, R9, stateOffFlags)
@@ -298,6 +550,22 @@ func (p *Builder) writeProgramFooter(forXDP bool) {
 	// Store the policy result in the state for the next program to see.
 	p.b.MovImm32(R1, int32(state.PolicyDeny))
 	p.b.Store32(R9, R1, stateOffPolResult)
+	if p.countVerdicts {
+		p.writeCounterIncrement(p.verdictCounterMapFD,
+			counters.VerdictIndex(p.verdictHook, counters.ReasonPolicy, true), "deny_counted")
+	}
+	// Tail call the endpoint's denied program, which samples the packet and drops it.  A
+	// shared chain goes through the endpoint's return trampoline, which checks the policy
+	// result.  If the tail call fails, we drop the packet here.
+	p.b.Mov64(R1, R6)
+	if p.sharedProgs {
+		p.b.LoadMapFD(R2, uint32(p.sharedProgArrayFD))
+		p.b.Load32(R3, R9, stateOffPolRetIdx)
+	} else {
+		p.b.LoadMapFD(R2, uint32(p.jumpMapFD))
+		p.b.MovImm32(R3, int32(jumpIdxDenied))
+	}
+	p.b.Call(HelperTailCall)
 
 	if forXDP {
 		p.b.LabelNextInsn("exit")
@@ -310,6 +578,10 @@ func (p *Builder) writeProgramFooter(forXDP bool) {
 
 	if forXDP {
 		p.b.LabelNextInsn("xdp_pass")
+		if p.countVerdicts {
+			p.writeCounterIncrement(p.verdictCounterMapFD,
+				counters.VerdictIndex(p.verdictHook, counters.ReasonPolicy, false), "xdp_pass_counted")
+		}
 		p.b.MovImm64(R0, 2 /* XDP_PASS */)
 		p.b.Exit()
 	}
@@ -319,35 +591,68 @@ func (p *Builder) writeProgramFooter(forXDP bool) {
 		// Store the policy result in the state for the next program to see.
 		p.b.MovImm32(R1, int32(state.PolicyAllow))
 		p.b.Store32(R9, R1, stateOffPolResult)
-		// Execute the tail call.
-		p.b.Mov64(R1, R6)                      // First arg is the context.
-		p.b.LoadMapFD(R2, uint32(p.jumpMapFD)) // Second arg is the map.
-		p.b.MovImm32(R3, jumpIdxAllowed)       // Third arg is the index (rather than a pointer to the index).
-		p.b.Call(HelperTailCall)
-
-		// Fall through if tail call fails.
-		p.b.MovImm32(R1, state.PolicyTailCallFailed)
-		p.b.Store32(R9, R1, stateOffPolResult)
-		p.b.MovImm64(R0, 2 /* TC_ACT_SHOT */)
-		p.b.Exit()
+		if p.sharedProgs {
+			// Return to the endpoint through the slot that its entry trampoline recorded.
+			p.b.Mov64(R1, R6)
+			p.b.LoadMapFD(R2, uint32(p.sharedProgArrayFD))
+			p.b.Load32(R3, R9, stateOffPolRetIdx)
+			p.b.Call(HelperTailCall)
+			p.writeTailCallFailed()
+		} else {
+			p.writeTailCall(jumpIdxAllowed)
+		}
 	}
 }
 
-func (p *Builder) setUpIPSetKey(ipsetID uint64, keyOffset, ipOffset, portOffset int16) {
+// writeTailCall emits a tail call to the program at the given index of the jump map,
+// followed by the drop path for when the tail call fails.
+func (p *Builder) writeTailCall(jumpIdx int) {
+	p.writeTailCallToMap(p.jumpMapFD, jumpIdx)
+}
+
+// writeTailCallToMap emits a tail call to the program at the given index of the given prog
+// array, followed by the drop path for when the tail call fails.
+func (p *Builder) writeTailCallToMap(mapFD bpf.MapFD, idx int) {
+	p.b.Mov64(R1, R6)                // First arg is the context.
+	p.b.LoadMapFD(R2, uint32(mapFD)) // Second arg is the map.
+	p.b.MovImm32(R3, int32(idx))     // Third arg is the index (rather than a pointer to the index).
+	p.b.Call(HelperTailCall)
+	p.writeTailCallFailed()
+}
+
+// writeTailCallFailed emits the drop path that follows a tail call, for when it fails.
+func (p *Builder) writeTailCallFailed() {
+	p.b.MovImm32(R1, state.PolicyTailCallFailed)
+	p.b.Store32(R9, R1, stateOffPolResult)
+	p.b.MovImm64(R0, 2 /* TC_ACT_SHOT */)
+	p.b.Exit()
+}
+
+// setUpIPSetKey writes the IP set key for the given leg to the stack.  The port and protocol
+// are only filled in for named port sets; other sets only have address and CIDR members,
+// which the LPM trie matches whatever the port, but which are stored in the hash map with
+// zero port and protocol.
+func (p *Builder) setUpIPSetKey(ipsetID uint64, keyOffset int16, leg matchLeg, namedPort bool) {
 	// TODO track whether we've already done an initialisation and skip the parts that don't change.
 	// Zero the padding.
 	p.b.MovImm64(R1, 0) // R1 = 0
 	p.b.StoreStack8(R1, keyOffset+ipsKeyPad)
+	if !namedPort {
+		p.b.StoreStack16(R1, keyOffset+ipsKeyPort)
+		p.b.StoreStack8(R1, keyOffset+ipsKeyProto)
+	}
 	p.b.MovImm64(R1, 128) // R1 = 128
 	p.b.StoreStack32(R1, keyOffset+ipsKeyPrefix)
 
 	// Store the IP address, port and protocol.
-	p.b.Load32(R1, R9, ipOffset)
+	p.b.Load32(R1, R9, leg.offsetToStateIPAddressField())
 	p.b.StoreStack32(R1, keyOffset+ipsKeyAddr)
-	p.b.Load16(R1, R9, portOffset)
-	p.b.StoreStack16(R1, keyOffset+ipsKeyPort)
-	p.b.Load8(R1, R9, stateOffIPProto)
-	p.b.StoreStack8(R1, keyOffset+ipsKeyProto)
+	if namedPort {
+		p.b.Load16(R1, R9, leg.offsetToStatePortField())
+		p.b.StoreStack16(R1, keyOffset+ipsKeyPort)
+		p.b.Load8(R1, R9, stateOffIPProto)
+		p.b.StoreStack8(R1, keyOffset+ipsKeyProto)
+	}
 
 	// Store the IP set ID.  It is 64-bit but, since it's a packed struct, we have to write it in two
 	// 32-bit chunks.
@@ -369,8 +674,10 @@ func (p *Builder) writeTiers(tiers []Tier, destLeg matchLeg, allowLabel string)
 		actionLabels["next-tier"] = endOfTierLabel
 
 		log.Debugf("Start of tier %d %q", p.tierID, tier.Name)
+		p.startProgramForTier()
+		var units [][]ruleEntry
 		for _, pol := range tier.Policies {
-			p.writePolicy(pol, actionLabels, destLeg)
+			units = append(units, p.appendPolicy(nil, pol, actionLabels))
 		}
 
 		// End of tier rule.
@@ -379,57 +686,102 @@ func (p *Builder) writeTiers(tiers []Tier, destLeg matchLeg, allowLabel string)
 			action = TierEndDeny
 		}
 		log.Debugf("End of tier %d %q: %s", p.tierID, tier.Name, action)
-		p.writeRule(Rule{
+		units = append(units, appendRule(nil, Rule{
 			Rule: &proto.Rule{},
-		}, actionLabels[string(action)], destLeg)
-		p.b.LabelNextInsn(endOfTierLabel)
+		}, actionLabels[string(action)]))
+		p.writeRuleUnits(units, destLeg)
+		p.labelTarget(endOfTierLabel)
 		p.tierID++
 	}
 }
 
 func (p *Builder) writeProfiles(profiles []Policy, allowLabel string) {
 	log.Debugf("Start of profiles")
+	p.startProgramForTier()
+	var units [][]ruleEntry
 	for idx, prof := range profiles {
-		p.writeProfile(prof, idx, allowLabel)
+		units = append(units, p.appendProfile(nil, prof, idx, allowLabel))
 	}
 
 	log.Debugf("End of profiles drop")
-	p.writeRule(Rule{
+	units = append(units, appendRule(nil, Rule{
 		Rule: &proto.Rule{},
-	}, "deny", legDest)
+	}, "deny"))
+	p.writeRuleUnits(units, legDest)
+}
+
+// ruleEntry is a rule, already filtered to IPv4, along with the label to jump to when
+// the rule matches.
+type ruleEntry struct {
+	rule        *proto.Rule
+	actionLabel string
+}
+
+func appendRule(entries []ruleEntry, r Rule, actionLabel string) []ruleEntry {
+	if actionLabel == "" {
+		log.Panic("empty action label")
+	}
+
+	rule := rules.FilterRuleToIPVersion(4, r.Rule)
+	if rule == nil {
+		log.Debugf("Version mismatch, skipping rule")
+		return entries
+	}
+	return append(entries, ruleEntry{rule: rule, actionLabel: actionLabel})
 }
 
-func (p *Builder) writePolicyRules(policy Policy, actionLabels map[string]string, destLeg matchLeg) {
+// actionLabelContinue is the action label of a rule that, when it matches, only has its
+// counters incremented; evaluation then continues with the next rule.
+const actionLabelContinue = "continue"
+
+func (p *Builder) appendPolicyRules(entries []ruleEntry, policy Policy, actionLabels map[string]string) []ruleEntry {
 	for ruleIdx, rule := range policy.Rules {
-		log.Debugf("Start of rule %d", ruleIdx)
 		action := strings.ToLower(rule.Action)
 		if action == "log" {
-			log.Debug("Skipping log rule.  Not supported in BPF mode.")
+			if _, counted := p.ruleCounterIndex(rule.Rule); counted {
+				// Logging is not supported in BPF mode but we can still count the rule.
+				entries = appendRule(entries, rule, actionLabelContinue)
+				continue
+			}
+			log.Debugf("Skipping log rule %d.  Not supported in BPF mode.", ruleIdx)
 			continue
 		}
-		p.writeRule(rule, actionLabels[action], destLeg)
-		log.Debugf("End of rule %d", ruleIdx)
+		entries = appendRule(entries, rule, actionLabels[action])
 	}
+	return entries
 }
 
-func (p *Builder) writePolicy(policy Policy, actionLabels map[string]string, destLeg matchLeg) {
-	log.Debugf("Start of policy %q %d", policy.Name, p.policyID)
-	p.writePolicyRules(policy, actionLabels, destLeg)
-	log.Debugf("End of policy %q %d", policy.Name, p.policyID)
+func (p *Builder) appendPolicy(entries []ruleEntry, policy Policy, actionLabels map[string]string) []ruleEntry {
+	log.Debugf("Policy %q %d", policy.Name, p.policyID)
+	entries = p.appendPolicyRules(entries, policy, actionLabels)
 	p.policyID++
+	return entries
 }
 
-func (p *Builder) writeProfile(profile Profile, idx int, allowLabel string) {
+func (p *Builder) appendProfile(entries []ruleEntry, profile Profile, idx int, allowLabel string) []ruleEntry {
 	actionLabels := map[string]string{
 		"allow":     allowLabel,
 		"deny":      "deny",
 		"pass":      "deny",
 		"next-tier": "deny",
 	}
-	log.Debugf("Start of profile %q %d", profile.Name, idx)
-	p.writePolicyRules(profile, actionLabels, legDest)
-	log.Debugf("End of profile %q %d", profile.Name, idx)
+	log.Debugf("Profile %q %d", profile.Name, idx)
+	entries = p.appendPolicyRules(entries, profile, actionLabels)
 	p.policyID++
+	return entries
+}
+
+// writeRules emits a sequence of rules with first-match semantics.  Unless the builder
+// was asked for flat rules, consecutive rules that share match criteria are grouped so
+// that the shared criteria are checked once for the whole group, see writeRuleTree.
+func (p *Builder) writeRules(entries []ruleEntry, destLeg matchLeg) {
+	if p.flatRules {
+		for _, e := range entries {
+			p.writeFilteredRule(e.rule, e.actionLabel, destLeg)
+		}
+		return
+	}
+	p.writeRuleTree(reorderByProtocol(entries), destLeg, 0)
 }
 
 type matchLeg string
@@ -471,16 +823,10 @@ func (leg matchLeg) stackOffsetToIPSetKey() (keyOffset int16) {
 	return
 }
 
-func (p *Builder) writeRule(r Rule, actionLabel string, destLeg matchLeg) {
-	if actionLabel == "" {
-		log.Panic("empty action label")
-	}
-
-	rule := rules.FilterRuleToIPVersion(4, r.Rule)
-	if rule == nil {
-		log.Debugf("Version mismatch, skipping rule")
-		return
-	}
+// writeFilteredRule emits the match criteria and the action of a single rule that has
+// already been filtered to IPv4.
+func (p *Builder) writeFilteredRule(rule *proto.Rule, actionLabel string, destLeg matchLeg) {
+	log.Debugf("Start of rule %d", p.ruleID)
 	p.writeStartOfRule()
 
 	if rule.Protocol != nil {
@@ -512,11 +858,11 @@ func (p *Builder) writeRule(r Rule, actionLabel string, destLeg matchLeg) {
 
 	if len(rule.SrcIpSetIds) > 0 {
 		log.WithField("ipSetIDs", rule.SrcIpSetIds).Debugf("SrcIpSetIds match")
-		p.writeIPSetMatch(false, legSource, rule.SrcIpSetIds)
+		p.writeIPSetMatch(false, legSource, rule.SrcIpSetIds, false)
 	}
 	if len(rule.NotSrcIpSetIds) > 0 {
 		log.WithField("ipSetIDs", rule.NotSrcIpSetIds).Debugf("NotSrcIpSetIds match")
-		p.writeIPSetMatch(true, legSource, rule.NotSrcIpSetIds)
+		p.writeIPSetMatch(true, legSource, rule.NotSrcIpSetIds, false)
 	}
 
 	if len(rule.DstIpSetIds) > 1 {
@@ -531,12 +877,12 @@ func (p *Builder) writeRule(r Rule, actionLabel string, destLeg matchLeg) {
 	}
 	if len(rule.NotDstIpSetIds) > 0 {
 		log.WithField("ipSetIDs", rule.NotDstIpSetIds).Debugf("NotDstIpSetIds match")
-		p.writeIPSetMatch(true, destLeg, rule.NotDstIpSetIds)
+		p.writeIPSetMatch(true, destLeg, rule.NotDstIpSetIds, false)
 	}
 
 	if len(rule.DstIpPortSetIds) > 0 {
 		log.WithField("ipPortSetIDs", rule.DstIpPortSetIds).Debugf("DstIpPortSetIds match")
-		p.writeIPSetMatch(false, destLeg, rule.DstIpPortSetIds)
+		p.writeIPSetMatch(false, destLeg, rule.DstIpPortSetIds, true)
 	}
 
 	if len(rule.SrcPorts) > 0 || len(rule.SrcNamedPortIpSetIds) > 0 {
@@ -576,7 +922,8 @@ func (p *Builder) writeRule(r Rule, actionLabel string, destLeg matchLeg) {
 		}
 	}
 
-	p.writeEndOfRule(r, actionLabel)
+	p.writeEndOfRule(rule, actionLabel)
+	log.Debugf("End of rule %d", p.ruleID)
 	p.ruleID++
 	p.rulePartID = 0
 }
@@ -584,15 +931,57 @@ func (p *Builder) writeRule(r Rule, actionLabel string, destLeg matchLeg) {
 func (p *Builder) writeStartOfRule() {
 }
 
-func (p *Builder) writeEndOfRule(rule Rule, actionLabel string) {
+func (p *Builder) writeEndOfRule(rule *proto.Rule, actionLabel string) {
 	// If all the match criteria are met, we fall through to the end of the rule
-	// so all that's left to do is to jump to the relevant action.
-	// TODO log and log-and-xxx actions
-	p.b.Jump(actionLabel)
+	// so all that's left to do is to count the rule and jump to the relevant action.
+	if idx, counted := p.ruleCounterIndex(rule); counted {
+		p.writeCounterIncrement(p.ruleCounterMapFD, idx, p.freshPerRuleLabel())
+	}
+	if actionLabel != actionLabelContinue {
+		p.b.Jump(actionLabel)
+	}
 
 	p.b.LabelNextInsn(p.endOfRuleLabel())
 }
 
+// ruleCounterIndex returns the index of the counters of the rule, false if the builder
+// doesn't count rules or if the rule has no counters.
+func (p *Builder) ruleCounterIndex(rule *proto.Rule) (uint32, bool) {
+	if p.ruleCounterIdxProvider == nil || rule.RuleId == "" {
+		return 0, false
+	}
+	return p.ruleCounterIdxProvider.RuleCounterIndex(rule.RuleId)
+}
+
+// writeCounterIncrement emits the increment of the packet and byte counters at the given
+// index of a counter map (the rule or the verdict counter map, which have the same value
+// layout), labelling the next instruction with doneLabel.  The maps are per-CPU so no atomic
+// operations are needed.
+func (p *Builder) writeCounterIncrement(mapFD bpf.MapFD, idx uint32, doneLabel string) {
+	p.b.MovImm32(R1, int32(idx))
+	p.b.StoreStack32(R1, offRuleCtrKey)
+	p.b.Mov64(R2, R10)
+	p.b.AddImm64(R2, int32(offRuleCtrKey))
+	p.b.LoadMapFD(R1, uint32(mapFD))
+	p.b.Call(HelperMapLookupElem)
+	// The index is always in range of the array but the verifier requires the check.
+	p.b.JumpEqImm64(R0, 0, doneLabel)
+
+	p.b.Load64(R1, R0, counters.RuleValueOffPackets)
+	p.b.AddImm64(R1, 1)
+	p.b.Store64(R0, R1, counters.RuleValueOffPackets)
+
+	if !p.forXDP {
+		// XDP programs only count packets, xdp_md has no length field.
+		p.b.Load32(R2, R6, skbOffLen)
+		p.b.Load64(R1, R0, counters.RuleValueOffBytes)
+		p.b.Add64(R1, R2)
+		p.b.Store64(R0, R1, counters.RuleValueOffBytes)
+	}
+
+	p.b.LabelNextInsn(doneLabel)
+}
+
 func (p *Builder) writeProtoMatch(negate bool, protocol *proto.Protocol) {
 	p.b.Load8(R1, R9, stateOffIPProto)
 	protoNum := protocolToNumber(protocol)
@@ -620,7 +1009,15 @@ func (p *Builder) writeICMPTypeCodeMatch(negate bool, icmpType, icmpCode uint8)
 		p.b.JumpNEImm64(R1, (int32(icmpCode)<<8)|int32(icmpType), p.endOfRuleLabel())
 	}
 }
+
 func (p *Builder) writeCIDRSMatch(negate bool, leg matchLeg, cidrs []string) {
+	if p.cidrSetThreshold > 0 && len(cidrs) > p.cidrSetThreshold {
+		// Too many CIDRs to compare inline, the list has been spilled into an IP set
+		// so it takes a single (LPM) lookup.
+		p.writeIPSetMatch(negate, leg, []string{CIDRSetID(cidrs)}, false)
+		return
+	}
+
 	p.b.Load32(R1, R9, leg.offsetToStateIPAddressField())
 
 	var onMatchLabel string
@@ -648,30 +1045,18 @@ func (p *Builder) writeCIDRSMatch(negate bool, leg matchLeg, cidrs []string) {
 	}
 }
 
-func (p *Builder) writeIPSetMatch(negate bool, leg matchLeg, ipSets []string) {
+func (p *Builder) writeIPSetMatch(negate bool, leg matchLeg, ipSets []string, namedPort bool) {
 	// IP sets are different to CIDRs, if we have multiple IP sets then they all have to match
 	// so we treat them as independent match criteria.
 	for _, ipSetID := range ipSets {
-		id := p.ipSetIDProvider.GetNoAlloc(ipSetID)
-		if id == 0 {
-			log.WithField("setID", ipSetID).Panic("Failed to look up IP set ID.")
-		}
-
-		keyOffset := leg.stackOffsetToIPSetKey()
-		p.setUpIPSetKey(id, keyOffset, leg.offsetToStateIPAddressField(), leg.offsetToStatePortField())
-		p.b.LoadMapFD(R1, uint32(p.ipSetMapFD))
-		p.b.Mov64(R2, R10)
-		p.b.AddImm64(R2, int32(keyOffset))
-		p.b.Call(HelperMapLookupElem)
-
 		if negate {
-			// Negated; if we got a hit (non-0) then the rule doesn't match.
+			// Negated; if we got a hit then the rule doesn't match.
 			// (Otherwise we fall through to the next match criteria.)
-			p.b.JumpNEImm64(R0, 0, p.endOfRuleLabel())
+			p.writeIPSetLookup(leg, ipSetID, namedPort, p.endOfRuleLabel(), "")
 		} else {
-			// Non-negated; if we got a miss (0) then the rule can't match.
+			// Non-negated; if we got a miss then the rule can't match.
 			// (Otherwise we fall through to the next match criteria.)
-			p.b.JumpEqImm64(R0, 0, p.endOfRuleLabel())
+			p.writeIPSetLookup(leg, ipSetID, namedPort, "", p.endOfRuleLabel())
 		}
 	}
 }
@@ -682,21 +1067,9 @@ func (p *Builder) writeIPSetOrMatch(leg matchLeg, ipSets []string) {
 	onMatchLabel := p.freshPerRuleLabel()
 
 	for _, ipSetID := range ipSets {
-		id := p.ipSetIDProvider.GetNoAlloc(ipSetID)
-		if id == 0 {
-			log.WithField("setID", ipSetID).Panic("Failed to look up IP set ID.")
-		}
-
-		keyOffset := leg.stackOffsetToIPSetKey()
-		p.setUpIPSetKey(id, keyOffset, leg.offsetToStateIPAddressField(), leg.offsetToStatePortField())
-		p.b.LoadMapFD(R1, uint32(p.ipSetMapFD))
-		p.b.Mov64(R2, R10)
-		p.b.AddImm64(R2, int32(keyOffset))
-		p.b.Call(HelperMapLookupElem)
-
-		// If we got a hit (non-0) then packet matches one of the IP sets.
+		// If we got a hit then packet matches one of the IP sets.
 		// (Otherwise we fall through to try the next IP set.)
-		p.b.JumpNEImm64(R0, 0, onMatchLabel)
+		p.writeIPSetLookup(leg, ipSetID, false, onMatchLabel, "")
 	}
 
 	// If packet reaches here, it hasn't matched any of the IP sets.
@@ -705,6 +1078,69 @@ func (p *Builder) writeIPSetOrMatch(leg matchLeg, ipSets []string) {
 	p.b.LabelNextInsn(onMatchLabel)
 }
 
+// writeIPSetLookup emits the lookup of the packet in the given IP set.  It jumps to hitLabel
+// if the packet is in the set, or to missLabel if it is not; exactly one of the labels must
+// be set, the other outcome falls through.
+func (p *Builder) writeIPSetLookup(leg matchLeg, ipSetID string, namedPort bool, hitLabel, missLabel string) {
+	id := p.ipSetIDProvider.GetNoAlloc(ipSetID)
+	if id == 0 {
+		log.WithField("setID", ipSetID).Panic("Failed to look up IP set ID.")
+	}
+
+	// Work out which maps may hold members of the set.  Exact-match members are in the
+	// hash map, if we have one, which is cheaper to look up than the LPM trie.
+	type ipSetProbe struct {
+		mapFD  bpf.MapFD
+		keyOff int16
+	}
+	keyOffset := leg.stackOffsetToIPSetKey()
+	var probes []ipSetProbe
+	if p.ipSetMemberKinds == nil {
+		probes = append(probes, ipSetProbe{p.ipSetMapFD, keyOffset})
+	} else {
+		exact, cidr := p.ipSetMemberKinds.MemberKinds(ipSetID)
+		if exact {
+			probes = append(probes, ipSetProbe{p.ipSetHashMapFD, keyOffset + ipsKeyID})
+		}
+		if cidr {
+			probes = append(probes, ipSetProbe{p.ipSetMapFD, keyOffset})
+		}
+	}
+
+	if len(probes) == 0 {
+		// Empty set, the packet can't be in it.
+		log.WithField("setID", ipSetID).Debug("IP set is empty")
+		if missLabel != "" {
+			p.b.Jump(missLabel)
+		}
+		return
+	}
+
+	p.setUpIPSetKey(id, keyOffset, leg, namedPort)
+	var fallThroughLabel string
+	for i, probe := range probes {
+		p.b.LoadMapFD(R1, uint32(probe.mapFD))
+		p.b.Mov64(R2, R10)
+		p.b.AddImm64(R2, int32(probe.keyOff))
+		p.b.Call(HelperMapLookupElem)
+
+		if hitLabel != "" {
+			p.b.JumpNEImm64(R0, 0, hitLabel)
+		} else if i == len(probes)-1 {
+			p.b.JumpEqImm64(R0, 0, missLabel)
+		} else {
+			// A hit in this map is a hit in the set, skip the other map.
+			if fallThroughLabel == "" {
+				fallThroughLabel = p.freshPerRuleLabel()
+			}
+			p.b.JumpNEImm64(R0, 0, fallThroughLabel)
+		}
+	}
+	if fallThroughLabel != "" {
+		p.b.LabelNextInsn(fallThroughLabel)
+	}
+}
+
 func (p *Builder) writePortsMatch(negate bool, leg matchLeg, ports []*proto.PortRange, namedPorts []string) {
 	// For a ports match, numeric ports and named ports are ORed together.  Check any
 	// numeric ports first and then any named ports.
@@ -720,40 +1156,21 @@ func (p *Builder) writePortsMatch(negate bool, leg matchLeg, ports []*proto.Port
 	// R1 = port to test against.
 	p.b.Load16(R1, R9, leg.offsetToStatePortField())
 
-	for _, portRange := range ports {
-		if portRange.First == portRange.Last {
-			// Optimisation, single port, just do a comparison.
-			p.b.JumpEqImm64(R1, portRange.First, onMatchLabel)
-		} else {
-			// Port range,
-			var skipToNextPortLabel string
-			if portRange.First > 0 {
-				// If port is too low, skip to next port.
-				skipToNextPortLabel = p.freshPerRuleLabel()
-				p.b.JumpLTImm64(R1, portRange.First, skipToNextPortLabel)
-			}
-			// If port is in range, got a match, otherwise fall through to next port.
-			p.b.JumpLEImm64(R1, portRange.Last, onMatchLabel)
-			if portRange.First > 0 {
-				p.b.LabelNextInsn(skipToNextPortLabel)
-			}
+	ranges := normalisePortRanges(ports)
+	if len(ranges) > maxLinearPortRanges {
+		// Many ranges, do a binary search over the sorted ranges so that the number of
+		// comparisons is logarithmic in the number of ranges.
+		noPortMatchLabel := p.freshPerRuleLabel()
+		p.writePortRangeSearch(ranges, onMatchLabel, noPortMatchLabel)
+		p.b.LabelNextInsn(noPortMatchLabel)
+	} else {
+		for _, portRange := range ranges {
+			p.writePortRangeMatch(portRange, onMatchLabel)
 		}
 	}
 
 	for _, ipSetID := range namedPorts {
-		id := p.ipSetIDProvider.GetNoAlloc(ipSetID)
-		if id == 0 {
-			log.WithField("setID", ipSetID).Panic("Failed to look up IP set ID.")
-		}
-
-		keyOffset := leg.stackOffsetToIPSetKey()
-		p.setUpIPSetKey(id, keyOffset, leg.offsetToStateIPAddressField(), leg.offsetToStatePortField())
-		p.b.LoadMapFD(R1, uint32(p.ipSetMapFD))
-		p.b.Mov64(R2, R10)
-		p.b.AddImm64(R2, int32(keyOffset))
-		p.b.Call(HelperMapLookupElem)
-
-		p.b.JumpNEImm64(R0, 0, onMatchLabel)
+		p.writeIPSetLookup(leg, ipSetID, true, onMatchLabel, "")
 	}
 
 	if !negate {
@@ -764,13 +1181,90 @@ func (p *Builder) writePortsMatch(negate bool, leg matchLeg, ports []*proto.Port
 	}
 }
 
+// maxLinearPortRanges is the number of port ranges up to which we check the ranges one after
+// the other.  Above that, we binary search the ranges instead.
+const maxLinearPortRanges = 4
+
+// normalisePortRanges returns the given port ranges sorted and with overlapping or adjacent
+// ranges merged.
+func normalisePortRanges(ports []*proto.PortRange) []proto.PortRange {
+	ranges := make([]proto.PortRange, 0, len(ports))
+	for _, pr := range ports {
+		ranges = append(ranges, *pr)
+	}
+	sort.Slice(ranges, func(i, j int) bool {
+		return ranges[i].First < ranges[j].First
+	})
+
+	var merged []proto.PortRange
+	for _, r := range ranges {
+		if n := len(merged); n > 0 && r.First <= merged[n-1].Last+1 {
+			if r.Last > merged[n-1].Last {
+				merged[n-1].Last = r.Last
+			}
+			continue
+		}
+		merged = append(merged, r)
+	}
+	return merged
+}
+
+// writePortRangeMatch emits a check of the port in R1 against a single range, jumping to
+// onMatchLabel if it is in the range, falling through otherwise.
+func (p *Builder) writePortRangeMatch(portRange proto.PortRange, onMatchLabel string) {
+	if portRange.First == portRange.Last {
+		// Optimisation, single port, just do a comparison.
+		p.b.JumpEqImm64(R1, portRange.First, onMatchLabel)
+		return
+	}
+
+	// Port range,
+	var skipToNextPortLabel string
+	if portRange.First > 0 {
+		// If port is too low, skip to next port.
+		skipToNextPortLabel = p.freshPerRuleLabel()
+		p.b.JumpLTImm64(R1, portRange.First, skipToNextPortLabel)
+	}
+	// If port is in range, got a match, otherwise fall through to next port.
+	p.b.JumpLEImm64(R1, portRange.Last, onMatchLabel)
+	if portRange.First > 0 {
+		p.b.LabelNextInsn(skipToNextPortLabel)
+	}
+}
+
+// writePortRangeSearch emits a binary search of the port in R1 over the sorted, disjoint
+// ranges, jumping to onMatchLabel if the port is in one of them and to noMatchLabel if not.
+func (p *Builder) writePortRangeSearch(ranges []proto.PortRange, onMatchLabel, noMatchLabel string) {
+	if len(ranges) == 0 {
+		p.b.Jump(noMatchLabel)
+		return
+	}
+
+	mid := len(ranges) / 2
+	lowerHalfLabel := p.freshPerRuleLabel()
+	// Below the middle range, search the lower half.
+	p.b.JumpLTImm64(R1, ranges[mid].First, lowerHalfLabel)
+	// In the middle range, got a match.
+	p.b.JumpLEImm64(R1, ranges[mid].Last, onMatchLabel)
+	// Otherwise, above the middle range, search the upper half.
+	p.writePortRangeSearch(ranges[mid+1:], onMatchLabel, noMatchLabel)
+	p.b.LabelNextInsn(lowerHalfLabel)
+	p.writePortRangeSearch(ranges[:mid], onMatchLabel, noMatchLabel)
+}
+
 func (p *Builder) freshPerRuleLabel() string {
 	part := p.rulePartID
 	p.rulePartID++
+	if p.groupLabelPrefix != "" {
+		return fmt.Sprintf("%s_part_%d", p.groupLabelPrefix, part)
+	}
 	return fmt.Sprintf("rule_%d_part_%d", p.ruleID, part)
 }
 
 func (p *Builder) endOfRuleLabel() string {
+	if p.groupLabelPrefix != "" {
+		return p.groupLabelPrefix + "_no_match"
+	}
 	return fmt.Sprintf("rule_%d_no_match", p.ruleID)
 }
 
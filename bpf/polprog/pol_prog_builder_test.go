@@ -15,10 +15,14 @@
 package polprog
 
 import (
+	"fmt"
+	"reflect"
 	"testing"
 
 	. "github.com/onsi/gomega"
 
+	. "github.com/projectcalico/felix/bpf/asm"
+	"github.com/projectcalico/felix/bpf/counters"
 	"github.com/projectcalico/felix/idalloc"
 	"github.com/projectcalico/felix/proto"
 )
@@ -100,3 +104,500 @@ func TestLogActionIgnored(t *testing.T) {
 	Expect(err).NotTo(HaveOccurred())
 	Expect(noOpInsns).To(Equal(insns))
 }
+
+type ruleCounterIdxs map[string]uint32
+
+func (m ruleCounterIdxs) RuleCounterIndex(ruleID string) (uint32, bool) {
+	idx, ok := m[ruleID]
+	return idx, ok
+}
+
+func TestRuleCounters(t *testing.T) {
+	RegisterTestingT(t)
+	alloc := idalloc.New()
+
+	const ruleCounterMapFD = 4
+	rules := Rules{
+		Tiers: []Tier{{
+			Name: "default",
+			Policies: []Policy{{
+				Name: "counted",
+				Rules: []Rule{
+					{Rule: &proto.Rule{Action: "Log", RuleId: "log-rule"}},
+					{Rule: &proto.Rule{Action: "Allow", RuleId: "counted-rule", DstNet: []string{"10.0.0.0/8"}}},
+					{Rule: &proto.Rule{Action: "Allow", RuleId: "uncounted-rule", DstNet: []string{"11.0.0.0/8"}}},
+				},
+			}},
+		}},
+	}
+	idxs := ruleCounterIdxs{"log-rule": 7, "counted-rule": 8}
+
+	countLookups := func(insns []Insn) (n int) {
+		for _, in := range insns {
+			if in.OpCode() == LoadImm64 && in.Src() == RPseudoMapFD && in.Imm() == ruleCounterMapFD {
+				n++
+			}
+		}
+		return
+	}
+
+	uncounted, err := NewBuilder(alloc, 1, 2, 3).Instructions(rules)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(countLookups(uncounted)).To(Equal(0))
+
+	counted, err := NewBuilder(alloc, 1, 2, 3, WithRuleCounters(ruleCounterMapFD, idxs)).Instructions(rules)
+	Expect(err).NotTo(HaveOccurred())
+	for i, in := range counted {
+		t.Log(i, ": ", in)
+	}
+	// The log rule and the first allow rule each look up their counters.
+	Expect(countLookups(counted)).To(Equal(2))
+}
+
+func TestVerdictCounters(t *testing.T) {
+	RegisterTestingT(t)
+	alloc := idalloc.New()
+
+	const verdictCounterMapFD = 5
+	countIdxs := func(insns []Insn) (idxs []int32) {
+		for i, in := range insns {
+			if in.OpCode() == LoadImm64 && in.Src() == RPseudoMapFD && in.Imm() == verdictCounterMapFD {
+				// The key is stored to the stack just before the map FD is loaded.
+				idxs = append(idxs, insns[i-4].Imm())
+			}
+		}
+		return
+	}
+
+	insns, err := NewBuilder(alloc, 1, 2, 3, WithVerdictCounters(verdictCounterMapFD, counters.HookToWEP), WithoutOptimizer()).
+		Instructions(Rules{})
+	Expect(err).NotTo(HaveOccurred())
+	Expect(countIdxs(insns)).To(ConsistOf(int32(counters.VerdictIndex(counters.HookToWEP, counters.ReasonPolicy, true))))
+
+	insns, err = NewBuilder(alloc, 1, 2, 3, WithVerdictCounters(verdictCounterMapFD, counters.HookXDP), WithoutOptimizer()).
+		Instructions(Rules{ForHostInterface: true, ForXDP: true})
+	Expect(err).NotTo(HaveOccurred())
+	Expect(countIdxs(insns)).To(ConsistOf(
+		int32(counters.VerdictIndex(counters.HookXDP, counters.ReasonPolicy, true)),
+		int32(counters.VerdictIndex(counters.HookXDP, counters.ReasonPolicy, false)),
+	))
+}
+
+func TestRuleGroupingSharesChecks(t *testing.T) {
+	RegisterTestingT(t)
+	alloc := idalloc.New()
+
+	tcp := &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: "tcp"}}
+	udp := &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: "udp"}}
+	var polRules []Rule
+	for i := 0; i < 20; i++ {
+		protocol := tcp
+		if i%2 == 1 {
+			protocol = udp
+		}
+		polRules = append(polRules, Rule{Rule: &proto.Rule{
+			Action:   "Allow",
+			Protocol: protocol,
+			DstPorts: []*proto.PortRange{{First: 80, Last: 80}},
+			DstNet:   []string{fmt.Sprintf("10.0.%d.0/24", i)},
+		}})
+	}
+	rules := Rules{
+		Tiers: []Tier{{
+			Name:     "default",
+			Policies: []Policy{{Name: "many rules", Rules: polRules}},
+		}},
+	}
+
+	// Compare the programs before optimization, the optimizer removes some of the loads
+	// that the grouping saves.
+	flatInsns, err := NewBuilder(alloc, 1, 2, 3, WithFlatRules(), WithoutOptimizer()).Instructions(rules)
+	Expect(err).NotTo(HaveOccurred())
+	treeInsns, err := NewBuilder(alloc, 1, 2, 3, WithoutOptimizer()).Instructions(rules)
+	Expect(err).NotTo(HaveOccurred())
+
+	// Each rule loses its protocol and port checks (2 loads and 2 jumps), only the CIDR
+	// check remains.
+	Expect(len(treeInsns)).To(BeNumerically("<", len(flatInsns)-3*len(polRules)))
+}
+
+func TestOptimizerShrinksPolicyProgram(t *testing.T) {
+	RegisterTestingT(t)
+	alloc := idalloc.New()
+
+	var polRules []Rule
+	for i := 0; i < 20; i++ {
+		polRules = append(polRules, Rule{Rule: &proto.Rule{
+			Action:   "Allow",
+			Protocol: &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: "tcp"}},
+			SrcNet:   []string{fmt.Sprintf("10.0.%d.0/24", i)},
+			DstPorts: []*proto.PortRange{{First: int32(1000 + i), Last: int32(1000 + i)}},
+		}})
+	}
+	rules := Rules{
+		Tiers: []Tier{{
+			Name:     "default",
+			Policies: []Policy{{Name: "many rules", Rules: polRules}},
+		}},
+	}
+
+	for _, flat := range []bool{true, false} {
+		var opts []Option
+		if flat {
+			opts = append(opts, WithFlatRules())
+		}
+		unoptimized, err := NewBuilder(alloc, 1, 2, 3, append(opts, WithoutOptimizer())...).Instructions(rules)
+		Expect(err).NotTo(HaveOccurred())
+		optimized, err := NewBuilder(alloc, 1, 2, 3, opts...).Instructions(rules)
+		Expect(err).NotTo(HaveOccurred())
+
+		// At least the source address and the destination port loads are replaced by
+		// registers.
+		t.Logf("flat=%v: %d -> %d instructions", flat, len(unoptimized), len(optimized))
+		Expect(len(optimized)).To(BeNumerically("<", len(unoptimized)-len(polRules)))
+	}
+}
+
+func TestReorderByProtocol(t *testing.T) {
+	RegisterTestingT(t)
+
+	rule := func(protoName string) ruleEntry {
+		r := &proto.Rule{Action: "Allow"}
+		if protoName != "" {
+			r.Protocol = &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: protoName}}
+		}
+		return ruleEntry{rule: r, actionLabel: fmt.Sprintf("%s_%p", protoName, r)}
+	}
+
+	in := []ruleEntry{
+		rule("tcp"), rule("udp"), rule("tcp"), rule(""), rule("udp"), rule("sctp"), rule("udp"),
+	}
+	out := reorderByProtocol(in)
+	// Rules without a protocol are barriers, the rules before and after them are
+	// reordered independently.
+	Expect(out).To(Equal([]ruleEntry{
+		in[0], in[2], in[1], in[3], in[4], in[6], in[5],
+	}))
+}
+
+func TestLongCIDRListsSpilledToIPSets(t *testing.T) {
+	RegisterTestingT(t)
+	alloc := idalloc.New()
+
+	var cidrs []string
+	for i := 0; i < 200; i++ {
+		cidrs = append(cidrs, fmt.Sprintf("10.%d.0.0/16", i))
+	}
+	rule := &proto.Rule{
+		Action: "Allow",
+		SrcNet: cidrs,
+		DstNet: []string{"11.0.0.0/8", "12.0.0.0/8"},
+	}
+	rules := Rules{
+		Tiers: []Tier{{
+			Name:     "default",
+			Policies: []Policy{{Name: "egress allowlist", Rules: []Rule{{Rule: rule}}}},
+		}},
+	}
+
+	Expect(SpilledCIDRLists(rule, 0)).To(BeEmpty())
+	Expect(SpilledCIDRLists(rule, 32)).To(Equal([][]string{cidrs}))
+
+	// The ID depends only on the content of the list.
+	reversed := make([]string, len(cidrs))
+	for i, c := range cidrs {
+		reversed[len(cidrs)-1-i] = c
+	}
+	setID := CIDRSetID(cidrs)
+	Expect(CIDRSetID(reversed)).To(Equal(setID))
+	Expect(CIDRSetID(cidrs[1:])).NotTo(Equal(setID))
+
+	inlineInsns, err := NewBuilder(alloc, 1, 2, 3).Instructions(rules)
+	Expect(err).NotTo(HaveOccurred())
+
+	alloc.GetOrAlloc(setID)
+	spilledInsns, err := NewBuilder(alloc, 1, 2, 3, WithCIDRSetThreshold(32)).Instructions(rules)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(len(inlineInsns)).To(BeNumerically(">", 3*len(cidrs)))
+	Expect(len(spilledInsns)).To(BeNumerically("<", 50))
+}
+
+type ipSetKinds map[string][2]bool
+
+func (m ipSetKinds) MemberKinds(ipSetID string) (exact, cidr bool) {
+	return m[ipSetID][0], m[ipSetID][1]
+}
+
+func TestIPSetHashMap(t *testing.T) {
+	RegisterTestingT(t)
+	alloc := idalloc.New()
+
+	const ipSetMapFD, ipSetHashMapFD = 1, 4
+	kinds := ipSetKinds{
+		"pods":     {true, false},
+		"nets":     {false, true},
+		"mixed":    {true, true},
+		"empty":    {false, false},
+		"svc-port": {true, false},
+	}
+	for id := range kinds {
+		alloc.GetOrAlloc(id)
+	}
+
+	countLookups := func(insns []Insn, mapFD int32) (n int) {
+		for _, in := range insns {
+			if in.OpCode() == LoadImm64 && in.Src() == RPseudoMapFD && in.Imm() == mapFD {
+				n++
+			}
+		}
+		return
+	}
+	build := func(rule *proto.Rule, opts ...Option) []Insn {
+		insns, err := NewBuilder(alloc, ipSetMapFD, 2, 3, opts...).Instructions(Rules{
+			Tiers: []Tier{{
+				Name:     "default",
+				Policies: []Policy{{Name: "pol", Rules: []Rule{{Rule: rule}}}},
+			}},
+		})
+		Expect(err).NotTo(HaveOccurred())
+		return insns
+	}
+
+	for _, tc := range []struct {
+		rule          *proto.Rule
+		hash, lpm     int
+		lpmWithoutOpt int
+	}{
+		{&proto.Rule{Action: "Allow", SrcIpSetIds: []string{"pods"}}, 1, 0, 1},
+		{&proto.Rule{Action: "Allow", SrcIpSetIds: []string{"nets"}}, 0, 1, 1},
+		{&proto.Rule{Action: "Allow", NotSrcIpSetIds: []string{"mixed"}}, 1, 1, 1},
+		{&proto.Rule{Action: "Allow", DstIpSetIds: []string{"empty"}}, 0, 0, 1},
+		{&proto.Rule{Action: "Allow", DstIpPortSetIds: []string{"svc-port"}}, 1, 0, 1},
+		{&proto.Rule{Action: "Allow", SrcIpSetIds: []string{"pods", "mixed"}}, 2, 1, 2},
+	} {
+		// Without the hash map, every IP set is looked up in the LPM trie.
+		insns := build(tc.rule)
+		Expect(countLookups(insns, ipSetHashMapFD)).To(Equal(0))
+		Expect(countLookups(insns, ipSetMapFD)).To(Equal(tc.lpmWithoutOpt))
+
+		insns = build(tc.rule, WithIPSetHashMap(ipSetHashMapFD, kinds))
+		Expect(countLookups(insns, ipSetHashMapFD)).To(Equal(tc.hash), fmt.Sprint(tc.rule))
+		Expect(countLookups(insns, ipSetMapFD)).To(Equal(tc.lpm), fmt.Sprint(tc.rule))
+	}
+}
+
+func TestNormalisePortRanges(t *testing.T) {
+	RegisterTestingT(t)
+
+	Expect(normalisePortRanges([]*proto.PortRange{
+		{First: 8080, Last: 8090},
+		{First: 80, Last: 81},
+		{First: 82, Last: 82},
+		{First: 443, Last: 443},
+		{First: 8085, Last: 8086},
+		{First: 0, Last: 10},
+	})).To(Equal([]proto.PortRange{
+		{First: 0, Last: 10},
+		{First: 80, Last: 82},
+		{First: 443, Last: 443},
+		{First: 8080, Last: 8090},
+	}))
+}
+
+func TestLargePolicySplitIntoChain(t *testing.T) {
+	RegisterTestingT(t)
+	alloc := idalloc.New()
+
+	var tiers []Tier
+	for tier := 0; tier < 3; tier++ {
+		var policies []Policy
+		for pol := 0; pol < 20; pol++ {
+			var polRules []Rule
+			for i := 0; i < 10; i++ {
+				polRules = append(polRules, Rule{Rule: &proto.Rule{
+					Action: "Allow",
+					SrcNet: []string{fmt.Sprintf("10.%d.%d.%d/32", tier, pol, i)},
+				}}, Rule{Rule: &proto.Rule{
+					Action: "Pass",
+					DstNet: []string{fmt.Sprintf("11.%d.%d.%d/32", tier, pol, i)},
+				}})
+			}
+			policies = append(policies, Policy{Name: fmt.Sprintf("pol-%d", pol), Rules: polRules})
+		}
+		tiers = append(tiers, Tier{Name: fmt.Sprintf("tier-%d", tier), Policies: policies})
+	}
+	rules := Rules{
+		Tiers:            tiers,
+		HostForwardTiers: tiers[:1],
+	}
+
+	single, err := NewBuilder(alloc, 1, 2, 3).Programs(rules)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(single).To(HaveLen(1))
+
+	const maxInsns = 1000
+	chain, err := NewBuilder(alloc, 1, 2, 3, WithMaxInsnsPerProgram(maxInsns)).Programs(rules)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(len(chain)).To(BeNumerically(">", len(single[0])/maxInsns))
+	Expect(len(chain)).To(BeNumerically("<=", MaxPolicyChainLen))
+	for _, insns := range chain {
+		// The stubs that tail call other programs of the chain come on top of the budget.
+		Expect(len(insns)).To(BeNumerically("<", maxInsns+100))
+	}
+
+	_, err = NewBuilder(alloc, 1, 2, 3, WithMaxInsnsPerProgram(maxInsns)).Instructions(rules)
+	Expect(err).To(HaveOccurred())
+
+	_, err = NewBuilder(alloc, 1, 2, 3, WithMaxInsnsPerProgram(100)).Programs(rules)
+	Expect(err).To(HaveOccurred(), "chain should be too long")
+}
+
+func TestProgramPerTier(t *testing.T) {
+	RegisterTestingT(t)
+	alloc := idalloc.New()
+
+	makeRules := func(numTiers int, port int32) Rules {
+		var tiers []Tier
+		for tier := 0; tier < numTiers; tier++ {
+			tierPort := int32(1000 + tier)
+			if tier == 1 {
+				tierPort = port
+			}
+			tiers = append(tiers, Tier{
+				Name: fmt.Sprintf("tier-%d", tier),
+				Policies: []Policy{{
+					Name: "pol",
+					Rules: []Rule{{Rule: &proto.Rule{
+						Action:   "Allow",
+						Protocol: &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: "tcp"}},
+						DstPorts: []*proto.PortRange{{First: tierPort, Last: tierPort}},
+					}}},
+				}},
+			})
+		}
+		return Rules{
+			Tiers:    tiers,
+			Profiles: []Profile{{Name: "prof", Rules: []Rule{{Rule: &proto.Rule{Action: "Allow"}}}}},
+		}
+	}
+
+	before, err := NewBuilder(alloc, 1, 2, 3, WithProgramPerTier()).Programs(makeRules(3, 80))
+	Expect(err).NotTo(HaveOccurred())
+	// At least a program per tier and one for the profiles.
+	Expect(len(before)).To(BeNumerically(">=", 4))
+
+	// Changing a rule of the second tier only changes its program.
+	after, err := NewBuilder(alloc, 1, 2, 3, WithProgramPerTier()).Programs(makeRules(3, 8080))
+	Expect(err).NotTo(HaveOccurred())
+	Expect(after).To(HaveLen(len(before)))
+	changed := 0
+	for i := range before {
+		if !reflect.DeepEqual(after[i], before[i]) {
+			changed++
+		}
+	}
+	Expect(changed).To(Equal(1))
+
+	// Too many tiers for a program each, the tiers are packed instead.
+	packed, err := NewBuilder(alloc, 1, 2, 3, WithProgramPerTier()).Programs(makeRules(MaxPolicyChainLen+1, 80))
+	Expect(err).NotTo(HaveOccurred())
+	Expect(packed).To(HaveLen(1))
+}
+
+func TestChainSlotSets(t *testing.T) {
+	RegisterTestingT(t)
+
+	// The slot sets mustn't overlap each other or the other programs and must fit in the
+	// jump map.
+	seen := map[int]bool{}
+	for slotSet := 0; slotSet < PolicyChainSlotSets; slotSet++ {
+		Expect(PolicyChainJumpIndex(0, slotSet)).To(Equal(jumpIdxPolicy))
+		for i := 1; i < MaxPolicyChainLen; i++ {
+			idx := PolicyChainJumpIndex(i, slotSet)
+			Expect(idx).To(BeNumerically(">=", jumpIdxPolicyChain))
+			Expect(idx).To(BeNumerically("<", 64), "index outside cali_jump")
+			Expect(seen[idx]).To(BeFalse(), "slot sets overlap")
+			seen[idx] = true
+		}
+	}
+
+	alloc := idalloc.New()
+	var tiers []Tier
+	for tier := 0; tier < 3; tier++ {
+		tiers = append(tiers, Tier{
+			Name: fmt.Sprintf("tier-%d", tier),
+			Policies: []Policy{{
+				Name:  "pol",
+				Rules: []Rule{{Rule: &proto.Rule{Action: "Pass"}}},
+			}},
+		})
+	}
+	rules := Rules{Tiers: tiers}
+	setA, err := NewBuilder(alloc, 1, 2, 3, WithProgramPerTier()).Programs(rules)
+	Expect(err).NotTo(HaveOccurred())
+	setB, err := NewBuilder(alloc, 1, 2, 3, WithProgramPerTier(), WithChainSlotSet(1)).Programs(rules)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(setB).To(HaveLen(len(setA)))
+	Expect(len(setA)).To(BeNumerically(">", 1))
+	// Only the first program, which records the base of the slot set, depends on it; the
+	// others can be moved between the slot sets as they are.
+	Expect(setB[0]).NotTo(Equal(setA[0]), "first program doesn't depend on the slot set")
+	for i := 1; i < len(setA); i++ {
+		Expect(setB[i]).To(Equal(setA[i]), fmt.Sprintf("program %d depends on the slot set", i))
+	}
+}
+
+func TestSharedChain(t *testing.T) {
+	RegisterTestingT(t)
+	alloc := idalloc.New()
+
+	var tiers []Tier
+	for tier := 0; tier < 3; tier++ {
+		tiers = append(tiers, Tier{
+			Name: fmt.Sprintf("tier-%d", tier),
+			Policies: []Policy{{
+				Name:  "pol",
+				Rules: []Rule{{Rule: &proto.Rule{Action: "Pass"}}},
+			}},
+		})
+	}
+	rules := Rules{
+		Tiers:    tiers,
+		Profiles: []Profile{{Name: "prof", Rules: []Rule{{Rule: &proto.Rule{Action: "Allow"}}}}},
+	}
+
+	// Without sharing, the programs embed the endpoint's jump map.
+	ep1, err := NewBuilder(alloc, 1, 2, 3, WithProgramPerTier()).Programs(rules)
+	Expect(err).NotTo(HaveOccurred())
+	ep2, err := NewBuilder(alloc, 1, 2, 4, WithProgramPerTier()).Programs(rules)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(ep2).NotTo(Equal(ep1))
+
+	// Shared programs don't depend on the endpoint.
+	ep1, err = NewBuilder(alloc, 1, 2, 3, WithProgramPerTier(), WithSharedProgArray(5)).Programs(rules)
+	Expect(err).NotTo(HaveOccurred())
+	ep2, err = NewBuilder(alloc, 1, 2, 4, WithProgramPerTier(), WithSharedProgArray(5)).Programs(rules)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(ep2).To(Equal(ep1))
+	Expect(len(ep1)).To(BeNumerically(">", 1))
+
+	// A change to one tier only changes that tier's program.
+	tiers[1].Policies[0].Rules = []Rule{{Rule: &proto.Rule{Action: "Deny"}}}
+	changed, err := NewBuilder(alloc, 1, 2, 3, WithProgramPerTier(), WithSharedProgArray(5)).Programs(rules)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(changed).To(HaveLen(len(ep1)))
+	numChanged := 0
+	for i := range changed {
+		if !reflect.DeepEqual(changed[i], ep1[i]) {
+			numChanged++
+		}
+	}
+	Expect(numChanged).To(Equal(1))
+
+	entry, err := EntryTrampoline(2, 5, 100, 200)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(entry).NotTo(BeEmpty())
+	ret, err := ReturnTrampoline(2, 3)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(ret).NotTo(BeEmpty())
+}
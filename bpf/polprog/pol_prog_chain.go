@@ -0,0 +1,227 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package polprog
+
+import (
+	"fmt"
+
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/felix/bpf"
+	. "github.com/projectcalico/felix/bpf/asm"
+	"github.com/projectcalico/felix/bpf/state"
+)
+
+// A policy program that is too large for the verifier is split into a chain of programs.
+// The program is only ever split between policies (or, for a policy that is too large on
+// its own, between rules) so the rules of a program never jump into the middle of another
+// program's rules.  The only jumps that cross programs are the jumps to the end of a tier
+// and to the end of the host policy.  Since a tail call enters a program at its start, we
+// make sure that such labels start a program (see labelTarget) and, in the programs that
+// jump to them, we resolve them to a stub that tail calls that program (see assembleChain).
+//
+// Each program of the chain starts with the usual header so it reloads the state pointer
+// from the state map, all the inputs of the policy are in the state so nothing else has to
+// be passed along.
+
+// writeRuleUnits emits the given rules, which are split into units (typically, a unit per
+// policy) that are kept in the same program when the policy program is split.
+func (p *Builder) writeRuleUnits(units [][]ruleEntry, destLeg matchLeg) {
+	if p.maxInsnsPerProgram == 0 {
+		var entries []ruleEntry
+		for _, u := range units {
+			entries = append(entries, u...)
+		}
+		p.writeRules(entries, destLeg)
+		return
+	}
+
+	var chunk []ruleEntry
+	chunkInsns := 0
+	for _, u := range p.splitOversizedUnits(units, destLeg) {
+		insns := p.estimateInsns(u, destLeg)
+		if p.b.NumInsns()+chunkInsns+insns > p.maxInsnsPerProgram &&
+			(len(chunk) > 0 || p.b.NumInsns() > p.progStartInsns) {
+			p.writeRules(chunk, destLeg)
+			p.startNextProgram()
+			chunk = nil
+			chunkInsns = 0
+		}
+		chunk = append(chunk, u...)
+		chunkInsns += insns
+	}
+	p.writeRules(chunk, destLeg)
+}
+
+// splitOversizedUnits splits the units that would not fit in a program on their own into a
+// unit per rule.
+func (p *Builder) splitOversizedUnits(units [][]ruleEntry, destLeg matchLeg) [][]ruleEntry {
+	var out [][]ruleEntry
+	for _, u := range units {
+		if len(u) <= 1 || p.progStartInsns+p.estimateInsns(u, destLeg) <= p.maxInsnsPerProgram {
+			out = append(out, u)
+			continue
+		}
+		log.Debugf("Policy with %d rules does not fit in a single program, splitting it", len(u))
+		for i := range u {
+			out = append(out, u[i:i+1])
+		}
+	}
+	return out
+}
+
+// estimateInsns returns the number of instructions that writeRules would emit for the
+// given rules.
+func (p *Builder) estimateInsns(entries []ruleEntry, destLeg matchLeg) int {
+	scratch := *p
+	scratch.b = NewBlock()
+	scratch.writeRules(entries, destLeg)
+	return scratch.b.NumInsns()
+}
+
+// startNextProgram completes the current program of the chain with a tail call to the next
+// one, which the following rules are written to.
+func (p *Builder) startNextProgram() {
+	cur := len(p.blocks)
+	log.Debugf("Policy program reached %d instructions, continuing in program %d", p.b.NumInsns(), cur+1)
+	p.writeChainTailCall(cur, cur+1)
+	p.writeProgramFooter(p.forXDP)
+	p.blocks = append(p.blocks, p.b)
+
+	p.b = NewBlock()
+	p.writeProgramHeader()
+	p.progStartInsns = p.b.NumInsns()
+}
+
+// writeChainTailCall emits, in program fromIdx of the chain, a tail call to program progIdx.
+// The programs of the chain are at consecutive indexes of their prog array, from the chain
+// base that is recorded in the state, so a program doesn't depend on where the chain is.
+// Only the first program of an endpoint's own chain sets the base, which depends on the
+// chain's slot set; the entry trampoline of a shared chain sets it instead.
+func (p *Builder) writeChainTailCall(fromIdx, progIdx int) {
+	mapFD := p.jumpMapFD
+	if p.sharedProgs {
+		mapFD = p.sharedProgArrayFD
+	} else if fromIdx == 0 {
+		p.b.MovImm32(R1, int32(policyChainBase(p.chainSlotSet)))
+		p.b.Store32(R9, R1, stateOffPolChainBase)
+	}
+	p.b.Mov64(R1, R6) // First arg is the context.
+	p.b.LoadMapFD(R2, uint32(mapFD))
+	p.b.Load32(R3, R9, stateOffPolChainBase)
+	p.b.AddImm64(R3, int32(progIdx))
+	p.b.Call(HelperTailCall)
+	p.writeTailCallFailed()
+}
+
+// EntryTrampoline returns the program that an endpoint whose policy program chain is shared
+// (see WithSharedProgArray) has in its policy slot.  It records the slot of the endpoint's
+// return trampoline and the base of the chain in the state and then tail calls the first
+// program of the chain, at index headSlot of the shared prog array.
+func EntryTrampoline(stateMapFD, progArrayFD bpf.MapFD, headSlot, retSlot int) (Insns, error) {
+	p := NewBuilder(nil, 0, stateMapFD, 0)
+	p.b = NewBlock()
+	p.writeProgramHeader()
+	p.b.MovImm32(R1, int32(retSlot))
+	p.b.Store32(R9, R1, stateOffPolRetIdx)
+	p.b.MovImm32(R1, int32(headSlot))
+	p.b.Store32(R9, R1, stateOffPolChainBase)
+	p.writeTailCallToMap(progArrayFD, headSlot)
+	p.b.LabelNextInsn("exit")
+	p.b.MovImm64(R0, 2 /* TC_ACT_SHOT */)
+	p.b.Exit()
+	return p.b.Assemble()
+}
+
+// ReturnTrampoline returns the program that a shared policy program chain tail calls, in the
+// shared prog array, once the policy has decided on a packet.  It tail calls the allowed or the
+// denied program of the endpoint that owns the given jump map, according to the policy result.
+func ReturnTrampoline(stateMapFD, jumpMapFD bpf.MapFD) (Insns, error) {
+	p := NewBuilder(nil, 0, stateMapFD, jumpMapFD)
+	p.b = NewBlock()
+	p.writeProgramHeader()
+	p.b.Load32(R1, R9, stateOffPolResult)
+	p.b.JumpEqImm64(R1, int32(state.PolicyDeny), "deny")
+	p.writeTailCall(jumpIdxAllowed)
+	p.b.LabelNextInsn("deny")
+	p.b.Mov64(R1, R6)
+	p.b.LoadMapFD(R2, uint32(jumpMapFD))
+	p.b.MovImm32(R3, int32(jumpIdxDenied))
+	p.b.Call(HelperTailCall)
+	p.b.LabelNextInsn("exit")
+	p.b.MovImm64(R0, 2 /* TC_ACT_SHOT */)
+	p.b.Exit()
+	return p.b.Assemble()
+}
+
+// startProgramForTier starts a new program for the next tier, if the builder emits a
+// program per tier and the current program already has rules.
+func (p *Builder) startProgramForTier() {
+	if p.programPerTier && p.b.NumInsns() > p.progStartInsns {
+		p.startNextProgram()
+	}
+}
+
+// labelTarget labels the next instruction with a label that may be the target of jumps from
+// earlier programs of the chain.  If it is, the label must start a program so we start a new
+// one unless we're already at the start of a program.
+func (p *Builder) labelTarget(label string) {
+	for _, b := range p.blocks {
+		if b.TargetIsUsed(label) {
+			if p.b.NumInsns() > p.progStartInsns {
+				p.startNextProgram()
+			}
+			break
+		}
+	}
+	p.labelProgIdx[label] = len(p.blocks)
+	p.b.LabelNextInsn(label)
+}
+
+// assembleChain resolves the jumps between the programs of the chain and assembles them.
+func (p *Builder) assembleChain() ([]Insns, error) {
+	if len(p.blocks) > MaxPolicyChainLen {
+		return nil, fmt.Errorf("policy program needs %d programs, more than the maximum of %d",
+			len(p.blocks), MaxPolicyChainLen)
+	}
+
+	progs := make([]Insns, len(p.blocks))
+	for i, b := range p.blocks {
+		p.b = b
+		for _, label := range b.UnresolvedTargets() {
+			progIdx, ok := p.labelProgIdx[label]
+			if !ok || progIdx <= i {
+				// Leave it to Assemble() to report the missing label.
+				continue
+			}
+			p.b.LabelNextInsn(label)
+			p.writeChainTailCall(i, progIdx)
+		}
+		if !p.noOptimizer {
+			stats := b.Optimize()
+			log.Debugf("Optimized policy program %d: %d -> %d instructions, %d loads promoted to registers",
+				i, stats.InsnsBefore, stats.InsnsAfter, stats.PromotedLoads)
+		}
+		insns, err := b.Assemble()
+		if err != nil {
+			return nil, err
+		}
+		progs[i] = insns
+	}
+	if len(progs) > 1 {
+		log.Debugf("Policy program split into %d programs", len(progs))
+	}
+	return progs, nil
+}
@@ -0,0 +1,206 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package polprog
+
+import (
+	"fmt"
+	"sort"
+	"strings"
+
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/felix/proto"
+)
+
+// A straight-line policy program checks every rule in turn, reloading and comparing the
+// same fields of the state over and over.  Instead, we build a decision tree over the
+// rules.  At each level of the tree we look for runs of consecutive rules that share a
+// match criterion (the same protocol, the same destination ports, ...).  The shared
+// criterion is checked once for the whole run, if it does not match, the whole run is
+// skipped; if it does, the rules of the run are emitted (recursively) without it.
+//
+// Since we only ever group consecutive rules, first-match semantics are preserved.  The
+// one exception is the protocol: rules that match different protocols are disjoint, so
+// they can be reordered with respect to each other without changing which rule a packet
+// matches first.  That lets us dispatch on protocol even when the rules interleave
+// protocols, see reorderByProtocol.
+
+type ruleGroupLevel struct {
+	name string
+	// key returns a string that is equal for two rules iff they share the criterion,
+	// or "" if the rule does not have the criterion.
+	key func(r *proto.Rule) string
+	// writeMatch emits the check for the criterion of the given rule.
+	writeMatch func(p *Builder, r *proto.Rule, destLeg matchLeg)
+	// strip removes the criterion from a copy of the rule.
+	strip func(r *proto.Rule)
+}
+
+var ruleGroupLevels = []ruleGroupLevel{
+	{
+		name: "protocol",
+		key: func(r *proto.Rule) string {
+			if r.Protocol == nil {
+				return ""
+			}
+			return fmt.Sprint(protocolToNumber(r.Protocol))
+		},
+		writeMatch: func(p *Builder, r *proto.Rule, _ matchLeg) {
+			p.writeProtoMatch(false, r.Protocol)
+		},
+		strip: func(r *proto.Rule) {
+			r.Protocol = nil
+		},
+	},
+	{
+		name: "dst ports",
+		key: func(r *proto.Rule) string {
+			if len(r.DstPorts) == 0 || len(r.DstNamedPortIpSetIds) > 0 {
+				// Named ports are ORed with the numeric ports so we cannot split them.
+				return ""
+			}
+			var sb strings.Builder
+			for _, pr := range r.DstPorts {
+				fmt.Fprintf(&sb, "%d-%d,", pr.First, pr.Last)
+			}
+			return sb.String()
+		},
+		writeMatch: func(p *Builder, r *proto.Rule, destLeg matchLeg) {
+			p.writePortsMatch(false, destLeg, r.DstPorts, nil)
+		},
+		strip: func(r *proto.Rule) {
+			r.DstPorts = nil
+		},
+	},
+	{
+		name: "dst nets",
+		key: func(r *proto.Rule) string {
+			return strings.Join(r.DstNet, ",")
+		},
+		writeMatch: func(p *Builder, r *proto.Rule, destLeg matchLeg) {
+			p.writeCIDRSMatch(false, destLeg, r.DstNet)
+		},
+		strip: func(r *proto.Rule) {
+			r.DstNet = nil
+		},
+	},
+	{
+		name: "dst IP sets",
+		key: func(r *proto.Rule) string {
+			return strings.Join(r.DstIpSetIds, ",")
+		},
+		writeMatch: func(p *Builder, r *proto.Rule, destLeg matchLeg) {
+			p.writeIPSetOrMatch(destLeg, r.DstIpSetIds)
+		},
+		strip: func(r *proto.Rule) {
+			r.DstIpSetIds = nil
+		},
+	},
+}
+
+// reorderByProtocol stably sorts each maximal run of rules that all match a (positive)
+// protocol so that rules for the same protocol become adjacent.  The relative order of
+// rules for the same protocol is preserved and rules for different protocols can never
+// both match a packet so the first rule that matches a packet does not change.
+func reorderByProtocol(entries []ruleEntry) []ruleEntry {
+	protoKey := ruleGroupLevels[0].key
+	out := make([]ruleEntry, len(entries))
+	copy(out, entries)
+
+	for start := 0; start < len(out); {
+		if protoKey(out[start].rule) == "" {
+			start++
+			continue
+		}
+		end := start
+		firstSeen := map[string]int{}
+		for end < len(out) {
+			k := protoKey(out[end].rule)
+			if k == "" {
+				break
+			}
+			if _, ok := firstSeen[k]; !ok {
+				firstSeen[k] = end
+			}
+			end++
+		}
+		run := out[start:end]
+		sort.SliceStable(run, func(i, j int) bool {
+			return firstSeen[protoKey(run[i].rule)] < firstSeen[protoKey(run[j].rule)]
+		})
+		start = end
+	}
+
+	return out
+}
+
+// writeRuleTree emits the given rules, grouping runs of consecutive rules that share
+// the match criterion of the given level and recursing into the next level for the
+// rules of each group and for the rules that could not be grouped.
+func (p *Builder) writeRuleTree(entries []ruleEntry, destLeg matchLeg, level int) {
+	if level >= len(ruleGroupLevels) {
+		for _, e := range entries {
+			p.writeFilteredRule(e.rule, e.actionLabel, destLeg)
+		}
+		return
+	}
+
+	lvl := ruleGroupLevels[level]
+	var ungrouped []ruleEntry
+	for i := 0; i < len(entries); {
+		key := lvl.key(entries[i].rule)
+		j := i + 1
+		if key != "" {
+			for j < len(entries) && lvl.key(entries[j].rule) == key {
+				j++
+			}
+		}
+		if j-i < 2 {
+			// Nothing to share, leave it to the next level.
+			ungrouped = append(ungrouped, entries[i])
+			i = j
+			continue
+		}
+
+		p.writeRuleTree(ungrouped, destLeg, level+1)
+		ungrouped = nil
+		p.writeRuleGroup(lvl, entries[i:j], destLeg, level)
+		i = j
+	}
+	p.writeRuleTree(ungrouped, destLeg, level+1)
+}
+
+func (p *Builder) writeRuleGroup(lvl ruleGroupLevel, entries []ruleEntry, destLeg matchLeg, level int) {
+	groupLabelPrefix := fmt.Sprintf("group_%d", p.groupID)
+	p.groupID++
+	log.Debugf("Start of %s %s (%d rules)", groupLabelPrefix, lvl.name, len(entries))
+
+	// Emit the shared criterion, jumping to the end of the group if it does not match.
+	p.groupLabelPrefix = groupLabelPrefix
+	lvl.writeMatch(p, entries[0].rule, destLeg)
+	p.groupLabelPrefix = ""
+	p.rulePartID = 0
+
+	stripped := make([]ruleEntry, len(entries))
+	for i, e := range entries {
+		r := *e.rule
+		lvl.strip(&r)
+		stripped[i] = ruleEntry{rule: &r, actionLabel: e.actionLabel}
+	}
+	p.writeRuleTree(stripped, destLeg, level+1)
+
+	p.b.LabelNextInsn(groupLabelPrefix + "_no_match")
+	log.Debugf("End of %s", groupLabelPrefix)
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Package ring decodes the per-CPU rings of fixed-size records that the BPF programs write
+// to single-entry percpu_array maps, such as the log records and the flow records.
+//
+// Each CPU's ring is:
+//
+// uint64 seq                 8   Number of records written so far.
+// record recs[size]              Record n (counting from 1) is at index (n-1) % size.
+//
+// and each record starts and ends with its own sequence number, which the program clears
+// before it writes the record and sets to n once it has written the rest of it, the trailing
+// one first.  A record is complete once its leading sequence number matches the sequence
+// number it is read for; a lower one means that the program is still writing it and a higher
+// one that it has already been overwritten.  The value of the map is copied while the
+// programs write to it, from start to end, so a record that the program started overwriting
+// after its leading sequence number was copied has a trailing one that doesn't match.
+package ring
+
+import "encoding/binary"
+
+// Reader keeps track of the next record to read from each CPU's ring.
+type Reader struct {
+	size       int
+	recordSize int
+
+	// nextSeq is the sequence number of the next record to read for each CPU.
+	nextSeq []uint64
+	// backlog is the largest number of new records in a CPU's ring at the last Read.
+	backlog uint64
+}
+
+// NewReader returns a Reader for rings of size records of recordSize bytes, including the
+// two sequence numbers; size must be a power of 2.
+func NewReader(size, recordSize int) *Reader {
+	return &Reader{
+		size:       size,
+		recordSize: recordSize,
+	}
+}
+
+// ValueSize returns the size of one CPU's ring, the value size of the map.
+func (r *Reader) ValueSize() int {
+	return 8 + r.size*r.recordSize
+}
+
+// SkipToEnd skips the records that are currently in the rings, given the per-CPU value of
+// the map.
+func (r *Reader) SkipToEnd(v []byte) {
+	valueSize := r.ValueSize()
+	r.nextSeq = r.nextSeq[:0]
+	for ; len(v) >= valueSize; v = v[valueSize:] {
+		r.nextSeq = append(r.nextSeq, binary.LittleEndian.Uint64(v)+1)
+	}
+}
+
+// Backlog returns the largest number of new records, including the lost ones, that the last
+// Read found in a CPU's ring.  A backlog close to the size of the ring means that the rings
+// should be read more often.
+func (r *Reader) Backlog() int {
+	return int(r.backlog)
+}
+
+// Read calls fn with the complete records that were written since the last call, in order
+// for each CPU, given the per-CPU value of the map.  It returns the number of records read
+// and the number of records that were overwritten before they could be read.
+func (r *Reader) Read(v []byte, fn func(cpu int, rec []byte)) (numRead int, numLost uint64) {
+	valueSize := r.ValueSize()
+	size := uint64(r.size)
+	r.backlog = 0
+	for cpu := 0; len(v) >= valueSize; cpu, v = cpu+1, v[valueSize:] {
+		if cpu >= len(r.nextSeq) {
+			r.nextSeq = append(r.nextSeq, 1)
+		}
+		ringSeq := binary.LittleEndian.Uint64(v)
+		seq := r.nextSeq[cpu]
+		if ringSeq >= seq && ringSeq-seq+1 > r.backlog {
+			r.backlog = ringSeq - seq + 1
+		}
+		if ringSeq >= seq+size {
+			lost := ringSeq - seq - size + 1
+			numLost += lost
+			seq += lost
+		}
+		for ; seq <= ringSeq; seq++ {
+			off := 8 + int((seq-1)%size)*r.recordSize
+			rec := v[off : off+r.recordSize]
+			recSeq := binary.LittleEndian.Uint64(rec)
+			if recSeq < seq {
+				// Still being written.
+				break
+			}
+			if recSeq > seq || binary.LittleEndian.Uint64(rec[r.recordSize-8:]) != seq {
+				// Overwritten since we read the ring's sequence number, or while we
+				// copied the record.
+				numLost++
+				continue
+			}
+			fn(cpu, rec)
+			numRead++
+		}
+		r.nextSeq[cpu] = seq
+	}
+	return
+}
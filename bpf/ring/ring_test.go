@@ -0,0 +1,102 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package ring
+
+import (
+	"encoding/binary"
+	"testing"
+
+	. "github.com/onsi/gomega"
+)
+
+const (
+	testSize       = 4
+	testRecordSize = 24
+)
+
+// write emulates a BPF program writing val to the given CPU's ring in a per-CPU value.  If
+// complete is false, it leaves the record's sequence numbers unset.
+func write(v []byte, cpu int, val uint64, complete bool) {
+	ring := v[cpu*(8+testSize*testRecordSize):]
+	seq := binary.LittleEndian.Uint64(ring)
+	rec := ring[8+int(seq%testSize)*testRecordSize:]
+	seq++
+	binary.LittleEndian.PutUint64(ring, seq)
+	binary.LittleEndian.PutUint64(rec, 0)
+	binary.LittleEndian.PutUint64(rec[16:], 0)
+	binary.LittleEndian.PutUint64(rec[8:], val)
+	if complete {
+		binary.LittleEndian.PutUint64(rec[16:], seq)
+		binary.LittleEndian.PutUint64(rec, seq)
+	}
+}
+
+func TestReader(t *testing.T) {
+	RegisterTestingT(t)
+
+	r := NewReader(testSize, testRecordSize)
+	v := make([]byte, 2*r.ValueSize())
+	var got []uint64
+	read := func() (int, uint64) {
+		got = nil
+		return r.Read(v, func(cpu int, rec []byte) {
+			got = append(got, uint64(cpu)*100+binary.LittleEndian.Uint64(rec[8:]))
+		})
+	}
+
+	write(v, 0, 1, true)
+	r.SkipToEnd(v)
+	n, lost := read()
+	Expect(n).To(BeZero())
+	Expect(lost).To(BeZero())
+
+	write(v, 0, 2, true)
+	write(v, 1, 3, true)
+	write(v, 0, 4, true)
+	n, lost = read()
+	Expect(n).To(Equal(3))
+	Expect(lost).To(BeZero())
+	Expect(got).To(Equal([]uint64{2, 4, 103}))
+	Expect(r.Backlog()).To(Equal(2))
+
+	// A record that is still being written is read once it is complete.
+	write(v, 1, 5, false)
+	n, _ = read()
+	Expect(n).To(BeZero())
+	binary.LittleEndian.PutUint64(v[r.ValueSize()+8+testRecordSize+16:], 2)
+	binary.LittleEndian.PutUint64(v[r.ValueSize()+8+testRecordSize:], 2)
+	read()
+	Expect(got).To(Equal([]uint64{105}))
+
+	// A record that was overwritten while it was copied, after its leading sequence number,
+	// is lost rather than read torn.
+	write(v, 1, 6, true)
+	rec := v[r.ValueSize()+8+2*testRecordSize:]
+	binary.LittleEndian.PutUint64(rec[8:], 7)
+	binary.LittleEndian.PutUint64(rec[16:], 0)
+	n, lost = read()
+	Expect(n).To(BeZero())
+	Expect(lost).To(Equal(uint64(1)))
+
+	// Records that were overwritten are counted as lost.
+	for i := uint64(0); i < testSize+2; i++ {
+		write(v, 0, 10+i, true)
+	}
+	n, lost = read()
+	Expect(n).To(Equal(testSize))
+	Expect(lost).To(Equal(uint64(2)))
+	Expect(got).To(Equal([]uint64{12, 13, 14, 15}))
+	Expect(r.Backlog()).To(Equal(testSize + 2))
+}
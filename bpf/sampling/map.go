@@ -0,0 +1,94 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Package sampling controls the packet sampler of the BPF programs and reads the samples
+// that it writes: the headers, hook, interface, verdict and reason of one packet in N.
+package sampling
+
+import (
+	"encoding/binary"
+
+	"github.com/projectcalico/felix/bpf"
+)
+
+// WARNING: must be kept in sync with the definitions in bpf-gpl/sample.h.
+//
+// The ring map has a single per-CPU entry, see package ring, with records:
+//
+// uint64 seq                 8
+// uint32 ifindex            +4
+// uint32 len                +4   Length of the packet.
+// uint8  hook               +1   As counters.Hook.
+// uint8  reason             +1   Reason index, as for the verdict counters.
+// uint8  drop               +1
+// uint8  pad                +1
+// uint32 hdr_len            +4   Number of bytes in hdr.
+// uint8  hdr[HdrLen]      +128   The start of the packet, from the Ethernet header.
+// uint64 seq_end            +8
+const (
+	RingSize   = 128
+	HdrLen     = 128
+	RecordSize = 24 + HdrLen + 8
+
+	// MaxRate is the largest rate that SetRate accepts.
+	MaxRate = 1 << 24
+)
+
+var MapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_smpl_rb",
+	Type:       "percpu_array",
+	KeySize:    4,
+	ValueSize:  8 + RingSize*RecordSize,
+	MaxEntries: 1,
+	Name:       "cali_v4_smpl_rb",
+}
+
+var CfgMapParams = bpf.MapParameters{
+	Filename:   "/sys/fs/bpf/tc/globals/cali_v4_smpl_cfg",
+	Type:       "array",
+	KeySize:    4,
+	ValueSize:  4,
+	MaxEntries: 1,
+	Name:       "cali_v4_smpl_cfg",
+}
+
+func Map(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(MapParams)
+}
+
+func CfgMap(mc *bpf.MapContext) bpf.Map {
+	return mc.NewPinnedMap(CfgMapParams)
+}
+
+var zeroKey = []byte{0, 0, 0, 0}
+
+// SetRate makes the BPF programs sample one packet in rate, chosen at random, or disables
+// sampling if rate is 0.  It takes effect immediately.
+func SetRate(cfgMap bpf.Map, rate uint32) error {
+	if rate > MaxRate {
+		rate = MaxRate
+	}
+	v := make([]byte, 4)
+	binary.LittleEndian.PutUint32(v, rate)
+	return cfgMap.Update(zeroKey, v)
+}
+
+// GetRate returns the sampling rate, 0 if sampling is disabled.
+func GetRate(cfgMap bpf.Map) (uint32, error) {
+	v, err := cfgMap.Get(zeroKey)
+	if err != nil {
+		return 0, err
+	}
+	return binary.LittleEndian.Uint32(v), nil
+}
@@ -0,0 +1,131 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package sampling
+
+import (
+	"encoding/binary"
+	"fmt"
+	"net"
+
+	"github.com/prometheus/client_golang/prometheus"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/counters"
+	"github.com/projectcalico/felix/bpf/ring"
+)
+
+var counterSamplesLost = prometheus.NewCounter(prometheus.CounterOpts{
+	Name: "felix_bpf_packet_samples_lost",
+	Help: "Number of BPF packet samples that were overwritten before they were read.",
+})
+
+func init() {
+	prometheus.MustRegister(counterSamplesLost)
+}
+
+// Sample is a sampled packet.
+type Sample struct {
+	CPU     int
+	Hook    counters.Hook
+	IfIndex uint32
+	// Len is the length of the packet, Headers holds up to HdrLen bytes from its start.
+	Len     uint32
+	Reason  int
+	Drop    bool
+	Headers []byte
+}
+
+func sampleFromBytes(cpu int, rec []byte) Sample {
+	hdrLen := binary.LittleEndian.Uint32(rec[20:24])
+	if hdrLen > HdrLen {
+		hdrLen = HdrLen
+	}
+	return Sample{
+		CPU:     cpu,
+		IfIndex: binary.LittleEndian.Uint32(rec[8:12]),
+		Len:     binary.LittleEndian.Uint32(rec[12:16]),
+		Hook:    counters.Hook(rec[16]),
+		Reason:  int(rec[17]),
+		Drop:    rec[18] != 0,
+		Headers: append([]byte(nil), rec[24:24+hdrLen]...),
+	}
+}
+
+func (s Sample) String() string {
+	verdict := "allow"
+	if s.Drop {
+		verdict = "drop"
+	}
+	return fmt.Sprintf("%s ifindex=%d %s len=%d %s reason=%s",
+		s.Hook, s.IfIndex, s.flowString(), s.Len, verdict, counters.ReasonName(s.Reason))
+}
+
+// flowString decodes the IPv4 addresses, protocol and ports from the headers.  XDP and the
+// TC programs on L3 devices may see packets without an Ethernet header, in which case the
+// headers start with the IP header.
+func (s Sample) flowString() string {
+	h := s.Headers
+	if len(h) >= 14 && binary.BigEndian.Uint16(h[12:14]) == 0x0800 {
+		h = h[14:]
+	}
+	if len(h) < 20 || h[0]>>4 != 4 {
+		return "non-ipv4"
+	}
+	proto := h[9]
+	src, dst := net.IP(h[12:16]), net.IP(h[16:20])
+	ihl := int(h[0]&0xf) * 4
+	if (proto == 6 || proto == 17) && len(h) >= ihl+4 {
+		return fmt.Sprintf("%s:%d->%s:%d proto=%d", src, binary.BigEndian.Uint16(h[ihl:]),
+			dst, binary.BigEndian.Uint16(h[ihl+2:]), proto)
+	}
+	return fmt.Sprintf("%s->%s proto=%d", src, dst, proto)
+}
+
+// Reader reads the samples from the per-CPU rings.
+type Reader struct {
+	ringMap bpf.Map
+	rings   *ring.Reader
+}
+
+func NewReader(ringMap bpf.Map) *Reader {
+	return &Reader{
+		ringMap: ringMap,
+		rings:   ring.NewReader(RingSize, RecordSize),
+	}
+}
+
+// SkipToEnd discards the samples that are currently in the rings.
+func (r *Reader) SkipToEnd() error {
+	v, err := r.ringMap.Get(zeroKey)
+	if err != nil {
+		return err
+	}
+	r.rings.SkipToEnd(v)
+	return nil
+}
+
+// Read passes the samples that were written since the last call to handler, in order for
+// each CPU.  It returns the number of samples read.
+func (r *Reader) Read(handler func(Sample)) (int, error) {
+	v, err := r.ringMap.Get(zeroKey)
+	if err != nil {
+		return 0, err
+	}
+	numRead, numLost := r.rings.Read(v, func(cpu int, rec []byte) {
+		handler(sampleFromBytes(cpu, rec))
+	})
+	counterSamplesLost.Add(float64(numLost))
+	return numRead, nil
+}
@@ -0,0 +1,88 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package sampling
+
+import (
+	"encoding/binary"
+	"testing"
+
+	. "github.com/onsi/gomega"
+
+	"github.com/projectcalico/felix/bpf/counters"
+	"github.com/projectcalico/felix/bpf/mock"
+)
+
+func TestReader(t *testing.T) {
+	RegisterTestingT(t)
+
+	m := mock.NewMockMap(MapParams)
+	v := make([]byte, MapParams.ValueSize)
+	r := NewReader(m)
+	Expect(m.Update(zeroKey, v)).To(Succeed())
+	Expect(r.SkipToEnd()).To(Succeed())
+
+	// A TCP packet from 10.0.0.1:1234 to 10.0.0.2:80, with an Ethernet header.
+	hdr := make([]byte, 14+20+20)
+	binary.BigEndian.PutUint16(hdr[12:], 0x0800)
+	hdr[14] = 0x45
+	hdr[14+9] = 6
+	copy(hdr[14+12:], []byte{10, 0, 0, 1, 10, 0, 0, 2})
+	binary.BigEndian.PutUint16(hdr[34:], 1234)
+	binary.BigEndian.PutUint16(hdr[36:], 80)
+
+	binary.LittleEndian.PutUint64(v, 1)
+	rec := v[8:]
+	binary.LittleEndian.PutUint64(rec, 1)
+	binary.LittleEndian.PutUint32(rec[8:], 5)
+	binary.LittleEndian.PutUint32(rec[12:], 1500)
+	rec[16] = byte(counters.HookFromWEP)
+	rec[17] = counters.ReasonPolicy
+	rec[18] = 1
+	binary.LittleEndian.PutUint32(rec[20:], uint32(len(hdr)))
+	copy(rec[24:], hdr)
+	binary.LittleEndian.PutUint64(rec[RecordSize-8:], 1)
+	Expect(m.Update(zeroKey, v)).To(Succeed())
+
+	var got []Sample
+	n, err := r.Read(func(s Sample) { got = append(got, s) })
+	Expect(err).NotTo(HaveOccurred())
+	Expect(n).To(Equal(1))
+	Expect(got[0].Headers).To(Equal(hdr))
+	Expect(got[0].String()).To(Equal(
+		"from_wep ifindex=5 10.0.0.1:1234->10.0.0.2:80 proto=6 len=1500 drop reason=policy"))
+
+	// A sample that the program was overwriting while it was copied is skipped, not torn.
+	binary.LittleEndian.PutUint64(v, 2)
+	rec = v[8+RecordSize:]
+	copy(rec, v[8:8+RecordSize])
+	binary.LittleEndian.PutUint64(rec, 2)
+	binary.LittleEndian.PutUint64(rec[RecordSize-8:], 0)
+	Expect(m.Update(zeroKey, v)).To(Succeed())
+	got = nil
+	n, err = r.Read(func(s Sample) { got = append(got, s) })
+	Expect(err).NotTo(HaveOccurred())
+	Expect(n).To(BeZero())
+	Expect(got).To(BeEmpty())
+}
+
+func TestRate(t *testing.T) {
+	RegisterTestingT(t)
+
+	m := mock.NewMockMap(CfgMapParams)
+	Expect(SetRate(m, 1000)).To(Succeed())
+	Expect(GetRate(m)).To(Equal(uint32(1000)))
+	Expect(SetRate(m, MaxRate+1)).To(Succeed())
+	Expect(GetRate(m)).To(Equal(uint32(MaxRate)))
+}
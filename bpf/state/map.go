@@ -48,6 +48,9 @@ const (
 //    struct calico_ct_result ct_result;
 //    struct calico_nat_dest nat_dest;
 //    __u64 prog_start_time;
+//    __u64 lat_stage_start;
+//    __u32 pol_ret_idx;
+//    __u32 pol_chain_base;
 // };
 type State struct {
 	SrcAddr             uint32
@@ -70,9 +73,12 @@ type State struct {
 	ConntrackIfIndexCtd uint32
 	NATData             uint64
 	ProgStartTime       uint64
+	LatStageStart       uint64
+	PolicyRetIdx        uint32
+	PolicyChainBase     uint32
 }
 
-const expectedSize = 80
+const expectedSize = 96
 
 func (s *State) AsBytes() []byte {
 	size := unsafe.Sizeof(State{})
@@ -100,7 +106,7 @@ func Map(mc *bpf.MapContext) bpf.Map {
 		ValueSize:  expectedSize,
 		MaxEntries: 1,
 		Name:       "cali_v4_state",
-		Version:    3,
+		Version:    5,
 	})
 }
 
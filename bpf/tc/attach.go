@@ -44,7 +44,6 @@ type AttachPoint struct {
 	ToOrFrom             ToOrFromEp
 	Hook                 Hook
 	Iface                string
-	LogLevel             string
 	HostIP               net.IP
 	IntfIP               net.IP
 	FIB                  bool
@@ -53,6 +52,12 @@ type AttachPoint struct {
 	TunnelMTU            uint16
 	VXLANPort            uint16
 	ExtToServiceConnmark uint32
+	// NATDisabled, CTLBDisabled and VXLANDisabled tell the program that there are no
+	// services, no connect-time load balancer NAT or no VXLAN packets, so that it can skip
+	// the stages that handle them.
+	NATDisabled   bool
+	CTLBDisabled  bool
+	VXLANDisabled bool
 }
 
 var tcLock sync.RWMutex
@@ -204,7 +209,7 @@ func (ap AttachPoint) listAttachedPrograms() ([]attachedProg, error) {
 		return nil, fmt.Errorf("failed to list tc filters on interface: %w", err)
 	}
 	// Lines look like this; the section name always includes calico.
-	// filter protocol all pref 49152 bpf chain 0 handle 0x1 to_hep_no_log.o:[calico_to_host_ep] direct-action not_in_hw id 821 tag ee402594f8f85ac3 jited
+	// filter protocol all pref 49152 bpf chain 0 handle 0x1 to_hep.o:[calico_to_host_ep] direct-action not_in_hw id 821 tag ee402594f8f85ac3 jited
 	var progsToClean []attachedProg
 	for _, line := range strings.Split(string(out), "\n") {
 		if !strings.Contains(line, "calico") {
@@ -243,6 +248,7 @@ func (ap AttachPoint) patchBinary(logCtx *log.Entry, ifile, ofile string) error
 	}
 	b.PatchVXLANPort(vxlanPort)
 	b.PatchExtToServiceConnmark(uint32(ap.ExtToServiceConnmark))
+	b.PatchGlobalFlags(ap.GlobalFlags())
 
 	err = b.PatchIntfAddr(ap.IntfIP)
 	if err != nil {
@@ -264,7 +270,22 @@ func (ap AttachPoint) ProgramName() string {
 
 // FileName return the file the AttachPoint will load the program from
 func (ap AttachPoint) FileName() string {
-	return ProgFilename(ap.Type, ap.ToOrFrom, ap.ToHostDrop, ap.FIB, ap.DSR, ap.LogLevel)
+	return ProgFilename(ap.Type, ap.ToOrFrom)
+}
+
+// GlobalFlags returns the global flags that are patched into the program.
+func (ap AttachPoint) GlobalFlags() uint32 {
+	flags := GlobalFlags(ap.Type, ap.ToOrFrom, ap.ToHostDrop, ap.FIB, ap.DSR)
+	if ap.NATDisabled {
+		flags |= GlobalsNoNAT
+	}
+	if ap.CTLBDisabled {
+		flags |= GlobalsNoCTLB
+	}
+	if ap.VXLANDisabled {
+		flags |= GlobalsNoVXLAN
+	}
+	return flags
 }
 
 func (ap AttachPoint) IsAttached() (bool, error) {
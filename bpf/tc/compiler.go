@@ -18,7 +18,6 @@ package tc
 
 import (
 	"fmt"
-	"strings"
 
 	"github.com/sirupsen/logrus"
 )
@@ -52,34 +51,51 @@ func SectionName(endpointType EndpointType, fromOrTo ToOrFromEp) string {
 	return fmt.Sprintf("calico_%s_%s_ep", fromOrTo, endpointType)
 }
 
-func ProgFilename(epType EndpointType, toOrFrom ToOrFromEp, epToHostDrop, fib, dsr bool, logLevel string) string {
-	if epToHostDrop && (epType != EpTypeWorkload || toOrFrom == ToEp) {
-		// epToHostDrop only makes sense in the from-workload program.
-		logrus.Debug("Ignoring epToHostDrop, doesn't apply to this target")
-		epToHostDrop = false
-	}
-	if fib && (toOrFrom != FromEp) {
-		// FIB lookup only makes sense for traffic towards the host.
-		logrus.Debug("Ignoring fib enabled, doesn't apply to this target")
-		fib = false
-	}
+// Bits of the global flags that are patched into the programs at load time.
+//
+// WARNING: must be kept in sync with CALI_GLOBALS_* in bpf.h.
+const (
+	GlobalsDropWorkloadToHost uint32 = 1 << iota
+	GlobalsFIBLookup
+	GlobalsDSR
+	// The GlobalsNo* bits switch off stages of the programs that are not in use.
+	GlobalsNoNAT
+	GlobalsNoCTLB
+	GlobalsNoVXLAN
+)
 
-	var hostDropPart string
-	if epType == EpTypeWorkload && epToHostDrop {
-		hostDropPart = "host_drop_"
+// GlobalFlags returns the global flags for a program, leaving out the settings that don't
+// apply to it.
+func GlobalFlags(epType EndpointType, toOrFrom ToOrFromEp, epToHostDrop, fib, dsr bool) uint32 {
+	var flags uint32
+
+	if epToHostDrop {
+		if epType == EpTypeWorkload && toOrFrom == FromEp {
+			flags |= GlobalsDropWorkloadToHost
+		} else {
+			// epToHostDrop only makes sense in the from-workload program.
+			logrus.Debug("Ignoring epToHostDrop, doesn't apply to this target")
+		}
 	}
-	fibPart := ""
 	if fib {
-		fibPart = "fib_"
+		if toOrFrom == FromEp {
+			flags |= GlobalsFIBLookup
+		} else {
+			// FIB lookup only makes sense for traffic towards the host.
+			logrus.Debug("Ignoring fib enabled, doesn't apply to this target")
+		}
 	}
-	dsrPart := ""
 	if dsr && ((epType == EpTypeWorkload && toOrFrom == FromEp) || (epType == EpTypeHost)) {
-		dsrPart = "dsr_"
-	}
-	logLevel = strings.ToLower(logLevel)
-	if logLevel == "off" {
-		logLevel = "no_log"
+		flags |= GlobalsDSR
 	}
+
+	return flags
+}
+
+// ProgFilename returns the name of the object file that holds the program for the given
+// endpoint type and direction.  Other settings are patched in at load time, see GlobalFlags,
+// and the log level is set at runtime, see eventlog.SetLevel.
+func ProgFilename(epType EndpointType, toOrFrom ToOrFromEp) string {
 	var epTypeShort string
 	switch epType {
 	case EpTypeWorkload:
@@ -91,7 +107,6 @@ func ProgFilename(epType EndpointType, toOrFrom ToOrFromEp, epToHostDrop, fib, d
 	case EpTypeWireguard:
 		epTypeShort = "wg"
 	}
-	oFileName := fmt.Sprintf("%v_%v_%s%s%s%v.o",
-		toOrFrom, epTypeShort, hostDropPart, fibPart, dsrPart, logLevel)
+	oFileName := fmt.Sprintf("%v_%v.o", toOrFrom, epTypeShort)
 	return oFileName
 }
@@ -40,7 +40,6 @@ func TestJumpMapCleanup(t *testing.T) {
 		ToOrFrom: tc.ToEp,
 		Hook:     tc.HookIngress,
 		DSR:      true,
-		LogLevel: "DEBUG",
 	}
 
 	t.Run(ap.ProgramName(), func(t *testing.T) {
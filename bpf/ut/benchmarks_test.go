@@ -19,6 +19,17 @@ import (
 	"testing"
 
 	. "github.com/onsi/gomega"
+	"golang.org/x/sys/unix"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/counters"
+	"github.com/projectcalico/felix/bpf/eventlog"
+	bpfipsets "github.com/projectcalico/felix/bpf/ipsets"
+	"github.com/projectcalico/felix/bpf/polprog"
+	"github.com/projectcalico/felix/idalloc"
+	"github.com/projectcalico/felix/ipsets"
+	"github.com/projectcalico/felix/logutils"
+	"github.com/projectcalico/felix/proto"
 )
 
 func BenchmarkHEP(b *testing.B) {
@@ -31,13 +42,13 @@ func BenchmarkHEP(b *testing.B) {
 	defer cleanUpMaps()
 
 	// Run once to create conntrack entry
-	setupAndRun(b, "no_log", "calico_from_host_ep", false, nil, func(progName string) {
+	setupAndRun(b, eventlog.LevelOff, "calico_from_host_ep", false, nil, func(progName string) {
 		res, err := bpftoolProgRun(progName, pktBytes)
 		Expect(err).NotTo(HaveOccurred())
 		Expect(res.Retval).To(Equal(resTC_ACT_UNSPEC))
 	})
 
-	setupAndRun(b, "no_log", "calico_from_host_ep", false, nil, func(progName string) {
+	setupAndRun(b, eventlog.LevelOff, "calico_from_host_ep", false, nil, func(progName string) {
 		b.ResetTimer()
 		res, err := bpftoolProgRunN(progName, pktBytes, b.N)
 		b.StopTimer()
@@ -46,3 +57,267 @@ func BenchmarkHEP(b *testing.B) {
 		fmt.Printf("%7d iterations avg %d\n", b.N, res.Duration)
 	})
 }
+
+// BenchmarkPolicyProgram measures the cost of evaluating the policy program for a new flow
+// as the number of rules grows.  The packet does not match any rule so that every rule
+// has to be considered, which is the worst case for the flat program.
+func BenchmarkPolicyProgram(b *testing.B) {
+	RegisterTestingT(b)
+
+	for _, numRules := range []int{10, 100, 1000, 2000} {
+		for _, flat := range []bool{true, false} {
+			for _, optimize := range []bool{true, false} {
+				b.Run(fmt.Sprintf("rules=%d,flat=%v,optimize=%v", numRules, flat, optimize), func(b *testing.B) {
+					benchmarkPolicyProgram(b, numRules, flat, optimize)
+				})
+			}
+		}
+	}
+}
+
+func benchmarkPolicyProgram(b *testing.B, numRules int, flat, optimize bool) {
+	protoRules := make([]*proto.Rule, numRules)
+	for i := range protoRules {
+		protoName := "tcp"
+		if i%2 == 1 {
+			protoName = "udp"
+		}
+		// Spread the rules over 16 ports, rules for the same port are adjacent, which is
+		// typical for a policy that lists many CIDRs per port.
+		port := int32(1000 + i*16/numRules)
+		protoRules[i] = &proto.Rule{
+			Action:   "Allow",
+			Protocol: &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: protoName}},
+			DstNet:   []string{fmt.Sprintf("10.%d.%d.0/24", i/256, i%256)},
+			DstPorts: []*proto.PortRange{{First: port, Last: port}},
+		}
+	}
+
+	var opts []polprog.Option
+	if flat {
+		opts = append(opts, polprog.WithFlatRules())
+	}
+	if !optimize {
+		opts = append(opts, polprog.WithoutOptimizer())
+	}
+	alloc := &forceAllocator{alloc: idalloc.New()}
+	pg := polprog.NewBuilder(alloc, ipsMap.MapFD(), testStateMap.MapFD(), tcJumpMap.MapFD(), opts...)
+	insns, err := pg.Instructions(makeRulesSingleTier(protoRules))
+	Expect(err).NotTo(HaveOccurred())
+
+	polProgFD, err := bpf.LoadBPFProgramFromInsns(insns, "Apache-2.0", unix.BPF_PROG_TYPE_SCHED_CLS)
+	Expect(err).NotTo(HaveOccurred())
+	defer func() { _ = polProgFD.Close() }()
+
+	stateIn := tcpPkt("10.0.0.1:31245", "11.0.0.1:80").StateIn()
+	err = testStateMap.Update([]byte{0, 0, 0, 0}, stateIn.AsBytes())
+	Expect(err).NotTo(HaveOccurred())
+
+	b.ResetTimer()
+	res, err := bpf.RunBPFProgram(polProgFD, make([]byte, 1000), b.N)
+	b.StopTimer()
+	Expect(err).NotTo(HaveOccurred())
+	Expect(res.RC).To(BeNumerically("==", RCDrop))
+	b.ReportMetric(float64(res.Duration), "prog-ns/op")
+	b.ReportMetric(float64(len(insns)), "insns")
+}
+
+type benchRuleCounterIdxs struct{}
+
+func (benchRuleCounterIdxs) RuleCounterIndex(ruleID string) (uint32, bool) {
+	var idx uint32
+	_, err := fmt.Sscanf(ruleID, "rule-%d", &idx)
+	return idx, err == nil
+}
+
+// BenchmarkPolicyProgramRuleCounters measures the cost of the rule counters.  The packet
+// matches the last rule, so it is counted once, like any packet that matches a rule.
+func BenchmarkPolicyProgramRuleCounters(b *testing.B) {
+	RegisterTestingT(b)
+
+	for _, counted := range []bool{false, true} {
+		b.Run(fmt.Sprintf("counters=%v", counted), func(b *testing.B) {
+			benchmarkPolicyProgramRuleCounters(b, counted)
+		})
+	}
+}
+
+func benchmarkPolicyProgramRuleCounters(b *testing.B, counted bool) {
+	const numRules = 10
+	protoRules := make([]*proto.Rule, numRules)
+	for i := range protoRules {
+		protoRules[i] = &proto.Rule{
+			Action: "Deny",
+			RuleId: fmt.Sprintf("rule-%d", i),
+			DstNet: []string{fmt.Sprintf("12.%d.0.0/16", i)},
+		}
+	}
+	protoRules[numRules-1].DstNet = nil
+
+	var opts []polprog.Option
+	if counted {
+		opts = append(opts, polprog.WithRuleCounters(ruleCtrsMap.MapFD(), benchRuleCounterIdxs{}))
+	}
+	alloc := &forceAllocator{alloc: idalloc.New()}
+	pg := polprog.NewBuilder(alloc, ipsMap.MapFD(), testStateMap.MapFD(), tcJumpMap.MapFD(), opts...)
+	insns, err := pg.Instructions(makeRulesSingleTier(protoRules))
+	Expect(err).NotTo(HaveOccurred())
+
+	polProgFD, err := bpf.LoadBPFProgramFromInsns(insns, "Apache-2.0", unix.BPF_PROG_TYPE_SCHED_CLS)
+	Expect(err).NotTo(HaveOccurred())
+	defer func() { _ = polProgFD.Close() }()
+
+	stateIn := tcpPkt("10.0.0.1:31245", "11.0.0.1:80").StateIn()
+	err = testStateMap.Update([]byte{0, 0, 0, 0}, stateIn.AsBytes())
+	Expect(err).NotTo(HaveOccurred())
+
+	ctrKey := counters.RuleKey(numRules - 1)
+	before, err := ruleCtrsMap.Get(ctrKey)
+	Expect(err).NotTo(HaveOccurred())
+
+	b.ResetTimer()
+	res, err := bpf.RunBPFProgram(polProgFD, make([]byte, 1000), b.N)
+	b.StopTimer()
+	Expect(err).NotTo(HaveOccurred())
+	Expect(res.RC).To(BeNumerically("==", RCDrop))
+	b.ReportMetric(float64(res.Duration), "prog-ns/op")
+
+	after, err := ruleCtrsMap.Get(ctrKey)
+	Expect(err).NotTo(HaveOccurred())
+	if counted {
+		Expect(counters.RuleValueFromPerCPUBytes(after).Packets -
+			counters.RuleValueFromPerCPUBytes(before).Packets).To(BeNumerically("==", b.N))
+	} else {
+		Expect(after).To(Equal(before))
+	}
+}
+
+type benchIPSetKinds struct{}
+
+func (benchIPSetKinds) MemberKinds(ipSetID string) (exact, cidr bool) {
+	return true, false
+}
+
+// BenchmarkPolicyProgramIPSets compares the cost of IP set matches against the LPM trie with
+// that of matches against the hash map of exact-match members.  Each rule matches the source
+// against a set of /32s that the packet is not in, apart from the last one.
+func BenchmarkPolicyProgramIPSets(b *testing.B) {
+	RegisterTestingT(b)
+
+	for _, hash := range []bool{false, true} {
+		b.Run(fmt.Sprintf("hash=%v", hash), func(b *testing.B) {
+			benchmarkPolicyProgramIPSets(b, hash)
+		})
+	}
+}
+
+func benchmarkPolicyProgramIPSets(b *testing.B, hash bool) {
+	const (
+		numRules   = 10
+		numMembers = 1000
+	)
+
+	cleanUpMaps()
+	defer cleanUpMaps()
+
+	alloc := &forceAllocator{alloc: idalloc.New()}
+	protoRules := make([]*proto.Rule, numRules)
+	for i := range protoRules {
+		setID := fmt.Sprintf("pods-%d", i)
+		protoRules[i] = &proto.Rule{
+			Action:      "Deny",
+			SrcIpSetIds: []string{setID},
+		}
+		id := alloc.GetNoAlloc(setID)
+		for j := 0; j < numMembers; j++ {
+			member := fmt.Sprintf("10.%d.%d.%d", i+1, j/256, j%256)
+			if i == numRules-1 && j == 0 {
+				member = "10.0.0.1"
+			}
+			entry := bpfipsets.ProtoIPSetMemberToBPFEntry(id, member)
+			var err error
+			if hash {
+				err = ipsHashMap.Update(entry.HashKey(), bpfipsets.DummyValue)
+			} else {
+				err = ipsMap.Update(entry[:], bpfipsets.DummyValue)
+			}
+			Expect(err).NotTo(HaveOccurred())
+		}
+	}
+
+	var opts []polprog.Option
+	if hash {
+		opts = append(opts, polprog.WithIPSetHashMap(ipsHashMap.MapFD(), benchIPSetKinds{}))
+	}
+	pg := polprog.NewBuilder(alloc, ipsMap.MapFD(), testStateMap.MapFD(), tcJumpMap.MapFD(), opts...)
+	insns, err := pg.Instructions(makeRulesSingleTier(protoRules))
+	Expect(err).NotTo(HaveOccurred())
+
+	polProgFD, err := bpf.LoadBPFProgramFromInsns(insns, "Apache-2.0", unix.BPF_PROG_TYPE_SCHED_CLS)
+	Expect(err).NotTo(HaveOccurred())
+	defer func() { _ = polProgFD.Close() }()
+
+	stateIn := tcpPkt("10.0.0.1:31245", "11.0.0.1:80").StateIn()
+	err = testStateMap.Update([]byte{0, 0, 0, 0}, stateIn.AsBytes())
+	Expect(err).NotTo(HaveOccurred())
+
+	b.ResetTimer()
+	res, err := bpf.RunBPFProgram(polProgFD, make([]byte, 1000), b.N)
+	b.StopTimer()
+	Expect(err).NotTo(HaveOccurred())
+	Expect(res.RC).To(BeNumerically("==", RCDrop))
+	b.ReportMetric(float64(res.Duration), "prog-ns/op")
+}
+
+// BenchmarkIPSetsResync measures a periodic resync of a 100k member IP set, with a small
+// fraction of the members changing between resyncs.
+func BenchmarkIPSetsResync(b *testing.B) {
+	RegisterTestingT(b)
+
+	const (
+		numMembers = 100000
+		churn      = 1000
+	)
+
+	cleanUpMaps()
+	defer cleanUpMaps()
+
+	ipSets := bpfipsets.NewBPFIPSets(
+		ipsets.NewIPVersionConfig(ipsets.IPFamilyV4, "cali", nil, nil),
+		idalloc.New(),
+		ipsMap,
+		ipsHashMap,
+		logutils.NewSummarizer("test"),
+	)
+	meta := ipsets.IPSetMetadata{SetID: "bench", Type: ipsets.IPSetTypeHashNet, MaxSize: 2 * numMembers}
+	members := func(first int) []string {
+		ms := make([]string, numMembers)
+		for i := range ms {
+			n := first + i
+			ms[i] = fmt.Sprintf("10.%d.%d.%d", (n>>16)&0xff, (n>>8)&0xff, n&0xff)
+		}
+		return ms
+	}
+
+	// Start of day, the map is read and the whole set is written.
+	ipSets.AddOrReplaceIPSet(meta, members(0))
+	ipSets.ApplyUpdates()
+
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		ipSets.AddOrReplaceIPSet(meta, members((i+1)*churn))
+		ipSets.QueueResync()
+		ipSets.ApplyUpdates()
+	}
+	b.StopTimer()
+
+	numEntries := 0
+	for _, m := range []bpf.Map{ipsMap, ipsHashMap} {
+		err := m.Iter(func(_, _ []byte) bpf.IteratorAction {
+			numEntries++
+			return bpf.IterNone
+		})
+		Expect(err).NotTo(HaveOccurred())
+	}
+	Expect(numEntries).To(Equal(numMembers))
+}
@@ -40,13 +40,18 @@ import (
 	"github.com/projectcalico/felix/bpf"
 	"github.com/projectcalico/felix/bpf/arp"
 	"github.com/projectcalico/felix/bpf/conntrack"
+	"github.com/projectcalico/felix/bpf/counters"
+	"github.com/projectcalico/felix/bpf/eventlog"
 	"github.com/projectcalico/felix/bpf/failsafes"
 	"github.com/projectcalico/felix/bpf/ipsets"
 	"github.com/projectcalico/felix/bpf/jump"
+	"github.com/projectcalico/felix/bpf/mapstats"
 	"github.com/projectcalico/felix/bpf/nat"
 	"github.com/projectcalico/felix/bpf/polprog"
 	"github.com/projectcalico/felix/bpf/routes"
+	"github.com/projectcalico/felix/bpf/sampling"
 	"github.com/projectcalico/felix/bpf/state"
+	"github.com/projectcalico/felix/bpf/tc"
 	"github.com/projectcalico/felix/idalloc"
 	"github.com/projectcalico/felix/ip"
 	"github.com/projectcalico/felix/logutils"
@@ -158,7 +163,8 @@ type testLogger interface {
 	Logf(format string, args ...interface{})
 }
 
-func setupAndRun(logger testLogger, loglevel, section string, forXDP bool, rules *polprog.Rules,
+// setupAndRun loads the program with the BPF log level set to logLevel and passes its pin to runFn.
+func setupAndRun(logger testLogger, logLevel uint32, section string, forXDP bool, rules *polprog.Rules,
 	runFn func(progName string), opts ...testOption) {
 
 	topts := testOpts{
@@ -183,6 +189,9 @@ outter:
 		maps = append(maps, m)
 	}
 
+	err := eventlog.SetLevel(logLevelMap, logLevel)
+	Expect(err).NotTo(HaveOccurred())
+
 	tempDir, err := ioutil.TempDir("", "calico-bpf-")
 	Expect(err).NotTo(HaveOccurred())
 	defer os.RemoveAll(tempDir)
@@ -194,9 +203,19 @@ outter:
 	Expect(err).NotTo(HaveOccurred())
 	defer os.RemoveAll(bpfFsDir)
 
-	obj := "../../bpf-gpl/bin/test_xdp_debug"
+	obj := "../../bpf-gpl/bin/test_xdp"
 	progLog := ""
-	if !forXDP {
+	globalFlags := topts.globalFlags
+	if topts.object != "" {
+		// A precompiled production object, its name is complete and its sections are not
+		// suffixed.
+		obj = strings.TrimSuffix(topts.object, ".o")
+		if strings.Contains(section, "host") {
+			progLog = "HEP"
+		} else if !forXDP {
+			progLog = "WEP"
+		}
+	} else if !forXDP {
 		obj = "../../bpf-gpl/bin/test_"
 		if strings.Contains(section, "from") {
 			obj += "from_"
@@ -214,10 +233,12 @@ outter:
 
 		log.WithField("hostIP", hostIP).Info("Host IP")
 		log.WithField("intfIP", intfIP).Info("Intf IP")
-		obj += fmt.Sprintf("fib_%s_skb0x%x", loglevel, skbMark)
+		obj += fmt.Sprintf("skb0x%x", skbMark)
 
+		// The UT programs always do FIB lookups.
+		globalFlags |= tc.GlobalsFIBLookup
 		if strings.Contains(section, "_dsr") {
-			obj += "_dsr"
+			globalFlags |= tc.GlobalsDSR
 			// XXX bit of a hack, we should change the section names to contain _dsr
 			section = strings.Trim(section, "_dsr")
 		}
@@ -235,6 +256,7 @@ outter:
 	Expect(err).NotTo(HaveOccurred())
 	bin.PatchTunnelMTU(natTunnelMTU)
 	bin.PatchVXLANPort(testVxlanPort)
+	bin.PatchGlobalFlags(globalFlags)
 	tempObj := tempDir + "bpf.o"
 	err = bin.WriteToFile(tempObj)
 	Expect(err).NotTo(HaveOccurred())
@@ -254,7 +276,7 @@ outter:
 
 	if rules != nil {
 		alloc := &forceAllocator{alloc: idalloc.New()}
-		pg := polprog.NewBuilder(alloc, ipsMap.MapFD(), stateMap.MapFD(), jumpMap.MapFD())
+		pg := polprog.NewBuilder(alloc, ipsMap.MapFD(), stateMap.MapFD(), jumpMap.MapFD(), topts.polprogOpts...)
 		insns, err := pg.Instructions(*rules)
 		Expect(err).NotTo(HaveOccurred())
 		polProgFD, err := bpf.LoadBPFProgramFromInsns(insns, "Apache-2.0", unix.BPF_PROG_TYPE_SCHED_CLS)
@@ -275,10 +297,13 @@ outter:
 // runBpfTest runs a specific section of the entire bpf program in isolation
 func runBpfTest(t *testing.T, section string, forXDP bool, rules *polprog.Rules, testFn func(bpfProgRunFn), opts ...testOption) {
 	RegisterTestingT(t)
-	setupAndRun(t, "debug", section, forXDP, rules, func(progName string) {
+	setupAndRun(t, eventlog.LevelDebug, section, forXDP, rules, func(progName string) {
 		t.Run(section, func(_ *testing.T) {
 			testFn(func(dataIn []byte) (bpfRunResult, error) {
 				res, err := bpftoolProgRun(progName, dataIn)
+				if _, logErr := logReader.Read(); logErr != nil {
+					log.WithError(logErr).Warn("Failed to read BPF log map")
+				}
 				log.Debugf("dataIn  = %+v", dataIn)
 				if err == nil {
 					log.Debugf("dataOut = %+v", res.dataOut)
@@ -316,8 +341,11 @@ func bpftool(args ...string) ([]byte, error) {
 var (
 	mapInitOnce sync.Once
 
-	natMap, natBEMap, ctMap, rtMap, ipsMap, stateMap, testStateMap, tcJumpMap, xdpJumpMap, affinityMap, arpMap, fsafeMap bpf.Map
-	allMaps, progMaps                                                                                                    []bpf.Map
+	natMap, natBEMap, ctMap, rtMap, ipsMap, ipsHashMap, stateMap, testStateMap, tcJumpMap, xdpJumpMap, affinityMap, arpMap, fsafeMap, ruleCtrsMap      bpf.Map
+	logMap, logLevelMap, traceMap, verdictCtrsMap, latencyMap, latencyCfgMap, flowRingMap, flowCtrsMap, flowCfgMap, sampleMap, sampleCfgMap, mapErrMap bpf.Map
+	allMaps, progMaps                                                                                                                                  []bpf.Map
+
+	logReader *eventlog.Reader
 )
 
 func initMapsOnce() {
@@ -329,6 +357,7 @@ func initMapsOnce() {
 		ctMap = conntrack.Map(mc)
 		rtMap = routes.Map(mc)
 		ipsMap = ipsets.Map(mc)
+		ipsHashMap = ipsets.HashMap(mc)
 		stateMap = state.Map(mc)
 		testStateMap = state.MapForTest(mc)
 		tcJumpMap = jump.MapForTest(mc)
@@ -336,8 +365,21 @@ func initMapsOnce() {
 		affinityMap = nat.AffinityMap(mc)
 		arpMap = arp.Map(mc)
 		fsafeMap = failsafes.Map(mc)
-
-		allMaps = []bpf.Map{natMap, natBEMap, ctMap, rtMap, ipsMap, stateMap, testStateMap, tcJumpMap, xdpJumpMap, affinityMap, arpMap, fsafeMap}
+		ruleCtrsMap = counters.RuleMap(mc)
+		logMap = eventlog.Map(mc)
+		logLevelMap = eventlog.LevelMap(mc)
+		traceMap = eventlog.TraceMap(mc)
+		verdictCtrsMap = counters.VerdictMap(mc)
+		latencyMap = counters.LatencyMap(mc)
+		latencyCfgMap = counters.LatencyCfgMap(mc)
+		flowRingMap = conntrack.FlowRingMap(mc)
+		flowCtrsMap = conntrack.FlowCountersMap(mc)
+		flowCfgMap = conntrack.FlowCfgMap(mc)
+		sampleMap = sampling.Map(mc)
+		sampleCfgMap = sampling.CfgMap(mc)
+		mapErrMap = mapstats.ErrMap(mc)
+
+		allMaps = []bpf.Map{natMap, natBEMap, ctMap, rtMap, ipsMap, ipsHashMap, stateMap, testStateMap, tcJumpMap, xdpJumpMap, affinityMap, arpMap, fsafeMap, ruleCtrsMap, logMap, logLevelMap, traceMap, verdictCtrsMap, latencyMap, latencyCfgMap, flowRingMap, flowCtrsMap, flowCfgMap, sampleMap, sampleCfgMap, mapErrMap}
 		for _, m := range allMaps {
 			err := m.EnsureExists()
 			if err != nil {
@@ -345,6 +387,14 @@ func initMapsOnce() {
 			}
 		}
 
+		logReader = eventlog.NewReader([]bpf.Map{logMap}, logLevelMap, traceMap, func(r eventlog.Record) {
+			log.WithField("cpu", r.CPU).Debug("BPF: ", r.String())
+		})
+		err := logReader.SkipToEnd()
+		if err != nil {
+			log.WithError(err).Panic("Failed to read BPF log map")
+		}
+
 		progMaps = []bpf.Map{
 			natMap,
 			natBEMap,
@@ -356,6 +406,18 @@ func initMapsOnce() {
 			affinityMap,
 			arpMap,
 			fsafeMap,
+			logMap,
+			logLevelMap,
+			traceMap,
+			verdictCtrsMap,
+			latencyMap,
+			latencyCfgMap,
+			flowRingMap,
+			flowCtrsMap,
+			flowCfgMap,
+			sampleMap,
+			sampleCfgMap,
+			mapErrMap,
 		}
 
 	})
@@ -369,7 +431,10 @@ func cleanUpMaps() {
 	defer log.SetLevel(logLevel)
 
 	for _, m := range allMaps {
-		if m == stateMap || m == testStateMap || m == tcJumpMap || m == xdpJumpMap {
+		if m == stateMap || m == testStateMap || m == tcJumpMap || m == xdpJumpMap || m == ruleCtrsMap ||
+			m == logMap || m == logLevelMap || m == traceMap || m == verdictCtrsMap ||
+			m == latencyMap || m == latencyCfgMap || m == flowRingMap || m == flowCfgMap ||
+			m == sampleMap || m == sampleCfgMap || m == mapErrMap {
 			continue // Can't clean up array maps
 		}
 		log.WithField("map", m.GetName()).Info("Cleaning")
@@ -440,6 +505,11 @@ func bpftoolProgLoadAll(fname, bpfFsDir string, forXDP bool, polProg bool, maps
 		}
 	}
 
+	_, err = bpftool("map", "update", "pinned", jumpMap.Path(), "key", "3", "0", "0", "0", "value", "pinned", path.Join(bpfFsDir, "1_3"))
+	if err != nil {
+		return errors.Wrap(err, "failed to update jump map (denied program)")
+	}
+
 	return nil
 }
 
@@ -541,6 +611,10 @@ outter:
 		maps = append(maps, m)
 	}
 
+	// The unit tests are compiled with debug logs, log everything they write.
+	err := eventlog.SetLevel(logLevelMap, eventlog.LevelDebug)
+	Expect(err).NotTo(HaveOccurred())
+
 	tempDir, err := ioutil.TempDir("", "calico-bpf-")
 	Expect(err).NotTo(HaveOccurred())
 	defer os.RemoveAll(tempDir)
@@ -563,6 +637,7 @@ outter:
 	Expect(err).NotTo(HaveOccurred())
 	bin.PatchTunnelMTU(natTunnelMTU)
 	bin.PatchVXLANPort(testVxlanPort)
+	bin.PatchGlobalFlags(tc.GlobalsFIBLookup)
 	tempObj := tempDir + "bpf.o"
 	err = bin.WriteToFile(tempObj)
 	Expect(err).NotTo(HaveOccurred())
@@ -591,9 +666,12 @@ outter:
 }
 
 type testOpts struct {
-	subtests  bool
-	logLevel  log.Level
-	extraMaps []bpf.Map
+	subtests    bool
+	logLevel    log.Level
+	extraMaps   []bpf.Map
+	object      string
+	globalFlags uint32
+	polprogOpts []polprog.Option
 }
 
 type testOption func(opts *testOpts)
@@ -622,6 +700,29 @@ func withExtraMap(m bpf.Map) testOption {
 
 var _ = withExtraMap
 
+// withObject runs the given object file instead of the UT build of the program that
+// setupAndRun picks from the section name.
+func withObject(obj string) testOption {
+	return func(o *testOpts) {
+		o.object = obj
+	}
+}
+
+// withGlobalFlags sets the global flags (see tc.GlobalFlags) that are patched into the
+// program, on top of the ones that setupAndRun picks for the UT builds.
+func withGlobalFlags(flags uint32) testOption {
+	return func(o *testOpts) {
+		o.globalFlags = flags
+	}
+}
+
+// withPolProgOpts passes the given options to the builder of the policy program.
+func withPolProgOpts(opts ...polprog.Option) testOption {
+	return func(o *testOpts) {
+		o.polprogOpts = opts
+	}
+}
+
 // layersMatchFields matches all Exported fields and ignore the ones explicitly
 // listed. It always ignores BaseLayer as that is not set by the tests.
 func layersMatchFields(l gopacket.Layer, ignore ...string) GomegaMatcher {
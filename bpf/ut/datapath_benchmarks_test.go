@@ -0,0 +1,532 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package ut_test
+
+import (
+	"encoding/json"
+	"fmt"
+	"io/ioutil"
+	"net"
+	"os"
+	"path"
+	"sort"
+	"strings"
+	"testing"
+	"time"
+
+	"github.com/google/gopacket"
+	"github.com/google/gopacket/layers"
+	. "github.com/onsi/gomega"
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/conntrack"
+	"github.com/projectcalico/felix/bpf/eventlog"
+	"github.com/projectcalico/felix/bpf/nat"
+	"github.com/projectcalico/felix/bpf/polprog"
+	"github.com/projectcalico/felix/bpf/routes"
+	"github.com/projectcalico/felix/bpf/tc"
+	"github.com/projectcalico/felix/ip"
+)
+
+// BenchmarkDatapath runs a corpus of packets through every precompiled datapath program, as
+// listed by bpf-gpl/list-objs, with the maps empty and with the maps filled to the levels of
+// a large cluster.  Each sub-benchmark reports the time that the program took per packet, as
+// measured by the kernel, and the number of instructions of the program.
+//
+// If BPF_BENCH_OUTPUT is set, the results are also written to that file as JSON, one entry
+// per variant, packet and fill level, so that CI can compare them with those of a previous
+// run.
+func BenchmarkDatapath(b *testing.B) {
+	RegisterTestingT(b)
+
+	logLevel := log.GetLevel()
+	log.SetLevel(log.InfoLevel)
+	defer log.SetLevel(logLevel)
+
+	defer cleanUpMaps()
+
+	for _, fill := range datapathFills {
+		for _, v := range datapathVariants() {
+			for _, p := range datapathCorpus {
+				fill, v, p := fill, v, p
+				b.Run(fmt.Sprintf("%s/%s/%s", v.name, p.name, fill.name), func(b *testing.B) {
+					fillDatapathMaps(fill)
+					benchmarkDatapath(b, v, p, fill.name)
+				})
+			}
+		}
+	}
+
+	writeDatapathResults()
+}
+
+// datapathResults holds the result of each datapath benchmark that ran, by name.  A
+// sub-benchmark may run several times, the last run is the one with the final b.N.
+var datapathResults = map[string]datapathResult{}
+
+type datapathResult struct {
+	Variant string `json:"variant"`
+	Packet  string `json:"packet"`
+	Fill    string `json:"fill"`
+	// NsPerPacket is the average run time of the program as measured by the kernel.
+	NsPerPacket int `json:"ns_per_packet"`
+	// Insns is the number of instructions of the entry program and InsnsTotal includes the
+	// programs that it tail calls, apart from the policy program.
+	Insns      int    `json:"insns"`
+	InsnsTotal int    `json:"insns_total"`
+	Verdict    string `json:"verdict"`
+	Runs       int    `json:"runs"`
+}
+
+// writeDatapathResults writes all the results so far to the file that BPF_BENCH_OUTPUT names,
+// if it is set.
+func writeDatapathResults() {
+	fname := os.Getenv("BPF_BENCH_OUTPUT")
+	if fname == "" {
+		return
+	}
+
+	names := make([]string, 0, len(datapathResults))
+	for name := range datapathResults {
+		names = append(names, name)
+	}
+	sort.Strings(names)
+
+	out := make([]datapathResult, len(names))
+	for i, name := range names {
+		out[i] = datapathResults[name]
+	}
+
+	bytes, err := json.MarshalIndent(out, "", "  ")
+	Expect(err).NotTo(HaveOccurred())
+	err = ioutil.WriteFile(fname, bytes, 0644)
+	Expect(err).NotTo(HaveOccurred())
+}
+
+// datapathNextPort is the source port of the next new flow.  It is not reset between runs so
+// that the flows stay new when the maps are not refilled.
+var datapathNextPort = uint16(1024)
+
+// benchmarkDatapath runs the packet through the program, with the maps as they are, and
+// records the result in datapathResults.
+func benchmarkDatapath(b *testing.B, v datapathVariant, p datapathPacket, fill string) {
+	hostIP = node1ip
+
+	res := datapathResult{
+		Variant: v.name,
+		Packet:  p.name,
+		Fill:    fill,
+		Runs:    b.N,
+	}
+
+	setupAndRun(b, eventlog.LevelOff, v.section, v.forXDP, v.rules, func(progName string) {
+		var err error
+		res.Insns, res.InsnsTotal, err = pinnedProgInsns(progName)
+		Expect(err).NotTo(HaveOccurred())
+
+		if p.warmUp != nil {
+			_, err := bpftoolProgRun(progName, p.warmUp(datapathSrcPort))
+			Expect(err).NotTo(HaveOccurred())
+		}
+
+		var run bpfRunResult
+		if p.newFlow {
+			// Each packet must create a new conntrack entry, which rules out repeating the
+			// same packet in the kernel.  The kernel still times each run on its own, so
+			// the overhead of bpftool does not skew the result.
+			b.ResetTimer()
+			total := 0
+			for i := 0; i < b.N; i++ {
+				run, err = bpftoolProgRun(progName, p.pkt(datapathNextPort))
+				Expect(err).NotTo(HaveOccurred())
+				total += run.Duration
+				datapathNextPort++
+				if datapathNextPort == 0 {
+					datapathNextPort = 1024
+				}
+			}
+			b.StopTimer()
+			res.NsPerPacket = total / b.N
+		} else {
+			b.ResetTimer()
+			run, err = bpftoolProgRunN(progName, p.pkt(datapathSrcPort), b.N)
+			b.StopTimer()
+			Expect(err).NotTo(HaveOccurred())
+			res.NsPerPacket = run.Duration
+		}
+
+		if v.forXDP {
+			res.Verdict = run.RetvalStrXDP()
+		} else {
+			res.Verdict = run.RetvalStr()
+		}
+	}, withObject(v.object), withGlobalFlags(v.globalFlags), withPolProgOpts(v.polprogOpts...))
+
+	b.ReportMetric(float64(res.NsPerPacket), "prog-ns/pkt")
+	b.ReportMetric(float64(res.Insns), "insns")
+	b.ReportMetric(float64(res.InsnsTotal), "insns-total")
+
+	datapathResults[b.Name()] = res
+}
+
+// pinnedProgInsns returns the number of instructions, after translation by the verifier, of
+// the given pinned program and of all the programs pinned next to it.
+func pinnedProgInsns(progName string) (entry, total int, err error) {
+	insns := func(p string) (int, error) {
+		out, err := bpftool("prog", "show", "pinned", p)
+		if err != nil {
+			return 0, err
+		}
+		var info struct {
+			BytesXlated int `json:"bytes_xlated"`
+		}
+		if err := json.Unmarshal(out, &info); err != nil {
+			return 0, err
+		}
+		return info.BytesXlated / 8, nil
+	}
+
+	entry, err = insns(progName)
+	if err != nil {
+		return
+	}
+
+	files, err := ioutil.ReadDir(path.Dir(progName))
+	if err != nil {
+		return
+	}
+	for _, f := range files {
+		n, err := insns(path.Join(path.Dir(progName), f.Name()))
+		if err != nil {
+			return 0, 0, err
+		}
+		total += n
+	}
+	return
+}
+
+// datapathVariant is one of the precompiled TC or XDP programs, with the settings that are
+// patched into it at load time.
+type datapathVariant struct {
+	name        string
+	object      string
+	section     string
+	forXDP      bool
+	rules       *polprog.Rules
+	globalFlags uint32
+	polprogOpts []polprog.Option
+}
+
+// datapathVariants returns each of the programs that bpf-gpl/list-objs emits, with each
+// combination of the global flags that applies to it.  The variants are named after the
+// settings, as in "from_wep_host_drop_fib_dsr", so that the results can be compared with those
+// from before the settings moved to load time.  They run with logging off.  The "minimal"
+// variants have the NAT, connect-time load balancer and VXLAN stages switched off, as on a
+// node that uses none of them.
+func datapathVariants() []datapathVariant {
+	var vs []datapathVariant
+	for _, epToHostDrop := range []bool{false, true} {
+		for _, fib := range []bool{false, true} {
+			for _, epType := range []tc.EndpointType{tc.EpTypeWorkload, tc.EpTypeHost, tc.EpTypeTunnel, tc.EpTypeWireguard} {
+				if epToHostDrop && epType != tc.EpTypeWorkload {
+					continue
+				}
+				for _, toOrFrom := range []tc.ToOrFromEp{tc.FromEp, tc.ToEp} {
+					if toOrFrom == tc.ToEp && (fib || epToHostDrop) {
+						continue
+					}
+					for _, dsr := range []bool{false, true} {
+						if dsr && !((epType == tc.EpTypeWorkload && toOrFrom == tc.FromEp) || epType == tc.EpTypeHost) {
+							continue
+						}
+						fname := tc.ProgFilename(epType, toOrFrom)
+						name := strings.TrimSuffix(fname, ".o")
+						if epToHostDrop {
+							name += "_host_drop"
+						}
+						if fib {
+							name += "_fib"
+						}
+						if dsr {
+							name += "_dsr"
+						}
+						v := datapathVariant{
+							name:        name,
+							object:      "../../bpf-gpl/bin/" + fname,
+							section:     tc.SectionName(epType, toOrFrom),
+							globalFlags: tc.GlobalFlags(epType, toOrFrom, epToHostDrop, fib, dsr),
+						}
+						if epType == tc.EpTypeWorkload {
+							v.rules = rulesDefaultAllow
+						}
+						vs = append(vs, v)
+
+						if !epToHostDrop && !dsr {
+							m := v
+							m.name = name + "_minimal"
+							m.globalFlags |= tc.GlobalsNoNAT | tc.GlobalsNoCTLB | tc.GlobalsNoVXLAN
+							vs = append(vs, m)
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return append(vs, datapathVariant{
+		name:    "xdp",
+		object:  "../../bpf-gpl/bin/xdp.o",
+		section: "calico_entrypoint_xdp",
+		forXDP:  true,
+		rules:   &allowAllRulesXDP,
+	})
+}
+
+// datapathFill is the number of entries that the maps are filled with, besides the ones that
+// the packets of the corpus use.
+type datapathFill struct {
+	name      string
+	conntrack int
+	routes    int
+	services  int
+}
+
+var datapathFills = []datapathFill{
+	{name: "empty"},
+	{name: "loaded", conntrack: 100000, routes: 10000, services: 5000},
+}
+
+var (
+	datapathSrcPort     = uint16(31245)
+	datapathSvcIP       = net.IPv4(10, 96, 0, 1).To4()
+	datapathSvcPort     = uint16(80)
+	datapathBackendIP   = net.IPv4(10, 65, 0, 2).To4()
+	datapathBackendPort = uint16(8080)
+)
+
+// fillDatapathMaps sets up the routes and the service that the corpus uses, and fills the
+// maps with as many unrelated entries as the fill level asks for.
+func fillDatapathMaps(fill datapathFill) {
+	cleanUpMaps()
+
+	update := func(m bpf.Map, k, v []byte) {
+		err := m.Update(k, v)
+		Expect(err).NotTo(HaveOccurred())
+	}
+	v4CIDR := func(addr net.IP) ip.V4CIDR {
+		return ip.CIDRFromNetIP(addr).(ip.V4CIDR)
+	}
+	v4Addr := func(addr net.IP) ip.V4Addr {
+		return ip.FromNetIP(addr).(ip.V4Addr)
+	}
+
+	update(rtMap, routes.NewKey(srcV4CIDR).AsBytes(),
+		routes.NewValueWithIfIndex(routes.FlagsLocalWorkload, 1).AsBytes())
+	update(rtMap, routes.NewKey(v4CIDR(node1ip)).AsBytes(), routes.NewValue(routes.FlagsLocalHost).AsBytes())
+	update(rtMap, routes.NewKey(v4CIDR(node2ip)).AsBytes(), routes.NewValue(routes.FlagsRemoteHost).AsBytes())
+	update(rtMap, routes.NewKey(v4CIDR(datapathBackendIP)).AsBytes(),
+		routes.NewValueWithNextHop(routes.FlagsRemoteWorkload, v4Addr(node2ip)).AsBytes())
+
+	update(natMap, nat.NewNATKey(datapathSvcIP, datapathSvcPort, uint8(layers.IPProtocolUDP)).AsBytes(),
+		nat.NewNATValue(0, 1, 0, 0).AsBytes())
+	update(natBEMap, nat.NewNATBackendKey(0, 0).AsBytes(),
+		nat.NewNATBackendValue(datapathBackendIP, datapathBackendPort).AsBytes())
+
+	// Workloads spread over 250 other nodes.
+	for i := 0; i < fill.routes; i++ {
+		cidr := v4CIDR(net.IPv4(10, 66, byte(i>>8), byte(i)))
+		nextHop := v4Addr(net.IPv4(10, 10, 1, byte(i%250+1)))
+		update(rtMap, routes.NewKey(cidr).AsBytes(),
+			routes.NewValueWithNextHop(routes.FlagsRemoteWorkload, nextHop).AsBytes())
+	}
+
+	// Services with two backends each.
+	for i := 0; i < fill.services; i++ {
+		id := uint32(i + 1)
+		svcIP := net.IPv4(10, 97, byte(i>>8), byte(i))
+		update(natMap, nat.NewNATKey(svcIP, 80, uint8(layers.IPProtocolTCP)).AsBytes(),
+			nat.NewNATValue(id, 2, 0, 0).AsBytes())
+		for j := uint32(0); j < 2; j++ {
+			beIP := net.IPv4(10, 66, byte(i>>8), byte(i))
+			update(natBEMap, nat.NewNATBackendKey(id, j).AsBytes(),
+				nat.NewNATBackendValue(beIP, uint16(8080+j)).AsBytes())
+		}
+	}
+
+	// Established TCP connections.
+	now := time.Duration(bpf.KTimeNanos())
+	leg := conntrack.Leg{SynSeen: true, AckSeen: true}
+	for i := 0; i < fill.conntrack; i++ {
+		ipA := net.IPv4(10, 66, byte(i>>16), byte(i>>8))
+		ipB := net.IPv4(10, 67, byte(i>>8), byte(i))
+		k := conntrack.NewKey(uint8(layers.IPProtocolTCP), ipA, uint16(i), ipB, 443)
+		update(ctMap, k.AsBytes(), conntrack.NewValueNormal(now, now, 0, leg, leg).AsBytes())
+	}
+}
+
+// datapathPacket is a packet of the corpus, built for the given source port.
+type datapathPacket struct {
+	name string
+	pkt  func(srcPort uint16) []byte
+	// warmUp, if not nil, builds a packet that is run once before the measurement to set up
+	// the conntrack state that the measured packet relies on.
+	warmUp func(srcPort uint16) []byte
+	// newFlow packets are given a different source port for each run so that each run
+	// creates a new conntrack entry.
+	newFlow bool
+}
+
+var datapathCorpus = []datapathPacket{
+	{
+		name:    "tcp_syn",
+		pkt:     func(sport uint16) []byte { return datapathTCP(sport, true) },
+		newFlow: true,
+	},
+	{
+		name:   "tcp_established",
+		pkt:    func(sport uint16) []byte { return datapathTCP(sport, false) },
+		warmUp: func(sport uint16) []byte { return datapathTCP(sport, true) },
+	},
+	{
+		name:   "udp",
+		pkt:    func(sport uint16) []byte { return datapathUDP(sport, dstIP) },
+		warmUp: func(sport uint16) []byte { return datapathUDP(sport, dstIP) },
+	},
+	{
+		name:   "icmp",
+		pkt:    datapathICMPEcho,
+		warmUp: datapathICMPEcho,
+	},
+	{
+		name:   "nat",
+		pkt:    func(sport uint16) []byte { return datapathUDP(sport, datapathSvcIP) },
+		warmUp: func(sport uint16) []byte { return datapathUDP(sport, datapathSvcIP) },
+	},
+	{
+		name: "vxlan",
+		pkt:  datapathVXLAN,
+	},
+	{
+		name:   "icmp_related",
+		pkt:    datapathICMPRelated,
+		warmUp: func(sport uint16) []byte { return datapathUDP(sport, dstIP) },
+	},
+	{
+		name: "ip_options",
+		pkt:  datapathIPOptions,
+	},
+}
+
+func datapathTCP(sport uint16, syn bool) []byte {
+	tcp := &layers.TCP{
+		SrcPort:    layers.TCPPort(sport),
+		DstPort:    80,
+		SYN:        syn,
+		ACK:        !syn,
+		DataOffset: 5,
+		Window:     65535,
+	}
+	_, _, _, _, pktBytes, err := testPacket(nil, nil, tcp, nil)
+	Expect(err).NotTo(HaveOccurred())
+	return pktBytes
+}
+
+func datapathUDP(sport uint16, dst net.IP) []byte {
+	ipv4 := *ipv4Default
+	ipv4.DstIP = dst
+	udp := &layers.UDP{
+		SrcPort: layers.UDPPort(sport),
+		DstPort: layers.UDPPort(datapathSvcPort),
+	}
+	_, _, _, _, pktBytes, err := testPacket(nil, &ipv4, udp, nil)
+	Expect(err).NotTo(HaveOccurred())
+	return pktBytes
+}
+
+func datapathICMPEcho(id uint16) []byte {
+	icmp := &layers.ICMPv4{
+		TypeCode: layers.CreateICMPv4TypeCode(layers.ICMPv4TypeEchoRequest, 0),
+		Id:       id,
+		Seq:      1,
+	}
+	_, _, _, _, pktBytes, err := testPacket(nil, nil, icmp, nil)
+	Expect(err).NotTo(HaveOccurred())
+	return pktBytes
+}
+
+// datapathICMPRelated is a port unreachable error for the UDP packet of the corpus.
+func datapathICMPRelated(sport uint16) []byte {
+	ipv4 := *ipv4Default
+	udp := &layers.UDP{
+		SrcPort: layers.UDPPort(sport),
+		DstPort: layers.UDPPort(datapathSvcPort),
+	}
+	ipv4.Length = uint16(20 + 8 + len(payloadDefault))
+	udp.Length = uint16(8 + len(payloadDefault))
+	return makeICMPError(&ipv4, udp, layers.ICMPv4TypeDestinationUnreachable, layers.ICMPv4CodePort)
+}
+
+// datapathVXLAN is the UDP packet of the corpus, encapsulated by another node.
+func datapathVXLAN(sport uint16) []byte {
+	inner := datapathUDP(sport, dstIP)
+
+	ipv4 := &layers.IPv4{
+		Version:  4,
+		IHL:      5,
+		TTL:      64,
+		Flags:    layers.IPv4DontFragment,
+		SrcIP:    node2ip,
+		DstIP:    node1ip,
+		Protocol: layers.IPProtocolUDP,
+		Length:   uint16(20 + 8 + 8 + len(inner)),
+	}
+	udp := &layers.UDP{
+		SrcPort: layers.UDPPort(testVxlanPort),
+		DstPort: layers.UDPPort(testVxlanPort),
+		Length:  uint16(8 + 8 + len(inner)),
+	}
+	vxlan := &layers.VXLAN{
+		ValidIDFlag: true,
+		VNI:         4096,
+	}
+	_ = udp.SetNetworkLayerForChecksum(ipv4)
+
+	pkt := gopacket.NewSerializeBuffer()
+	err := gopacket.SerializeLayers(pkt, gopacket.SerializeOptions{ComputeChecksums: true},
+		ethDefault, ipv4, udp, vxlan, gopacket.Payload(inner))
+	Expect(err).NotTo(HaveOccurred())
+	return pkt.Bytes()
+}
+
+// datapathIPOptions is the UDP packet of the corpus with a 4 byte router alert option.
+func datapathIPOptions(sport uint16) []byte {
+	ipv4 := *ipv4Default
+	ipv4.IHL = 6
+	ipv4.Options = []layers.IPv4Option{{OptionType: 148, OptionLength: 4, OptionData: []byte{0, 0}}}
+	ipv4.Length = uint16(24 + 8 + len(payloadDefault))
+	udp := &layers.UDP{
+		SrcPort: layers.UDPPort(sport),
+		DstPort: layers.UDPPort(datapathSvcPort),
+		Length:  uint16(8 + len(payloadDefault)),
+	}
+	_ = udp.SetNetworkLayerForChecksum(&ipv4)
+
+	pkt := gopacket.NewSerializeBuffer()
+	err := gopacket.SerializeLayers(pkt, gopacket.SerializeOptions{ComputeChecksums: true},
+		ethDefault, &ipv4, udp, gopacket.Payload(payloadDefault))
+	Expect(err).NotTo(HaveOccurred())
+	return pkt.Bytes()
+}
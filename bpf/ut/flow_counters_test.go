@@ -0,0 +1,61 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package ut_test
+
+import (
+	"testing"
+
+	. "github.com/onsi/gomega"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/conntrack"
+)
+
+func TestFlowCountersIncludeFirstPacket(t *testing.T) {
+	RegisterTestingT(t)
+
+	_, _, _, _, pktBytes, err := testPacketUDPDefaultNP(node1ip)
+	Expect(err).NotTo(HaveOccurred())
+
+	cleanUpMaps()
+	defer cleanUpMaps()
+
+	Expect(conntrack.SetFlowsEnabled(flowCfgMap, true)).To(Succeed())
+	defer func() {
+		Expect(conntrack.SetFlowsEnabled(flowCfgMap, false)).To(Succeed())
+	}()
+
+	// The first packet creates the tracking entry, the second one hits it.
+	runBpfTest(t, "calico_from_host_ep", false, nil, func(bpfrun bpfProgRunFn) {
+		for i := 0; i < 2; i++ {
+			res, err := bpfrun(pktBytes)
+			Expect(err).NotTo(HaveOccurred())
+			Expect(res.Retval).To(Equal(resTC_ACT_UNSPEC))
+		}
+	})
+
+	var ctrs []conntrack.FlowCounters
+	err = flowCtrsMap.Iter(func(k, v []byte) bpf.IteratorAction {
+		ctrs = append(ctrs, conntrack.FlowCountersFromBytes(v))
+		return bpf.IterNone
+	})
+	Expect(err).NotTo(HaveOccurred())
+	Expect(ctrs).To(HaveLen(1))
+	// Both packets go the same way, whichever leg that is in the key.
+	c := ctrs[0]
+	Expect(c.PacketsAToB + c.PacketsBToA).To(Equal(uint64(2)))
+	Expect(c.PacketsAToB == 0 || c.PacketsBToA == 0).To(BeTrue())
+	Expect(c.BytesAToB + c.BytesBToA).To(Equal(uint64(2 * len(pktBytes))))
+}
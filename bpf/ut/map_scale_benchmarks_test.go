@@ -0,0 +1,260 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package ut_test
+
+import (
+	"encoding/binary"
+	"fmt"
+	"strings"
+	"testing"
+	"time"
+
+	"github.com/google/gopacket/layers"
+	. "github.com/onsi/gomega"
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/conntrack"
+	bpfipsets "github.com/projectcalico/felix/bpf/ipsets"
+	"github.com/projectcalico/felix/bpf/nat"
+	"github.com/projectcalico/felix/bpf/polprog"
+	"github.com/projectcalico/felix/bpf/routes"
+	"github.com/projectcalico/felix/idalloc"
+	"github.com/projectcalico/felix/ip"
+	"github.com/projectcalico/felix/proto"
+)
+
+// BenchmarkMapScale measures how the per-packet cost of the datapath grows as the conntrack,
+// route, NAT frontend and IP set maps fill up.  The maps are filled to a percentage of their
+// capacity and then a new flow and an established flow to a service are run through the
+// programs whose lookups depend on them.  The results are added to the BPF_BENCH_OUTPUT file,
+// like those of BenchmarkDatapath.
+func BenchmarkMapScale(b *testing.B) {
+	RegisterTestingT(b)
+
+	logLevel := log.GetLevel()
+	log.SetLevel(log.InfoLevel)
+	defer log.SetLevel(logLevel)
+
+	defer cleanUpMaps()
+
+	variants := map[string]bool{
+		"from_wep_fib": true,
+		"to_wep":       true,
+		"from_hep_fib": true,
+		"to_hep":       true,
+	}
+
+	for _, pct := range []int{1, 50, 95} {
+		start := time.Now()
+		fillMapsToScale(pct)
+		log.Infof("Filled maps to %d%% of capacity in %v", pct, time.Since(start))
+
+		fill := fmt.Sprintf("fill=%d", pct)
+		for _, v := range datapathVariants() {
+			if !variants[v.name] {
+				continue
+			}
+			if v.rules != nil {
+				v.rules = &mapScaleRules
+				v.polprogOpts = []polprog.Option{
+					polprog.WithIPSetHashMap(ipsHashMap.MapFD(), mapScaleIPSetKinds{}),
+				}
+			}
+			for _, p := range mapScaleCorpus {
+				v, p := v, p
+				b.Run(fmt.Sprintf("%s/%s/%s", v.name, p.name, fill), func(b *testing.B) {
+					benchmarkDatapath(b, v, p, fill)
+				})
+			}
+		}
+	}
+
+	writeDatapathResults()
+}
+
+// mapScaleSrcSet is the IP set of pods that the source of the corpus packets is in, and
+// mapScaleNetSet is a set of external networks that it is not in.  The policy of the workload
+// programs denies traffic from the networks and allows it from the pods, so that each packet
+// looks up both the hash map of the exact members and the LPM trie of the CIDRs.
+const (
+	mapScaleSrcSet = "scale-src"
+	mapScaleNetSet = "scale-net"
+)
+
+var mapScaleRules = makeRulesSingleTier([]*proto.Rule{
+	{
+		Action:      "Deny",
+		SrcIpSetIds: []string{mapScaleNetSet},
+	},
+	{
+		Action:      "Allow",
+		SrcIpSetIds: []string{mapScaleSrcSet},
+	},
+})
+
+// mapScaleIPSetKinds gives the kinds of members of the sets that fillMapsToScale creates: the
+// sets of networks have CIDRs only, the sets of pods exact members only.
+type mapScaleIPSetKinds struct{}
+
+func (mapScaleIPSetKinds) MemberKinds(ipSetID string) (exact, cidr bool) {
+	if strings.HasPrefix(ipSetID, mapScaleNetSet) {
+		return false, true
+	}
+	return true, false
+}
+
+var mapScaleCorpus = []datapathPacket{
+	{
+		name:    "new_flow",
+		pkt:     func(sport uint16) []byte { return mapScaleTCP(sport, true) },
+		newFlow: true,
+	},
+	{
+		name:   "established",
+		pkt:    func(sport uint16) []byte { return mapScaleTCP(sport, false) },
+		warmUp: func(sport uint16) []byte { return mapScaleTCP(sport, true) },
+	},
+}
+
+func mapScaleTCP(sport uint16, syn bool) []byte {
+	ipv4 := *ipv4Default
+	ipv4.DstIP = datapathSvcIP
+	tcp := &layers.TCP{
+		SrcPort:    layers.TCPPort(sport),
+		DstPort:    layers.TCPPort(datapathSvcPort),
+		SYN:        syn,
+		ACK:        !syn,
+		DataOffset: 5,
+		Window:     65535,
+	}
+	_, _, _, _, pktBytes, err := testPacket(nil, &ipv4, tcp, nil)
+	Expect(err).NotTo(HaveOccurred())
+	return pktBytes
+}
+
+func mapScaleAddr(a uint32) ip.V4Addr {
+	var addr ip.V4Addr
+	binary.BigEndian.PutUint32(addr[:], a)
+	return addr
+}
+
+func mapScaleCIDR(a uint32, prefixLen int) ip.V4CIDR {
+	return ip.CIDRFromAddrAndPrefix(mapScaleAddr(a), prefixLen).(ip.V4CIDR)
+}
+
+const (
+	mapScalePodNet  = 0x30000000 // 48.0.0.0, pod /26 blocks from here on
+	mapScaleHostNet = 0xac100000 // 172.16.0.0
+	mapScaleSvcNet  = 0x0a600000 // 10.96.0.0
+	mapScaleExtNet  = 0x64400000 // 100.64.0.0, clients outside the cluster
+)
+
+// fillMapsToScale fills the maps that the datapath looks up for each packet to the given
+// percentage of their capacity, with the keys distributed as in a large cluster.
+func fillMapsToScale(pct int) {
+	cleanUpMaps()
+
+	update := func(m bpf.Map, k, v []byte) {
+		err := m.Update(k, v)
+		Expect(err).NotTo(HaveOccurred())
+	}
+	fraction := func(params bpf.MapParameters) int {
+		return params.MaxEntries * pct / 100
+	}
+
+	// The route table is dominated by the pod CIDR blocks of the nodes.  Out of every 16
+	// routes, one is for a node, 12 are /26 blocks on that node and 3 are /32s of workloads
+	// whose address was borrowed from another block, which makes the trie deeper.
+	update(rtMap, routes.NewKey(srcV4CIDR).AsBytes(),
+		routes.NewValueWithIfIndex(routes.FlagsLocalWorkload, 1).AsBytes())
+	update(rtMap, routes.NewKey(ip.CIDRFromNetIP(node1ip).(ip.V4CIDR)).AsBytes(),
+		routes.NewValue(routes.FlagsLocalHost).AsBytes())
+	for i := 0; i < fraction(routes.MapParameters); i++ {
+		node := uint32(i / 16)
+		nodeAddr := mapScaleAddr(mapScaleHostNet + node)
+		var cidr ip.V4CIDR
+		var val routes.Value
+		switch n := uint32(i % 16); {
+		case n == 0:
+			cidr = mapScaleCIDR(mapScaleHostNet+node, 32)
+			val = routes.NewValue(routes.FlagsRemoteHost)
+		case n < 4:
+			cidr = mapScaleCIDR(mapScalePodNet+(node*12)<<6+n, 32)
+			val = routes.NewValueWithNextHop(routes.FlagsRemoteWorkload, nodeAddr)
+		default:
+			cidr = mapScaleCIDR(mapScalePodNet+(node*12+n-4)<<6, 26)
+			val = routes.NewValueWithNextHop(routes.FlagsRemoteWorkload|routes.FlagInIPAMPool, nodeAddr)
+		}
+		update(rtMap, routes.NewKey(cidr).AsBytes(), val.AsBytes())
+	}
+
+	// Services with a backend each, on the pods of the first blocks.  The service that the
+	// corpus uses, 10.96.0.1, is the first one.
+	numSvcs := fraction(nat.FrontendMapParameters)
+	if numSvcs < 1 {
+		numSvcs = 1
+	}
+	for i := 0; i < numSvcs; i++ {
+		id := uint32(i)
+		svcAddr := mapScaleAddr(mapScaleSvcNet + 1 + uint32(i))
+		beAddr := mapScaleAddr(mapScalePodNet + uint32(i%(1<<16))<<6 + 2)
+		update(natMap, nat.NewNATKey(svcAddr.AsNetIP(), datapathSvcPort, uint8(layers.IPProtocolTCP)).AsBytes(),
+			nat.NewNATValue(id, 1, 0, 0).AsBytes())
+		update(natBEMap, nat.NewNATBackendKey(id, 0).AsBytes(),
+			nat.NewNATBackendValue(beAddr.AsNetIP(), datapathBackendPort).AsBytes())
+	}
+
+	// Established connections from outside the cluster to the pods.
+	now := time.Duration(bpf.KTimeNanos())
+	leg := conntrack.Leg{SynSeen: true, AckSeen: true}
+	for i := 0; i < fraction(conntrack.MapParams); i++ {
+		client := mapScaleAddr(mapScaleExtNet + uint32(i>>4)).AsNetIP()
+		pod := mapScaleAddr(mapScalePodNet + uint32(i%(1<<16))<<6 + 2).AsNetIP()
+		k := conntrack.NewKey(uint8(layers.IPProtocolTCP), client, uint16(1024+i%16), pod, datapathBackendPort)
+		update(ctMap, k.AsBytes(), conntrack.NewValueNormal(now, now, 0, leg, leg).AsBytes())
+	}
+
+	// IP sets of 1000 pods each, as selected by the policies of a large cluster.  Their
+	// members are exact so, as in the dataplane, they go in the hash map.  The source of the
+	// corpus is in the first one.
+	alloc := idalloc.New()
+	numMembers := fraction(bpfipsets.HashMapParameters)
+	for i := 0; i < numMembers; i++ {
+		setID := fmt.Sprintf("scale-%d", i/1000)
+		if i < 1000 {
+			setID = mapScaleSrcSet
+		}
+		member := mapScaleAddr(mapScalePodNet + uint32(i)<<6 + 2).String()
+		if i == 0 {
+			member = srcIP.String()
+		}
+		entry := bpfipsets.ProtoIPSetMemberToBPFEntry(alloc.GetOrAlloc(setID), member)
+		update(ipsHashMap, entry.HashKey(), bpfipsets.DummyValue)
+	}
+
+	// IP sets of 1000 external /24 networks each, as selected by network policies; only
+	// these CIDRs go in the LPM trie.
+	numCIDRs := fraction(bpfipsets.MapParameters)
+	for i := 0; i < numCIDRs; i++ {
+		setID := fmt.Sprintf("%s-%d", mapScaleNetSet, i/1000)
+		if i < 1000 {
+			setID = mapScaleNetSet
+		}
+		member := mapScaleCIDR(mapScaleExtNet+uint32(i)<<8, 24).String()
+		entry := bpfipsets.ProtoIPSetMemberToBPFEntry(alloc.GetOrAlloc(setID), member)
+		update(ipsMap, entry[:], bpfipsets.DummyValue)
+	}
+}
@@ -27,6 +27,8 @@ import (
 
 	"github.com/projectcalico/felix/bpf"
 	"github.com/projectcalico/felix/bpf/conntrack"
+	"github.com/projectcalico/felix/bpf/ipsets"
+	"github.com/projectcalico/felix/ip"
 )
 
 func TestMapEntryDeletion(t *testing.T) {
@@ -90,6 +92,38 @@ func TestMapIterationDeleteAfter(t *testing.T) {
 	Expect(err2).NotTo(HaveOccurred(), "Failed to delete map entry")
 }
 
+// TestMapBatchUnsupported checks that the batch operations fall back to an operation per
+// entry on an LPM trie, which doesn't implement the batch commands, and that they report
+// the entries that they actually wrote.
+func TestMapBatchUnsupported(t *testing.T) {
+	RegisterTestingT(t)
+	defer cleanUpMaps()
+
+	var ks, vs [][]byte
+	for i := 0; i < 10; i++ {
+		cidr := ip.MustParseCIDROrIP(fmt.Sprintf("10.0.%d.0/24", i)).(ip.V4CIDR)
+		entry := ipsets.MakeBPFIPSetEntry(1, cidr, 0, 0)
+		ks = append(ks, entry[:])
+		vs = append(vs, ipsets.DummyValue)
+	}
+
+	n, err := bpf.UpdateBatch(ipsMap, ks, vs)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(n).To(Equal(len(ks)))
+	for _, k := range ks {
+		_, err := ipsMap.Get(k)
+		Expect(err).NotTo(HaveOccurred(), "Batch update didn't write all the entries")
+	}
+
+	n, err = bpf.DeleteBatch(ipsMap, ks)
+	Expect(err).NotTo(HaveOccurred())
+	Expect(n).To(Equal(len(ks)))
+	for _, k := range ks {
+		_, err := ipsMap.Get(k)
+		Expect(bpf.IsNotExists(err)).To(BeTrue(), "Batch delete didn't remove all the entries")
+	}
+}
+
 func setUpMapTestWithSingleKV(t *testing.T) (conntrack.Key, error) {
 	RegisterTestingT(t)
 	k := conntrack.NewKey(1, net.ParseIP("10.0.0.1"), 51234, net.ParseIP("10.0.0.2"), 8080)
@@ -17,6 +17,7 @@ package ut_test
 import (
 	"fmt"
 	"net"
+	"strings"
 	"testing"
 
 	"github.com/projectcalico/felix/bpf"
@@ -28,6 +29,7 @@ import (
 
 	"github.com/projectcalico/felix/bpf/arp"
 	"github.com/projectcalico/felix/bpf/conntrack"
+	"github.com/projectcalico/felix/bpf/eventlog"
 	"github.com/projectcalico/felix/bpf/nat"
 	"github.com/projectcalico/felix/bpf/routes"
 	"github.com/projectcalico/felix/ip"
@@ -257,6 +259,192 @@ func TestNATPodPodXNode(t *testing.T) {
 	resetCTMap(ctMap)
 }
 
+// TestNATDisabled checks that a program that is loaded with NAT switched off, as Felix does
+// when its kube-proxy isn't running, leaves a packet to a service alone.
+func TestNATDisabled(t *testing.T) {
+	RegisterTestingT(t)
+
+	bpfIfaceName = "NATD"
+	defer func() { bpfIfaceName = "" }()
+
+	_, ipv4, l4, _, pktBytes, err := testPacketUDPDefaultNP(node1ip)
+	Expect(err).NotTo(HaveOccurred())
+	udp := l4.(*layers.UDP)
+
+	mc := &bpf.MapContext{}
+	natMap := nat.FrontendMap(mc)
+	err = natMap.EnsureExists()
+	Expect(err).NotTo(HaveOccurred())
+	defer resetMap(natMap)
+
+	natBEMap := nat.BackendMap(mc)
+	err = natBEMap.EnsureExists()
+	Expect(err).NotTo(HaveOccurred())
+	defer resetMap(natBEMap)
+
+	err = natMap.Update(
+		nat.NewNATKey(ipv4.DstIP, uint16(udp.DstPort), uint8(ipv4.Protocol)).AsBytes(),
+		nat.NewNATValue(0, 1, 0, 0).AsBytes(),
+	)
+	Expect(err).NotTo(HaveOccurred())
+
+	err = natBEMap.Update(
+		nat.NewNATBackendKey(0, 0).AsBytes(),
+		nat.NewNATBackendValue(net.IPv4(8, 8, 8, 8), 666).AsBytes(),
+	)
+	Expect(err).NotTo(HaveOccurred())
+
+	ctMap := conntrack.Map(mc)
+	err = ctMap.EnsureExists()
+	Expect(err).NotTo(HaveOccurred())
+	resetCTMap(ctMap)
+	defer resetCTMap(ctMap)
+
+	hostIP = node1ip
+
+	rtKey := routes.NewKey(srcV4CIDR).AsBytes()
+	rtVal := routes.NewValueWithIfIndex(routes.FlagsLocalWorkload, 1).AsBytes()
+	defer resetRTMap(rtMap)
+	err = rtMap.Update(rtKey, rtVal)
+	Expect(err).NotTo(HaveOccurred())
+
+	runBpfTest(t, "calico_from_workload_ep", false, rulesDefaultAllow, func(bpfrun bpfProgRunFn) {
+		res, err := bpfrun(pktBytes)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(res.Retval).To(Equal(resTC_ACT_UNSPEC))
+		Expect(res.dataOut).To(Equal(pktBytes))
+	}, withGlobalFlags(tc.GlobalsNoNAT))
+}
+
+func TestCTLBDisabled(t *testing.T) {
+	RegisterTestingT(t)
+
+	bpfIfaceName = "CTLB"
+	defer func() { bpfIfaceName = "" }()
+
+	_, _, _, _, pktBytes, err := testPacketUDPDefault()
+	Expect(err).NotTo(HaveOccurred())
+
+	defer resetCTMap(ctMap)
+
+	rtKey := routes.NewKey(srcV4CIDR).AsBytes()
+	rtVal := routes.NewValueWithIfIndex(routes.FlagsLocalWorkload, 1).AsBytes()
+	defer resetRTMap(rtMap)
+	err = rtMap.Update(rtKey, rtVal)
+	Expect(err).NotTo(HaveOccurred())
+
+	var cookieLookups int
+	reader := eventlog.NewReader([]bpf.Map{logMap}, logLevelMap, traceMap, func(r eventlog.Record) {
+		if strings.Contains(r.Fmt, "Socket cookie") {
+			cookieLookups++
+		}
+	})
+	Expect(reader.SkipToEnd()).To(Succeed())
+
+	// lookups returns the number of times that the program looked up the connect-time load
+	// balancer NAT of the packet's socket.
+	lookups := func(flags uint32) int {
+		// A new flow each time, established flows skip the lookup.
+		resetCTMap(ctMap)
+		cookieLookups = 0
+		runBpfTest(t, "calico_from_workload_ep", false, rulesDefaultAllow, func(bpfrun bpfProgRunFn) {
+			res, err := bpfrun(pktBytes)
+			Expect(err).NotTo(HaveOccurred())
+			Expect(res.Retval).To(Equal(resTC_ACT_UNSPEC))
+			Expect(res.dataOut).To(Equal(pktBytes))
+		}, withGlobalFlags(flags))
+		_, err := reader.Read()
+		Expect(err).NotTo(HaveOccurred())
+		return cookieLookups
+	}
+
+	// The test runner gives the packet a socket, so the program looks up its cookie unless
+	// the connect-time load balancer is switched off.
+	Expect(lookups(0)).To(Equal(1))
+	Expect(lookups(tc.GlobalsNoCTLB)).To(Equal(0))
+}
+
+func TestVXLANDisabled(t *testing.T) {
+	RegisterTestingT(t)
+
+	bpfIfaceName = "VXLD"
+	defer func() { bpfIfaceName = "" }()
+
+	_, innerIP, _, _, inner, err := testPacketUDPDefault()
+	Expect(err).NotTo(HaveOccurred())
+
+	// Encapsulate the packet the way that the programs of node 2 do to forward it to node 1:
+	// with our VNI and no UDP checksum.
+	ipv4 := &layers.IPv4{
+		Version:  4,
+		IHL:      5,
+		TTL:      64,
+		Flags:    layers.IPv4DontFragment,
+		SrcIP:    node2ip,
+		DstIP:    node1ip,
+		Protocol: layers.IPProtocolUDP,
+	}
+	udp := &layers.UDP{
+		SrcPort: layers.UDPPort(testVxlanPort),
+		DstPort: layers.UDPPort(testVxlanPort),
+		Length:  uint16(8 + 8 + len(inner)),
+	}
+	vxlan := &layers.VXLAN{
+		ValidIDFlag: true,
+		VNI:         0xca11c0,
+	}
+	_ = udp.SetNetworkLayerForChecksum(ipv4)
+
+	pkt := gopacket.NewSerializeBuffer()
+	err = gopacket.SerializeLayers(pkt, gopacket.SerializeOptions{ComputeChecksums: true, FixLengths: true},
+		ethDefault, ipv4, udp, vxlan, gopacket.Payload(inner))
+	Expect(err).NotTo(HaveOccurred())
+	pktBytes := pkt.Bytes()
+	udpCsumOff := 14 /* eth */ + 20 /* ip */ + 6
+	pktBytes[udpCsumOff] = 0
+	pktBytes[udpCsumOff+1] = 0
+
+	hostIP = node1ip
+
+	defer resetCTMap(ctMap)
+	defer resetRTMap(rtMap)
+	err = rtMap.Update(
+		routes.NewKey(ip.CIDRFromIPNet(&node1CIDR).(ip.V4CIDR)).AsBytes(),
+		routes.NewValue(routes.FlagsLocalHost).AsBytes(),
+	)
+	Expect(err).NotTo(HaveOccurred())
+	err = rtMap.Update(
+		routes.NewKey(ip.CIDRFromIPNet(&node2CIDR).(ip.V4CIDR)).AsBytes(),
+		routes.NewValue(routes.FlagsRemoteHost).AsBytes(),
+	)
+	Expect(err).NotTo(HaveOccurred())
+
+	// The host endpoint decaps the packet...
+	resetCTMap(ctMap)
+	runBpfTest(t, "calico_from_host_ep", false, nil, func(bpfrun bpfProgRunFn) {
+		res, err := bpfrun(pktBytes)
+		Expect(err).NotTo(HaveOccurred())
+
+		pktR := gopacket.NewPacket(res.dataOut, layers.LayerTypeEthernet, gopacket.Default)
+		fmt.Printf("pktR = %+v\n", pktR)
+
+		ipv4L := pktR.Layer(layers.LayerTypeIPv4)
+		Expect(ipv4L).NotTo(BeNil())
+		ipv4R := ipv4L.(*layers.IPv4)
+		Expect(ipv4R.SrcIP.String()).To(Equal(innerIP.SrcIP.String()))
+		Expect(ipv4R.DstIP.String()).To(Equal(innerIP.DstIP.String()))
+	})
+
+	// ...unless VXLAN is switched off, then it is just a UDP packet to the host.
+	resetCTMap(ctMap)
+	runBpfTest(t, "calico_from_host_ep", false, nil, func(bpfrun bpfProgRunFn) {
+		res, err := bpfrun(pktBytes)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(res.Retval).To(Equal(resTC_ACT_UNSPEC))
+		Expect(res.dataOut).To(Equal(pktBytes))
+	}, withGlobalFlags(tc.GlobalsNoVXLAN))
+}
+
 func TestNATNodePort(t *testing.T) {
 	RegisterTestingT(t)
 
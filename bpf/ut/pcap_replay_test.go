@@ -0,0 +1,253 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package ut_test
+
+import (
+	"encoding/json"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net"
+	"os"
+	"sort"
+	"strings"
+	"testing"
+	"time"
+
+	"github.com/google/gopacket/layers"
+	"github.com/google/gopacket/pcapgo"
+	. "github.com/onsi/gomega"
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/conntrack"
+	"github.com/projectcalico/felix/bpf/eventlog"
+)
+
+// TestPcapReplay replays a capture through precompiled datapath programs, one packet at a time
+// and in capture order.  The maps are pinned and shared by the runs, so conntrack, NAT
+// affinity and the other state that the programs keep is carried from one packet to the next,
+// as it would be in the kernel.  The timestamps of the capture are not replayed.
+//
+// It is a tool rather than a test and it only runs if BPF_REPLAY_PCAP is set:
+//
+//	BPF_REPLAY_PCAP     the capture, in pcap format with an Ethernet link type
+//	BPF_REPLAY_PROGS    comma-separated programs, named after their object and settings as in
+//	                    BenchmarkDatapath, from_hep_fib by default
+//	BPF_REPLAY_HOST_IP  the IP of the host that the capture was taken on, 10.10.0.1 by default
+//	BPF_REPLAY_OUTPUT   a file to also write the report to, as JSON
+//
+// Each program starts with empty maps.  The report has the distribution of the verdicts, the
+// percentiles of the run time of the program per packet and the number of entries left in the
+// maps.
+func TestPcapReplay(t *testing.T) {
+	pcapFile := os.Getenv("BPF_REPLAY_PCAP")
+	if pcapFile == "" {
+		t.Skip("BPF_REPLAY_PCAP not set")
+	}
+	RegisterTestingT(t)
+
+	logLevel := log.GetLevel()
+	log.SetLevel(log.InfoLevel)
+	defer log.SetLevel(logLevel)
+
+	pkts, err := readPcap(pcapFile)
+	Expect(err).NotTo(HaveOccurred())
+	log.Infof("Read %d packets from %s", len(pkts), pcapFile)
+
+	progs := "from_hep_fib"
+	if s := os.Getenv("BPF_REPLAY_PROGS"); s != "" {
+		progs = s
+	}
+	if s := os.Getenv("BPF_REPLAY_HOST_IP"); s != "" {
+		hostIP = net.ParseIP(s).To4()
+		Expect(hostIP).NotTo(BeNil(), "BPF_REPLAY_HOST_IP is not an IPv4 address")
+	}
+	defer func() { hostIP = node1ip }()
+
+	variants := map[string]datapathVariant{}
+	for _, v := range datapathVariants() {
+		variants[v.name] = v
+	}
+
+	var reports []replayReport
+	for _, name := range strings.Split(progs, ",") {
+		v, ok := variants[strings.TrimSpace(name)]
+		Expect(ok).To(BeTrue(), "unknown program %q", name)
+
+		cleanUpMaps()
+		r := replayPackets(t, v, pkts)
+		r.print()
+		reports = append(reports, r)
+	}
+	cleanUpMaps()
+
+	if fname := os.Getenv("BPF_REPLAY_OUTPUT"); fname != "" {
+		bytes, err := json.MarshalIndent(reports, "", "  ")
+		Expect(err).NotTo(HaveOccurred())
+		err = ioutil.WriteFile(fname, bytes, 0644)
+		Expect(err).NotTo(HaveOccurred())
+	}
+}
+
+func readPcap(fname string) ([][]byte, error) {
+	f, err := os.Open(fname)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+
+	r, err := pcapgo.NewReader(f)
+	if err != nil {
+		return nil, err
+	}
+	if r.LinkType() != layers.LinkTypeEthernet {
+		return nil, fmt.Errorf("unsupported link type %v, the programs expect Ethernet frames", r.LinkType())
+	}
+
+	var pkts [][]byte
+	for {
+		data, _, err := r.ReadPacketData()
+		if err == io.EOF {
+			return pkts, nil
+		}
+		if err != nil {
+			return nil, err
+		}
+		pkts = append(pkts, data)
+	}
+}
+
+type replayReport struct {
+	Program  string         `json:"program"`
+	Packets  int            `json:"packets"`
+	Verdicts map[string]int `json:"verdicts"`
+	// Errors counts the packets that the kernel refused to run the program with, typically
+	// because they were truncated by the capture or too large for the output buffer.
+	Errors     int                      `json:"errors"`
+	LatencyNs  map[string]time.Duration `json:"latency_ns"`
+	MapEntries map[string]int           `json:"map_entries"`
+	CTByType   map[string]int           `json:"conntrack_by_type"`
+}
+
+func (r replayReport) print() {
+	fmt.Printf("%s: %d packets, %d errors\n", r.Program, r.Packets, r.Errors)
+	fmt.Printf("  verdicts:")
+	for _, k := range sortedKeys(r.Verdicts) {
+		fmt.Printf(" %s=%d", k, r.Verdicts[k])
+	}
+	fmt.Printf("\n  latency:")
+	for _, p := range replayPercentiles {
+		fmt.Printf(" %s=%v", p.name, r.LatencyNs[p.name])
+	}
+	fmt.Printf("\n  map entries:")
+	for _, k := range sortedKeys(r.MapEntries) {
+		fmt.Printf(" %s=%d", k, r.MapEntries[k])
+	}
+	fmt.Printf("\n  conntrack:")
+	for _, k := range sortedKeys(r.CTByType) {
+		fmt.Printf(" %s=%d", k, r.CTByType[k])
+	}
+	fmt.Printf("\n")
+}
+
+func sortedKeys(m map[string]int) []string {
+	keys := make([]string, 0, len(m))
+	for k := range m {
+		keys = append(keys, k)
+	}
+	sort.Strings(keys)
+	return keys
+}
+
+var replayPercentiles = []struct {
+	name string
+	p    float64
+}{
+	{"p50", 0.50},
+	{"p90", 0.90},
+	{"p99", 0.99},
+	{"p99.9", 0.999},
+	{"max", 1},
+}
+
+func replayPackets(t *testing.T, v datapathVariant, pkts [][]byte) replayReport {
+	r := replayReport{
+		Program:    v.name,
+		Packets:    len(pkts),
+		Verdicts:   map[string]int{},
+		LatencyNs:  map[string]time.Duration{},
+		MapEntries: map[string]int{},
+		CTByType:   map[string]int{},
+	}
+
+	setupAndRun(t, eventlog.LevelOff, v.section, v.forXDP, v.rules, func(progName string) {
+		fd, err := bpf.GetProgFDByPin(progName)
+		Expect(err).NotTo(HaveOccurred())
+		defer func() { _ = fd.Close() }()
+
+		durations := make([]time.Duration, 0, len(pkts))
+		for _, pkt := range pkts {
+			// Going through the syscall directly rather than bpftool, which would dominate
+			// the replay time of any sizeable capture.
+			res, err := bpf.RunBPFProgram(fd, pkt, 1)
+			if err != nil {
+				log.WithError(err).Debug("Failed to run packet")
+				r.Errors++
+				continue
+			}
+			run := bpfRunResult{Retval: int(uint32(res.RC))}
+			if v.forXDP {
+				r.Verdicts[run.RetvalStrXDP()]++
+			} else {
+				r.Verdicts[run.RetvalStr()]++
+			}
+			durations = append(durations, res.Duration)
+		}
+
+		sort.Slice(durations, func(i, j int) bool { return durations[i] < durations[j] })
+		if len(durations) > 0 {
+			for _, p := range replayPercentiles {
+				idx := int(p.p * float64(len(durations)-1))
+				r.LatencyNs[p.name] = durations[idx]
+			}
+		}
+	}, withObject(v.object), withGlobalFlags(v.globalFlags))
+
+	for _, m := range []bpf.Map{ctMap, affinityMap, arpMap, flowCtrsMap} {
+		n := 0
+		err := m.Iter(func(_, _ []byte) bpf.IteratorAction {
+			n++
+			return bpf.IterNone
+		})
+		Expect(err).NotTo(HaveOccurred())
+		r.MapEntries[m.GetName()] = n
+	}
+
+	ctTypes := map[uint8]string{
+		conntrack.TypeNormal:     "normal",
+		conntrack.TypeNATForward: "nat_forward",
+		conntrack.TypeNATReverse: "nat_reverse",
+	}
+	err := ctMap.Iter(func(_, v []byte) bpf.IteratorAction {
+		var val conntrack.Value
+		copy(val[:], v)
+		r.CTByType[ctTypes[val.Type()]]++
+		return bpf.IterNone
+	})
+	Expect(err).NotTo(HaveOccurred())
+
+	return r
+}
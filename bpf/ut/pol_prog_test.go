@@ -733,6 +733,69 @@ var polProgramTests = []polProgramTest{
 			tcpPkt("10.0.0.1:31245", "10.0.0.2:90"),
 			udpPkt("10.0.0.1:31245", "10.0.0.2:80")},
 	},
+	{
+		// Enough ranges to be binary searched, unsorted and overlapping.
+		PolicyName: "allow to tcp:many ranges",
+		Policy: makeRulesSingleTier([]*proto.Rule{{
+			Action:   "Allow",
+			Protocol: &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: "tcp"}},
+			DstPorts: []*proto.PortRange{
+				{First: 8080, Last: 8090},
+				{First: 22, Last: 22},
+				{First: 443, Last: 443},
+				{First: 80, Last: 81},
+				{First: 81, Last: 85},
+				{First: 3000, Last: 3999},
+				{First: 53, Last: 53},
+				{First: 65535, Last: 65535},
+			},
+		}}),
+		AllowedPackets: []packet{
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:22"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:53"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:80"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:85"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:443"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:3000"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:3999"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:8085"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:65535")},
+		DroppedPackets: []packet{
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:0"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:21"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:86"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:2999"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:4000"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:8091"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:65534"),
+			udpPkt("10.0.0.1:31245", "10.0.0.2:80")},
+	},
+	{
+		PolicyName: "allow to tcp:!many ranges",
+		Policy: makeRulesSingleTier([]*proto.Rule{{
+			Action:   "Allow",
+			Protocol: &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: "tcp"}},
+			NotDstPorts: []*proto.PortRange{
+				{First: 8080, Last: 8090},
+				{First: 22, Last: 22},
+				{First: 443, Last: 443},
+				{First: 80, Last: 85},
+				{First: 3000, Last: 3999},
+				{First: 53, Last: 53},
+			},
+		}}),
+		AllowedPackets: []packet{
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:21"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:86"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:4000"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:8091")},
+		DroppedPackets: []packet{
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:22"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:82"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:443"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:3500"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:8080")},
+	},
 	{
 		PolicyName: "allow from tcp:!80",
 		Policy: makeRulesSingleTier([]*proto.Rule{{
@@ -1096,6 +1159,54 @@ var polProgramTests = []polProgramTest{
 			packetNoPorts(254, "11.0.0.2", "10.0.0.2"),
 		},
 	},
+
+	// Rule grouping tests, the rules interleave protocols and share ports/CIDRs so that the
+	// builder groups and reorders them.  First-match semantics must be preserved.
+	{
+		PolicyName: "interleaved protocols",
+		Policy: makeRulesSingleTier([]*proto.Rule{
+			{
+				Action:   "Deny",
+				Protocol: &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: "tcp"}},
+				DstPorts: []*proto.PortRange{{First: 80, Last: 80}},
+				DstNet:   []string{"10.0.0.2/32"},
+			},
+			{
+				Action:   "Allow",
+				Protocol: &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: "udp"}},
+				DstPorts: []*proto.PortRange{{First: 53, Last: 53}},
+			},
+			{
+				Action:   "Allow",
+				Protocol: &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: "tcp"}},
+				DstPorts: []*proto.PortRange{{First: 80, Last: 80}},
+			},
+			{
+				Action:   "Deny",
+				Protocol: &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: "udp"}},
+			},
+			{
+				Action: "Allow",
+				DstNet: []string{"10.0.0.0/8"},
+			},
+			{
+				Action:   "Deny",
+				Protocol: &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: "tcp"}},
+			},
+		}),
+		AllowedPackets: []packet{
+			udpPkt("10.0.0.1:31245", "10.0.0.2:53"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.3:80"),
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:8080"),
+			icmpPkt("10.0.0.1", "10.0.0.2"),
+		},
+		DroppedPackets: []packet{
+			tcpPkt("10.0.0.1:31245", "10.0.0.2:80"),
+			udpPkt("10.0.0.1:31245", "10.0.0.2:54"),
+			tcpPkt("10.0.0.1:31245", "11.0.0.2:8080"),
+			icmpPkt("10.0.0.1", "11.0.0.2"),
+		},
+	},
 }
 
 var hostPolProgramTests = []polProgramTest{
@@ -1510,6 +1621,18 @@ func TestXDPPolicyPrograms(t *testing.T) {
 	}
 }
 
+// TestChainedPolicyPrograms reruns the policy tests with a tiny instruction budget so that
+// the policy programs get split into chains of programs.
+func TestChainedPolicyPrograms(t *testing.T) {
+	opt := polprog.WithMaxInsnsPerProgram(200)
+	for i, p := range polProgramTests {
+		t.Run(fmt.Sprintf("%d:Policy=%s", i, p.PolicyName), func(t *testing.T) { runTest(t, wrap(p), opt) })
+	}
+	for i, p := range hostPolProgramTests {
+		t.Run(fmt.Sprintf("host:%d:Policy=%s", i, p.PolicyName), func(t *testing.T) { runTest(t, wrap(p), opt) })
+	}
+}
+
 type polProgramTest struct {
 	PolicyName       string
 	Policy           polprog.Rules
@@ -1658,7 +1781,7 @@ type testCase interface {
 	MatchStateOut(stateOut state.State)
 }
 
-func runTest(t *testing.T, tp testPolicy) {
+func runTest(t *testing.T, tp testPolicy, polprogOpts ...polprog.Option) {
 	RegisterTestingT(t)
 
 	// The prog builder refuses to allocate IDs as a precaution, give it an allocator that forces allocations.
@@ -1672,19 +1795,37 @@ func runTest(t *testing.T, tp testPolicy) {
 	setUpIPSets(tp.IPSets(), realAlloc, ipsMap)
 
 	// Build the program.
-	pg := polprog.NewBuilder(forceAlloc, ipsMap.MapFD(), testStateMap.MapFD(), tcJumpMap.MapFD())
-	insns, err := pg.Instructions(tp.Policy())
+	pg := polprog.NewBuilder(forceAlloc, ipsMap.MapFD(), testStateMap.MapFD(), tcJumpMap.MapFD(), polprogOpts...)
+	progs, err := pg.Programs(tp.Policy())
 	Expect(err).NotTo(HaveOccurred(), "failed to assemble program")
 
-	// Load the program into the kernel.  We don't pin it so it'll be removed when the
-	// test process exits (or by the defer).
-	polProgFD, err := bpf.LoadBPFProgramFromInsns(insns, "Apache-2.0", unix.BPF_PROG_TYPE_SCHED_CLS)
-	Expect(err).NotTo(HaveOccurred(), "failed to load program into the kernel")
-	Expect(polProgFD).NotTo(BeZero())
-	defer func() {
-		err := polProgFD.Close()
+	// Load the programs into the kernel.  We don't pin them so they'll be removed when the
+	// test process exits (or by the defer).  The first program is run directly, the rest
+	// of the chain (if any) is reached through the jump map.
+	var polProgFD bpf.ProgFD
+	for i, insns := range progs {
+		progFD, err := bpf.LoadBPFProgramFromInsns(insns, "Apache-2.0", unix.BPF_PROG_TYPE_SCHED_CLS)
+		Expect(err).NotTo(HaveOccurred(), "failed to load program into the kernel")
+		Expect(progFD).NotTo(BeZero())
+		defer func() {
+			err := progFD.Close()
+			Expect(err).NotTo(HaveOccurred())
+		}()
+		if i == 0 {
+			polProgFD = progFD
+			continue
+		}
+		jumpKey := make([]byte, 4)
+		binary.LittleEndian.PutUint32(jumpKey, uint32(polprog.PolicyChainJumpIndex(i, 0)))
+		jumpValue := make([]byte, 4)
+		binary.LittleEndian.PutUint32(jumpValue, uint32(progFD))
+		err = tcJumpMap.Update(jumpKey, jumpValue)
 		Expect(err).NotTo(HaveOccurred())
-	}()
+		defer func() {
+			err := tcJumpMap.Delete(jumpKey)
+			Expect(err).NotTo(HaveOccurred())
+		}()
+	}
 
 	// Give the policy program somewhere to jump to.
 	epiFD := installAllowedProgram(tcJumpMap)
@@ -37,60 +37,74 @@ func TestPrecompiledBinariesAreLoadable(t *testing.T) {
 	Expect(err).NotTo(HaveOccurred())
 	Expect(bpffs).To(Equal("/sys/fs/bpf"))
 
-	for _, logLevel := range []string{"OFF", "INFO", "DEBUG"} {
-		logLevel := logLevel
-		// Compile the TC endpoint programs.
-		logCxt := log.WithField("logLevel", logLevel)
-		for _, epToHostDrop := range []bool{false, true} {
-			epToHostDrop := epToHostDrop
-			logCxt = logCxt.WithField("epToHostDrop", epToHostDrop)
-			for _, fibEnabled := range []bool{false, true} {
-				fibEnabled := fibEnabled
-				logCxt = logCxt.WithField("fibEnabled", fibEnabled)
-				epTypes := []tc.EndpointType{
-					tc.EpTypeWorkload,
-					tc.EpTypeHost,
-					tc.EpTypeTunnel,
-					tc.EpTypeWireguard,
+	// Each stage that can be switched off on its own, and all of them together, as on a node
+	// without kube-proxy or a VXLAN overlay.
+	disabledStages := []struct{ nat, ctlb, vxlan bool }{
+		{},
+		{nat: true},
+		{ctlb: true},
+		{vxlan: true},
+		{nat: true, ctlb: true, vxlan: true},
+	}
+
+	// Compile the TC endpoint programs.
+	logCxt := log.NewEntry(log.StandardLogger())
+	for _, epToHostDrop := range []bool{false, true} {
+		epToHostDrop := epToHostDrop
+		logCxt = logCxt.WithField("epToHostDrop", epToHostDrop)
+		for _, fibEnabled := range []bool{false, true} {
+			fibEnabled := fibEnabled
+			logCxt = logCxt.WithField("fibEnabled", fibEnabled)
+			epTypes := []tc.EndpointType{
+				tc.EpTypeWorkload,
+				tc.EpTypeHost,
+				tc.EpTypeTunnel,
+				tc.EpTypeWireguard,
+			}
+			for _, epType := range epTypes {
+				epType := epType
+				logCxt = logCxt.WithField("epType", epType)
+				if epToHostDrop && epType != tc.EpTypeWorkload {
+					log.Debug("Skipping combination since epToHostDrop only affect workloads")
+					continue
 				}
-				for _, epType := range epTypes {
-					epType := epType
-					logCxt = logCxt.WithField("epType", epType)
-					if epToHostDrop && epType != tc.EpTypeWorkload {
-						log.Debug("Skipping combination since epToHostDrop only affect workloads")
+				for _, toOrFrom := range []tc.ToOrFromEp{tc.FromEp, tc.ToEp} {
+					toOrFrom := toOrFrom
+
+					logCxt := logCxt.WithField("toOrFrom", toOrFrom)
+					if toOrFrom == tc.ToEp && (fibEnabled || epToHostDrop) {
+						log.Debug("Skipping combination since fibEnabled/epToHostDrop only affect from targets")
 						continue
 					}
-					for _, toOrFrom := range []tc.ToOrFromEp{tc.FromEp, tc.ToEp} {
-						toOrFrom := toOrFrom
 
-						logCxt := logCxt.WithField("toOrFrom", toOrFrom)
-						if toOrFrom == tc.ToEp && (fibEnabled || epToHostDrop) {
-							log.Debug("Skipping combination since fibEnabled/epToHostDrop only affect from targets")
+					for _, dsr := range []bool{false, true} {
+						if dsr && !((epType == tc.EpTypeWorkload && toOrFrom == tc.FromEp) ||
+							(epType == tc.EpTypeHost)) {
+							log.Debug("DSR only affects from WEP and HEP")
 							continue
 						}
 
-						for _, dsr := range []bool{false, true} {
-							if dsr && !((epType == tc.EpTypeWorkload && toOrFrom == tc.FromEp) ||
-								(epType == tc.EpTypeHost)) {
-								log.Debug("DSR only affects from WEP and HEP")
-								continue
-							}
-
+						for _, disabled := range disabledStages {
 							ap := tc.AttachPoint{
-								Type:       epType,
-								ToOrFrom:   toOrFrom,
-								Hook:       tc.HookIngress,
-								ToHostDrop: epToHostDrop,
-								FIB:        fibEnabled,
-								DSR:        dsr,
-								LogLevel:   logLevel,
-								HostIP:     net.ParseIP("10.0.0.1"),
-								IntfIP:     net.ParseIP("10.0.0.2"),
+								Type:          epType,
+								ToOrFrom:      toOrFrom,
+								Hook:          tc.HookIngress,
+								ToHostDrop:    epToHostDrop,
+								FIB:           fibEnabled,
+								DSR:           dsr,
+								NATDisabled:   disabled.nat,
+								CTLBDisabled:  disabled.ctlb,
+								VXLANDisabled: disabled.vxlan,
+								HostIP:        net.ParseIP("10.0.0.1"),
+								IntfIP:        net.ParseIP("10.0.0.2"),
 							}
 
-							t.Run(ap.FileName(), func(t *testing.T) {
+							// The settings are patched in at load time, so each object is loaded
+							// with every combination of them that applies.
+							name := fmt.Sprintf("%s_flags_0x%x", ap.FileName(), ap.GlobalFlags())
+							t.Run(name, func(t *testing.T) {
 								RegisterTestingT(t)
-								logCxt.Debugf("Testing %v in %v", ap.ProgramName(), ap.FileName())
+								logCxt.Debugf("Testing %v in %v with flags 0x%x", ap.ProgramName(), ap.FileName(), ap.GlobalFlags())
 
 								vethName, veth := createVeth()
 								defer deleteLink(veth)
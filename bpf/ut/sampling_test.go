@@ -0,0 +1,57 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package ut_test
+
+import (
+	"testing"
+
+	. "github.com/onsi/gomega"
+
+	"github.com/projectcalico/felix/bpf/counters"
+	"github.com/projectcalico/felix/bpf/polprog"
+	"github.com/projectcalico/felix/bpf/sampling"
+)
+
+func TestPolicyDenySampled(t *testing.T) {
+	RegisterTestingT(t)
+
+	_, _, _, _, pktBytes, err := testPacketUDPDefault()
+	Expect(err).NotTo(HaveOccurred())
+
+	Expect(sampling.SetRate(sampleCfgMap, 1)).To(Succeed())
+	defer func() {
+		Expect(sampling.SetRate(sampleCfgMap, 0)).To(Succeed())
+	}()
+	r := sampling.NewReader(sampleMap)
+	Expect(r.SkipToEnd()).To(Succeed())
+
+	// No rules, so the policy program denies the packet.
+	runBpfTest(t, "calico_to_workload_ep", false, &polprog.Rules{}, func(bpfrun bpfProgRunFn) {
+		res, err := bpfrun(pktBytes)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(res.Retval).To(Equal(resTC_ACT_SHOT))
+	})
+
+	var samples []sampling.Sample
+	_, err = r.Read(func(s sampling.Sample) {
+		samples = append(samples, s)
+	})
+	Expect(err).NotTo(HaveOccurred())
+	Expect(samples).To(HaveLen(1))
+	Expect(samples[0].Hook).To(Equal(counters.HookToWEP))
+	Expect(samples[0].Reason).To(Equal(counters.ReasonPolicy))
+	Expect(samples[0].Drop).To(BeTrue())
+	Expect(samples[0].Len).To(Equal(uint32(len(pktBytes))))
+}
@@ -0,0 +1,75 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package ut_test
+
+import (
+	"net"
+	"strings"
+	"testing"
+
+	. "github.com/onsi/gomega"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/eventlog"
+)
+
+func TestPacketTrace(t *testing.T) {
+	RegisterTestingT(t)
+
+	_, _, _, _, pktBytes, err := testPacketUDPDefault()
+	Expect(err).NotTo(HaveOccurred())
+
+	var traced []string
+	reader := eventlog.NewReader([]bpf.Map{logMap}, logLevelMap, traceMap, func(r eventlog.Record) {
+		if strings.Contains(r.Fmt, "-T: ") {
+			traced = append(traced, r.String())
+		}
+	})
+	Expect(reader.SkipToEnd()).To(Succeed())
+
+	defer func() {
+		Expect(eventlog.ClearTraceFilter(traceMap)).To(Succeed())
+	}()
+
+	// Packets of the reverse direction only match if asked for.
+	Expect(eventlog.SetTraceFilter(traceMap, eventlog.TraceFilter{
+		Src: &net.IPNet{IP: ipv4Default.DstIP, Mask: net.CIDRMask(32, 32)},
+	})).To(Succeed())
+
+	runBpfTest(t, "calico_from_host_ep", false, nil, func(bpfrun bpfProgRunFn) {
+		_, err := bpfrun(pktBytes)
+		Expect(err).NotTo(HaveOccurred())
+	})
+	_, err = reader.Read()
+	Expect(err).NotTo(HaveOccurred())
+	Expect(traced).To(BeEmpty())
+
+	Expect(eventlog.SetTraceFilter(traceMap, eventlog.TraceFilter{
+		Src:            &net.IPNet{IP: ipv4Default.DstIP, Mask: net.CIDRMask(32, 32)},
+		DstPort:        uint16(udpDefault.SrcPort),
+		Proto:          17,
+		BothDirections: true,
+	})).To(Succeed())
+
+	runBpfTest(t, "calico_from_host_ep", false, nil, func(bpfrun bpfProgRunFn) {
+		_, err := bpfrun(pktBytes)
+		Expect(err).NotTo(HaveOccurred())
+	})
+	_, err = reader.Read()
+	Expect(err).NotTo(HaveOccurred())
+	Expect(traced).NotTo(BeEmpty())
+	Expect(traced[0]).To(ContainSubstring("New packet proto=17"))
+	Expect(traced[len(traced)-1]).To(ContainSubstring("Final result="))
+}
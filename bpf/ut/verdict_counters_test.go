@@ -0,0 +1,46 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package ut_test
+
+import (
+	"testing"
+
+	. "github.com/onsi/gomega"
+
+	"github.com/projectcalico/felix/bpf/counters"
+)
+
+func verdictCount(hook counters.Hook, reason int, drop bool) uint64 {
+	v, err := verdictCtrsMap.Get(counters.VerdictKey(counters.VerdictIndex(hook, reason, drop)))
+	Expect(err).NotTo(HaveOccurred())
+	return counters.RuleValueFromPerCPUBytes(v).Packets
+}
+
+func TestVerdictCounters(t *testing.T) {
+	RegisterTestingT(t)
+
+	_, _, _, _, pktBytes, err := testPacketUDPDefault()
+	Expect(err).NotTo(HaveOccurred())
+
+	// A truncated packet is dropped as too short, before it gets to policy.
+	before := verdictCount(counters.HookFromHEP, counters.ReasonShort, true)
+	runBpfTest(t, "calico_from_host_ep", false, nil, func(bpfrun bpfProgRunFn) {
+		res, err := bpfrun(pktBytes[:30])
+		Expect(err).NotTo(HaveOccurred())
+		Expect(res.Retval).To(Equal(resTC_ACT_SHOT))
+	})
+	Expect(verdictCount(counters.HookFromHEP, counters.ReasonShort, true)).To(Equal(before + 1))
+	Expect(verdictCount(counters.HookFromHEP, counters.ReasonShort, false)).To(BeZero())
+}
@@ -0,0 +1,384 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package ut_test
+
+import (
+	"bytes"
+	"encoding/json"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"os/exec"
+	"path"
+	"regexp"
+	"strconv"
+	"strings"
+	"testing"
+
+	. "github.com/onsi/gomega"
+	"github.com/pkg/errors"
+	log "github.com/sirupsen/logrus"
+	"golang.org/x/sys/unix"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/polprog"
+	"github.com/projectcalico/felix/bpf/tc"
+	"github.com/projectcalico/felix/idalloc"
+	"github.com/projectcalico/felix/proto"
+)
+
+// verifierComplexityLimit is the kernel's limit on the number of instructions that the
+// verifier may process for a single program (BPF_COMPLEXITY_LIMIT_INSNS).
+const verifierComplexityLimit = 1000000
+
+// progNameLen is the length that the kernel truncates program names to.
+const progNameLen = 15
+
+// TestVerifierReport loads every object that bpf-gpl/list-objs emits, with all the settings and
+// stages in the global flags switched on so that the verifier walks all of their code, and a
+// sample of policy programs, and reports the size of each program and, where the kernel and
+// bpftool provide them, the verifier's statistics.  It only runs if BPF_VERIFIER_REPORT names
+// the file to write the report to, as JSON.  The checks are:
+//
+//   - no program may need more than BPF_VERIFIER_MAX_PCT percent (80 by default) of the
+//     verifier's complexity limit;
+//   - if BPF_VERIFIER_BASELINE names the report of a previous run, no program may have grown
+//     by more than BPF_VERIFIER_MAX_GROWTH percent (2 by default) of its translated
+//     instructions.  All changes in size are printed either way.
+//
+// The number of verifier states and the stack depth come from the verifier log, which is
+// only parsed if BPF_VERIFIER_LOG_STATS is set; the log is very large for the bigger programs
+// and recent versions of bpftool and libbpf are needed to attribute it to the programs.
+func TestVerifierReport(t *testing.T) {
+	reportFile := os.Getenv("BPF_VERIFIER_REPORT")
+	if reportFile == "" {
+		t.Skip("BPF_VERIFIER_REPORT not set")
+	}
+	RegisterTestingT(t)
+
+	out, err := exec.Command("../../bpf-gpl/list-objs").Output()
+	Expect(err).NotTo(HaveOccurred())
+
+	var report []verifierReportEntry
+	for _, obj := range strings.Fields(string(out)) {
+		entries, err := verifierReportObject("../../bpf-gpl/" + obj)
+		Expect(err).NotTo(HaveOccurred(), "failed to load "+obj)
+		report = append(report, entries...)
+	}
+	report = append(report, verifierReportPolicies()...)
+
+	data, err := json.MarshalIndent(report, "", "  ")
+	Expect(err).NotTo(HaveOccurred())
+	err = ioutil.WriteFile(reportFile, data, 0644)
+	Expect(err).NotTo(HaveOccurred())
+
+	maxPct := envInt("BPF_VERIFIER_MAX_PCT", 80)
+	for _, e := range report {
+		if e.VerifiedInsns > 0 {
+			Expect(e.VerifiedInsns).To(BeNumerically("<=", verifierComplexityLimit*maxPct/100),
+				fmt.Sprintf("%s: verifier processed more than %d%% of its limit", e.key(), maxPct))
+		}
+	}
+
+	if baselineFile := os.Getenv("BPF_VERIFIER_BASELINE"); baselineFile != "" {
+		data, err := ioutil.ReadFile(baselineFile)
+		Expect(err).NotTo(HaveOccurred())
+		var baseline []verifierReportEntry
+		err = json.Unmarshal(data, &baseline)
+		Expect(err).NotTo(HaveOccurred())
+
+		maxGrowth := envInt("BPF_VERIFIER_MAX_GROWTH", 2)
+		checkVerifierReportGrowth(baseline, report, maxGrowth)
+	}
+}
+
+func envInt(name string, def int) int {
+	s := os.Getenv(name)
+	if s == "" {
+		return def
+	}
+	v, err := strconv.Atoi(s)
+	Expect(err).NotTo(HaveOccurred(), name+" is not an integer")
+	return v
+}
+
+type verifierReportEntry struct {
+	// Object is the object file, or "policy" for the sample policy programs.
+	Object string `json:"object"`
+	// Program is the name of the file that the program is pinned as, which is named after
+	// its section, or the parameters of a policy program.
+	Program     string `json:"program"`
+	XlatedInsns int    `json:"xlated_insns"`
+	JitedBytes  int    `json:"jited_bytes"`
+	// VerifiedInsns is the number of instructions that the verifier processed, which is what
+	// the complexity limit applies to.  It is only reported by recent kernels.
+	VerifiedInsns int    `json:"verified_insns,omitempty"`
+	TotalStates   int    `json:"total_states,omitempty"`
+	PeakStates    int    `json:"peak_states,omitempty"`
+	StackDepth    string `json:"stack_depth,omitempty"`
+}
+
+func (e verifierReportEntry) key() string {
+	return e.Object + ":" + e.Program
+}
+
+type progShowInfo struct {
+	Name          string `json:"name"`
+	BytesXlated   int    `json:"bytes_xlated"`
+	BytesJited    int    `json:"bytes_jited"`
+	VerifiedInsns int    `json:"verified_insns"`
+}
+
+func progShowPinned(p string) (progShowInfo, error) {
+	var info progShowInfo
+	out, err := bpftool("prog", "show", "pinned", p)
+	if err != nil {
+		return info, err
+	}
+	err = json.Unmarshal(out, &info)
+	return info, err
+}
+
+// verifierReportObject loads all the programs of the object and reports on each of them.
+func verifierReportObject(obj string) ([]verifierReportEntry, error) {
+	base := path.Base(obj)
+	var progType string
+	var maps []bpf.Map
+	switch {
+	case strings.HasPrefix(base, "connect_time_") && strings.HasSuffix(base, "_v6.o"):
+		progType = "cgroup/sendmsg6"
+	case strings.HasPrefix(base, "connect_time_"):
+		progType = "cgroup/connect4"
+	case base == "xdp.o":
+		progType = "xdp"
+		for _, m := range progMaps {
+			if m != tcJumpMap {
+				maps = append(maps, m)
+			}
+		}
+	default:
+		progType = "classifier"
+		for _, m := range progMaps {
+			if m != xdpJumpMap {
+				maps = append(maps, m)
+			}
+		}
+	}
+
+	objDir, err := ioutil.TempDir("", "calico-verifier-")
+	if err != nil {
+		return nil, err
+	}
+	defer os.RemoveAll(objDir)
+
+	// The flags that don't apply to a program are ignored by it, see bpf.h.  The GlobalsNo*
+	// bits are left clear.
+	bin, err := bpf.BinaryFromFile(obj)
+	if err != nil {
+		return nil, err
+	}
+	bin.PatchGlobalFlags(tc.GlobalsDropWorkloadToHost | tc.GlobalsFIBLookup | tc.GlobalsDSR)
+	patchedObj := path.Join(objDir, base)
+	if err := bin.WriteToFile(patchedObj); err != nil {
+		return nil, err
+	}
+
+	tempDir, err := ioutil.TempDir("/sys/fs/bpf", "calico-verifier-")
+	if err != nil {
+		return nil, err
+	}
+	defer os.RemoveAll(tempDir)
+
+	logStats := os.Getenv("BPF_VERIFIER_LOG_STATS") != ""
+	args := []string{"prog", "loadall", patchedObj, tempDir, "type", progType}
+	if logStats {
+		args = append([]string{"-d"}, args...)
+	}
+	for _, m := range maps {
+		args = append(args, "map", "name", m.GetName(), "pinned", m.Path())
+	}
+	cmd := exec.Command("bpftool", args...)
+	var stderr bytes.Buffer
+	cmd.Stderr = &stderr
+	log.WithField("cmd", cmd.String()).Debug("Loading object")
+	if err := cmd.Run(); err != nil {
+		return nil, errors.Wrap(err, lastLines(stderr.String(), 20))
+	}
+
+	var stats map[string]verifierStats
+	if logStats {
+		stats = parseVerifierLog(stderr.String())
+	}
+
+	files, err := ioutil.ReadDir(tempDir)
+	if err != nil {
+		return nil, err
+	}
+	var entries []verifierReportEntry
+	for _, f := range files {
+		info, err := progShowPinned(path.Join(tempDir, f.Name()))
+		if err != nil {
+			return nil, err
+		}
+		e := verifierReportEntry{
+			Object:        base,
+			Program:       f.Name(),
+			XlatedInsns:   info.BytesXlated / 8,
+			JitedBytes:    info.BytesJited,
+			VerifiedInsns: info.VerifiedInsns,
+		}
+		if s, ok := stats[info.Name]; ok {
+			if e.VerifiedInsns == 0 {
+				e.VerifiedInsns = s.processed
+			}
+			e.TotalStates = s.totalStates
+			e.PeakStates = s.peakStates
+			e.StackDepth = s.stackDepth
+		}
+		entries = append(entries, e)
+	}
+	return entries, nil
+}
+
+func lastLines(s string, n int) string {
+	lines := strings.Split(strings.TrimSpace(s), "\n")
+	if len(lines) > n {
+		lines = lines[len(lines)-n:]
+	}
+	return strings.Join(lines, "\n")
+}
+
+type verifierStats struct {
+	processed   int
+	totalStates int
+	peakStates  int
+	stackDepth  string
+}
+
+var (
+	verifierLogBeginRegexp  = regexp.MustCompile(`prog '([^']+)': -- BEGIN PROG LOAD LOG --`)
+	verifierProcessedRegexp = regexp.MustCompile(
+		`processed (\d+) insns \(limit \d+\) max_states_per_insn \d+ total_states (\d+) peak_states (\d+)`)
+	verifierStackRegexp = regexp.MustCompile(`stack depth ([\d+]+)`)
+)
+
+// parseVerifierLog extracts the statistics of each program from the output of bpftool -d.
+// libbpf wraps the verifier log of each program in BEGIN/END markers that name the program;
+// the statistics are at the end of the log.  The names are truncated to the length that the
+// kernel keeps, so that they match those that bpftool prog show reports.
+func parseVerifierLog(out string) map[string]verifierStats {
+	stats := map[string]verifierStats{}
+	var name string
+	for _, line := range strings.Split(out, "\n") {
+		if m := verifierLogBeginRegexp.FindStringSubmatch(line); m != nil {
+			name = m[1]
+			if len(name) > progNameLen {
+				name = name[:progNameLen]
+			}
+			continue
+		}
+		if name == "" {
+			continue
+		}
+		s := stats[name]
+		if m := verifierProcessedRegexp.FindStringSubmatch(line); m != nil {
+			s.processed, _ = strconv.Atoi(m[1])
+			s.totalStates, _ = strconv.Atoi(m[2])
+			s.peakStates, _ = strconv.Atoi(m[3])
+		} else if m := verifierStackRegexp.FindStringSubmatch(line); m != nil {
+			s.stackDepth = m[1]
+		} else {
+			continue
+		}
+		stats[name] = s
+	}
+	return stats
+}
+
+// verifierReportPolicies loads policy programs of a range of sizes.
+func verifierReportPolicies() []verifierReportEntry {
+	tempDir, err := ioutil.TempDir("/sys/fs/bpf", "calico-verifier-")
+	Expect(err).NotTo(HaveOccurred())
+	defer os.RemoveAll(tempDir)
+
+	var entries []verifierReportEntry
+	for _, numRules := range []int{10, 100, 1000} {
+		for _, flat := range []bool{false, true} {
+			protoRules := make([]*proto.Rule, numRules)
+			for i := range protoRules {
+				protoRules[i] = &proto.Rule{
+					Action:   "Allow",
+					Protocol: &proto.Protocol{NumberOrName: &proto.Protocol_Name{Name: "tcp"}},
+					DstNet:   []string{fmt.Sprintf("10.%d.%d.0/24", i/256, i%256)},
+					DstPorts: []*proto.PortRange{{First: int32(1000 + i), Last: int32(1000 + i)}},
+				}
+			}
+			var opts []polprog.Option
+			if flat {
+				opts = append(opts, polprog.WithFlatRules())
+			}
+			alloc := &forceAllocator{alloc: idalloc.New()}
+			pg := polprog.NewBuilder(alloc, ipsMap.MapFD(), stateMap.MapFD(), tcJumpMap.MapFD(), opts...)
+			insns, err := pg.Instructions(makeRulesSingleTier(protoRules))
+			Expect(err).NotTo(HaveOccurred())
+
+			fd, err := bpf.LoadBPFProgramFromInsns(insns, "Apache-2.0", unix.BPF_PROG_TYPE_SCHED_CLS)
+			Expect(err).NotTo(HaveOccurred())
+			name := fmt.Sprintf("rules=%d,flat=%v", numRules, flat)
+			pinPath := path.Join(tempDir, strings.NewReplacer("=", "_", ",", "_").Replace(name))
+			err = bpf.PinBPFProgram(fd, pinPath)
+			_ = fd.Close()
+			Expect(err).NotTo(HaveOccurred())
+
+			info, err := progShowPinned(pinPath)
+			Expect(err).NotTo(HaveOccurred())
+			entries = append(entries, verifierReportEntry{
+				Object:        "policy",
+				Program:       name,
+				XlatedInsns:   info.BytesXlated / 8,
+				JitedBytes:    info.BytesJited,
+				VerifiedInsns: info.VerifiedInsns,
+			})
+		}
+	}
+	return entries
+}
+
+// checkVerifierReportGrowth prints the change in size of each program since the baseline
+// and fails if any grew by more than maxGrowth percent.
+func checkVerifierReportGrowth(baseline, report []verifierReportEntry, maxGrowth int) {
+	before := map[string]verifierReportEntry{}
+	for _, e := range baseline {
+		before[e.key()] = e
+	}
+
+	var grown []string
+	for _, e := range report {
+		b, ok := before[e.key()]
+		if !ok {
+			fmt.Printf("%-60s new, %d insns\n", e.key(), e.XlatedInsns)
+			continue
+		}
+		if b.XlatedInsns == e.XlatedInsns {
+			continue
+		}
+		pct := float64(e.XlatedInsns-b.XlatedInsns) * 100 / float64(b.XlatedInsns)
+		fmt.Printf("%-60s %d -> %d insns (%+.1f%%)\n", e.key(), b.XlatedInsns, e.XlatedInsns, pct)
+		if pct > float64(maxGrowth) {
+			grown = append(grown, e.key())
+		}
+	}
+	Expect(grown).To(BeEmpty(), fmt.Sprintf("programs grew by more than %d%%", maxGrowth))
+}
@@ -35,7 +35,7 @@ func MapForTest(mc *bpf.MapContext) bpf.Map {
 		Type:       "prog_array",
 		KeySize:    4,
 		ValueSize:  4,
-		MaxEntries: 8,
+		MaxEntries: 64,
 		Name:       "cali_jump",
 	})
 }
@@ -30,9 +30,8 @@ import (
 )
 
 type AttachPoint struct {
-	Iface    string
-	LogLevel string
-	Modes    []bpf.XDPMode
+	Iface string
+	Modes []bpf.XDPMode
 }
 
 func (ap *AttachPoint) IfaceName() string {
@@ -44,11 +43,7 @@ func (ap *AttachPoint) JumpMapFDMapKey() string {
 }
 
 func (ap *AttachPoint) FileName() string {
-	logLevel := strings.ToLower(ap.LogLevel)
-	if logLevel == "off" {
-		logLevel = "no_log"
-	}
-	return "xdp_" + logLevel + ".o"
+	return "xdp.o"
 }
 
 func (ap *AttachPoint) SectionName() string {
@@ -57,9 +52,8 @@ func (ap *AttachPoint) SectionName() string {
 
 func (ap *AttachPoint) Log() *log.Entry {
 	return log.WithFields(log.Fields{
-		"iface":    ap.Iface,
-		"modes":    ap.Modes,
-		"logLevel": ap.LogLevel,
+		"iface": ap.Iface,
+		"modes": ap.Modes,
 	})
 }
 
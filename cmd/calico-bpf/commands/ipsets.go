@@ -49,15 +49,17 @@ var ipsetsCmd = &cobra.Command{
 
 func dumpIPSets() error {
 	ipsetMap := ipsets.Map(&bpf.MapContext{})
+	ipsetHashMap := ipsets.HashMap(&bpf.MapContext{})
 
 	if err := ipsetMap.Open(); err != nil {
 		return errors.WithMessage(err, "failed to open map")
 	}
+	if err := ipsetHashMap.Open(); err != nil {
+		return errors.WithMessage(err, "failed to open hash map")
+	}
 
 	membersBySet := map[uint64][]string{}
-	err := ipsetMap.Iter(func(k, v []byte) bpf.IteratorAction {
-		var entry ipsets.IPSetEntry
-		copy(entry[:], k[:])
+	addMember := func(entry ipsets.IPSetEntry) {
 		var member string
 		if entry.Protocol() == 0 {
 			member = fmt.Sprintf("%s/%d", entry.Addr(), entry.PrefixLen()-64)
@@ -65,6 +67,18 @@ func dumpIPSets() error {
 			member = fmt.Sprintf("%s:%d (proto %d)", entry.Addr(), entry.Port(), entry.Protocol())
 		}
 		membersBySet[entry.SetID()] = append(membersBySet[entry.SetID()], member)
+	}
+	err := ipsetMap.Iter(func(k, v []byte) bpf.IteratorAction {
+		var entry ipsets.IPSetEntry
+		copy(entry[:], k[:])
+		addMember(entry)
+		return bpf.IterNone
+	})
+	if err != nil {
+		return err
+	}
+	err = ipsetHashMap.Iter(func(k, v []byte) bpf.IteratorAction {
+		addMember(ipsets.IPSetEntryFromHashKey(k))
 		return bpf.IterNone
 	})
 	if err != nil {
@@ -0,0 +1,121 @@
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package commands
+
+import (
+	"fmt"
+	"os"
+	"os/signal"
+	"strconv"
+	"time"
+
+	"github.com/pkg/errors"
+	log "github.com/sirupsen/logrus"
+	"github.com/spf13/cobra"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/sampling"
+)
+
+func init() {
+	samplesCmd.AddCommand(samplesRateCmd)
+	samplesCmd.AddCommand(samplesFollowCmd)
+	rootCmd.AddCommand(samplesCmd)
+}
+
+// samplesCmd represents the samples command
+var samplesCmd = &cobra.Command{
+	Use:   "samples",
+	Short: "Controls and reads the packet samples of the BPF programs",
+}
+
+var samplesRateCmd = &cobra.Command{
+	Use:   "rate [<N>]",
+	Short: "shows the sampling rate or, given N, samples one packet in N (0 disables sampling)",
+	Args:  cobra.MaximumNArgs(1),
+	Run: func(cmd *cobra.Command, args []string) {
+		if err := sampleRate(args); err != nil {
+			log.WithError(err).Error("Failed to access the sampling rate.")
+		}
+	},
+}
+
+var samplesFollowCmd = &cobra.Command{
+	Use:   "follow",
+	Short: "prints the packet samples as they are written, until interrupted",
+	Run: func(cmd *cobra.Command, args []string) {
+		if err := followSamples(); err != nil {
+			log.WithError(err).Error("Failed to read the packet samples.")
+		}
+	},
+}
+
+func sampleRate(args []string) error {
+	cfgMap := sampling.CfgMap(&bpf.MapContext{})
+	if err := cfgMap.Open(); err != nil {
+		return errors.WithMessage(err, "failed to open map")
+	}
+
+	if len(args) == 1 {
+		rate, err := strconv.ParseUint(args[0], 10, 32)
+		if err != nil {
+			return errors.Errorf("invalid rate %q", args[0])
+		}
+		if err := sampling.SetRate(cfgMap, uint32(rate)); err != nil {
+			return err
+		}
+	}
+
+	rate, err := sampling.GetRate(cfgMap)
+	if err != nil {
+		return err
+	}
+	if rate == 0 {
+		fmt.Println("Sampling disabled")
+	} else {
+		fmt.Printf("Sampling 1 packet in %d\n", rate)
+	}
+	return nil
+}
+
+func followSamples() error {
+	ringMap := sampling.Map(&bpf.MapContext{})
+	if err := ringMap.Open(); err != nil {
+		return errors.WithMessage(err, "failed to open map")
+	}
+
+	r := sampling.NewReader(ringMap)
+	if err := r.SkipToEnd(); err != nil {
+		return err
+	}
+
+	sigCh := make(chan os.Signal, 1)
+	signal.Notify(sigCh, os.Interrupt)
+	ticker := time.NewTicker(100 * time.Millisecond)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-ticker.C:
+			_, err := r.Read(func(s sampling.Sample) {
+				fmt.Printf("cpu %3d: %s\n", s.CPU, s)
+			})
+			if err != nil {
+				return err
+			}
+		case <-sigCh:
+			return nil
+		}
+	}
+}
@@ -0,0 +1,225 @@
+// Copyright (c) 2019-2020 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package commands
+
+import (
+	"fmt"
+	"net"
+	"os"
+	"os/signal"
+	"strings"
+	"time"
+
+	"github.com/pkg/errors"
+	log "github.com/sirupsen/logrus"
+	"github.com/spf13/cobra"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/eventlog"
+)
+
+var traceFilter struct {
+	src, dst       string
+	sport, dport   uint16
+	proto          string
+	bothDirections bool
+}
+
+func init() {
+	traceSetCmd.Flags().StringVar(&traceFilter.src, "src", "", "source IP or CIDR to match")
+	traceSetCmd.Flags().StringVar(&traceFilter.dst, "dst", "", "destination IP or CIDR to match")
+	traceSetCmd.Flags().Uint16Var(&traceFilter.sport, "sport", 0, "source port to match")
+	traceSetCmd.Flags().Uint16Var(&traceFilter.dport, "dport", 0, "destination port to match")
+	traceSetCmd.Flags().StringVar(&traceFilter.proto, "proto", "", "protocol to match (tcp, udp, icmp or a number)")
+	traceSetCmd.Flags().BoolVar(&traceFilter.bothDirections, "both", false, "also match the reverse direction")
+
+	traceCmd.AddCommand(traceSetCmd)
+	traceCmd.AddCommand(traceClearCmd)
+	traceCmd.AddCommand(traceShowCmd)
+	traceCmd.AddCommand(traceFollowCmd)
+	rootCmd.AddCommand(traceCmd)
+}
+
+// traceCmd represents the trace command
+var traceCmd = &cobra.Command{
+	Use:   "trace",
+	Short: "Traces the packets that match a filter through the BPF programs",
+}
+
+var traceSetCmd = &cobra.Command{
+	Use:   "set",
+	Short: "starts tracing the packets that match the filter",
+	Run: func(cmd *cobra.Command, args []string) {
+		if err := setTrace(); err != nil {
+			log.WithError(err).Error("Failed to set the trace filter.")
+		}
+	},
+}
+
+var traceClearCmd = &cobra.Command{
+	Use:   "clear",
+	Short: "stops tracing",
+	Run: func(cmd *cobra.Command, args []string) {
+		if err := clearTrace(); err != nil {
+			log.WithError(err).Error("Failed to clear the trace filter.")
+		}
+	},
+}
+
+var traceShowCmd = &cobra.Command{
+	Use:   "show",
+	Short: "shows the trace filter",
+	Run: func(cmd *cobra.Command, args []string) {
+		if err := showTrace(); err != nil {
+			log.WithError(err).Error("Failed to read the trace filter.")
+		}
+	},
+}
+
+var traceFollowCmd = &cobra.Command{
+	Use:   "follow",
+	Short: "prints the BPF log records as they are written, until interrupted",
+	Run: func(cmd *cobra.Command, args []string) {
+		if err := followTrace(); err != nil {
+			log.WithError(err).Error("Failed to read the BPF log.")
+		}
+	},
+}
+
+func openTraceMap() (bpf.Map, error) {
+	traceMap := eventlog.TraceMap(&bpf.MapContext{})
+	if err := traceMap.Open(); err != nil {
+		return nil, errors.WithMessage(err, "failed to open map")
+	}
+	return traceMap, nil
+}
+
+func parseTraceCIDR(s string) (*net.IPNet, error) {
+	if s == "" {
+		return nil, nil
+	}
+	if !strings.Contains(s, "/") {
+		s += "/32"
+	}
+	_, n, err := net.ParseCIDR(s)
+	return n, err
+}
+
+func parseTraceProto(s string) (uint8, error) {
+	switch strings.ToLower(s) {
+	case "":
+		return 0, nil
+	case "tcp":
+		return 6, nil
+	case "udp":
+		return 17, nil
+	case "icmp":
+		return 1, nil
+	}
+	var p uint8
+	if _, err := fmt.Sscanf(s, "%d", &p); err != nil {
+		return 0, errors.Errorf("unknown protocol %q", s)
+	}
+	return p, nil
+}
+
+func setTrace() error {
+	var (
+		f   eventlog.TraceFilter
+		err error
+	)
+	if f.Src, err = parseTraceCIDR(traceFilter.src); err != nil {
+		return err
+	}
+	if f.Dst, err = parseTraceCIDR(traceFilter.dst); err != nil {
+		return err
+	}
+	if f.Proto, err = parseTraceProto(traceFilter.proto); err != nil {
+		return err
+	}
+	f.SrcPort = traceFilter.sport
+	f.DstPort = traceFilter.dport
+	f.BothDirections = traceFilter.bothDirections
+
+	traceMap, err := openTraceMap()
+	if err != nil {
+		return err
+	}
+	if err := eventlog.SetTraceFilter(traceMap, f); err != nil {
+		return err
+	}
+	fmt.Printf("Tracing %s\n", f)
+	return nil
+}
+
+func clearTrace() error {
+	traceMap, err := openTraceMap()
+	if err != nil {
+		return err
+	}
+	return eventlog.ClearTraceFilter(traceMap)
+}
+
+func showTrace() error {
+	traceMap, err := openTraceMap()
+	if err != nil {
+		return err
+	}
+	f, ok, err := eventlog.GetTraceFilter(traceMap)
+	if err != nil {
+		return err
+	}
+	if !ok {
+		fmt.Println("Tracing disabled")
+		return nil
+	}
+	fmt.Printf("Tracing %s\n", f)
+	return nil
+}
+
+func followTrace() error {
+	logMap := eventlog.Map(&bpf.MapContext{})
+	if err := logMap.Open(); err != nil {
+		return errors.WithMessage(err, "failed to open map")
+	}
+
+	// Traced packets are logged by the TC programs, which log to the main rings.  The reader
+	// is polled by hand, so it doesn't need the level and trace filter maps.
+	r := eventlog.NewReader([]bpf.Map{logMap}, nil, nil, func(rec eventlog.Record) {
+		fmt.Printf("cpu %3d: %s", rec.CPU, rec)
+		if !strings.HasSuffix(rec.Fmt, "\n") {
+			fmt.Println()
+		}
+	})
+	if err := r.SkipToEnd(); err != nil {
+		return err
+	}
+
+	sigCh := make(chan os.Signal, 1)
+	signal.Notify(sigCh, os.Interrupt)
+	timer := time.NewTimer(r.PollPeriod())
+	defer timer.Stop()
+	for {
+		select {
+		case <-timer.C:
+			if _, err := r.Read(); err != nil {
+				return err
+			}
+			timer.Reset(r.PollPeriod())
+		case <-sigCh:
+			return nil
+		}
+	}
+}
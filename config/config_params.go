@@ -176,6 +176,13 @@ type Config struct {
 	BPFKubeProxyMinSyncPeriod          time.Duration  `config:"seconds;1"`
 	BPFKubeProxyEndpointSlicesEnabled  bool           `config:"bool;false"`
 	BPFExtToServiceConnmark            int            `config:"int;0"`
+	BPFPolicyCIDRSetThreshold          int            `config:"int;32"`
+	BPFPolicyRuleCountersEnabled       bool           `config:"bool;false"`
+	BPFPolicyProgramPerTierEnabled     bool           `config:"bool;false"`
+	BPFLatencySampleRate               int            `config:"int(0,1048576);0"`
+	BPFFlowLogsEnabled                 bool           `config:"bool;false"`
+	BPFPacketSampleRate                int            `config:"int(0,16777216);0"`
+	BPFMapHighWatermarkPercent         int            `config:"int(1,100);80"`
 
 	// DebugBPFCgroupV2 controls the cgroup v2 path that we apply the connect-time load balancer to.  Most distros
 	// are configured for cgroup v1, which prevents all but hte root cgroup v2 from working so this is only useful
@@ -607,6 +607,17 @@ configRetry:
 	// Start communicating with the dataplane driver.
 	dpConnector.Start()
 
+	if stopper, ok := dpDriver.(interface{ Stop() }); ok {
+		// The internal dataplane driver has background threads to stop.
+		sc := make(chan *sync.WaitGroup)
+		stopSignalChans = append(stopSignalChans, sc)
+		go func() {
+			wg := <-sc
+			stopper.Stop()
+			wg.Done()
+		}()
+	}
+
 	if policySyncProcessor != nil {
 		log.WithField("policySyncPathPrefix", configParams.PolicySyncPathPrefix).Info(
 			"Policy sync API enabled.  Starting the policy sync server.")
@@ -346,6 +346,13 @@ func StartDataplaneDriver(configParams *config.Config,
 			BPFKubeProxyIptablesCleanupEnabled: configParams.BPFKubeProxyIptablesCleanupEnabled,
 			BPFLogLevel:                        configParams.BPFLogLevel,
 			BPFExtToServiceConnmark:            configParams.BPFExtToServiceConnmark,
+			BPFPolicyCIDRSetThreshold:          configParams.BPFPolicyCIDRSetThreshold,
+			BPFPolicyRuleCountersEnabled:       configParams.BPFPolicyRuleCountersEnabled,
+			BPFPolicyProgramPerTierEnabled:     configParams.BPFPolicyProgramPerTierEnabled,
+			BPFLatencySampleRate:               configParams.BPFLatencySampleRate,
+			BPFFlowLogsEnabled:                 configParams.BPFFlowLogsEnabled,
+			BPFPacketSampleRate:                configParams.BPFPacketSampleRate,
+			BPFMapHighWatermarkPercent:         configParams.BPFMapHighWatermarkPercent,
 			BPFDataIfacePattern:                configParams.BPFDataIfacePattern,
 			BPFCgroupV2:                        configParams.DebugBPFCgroupV2,
 			BPFMapRepin:                        configParams.DebugBPFMapRepinEnabled,
@@ -40,14 +40,18 @@ import (
 
 	"github.com/projectcalico/felix/logutils"
 
+	cprometheus "github.com/projectcalico/libcalico-go/lib/prometheus"
 	"github.com/projectcalico/libcalico-go/lib/set"
 
 	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/asm"
+	"github.com/projectcalico/felix/bpf/counters"
 	"github.com/projectcalico/felix/bpf/polprog"
 	"github.com/projectcalico/felix/bpf/tc"
 	"github.com/projectcalico/felix/bpf/xdp"
 	"github.com/projectcalico/felix/idalloc"
 	"github.com/projectcalico/felix/ifacemonitor"
+	"github.com/projectcalico/felix/ipsets"
 	"github.com/projectcalico/felix/iptables"
 	"github.com/projectcalico/felix/proto"
 	"github.com/projectcalico/felix/ratelimited"
@@ -68,12 +72,28 @@ var (
 		Name: "felix_bpf_happy_dataplane_endpoints",
 		Help: "Number of BPF endpoints that are successfully programmed.",
 	})
+	bpfPolicyProgramsLoadedCounter = prometheus.NewCounter(prometheus.CounterOpts{
+		Name: "felix_bpf_policy_programs_loaded",
+		Help: "Number of BPF policy programs loaded into the kernel (and verified).",
+	})
+	bpfPolicyProgramsUnchangedCounter = prometheus.NewCounter(prometheus.CounterOpts{
+		Name: "felix_bpf_policy_programs_unchanged",
+		Help: "Number of regenerated BPF policy programs that were already loaded and were skipped.",
+	})
+	summaryPolicyUpdateLatency = cprometheus.NewSummary(prometheus.SummaryOpts{
+		Name: "felix_bpf_policy_update_latency_seconds",
+		Help: "Time in seconds from receiving a policy or profile update to the end of the " +
+			"dataplane update that applied it to the BPF endpoints.",
+	})
 )
 
 func init() {
 	prometheus.MustRegister(bpfEndpointsGauge)
 	prometheus.MustRegister(bpfDirtyEndpointsGauge)
 	prometheus.MustRegister(bpfHappyEndpointsGauge)
+	prometheus.MustRegister(bpfPolicyProgramsLoadedCounter)
+	prometheus.MustRegister(bpfPolicyProgramsUnchangedCounter)
+	prometheus.MustRegister(summaryPolicyUpdateLatency)
 }
 
 type attachPoint interface {
@@ -91,7 +111,7 @@ type bpfDataplane interface {
 	ensureProgramAttached(ap attachPoint) (bpf.MapFD, error)
 	ensureNoProgram(ap attachPoint) error
 	ensureQdisc(iface string) error
-	updatePolicyProgram(jumpMapFD bpf.MapFD, rules polprog.Rules) error
+	updatePolicyProgram(jumpMapFD bpf.MapFD, rules polprog.Rules, hook counters.Hook) error
 	removePolicyProgram(jumpMapFD bpf.MapFD) error
 	setAcceptLocal(iface string, val bool) error
 }
@@ -132,7 +152,6 @@ type bpfEndpointManager struct {
 
 	dirtyIfaceNames set.Set
 
-	bpfLogLevel             string
 	hostname                string
 	hostIP                  net.IP
 	fibLookupEnabled        bool
@@ -145,8 +164,45 @@ type bpfEndpointManager struct {
 	dsrEnabled              bool
 	bpfExtToServiceConnmark int
 
-	ipSetMap bpf.Map
-	stateMap bpf.Map
+	// natEnabled, ctlbEnabled and vxlanEnabled say which optional stages of the programs are
+	// in use on this node; the programs are loaded with the others switched off.
+	natEnabled   bool
+	ctlbEnabled  bool
+	vxlanEnabled bool
+
+	ipSetMap     bpf.Map
+	ipSetHashMap bpf.Map
+	stateMap     bpf.Map
+
+	// ruleCounters, if not nil, holds the indexes of the counters of the policy rules in the
+	// rule counter map.  The policy programs then count the packets that each rule matches.
+	ruleCounters *counters.RuleCounters
+	// verdictCounters, if not nil, holds the map in which the programs count the packets
+	// that they allow or drop, the policy programs count the packets that policy drops.
+	verdictCounters *counters.VerdictCounters
+
+	// CIDR lists longer than cidrSetThreshold are matched by the policy programs against
+	// synthetic IP sets, which we program into ipSets.  The sets are shared by content and
+	// refcounted by the policies and profiles that use them.
+	ipSets           bpfIPSetsDataplane
+	cidrSetThreshold int
+	cidrSetRefs      map[string]int
+	cidrSetsByPolicy map[interface{}][]string
+
+	// programPerTier puts each tier in its own program of the policy program chain so that
+	// a policy change only reloads the programs of its tier, at the cost of a tail call per
+	// tier for every packet.
+	programPerTier bool
+	// polProgs records the policy programs that we installed in the jump maps.
+	polProgs *polProgCache
+	// sharedPolProgs holds the TC policy program chains that are shared between endpoints
+	// with the same rules, nil if the chains are per-endpoint.
+	sharedPolProgs *sharedPolProgs
+	// polProgArrays updates the jump maps and the prog array that hold the policy programs.
+	polProgArrays polProgArrays
+	// policyUpdatePendingSince is the time of the oldest policy or profile update that has
+	// not been applied yet, zero if there is none.
+	policyUpdatePendingSince time.Time
 
 	ruleRenderer        bpfAllowChainRenderer
 	iptablesFilterTable iptablesTable
@@ -172,6 +228,19 @@ type bpfEndpointManager struct {
 	xdpModes []bpf.XDPMode
 }
 
+// bpfIPSetsDataplane is the BPF IP sets dataplane.  It keeps the exact-match members of the
+// IP sets in a hash map and the CIDR members in an LPM trie; the policy programs only look up
+// the map(s) that hold members of each set.
+type bpfIPSetsDataplane interface {
+	ipsetsDataplane
+	MemberKinds(setID string) (exact, cidr bool)
+	// TakeMemberKindChanges returns the IP sets for which MemberKinds gained a kind since
+	// the last call.
+	TakeMemberKindChanges() []string
+	// ApplyAdds writes the pending additions to the IP sets, ahead of ApplyUpdates.
+	ApplyAdds()
+}
+
 type bpfAllowChainRenderer interface {
 	WorkloadInterfaceAllowChains(endpoints map[proto.WorkloadEndpointID]*proto.WorkloadEndpoint) []*iptables.Chain
 }
@@ -182,7 +251,12 @@ func newBPFEndpointManager(
 	workloadIfaceRegex *regexp.Regexp,
 	ipSetIDAlloc *idalloc.IDAllocator,
 	ipSetMap bpf.Map,
+	ipSetHashMap bpf.Map,
+	ipSets bpfIPSetsDataplane,
 	stateMap bpf.Map,
+	sharedPolProgs *sharedPolProgs,
+	ruleCounters *counters.RuleCounters,
+	verdictCounters *counters.VerdictCounters,
 	iptablesRuleRenderer bpfAllowChainRenderer,
 	iptablesFilterTable iptablesTable,
 	livenessCallback func(),
@@ -201,7 +275,6 @@ func newBPFEndpointManager(
 		policiesToWorkloads:     map[proto.PolicyID]set.Set{},
 		profilesToWorkloads:     map[proto.ProfileID]set.Set{},
 		dirtyIfaceNames:         set.New(),
-		bpfLogLevel:             config.BPFLogLevel,
 		hostname:                config.Hostname,
 		fibLookupEnabled:        fibLookupEnabled,
 		dataIfaceRegex:          config.BPFDataIfacePattern,
@@ -213,7 +286,18 @@ func newBPFEndpointManager(
 		dsrEnabled:              config.BPFNodePortDSREnabled,
 		bpfExtToServiceConnmark: config.BPFExtToServiceConnmark,
 		ipSetMap:                ipSetMap,
+		ipSetHashMap:            ipSetHashMap,
 		stateMap:                stateMap,
+		ruleCounters:            ruleCounters,
+		verdictCounters:         verdictCounters,
+		ipSets:                  ipSets,
+		cidrSetThreshold:        config.BPFPolicyCIDRSetThreshold,
+		programPerTier:          config.BPFPolicyProgramPerTierEnabled,
+		cidrSetRefs:             map[string]int{},
+		cidrSetsByPolicy:        map[interface{}][]string{},
+		polProgs:                newPolProgCache(),
+		sharedPolProgs:          sharedPolProgs,
+		polProgArrays:           kernelPolProgArrays{},
 		ruleRenderer:            iptablesRuleRenderer,
 		iptablesFilterTable:     iptablesFilterTable,
 		mapCleanupRunner: ratelimited.NewRunner(jumpMapCleanupInterval, func(ctx context.Context) {
@@ -226,6 +310,13 @@ func newBPFEndpointManager(
 		opReporter:       opReporter,
 	}
 
+	// Services are only programmed by our kube-proxy, which needs a Kubernetes client.  VXLAN
+	// packets to this node are either node port traffic forwarded by another node or, with
+	// the overlay, traffic between workloads.
+	m.natEnabled = config.KubeClientSet != nil
+	m.ctlbEnabled = config.BPFConnTimeLBEnabled
+	m.vxlanEnabled = m.natEnabled || config.RulesConfig.VXLANEnabled
+
 	// Calculate allowed XDP attachment modes.  Note, in BPF mode untracked ingress policy is
 	// _only_ implemented by XDP, so we _should_ fall back to XDPGeneric if necessary in order
 	// to preserve the semantics of untracked ingress policy.  (Therefore we are also saying
@@ -429,6 +520,9 @@ func (m *bpfEndpointManager) onWorkloadEnpdointRemove(msg *proto.WorkloadEndpoin
 func (m *bpfEndpointManager) onPolicyUpdate(msg *proto.ActivePolicyUpdate) {
 	polID := *msg.Id
 	log.WithField("id", polID).Debug("Policy update")
+	m.notePolicyUpdate()
+	m.updateCIDRSets(polID, msg.Policy.InboundRules, msg.Policy.OutboundRules)
+	m.updateRuleCounters(polID, polID.Tier+"/"+polID.Name, msg.Policy.InboundRules, msg.Policy.OutboundRules)
 	m.policies[polID] = msg.Policy
 	m.markEndpointsDirty(m.policiesToWorkloads[polID], "policy")
 }
@@ -438,7 +532,10 @@ func (m *bpfEndpointManager) onPolicyUpdate(msg *proto.ActivePolicyUpdate) {
 func (m *bpfEndpointManager) onPolicyRemove(msg *proto.ActivePolicyRemove) {
 	polID := *msg.Id
 	log.WithField("id", polID).Debug("Policy removed")
+	m.notePolicyUpdate()
 	m.markEndpointsDirty(m.policiesToWorkloads[polID], "policy")
+	m.updateCIDRSets(polID, nil, nil)
+	m.updateRuleCounters(polID, "", nil, nil)
 	delete(m.policies, polID)
 	delete(m.policiesToWorkloads, polID)
 }
@@ -447,6 +544,9 @@ func (m *bpfEndpointManager) onPolicyRemove(msg *proto.ActivePolicyRemove) {
 func (m *bpfEndpointManager) onProfileUpdate(msg *proto.ActiveProfileUpdate) {
 	profID := *msg.Id
 	log.WithField("id", profID).Debug("Profile update")
+	m.notePolicyUpdate()
+	m.updateCIDRSets(profID, msg.Profile.InboundRules, msg.Profile.OutboundRules)
+	m.updateRuleCounters(profID, "profile/"+profID.Name, msg.Profile.InboundRules, msg.Profile.OutboundRules)
 	m.profiles[profID] = msg.Profile
 	m.markEndpointsDirty(m.profilesToWorkloads[profID], "profile")
 }
@@ -456,11 +556,125 @@ func (m *bpfEndpointManager) onProfileUpdate(msg *proto.ActiveProfileUpdate) {
 func (m *bpfEndpointManager) onProfileRemove(msg *proto.ActiveProfileRemove) {
 	profID := *msg.Id
 	log.WithField("id", profID).Debug("Profile removed")
+	m.notePolicyUpdate()
 	m.markEndpointsDirty(m.profilesToWorkloads[profID], "profile")
+	m.updateCIDRSets(profID, nil, nil)
+	m.updateRuleCounters(profID, "", nil, nil)
 	delete(m.profiles, profID)
 	delete(m.profilesToWorkloads, profID)
 }
 
+// notePolicyUpdate records the time of a policy or profile update, for the update latency
+// metric, unless an earlier update is still pending.
+func (m *bpfEndpointManager) notePolicyUpdate() {
+	if m.policyUpdatePendingSince.IsZero() {
+		m.policyUpdatePendingSince = time.Now()
+	}
+}
+
+// updateCIDRSets makes sure that the synthetic IP sets for the long CIDR lists of the given
+// policy or profile exist and releases the ones it no longer uses.  CompleteDeferredWork
+// writes the members of new sets to the maps before it attaches the programs that use them;
+// released sets are only removed by the IP sets' ApplyUpdates, after the programs.
+func (m *bpfEndpointManager) updateCIDRSets(id interface{}, ruleLists ...[]*proto.Rule) {
+	var newSets []string
+	for _, ruleList := range ruleLists {
+		for _, r := range ruleList {
+			for _, cidrs := range polprog.SpilledCIDRLists(r, m.cidrSetThreshold) {
+				setID := polprog.CIDRSetID(cidrs)
+				if m.cidrSetRefs[setID] == 0 {
+					log.WithFields(log.Fields{"setID": setID, "numCIDRs": len(cidrs)}).Debug(
+						"Spilling CIDR list into IP set")
+					m.ipSets.AddOrReplaceIPSet(ipsets.IPSetMetadata{
+						SetID: setID,
+						Type:  ipsets.IPSetTypeHashNet,
+					}, cidrs)
+				}
+				m.cidrSetRefs[setID]++
+				newSets = append(newSets, setID)
+			}
+		}
+	}
+
+	for _, setID := range m.cidrSetsByPolicy[id] {
+		m.cidrSetRefs[setID]--
+		if m.cidrSetRefs[setID] == 0 {
+			log.WithField("setID", setID).Debug("CIDR list IP set no longer used")
+			delete(m.cidrSetRefs, setID)
+			m.ipSets.RemoveIPSet(setID)
+		}
+	}
+
+	if len(newSets) > 0 {
+		m.cidrSetsByPolicy[id] = newSets
+	} else {
+		delete(m.cidrSetsByPolicy, id)
+	}
+}
+
+// updateRuleCounters allocates counters to the rules of the given policy or profile, if rule
+// counters are enabled, and releases the counters of the rules that it no longer has.
+func (m *bpfEndpointManager) updateRuleCounters(id interface{}, name string, inbound, outbound []*proto.Rule) {
+	if m.ruleCounters == nil {
+		return
+	}
+	var rules []counters.RuleInfo
+	for _, r := range inbound {
+		rules = append(rules, counters.RuleInfo{Policy: name, Direction: "inbound", ID: r.RuleId})
+	}
+	for _, r := range outbound {
+		rules = append(rules, counters.RuleInfo{Policy: name, Direction: "outbound", ID: r.RuleId})
+	}
+	m.ruleCounters.SetRules(id, rules)
+}
+
+// markEndpointsUsingIPSetsDirty marks dirty the endpoints with policies or profiles that
+// match on any of the given IP sets, so that their policy programs are rebuilt.
+func (m *bpfEndpointManager) markEndpointsUsingIPSetsDirty(setIDs []string) {
+	if len(setIDs) == 0 {
+		return
+	}
+	log.WithField("setIDs", setIDs).Debug("IP set member kinds changed, rebuilding policy programs")
+	changed := map[string]bool{}
+	for _, setID := range setIDs {
+		changed[setID] = true
+	}
+	usesChangedSet := func(id interface{}, ruleLists ...[]*proto.Rule) bool {
+		for _, setID := range m.cidrSetsByPolicy[id] {
+			if changed[setID] {
+				return true
+			}
+		}
+		for _, ruleList := range ruleLists {
+			for _, r := range ruleList {
+				for _, setIDs := range [][]string{
+					r.SrcIpSetIds, r.NotSrcIpSetIds, r.DstIpSetIds, r.NotDstIpSetIds, r.DstIpPortSetIds,
+					r.SrcNamedPortIpSetIds, r.NotSrcNamedPortIpSetIds,
+					r.DstNamedPortIpSetIds, r.NotDstNamedPortIpSetIds,
+				} {
+					for _, setID := range setIDs {
+						if changed[setID] {
+							return true
+						}
+					}
+				}
+			}
+		}
+		return false
+	}
+
+	for polID, pol := range m.policies {
+		if usesChangedSet(polID, pol.InboundRules, pol.OutboundRules) {
+			m.markEndpointsDirty(m.policiesToWorkloads[polID], "policy")
+		}
+	}
+	for profID, prof := range m.profiles {
+		if usesChangedSet(profID, prof.InboundRules, prof.OutboundRules) {
+			m.markEndpointsDirty(m.profilesToWorkloads[profID], "profile")
+		}
+	}
+}
+
 func (m *bpfEndpointManager) markEndpointsDirty(ids set.Set, kind string) {
 	if ids == nil {
 		// Hear about the policy/profile before the endpoint.
@@ -501,9 +715,32 @@ func (m *bpfEndpointManager) CompleteDeferredWork() error {
 	// Do one-off initialisation.
 	m.dp.ensureStarted()
 
+	m.markEndpointsUsingIPSetsDirty(m.ipSets.TakeMemberKindChanges())
+	// The IP set updates are only applied after all the managers have completed their
+	// work, write the new members now so that no program runs with an incomplete set.
+	m.ipSets.ApplyAdds()
+	m.freeStalePolicyChains()
 	m.applyProgramsToDirtyDataInterfaces()
 	m.updateWEPsInDataplane()
 
+	if m.numFailedIfaces() == 0 {
+		if m.sharedPolProgs != nil {
+			// Every endpoint now runs policy programs that we loaded, free the ones that we
+			// inherited from before we started.
+			m.sharedPolProgs.ReleaseStaleSlots()
+		}
+		if m.ruleCounters != nil {
+			// Likewise, no program counts into the counters of the removed rules any more.
+			m.ruleCounters.ReleaseQuarantinedIdxs()
+		}
+		if !m.policyUpdatePendingSince.IsZero() {
+			// Only once all the endpoints have been updated, the latency then includes the
+			// retries of the endpoints that failed.
+			summaryPolicyUpdateLatency.Observe(time.Since(m.policyUpdatePendingSince).Seconds())
+			m.policyUpdatePendingSince = time.Time{}
+		}
+	}
+
 	bpfEndpointsGauge.Set(float64(len(m.nameToIface)))
 	bpfDirtyEndpointsGauge.Set(float64(m.dirtyIfaceNames.Len()))
 
@@ -517,6 +754,21 @@ func (m *bpfEndpointManager) CompleteDeferredWork() error {
 	return nil
 }
 
+// numFailedIfaces returns the number of workload and data interfaces that are still dirty
+// after an update, which are those that we failed to update.  Other interfaces, which we
+// don't program, may stay dirty.
+func (m *bpfEndpointManager) numFailedIfaces() int {
+	n := 0
+	m.dirtyIfaceNames.Iter(func(item interface{}) error {
+		iface := item.(string)
+		if m.isWorkloadIface(iface) || m.isDataIface(iface) {
+			n++
+		}
+		return nil
+	})
+	return n
+}
+
 func (m *bpfEndpointManager) applyProgramsToDirtyDataInterfaces() {
 	var mutex sync.Mutex
 	errs := map[string]error{}
@@ -708,6 +960,7 @@ func (m *bpfEndpointManager) applyPolicy(ifaceName string) error {
 		if !ifaceUp {
 			log.WithField("iface", ifaceName).Debug("Interface is down/gone, closing jump maps.")
 			for _, fd := range iface.dpState.jumpMapFDs {
+				m.forgetJumpMap(fd)
 				if err := fd.Close(); err != nil {
 					log.WithError(err).Error("Failed to close jump map.")
 				}
@@ -833,7 +1086,7 @@ func (m *bpfEndpointManager) attachWorkloadProgram(ifaceName string, endpoint *p
 		rules.SuppressNormalHostPolicy = true
 	}
 
-	return m.dp.updatePolicyProgram(jumpMapFD, rules)
+	return m.dp.updatePolicyProgram(jumpMapFD, rules, verdictHook(&ap))
 }
 
 func (m *bpfEndpointManager) addHostPolicy(rules *polprog.Rules, hostEndpoint *proto.HostEndpoint, polDirection PolDirection) {
@@ -891,7 +1144,7 @@ func (m *bpfEndpointManager) attachDataIfaceProgram(ifaceName string, ep *proto.
 			ForHostInterface: true,
 		}
 		m.addHostPolicy(&rules, ep, polDirection)
-		return m.dp.updatePolicyProgram(jumpMapFD, rules)
+		return m.dp.updatePolicyProgram(jumpMapFD, rules, verdictHook(&ap))
 	}
 
 	return m.dp.removePolicyProgram(jumpMapFD)
@@ -899,9 +1152,8 @@ func (m *bpfEndpointManager) attachDataIfaceProgram(ifaceName string, ep *proto.
 
 func (m *bpfEndpointManager) attachXDPProgram(ifaceName string, ep *proto.HostEndpoint) error {
 	ap := xdp.AttachPoint{
-		Iface:    ifaceName,
-		LogLevel: m.bpfLogLevel,
-		Modes:    m.xdpModes,
+		Iface: ifaceName,
+		Modes: m.xdpModes,
 	}
 
 	if ep != nil && len(ep.UntrackedTiers) == 1 {
@@ -917,7 +1169,7 @@ func (m *bpfEndpointManager) attachXDPProgram(ifaceName string, ep *proto.HostEn
 			ForXDP:           true,
 		}
 		ap.Log().Debugf("Rules: %v", rules)
-		return m.dp.updatePolicyProgram(jumpMapFD, rules)
+		return m.dp.updatePolicyProgram(jumpMapFD, rules, counters.HookXDP)
 	} else {
 		return m.dp.ensureNoProgram(&ap)
 	}
@@ -985,7 +1237,9 @@ func (m *bpfEndpointManager) calculateTCAttachPoint(policyDirection PolDirection
 	ap.ToHostDrop = (m.epToHostAction == "DROP")
 	ap.FIB = m.fibLookupEnabled
 	ap.DSR = m.dsrEnabled
-	ap.LogLevel = m.bpfLogLevel
+	ap.NATDisabled = !m.natEnabled
+	ap.CTLBDisabled = !m.ctlbEnabled
+	ap.VXLANDisabled = !m.vxlanEnabled
 	ap.VXLANPort = m.vxlanPort
 
 	return ap
@@ -1322,6 +1576,7 @@ func (m *bpfEndpointManager) ensureProgramAttached(ap attachPoint) (bpf.MapFD, e
 			// Close the now-defunct jump map.
 			log.WithField("iface", ap.IfaceName()).Info(
 				"Detected that BPF program no longer attached to interface.")
+			m.forgetJumpMap(jumpMapFD)
 			err := jumpMapFD.Close()
 			if err != nil {
 				log.WithError(err).Warn("Failed to close jump map FD. Ignoring.")
@@ -1362,6 +1617,7 @@ func (m *bpfEndpointManager) ensureNoProgram(ap attachPoint) error {
 	jumpMapFD := m.getJumpMapFD(ap)
 	if jumpMapFD != 0 {
 		// Close the jump map FD.
+		m.forgetJumpMap(jumpMapFD)
 		if err := jumpMapFD.Close(); err == nil {
 			m.setJumpMapFD(ap, 0)
 		} else {
@@ -1407,20 +1663,352 @@ func (m *bpfEndpointManager) setJumpMapFD(ap attachPoint, fd bpf.MapFD) {
 	})
 }
 
-func (m *bpfEndpointManager) updatePolicyProgram(jumpMapFD bpf.MapFD, rules polprog.Rules) error {
-	pg := polprog.NewBuilder(m.ipSetIDAlloc, m.ipSetMap.MapFD(), m.stateMap.MapFD(), jumpMapFD)
-	insns, err := pg.Instructions(rules)
-	if err != nil {
-		return fmt.Errorf("failed to generate policy bytecode: %w", err)
+// policyProgramMaxInsns is the size above which we split a policy program into a chain of
+// programs.  It keeps the work that the verifier does for each program well within its
+// limits.
+const policyProgramMaxInsns = 8192
+
+// verdictHook returns the hook that the programs attached at the given attach point count
+// their verdicts under.
+func verdictHook(ap *tc.AttachPoint) counters.Hook {
+	if ap.Type == tc.EpTypeWorkload {
+		if ap.Hook == tc.HookIngress {
+			return counters.HookFromWEP
+		}
+		return counters.HookToWEP
+	}
+	if ap.Hook == tc.HookIngress {
+		return counters.HookFromHEP
+	}
+	return counters.HookToHEP
+}
+
+func (m *bpfEndpointManager) updatePolicyProgram(jumpMapFD bpf.MapFD, rules polprog.Rules, hook counters.Hook) error {
+	opts := []polprog.Option{
+		polprog.WithCIDRSetThreshold(m.cidrSetThreshold),
+		polprog.WithMaxInsnsPerProgram(policyProgramMaxInsns),
+		polprog.WithIPSetHashMap(m.ipSetHashMap.MapFD(), m.ipSets),
+	}
+	if m.programPerTier {
+		opts = append(opts, polprog.WithProgramPerTier())
+	}
+	if m.ruleCounters != nil {
+		opts = append(opts, polprog.WithRuleCounters(m.ruleCounters.MapFD(), m.ruleCounters))
+	}
+	if m.verdictCounters != nil {
+		opts = append(opts, polprog.WithVerdictCounters(m.verdictCounters.MapFD(), hook))
 	}
+	if m.sharedPolProgs != nil && !rules.ForXDP {
+		// XDP programs can't go in the same prog array as the TC ones, they keep a chain
+		// per endpoint.
+		err := m.updateSharedPolicyProgram(jumpMapFD, rules, opts)
+		if !errors.Is(err, errNoFreePolicySlots) {
+			return err
+		}
+		log.WithField("jumpMapFD", jumpMapFD).Warn(
+			"Shared policy program map is full, loading the endpoint's own policy programs.")
+		if err := m.updateEndpointPolicyProgram(jumpMapFD, rules, opts); err != nil {
+			return err
+		}
+		// The endpoint no longer enters the shared chain that it used, if any.
+		m.sharedPolProgs.ForgetEndpoint(jumpMapFD, true)
+		return nil
+	}
+	return m.updateEndpointPolicyProgram(jumpMapFD, rules, opts)
+}
+
+// updateEndpointPolicyProgram loads the policy program chain for the given rules into the
+// endpoint's own jump map.
+func (m *bpfEndpointManager) updateEndpointPolicyProgram(jumpMapFD bpf.MapFD, rules polprog.Rules, opts []polprog.Option) error {
 	progType := unix.BPF_PROG_TYPE_SCHED_CLS
 	if rules.ForXDP {
 		progType = unix.BPF_PROG_TYPE_XDP
 	}
-	progFD, err := bpf.LoadBPFProgramFromInsns(insns, "Apache-2.0", uint32(progType))
+	buildChain := func(slotSet int) ([]asm.Insns, error) {
+		pg := polprog.NewBuilder(m.ipSetIDAlloc, m.ipSetMap.MapFD(), m.stateMap.MapFD(), jumpMapFD,
+			append(opts, polprog.WithChainSlotSet(slotSet))...)
+		progs, err := pg.Programs(rules)
+		if err != nil {
+			return nil, fmt.Errorf("failed to generate policy bytecode: %w", err)
+		}
+		return progs, nil
+	}
+	isInstalled := func(progs []asm.Insns, i, slotSet int) bool {
+		slot := jumpMapSlot{jumpMapFD: jumpMapFD, idx: polprog.PolicyChainJumpIndex(i, slotSet)}
+		return m.polProgs.IsInstalled(slot, hashPolicyProgram(progs[i], uint32(progType)))
+	}
+
+	curSet := m.chainSlotSet(jumpMapFD)
+	progs, err := buildChain(curSet)
+	if err != nil {
+		return err
+	}
+	tailUnchanged := true
+	for i := 1; i < len(progs); i++ {
+		if !isInstalled(progs, i, curSet) {
+			tailUnchanged = false
+			break
+		}
+	}
+	if tailUnchanged {
+		// At most the first program changed, replacing it switches to the new chain, whose
+		// other programs are already in place.  Then, remove the tail of a previous, longer,
+		// chain.
+		if err := m.installPolicyProgram(jumpMapFD, progs, 0, curSet, uint32(progType)); err != nil {
+			return err
+		}
+		return m.removePolicyChainPrograms(jumpMapFD, curSet, len(progs))
+	}
+
+	// Write the new chain to the other slot set, while the current chain keeps running, and
+	// then switch to it by replacing the first program.  A packet sees either the old chain
+	// or the new one, never a mix of the two.
+	newSet := (curSet + 1) % polprog.PolicyChainSlotSets
+	progs, err = buildChain(newSet)
+	if err != nil {
+		return err
+	}
+	for i := len(progs) - 1; i >= 0; i-- {
+		if err := m.installPolicyProgram(jumpMapFD, progs, i, newSet, uint32(progType)); err != nil {
+			return err
+		}
+	}
+	m.polProgs.SetChainSlotSet(jumpMapFD, newSet)
+	log.WithFields(log.Fields{"jumpMapFD": jumpMapFD, "slotSet": newSet}).Debug(
+		"Switched to new policy program chain.")
+
+	// Remove the tail of a previous, longer, chain in the new slot set; the old chain may
+	// still be running packets that entered it before the switch, freeStalePolicyChains
+	// removes it on the next update cycle.
+	if err := m.removePolicyChainPrograms(jumpMapFD, newSet, len(progs)); err != nil {
+		return err
+	}
+	m.polProgs.AddStaleSlotSet(jumpMapFD, curSet)
+	return nil
+}
+
+// freeStalePolicyChains removes the policy program chains, own or shared, that the endpoints
+// switched away from in the previous update cycle, no packet can still be running them.  It must be called
+// before the endpoints are updated, an endpoint may then switch back to the freed slot set.
+func (m *bpfEndpointManager) freeStalePolicyChains() {
+	for _, ref := range m.polProgs.TakeStaleSlotSets() {
+		if err := m.removePolicyChainPrograms(ref.jumpMapFD, ref.slotSet, 1); err != nil {
+			log.WithError(err).WithField("jumpMapFD", ref.jumpMapFD).Warn(
+				"Failed to remove stale policy program chain, will retry.")
+			m.polProgs.AddStaleSlotSet(ref.jumpMapFD, ref.slotSet)
+		}
+	}
+	if m.sharedPolProgs != nil {
+		m.sharedPolProgs.FreeRetiredSlots()
+	}
+}
+
+// updateSharedPolicyProgram points the endpoint with the given jump map at the shared policy
+// program chain for the given rules, loading the chain if no other endpoint uses it.
+func (m *bpfEndpointManager) updateSharedPolicyProgram(jumpMapFD bpf.MapFD, rules polprog.Rules, opts []polprog.Option) error {
+	const progType = unix.BPF_PROG_TYPE_SCHED_CLS
+	progArrayFD := m.sharedPolProgs.MapFD()
+	pg := polprog.NewBuilder(m.ipSetIDAlloc, m.ipSetMap.MapFD(), m.stateMap.MapFD(), jumpMapFD,
+		append(opts, polprog.WithSharedProgArray(progArrayFD))...)
+	progs, err := pg.Programs(rules)
+	if err != nil {
+		return fmt.Errorf("failed to generate policy bytecode: %w", err)
+	}
+	hashes := make([]polProgHash, len(progs))
+	for i, insns := range progs {
+		hashes[i] = hashPolicyProgram(insns, progType)
+	}
+
+	loaded := false
+	chain, err := m.sharedPolProgs.AcquireChain(hashPolicyChain(progs), hashes, func(slots []int) error {
+		// Install the programs from the end so that each program's successor is in place
+		// before it.  The programs that another chain has, typically those of the tiers
+		// that didn't change, are copied from that chain rather than loaded again.
+		for i := len(progs) - 1; i >= 0; i-- {
+			if from, ok := m.sharedPolProgs.ProgramSlot(hashes[i]); ok {
+				err := m.polProgArrays.copyProgram(progArrayFD, from, slots[i])
+				if err == nil {
+					bpfPolicyProgramsUnchangedCounter.Inc()
+					continue
+				}
+				log.WithError(err).WithField("slot", from).Warn(
+					"Failed to copy shared policy program, loading it again.")
+			}
+			if err := m.polProgArrays.loadProgram(progArrayFD, slots[i], progs[i], progType); err != nil {
+				return err
+			}
+			bpfPolicyProgramsLoadedCounter.Inc()
+		}
+		loaded = true
+		return nil
+	})
+	if err != nil {
+		return err
+	}
+	if !loaded {
+		log.WithField("slots", chain.slots).Debug("Reusing shared policy program chain.")
+		bpfPolicyProgramsUnchangedCounter.Add(float64(len(chain.slots)))
+	}
+
+	retSlot, err := m.sharedPolProgs.ReturnSlot(jumpMapFD, func(slot int) error {
+		insns, err := polprog.ReturnTrampoline(m.stateMap.MapFD(), jumpMapFD)
+		if err != nil {
+			return err
+		}
+		return m.polProgArrays.loadProgram(progArrayFD, slot, insns, progType)
+	})
+	if err != nil {
+		m.sharedPolProgs.ReleaseChain(chain)
+		return err
+	}
+
+	// Replacing the endpoint's entry point switches it to the chain in one go.
+	entry, err := polprog.EntryTrampoline(m.stateMap.MapFD(), progArrayFD, chain.slots[0], retSlot)
+	if err == nil {
+		err = m.installPolicyProgram(jumpMapFD, []asm.Insns{entry}, 0, 0, progType)
+	}
+	if err != nil {
+		m.sharedPolProgs.ReleaseChain(chain)
+		return err
+	}
+	m.sharedPolProgs.SetEndpointChain(jumpMapFD, chain)
+
+	// Remove the endpoint's own chain, if it had one, once no packet can be running it.
+	for slotSet := 0; slotSet < polprog.PolicyChainSlotSets; slotSet++ {
+		m.polProgs.AddStaleSlotSet(jumpMapFD, slotSet)
+	}
+	return nil
+}
+
+// forgetJumpMap drops what we know about the policy programs of the given jump map, which the
+// caller is about to close.
+func (m *bpfEndpointManager) forgetJumpMap(jumpMapFD bpf.MapFD) {
+	if m.sharedPolProgs != nil && m.sharedPolProgs.HasEndpoint(jumpMapFD) {
+		// The shared programs may only be freed once the endpoint can't reach them.
+		err := m.polProgArrays.removeProgram(jumpMapFD, polprog.PolicyChainJumpIndex(0, 0))
+		if err != nil {
+			log.WithError(err).Warn("Failed to remove policy program entry point.")
+		}
+		m.sharedPolProgs.ForgetEndpoint(jumpMapFD, err == nil)
+	}
+	m.polProgs.ForgetJumpMap(jumpMapFD)
+}
+
+// installPolicyProgram installs program i of the given policy program chain in its slot of
+// the given slot set, unless the slot already holds it.  If the other slot set holds it, it
+// is copied from there rather than loaded, and verified, again.
+func (m *bpfEndpointManager) installPolicyProgram(jumpMapFD bpf.MapFD, progs []asm.Insns, i, slotSet int, progType uint32) error {
+	slot := jumpMapSlot{jumpMapFD: jumpMapFD, idx: polprog.PolicyChainJumpIndex(i, slotSet)}
+	hash := hashPolicyProgram(progs[i], progType)
+	if m.polProgs.IsInstalled(slot, hash) {
+		log.WithField("slot", slot).Debug("Policy program unchanged, skipping load.")
+		bpfPolicyProgramsUnchangedCounter.Inc()
+		return nil
+	}
+	for s := 0; s < polprog.PolicyChainSlotSets && i > 0; s++ {
+		from := jumpMapSlot{jumpMapFD: jumpMapFD, idx: polprog.PolicyChainJumpIndex(i, s)}
+		if s == slotSet || !m.polProgs.IsInstalled(from, hash) {
+			continue
+		}
+		err := m.polProgArrays.copyProgram(jumpMapFD, from.idx, slot.idx)
+		if err == nil {
+			log.WithFields(log.Fields{"from": from, "to": slot}).Debug("Policy program unchanged, copied it.")
+			m.polProgs.SetInstalled(slot, hash)
+			bpfPolicyProgramsUnchangedCounter.Inc()
+			return nil
+		}
+		log.WithError(err).WithField("slot", slot).Warn("Failed to copy policy program, loading it again.")
+	}
+	err := m.polProgArrays.loadProgram(jumpMapFD, slot.idx, progs[i], progType)
+	if err != nil {
+		m.polProgs.Forget(slot)
+		return err
+	}
+	m.polProgs.SetInstalled(slot, hash)
+	bpfPolicyProgramsLoadedCounter.Inc()
+	return nil
+}
+
+// chainSlotSet returns the slot set that the policy program chain of the jump map is in.
+// After a restart, we don't know so we look for the second program of the chain in the
+// jump map.  If we restarted before freeing the previous chain, both slot sets hold one;
+// the current chain is the one that was loaded last, which has the higher program ID.
+func (m *bpfEndpointManager) chainSlotSet(jumpMapFD bpf.MapFD) int {
+	if slotSet, known := m.polProgs.ChainSlotSet(jumpMapFD); known {
+		return slotSet
+	}
+	slotSet := 0
+	var lastProgID uint32
+	for s := 0; s < polprog.PolicyChainSlotSets; s++ {
+		if progID, err := m.polProgArrays.programID(jumpMapFD, polprog.PolicyChainJumpIndex(1, s)); err == nil {
+			if progID > lastProgID {
+				slotSet = s
+				lastProgID = progID
+			}
+		}
+	}
+	m.polProgs.SetChainSlotSet(jumpMapFD, slotSet)
+	return slotSet
+}
+
+// polProgArrays updates the prog arrays, the endpoints' jump maps and the shared prog array,
+// that hold the policy programs.  UT replaces it to see which programs are loaded.
+type polProgArrays interface {
+	// loadProgram loads the given program and puts it at the given index.
+	loadProgram(progArrayFD bpf.MapFD, idx int, insns asm.Insns, progType uint32) error
+	// copyProgram puts the program that is at index from at index to as well.
+	copyProgram(progArrayFD bpf.MapFD, from, to int) error
+	// programID returns the ID of the program at the given index.
+	programID(progArrayFD bpf.MapFD, idx int) (uint32, error)
+	// removeProgram empties the given index, if it isn't empty already.
+	removeProgram(progArrayFD bpf.MapFD, idx int) error
+}
+
+type kernelPolProgArrays struct{}
+
+func (kernelPolProgArrays) loadProgram(jumpMapFD bpf.MapFD, idx int, insns asm.Insns, progType uint32) error {
+	progFD, err := bpf.LoadBPFProgramFromInsns(insns, "Apache-2.0", progType)
 	if err != nil {
 		return fmt.Errorf("failed to load BPF policy program: %w", err)
 	}
+	return setJumpMapProgram(jumpMapFD, idx, progFD)
+}
+
+func (k kernelPolProgArrays) copyProgram(jumpMapFD bpf.MapFD, from, to int) error {
+	progID, err := k.programID(jumpMapFD, from)
+	if err != nil {
+		return err
+	}
+	progFD, err := bpf.GetProgFDByID(progID)
+	if err != nil {
+		return fmt.Errorf("failed to get FD of BPF policy program %d: %w", progID, err)
+	}
+	return setJumpMapProgram(jumpMapFD, to, progFD)
+}
+
+func (kernelPolProgArrays) programID(jumpMapFD bpf.MapFD, idx int) (uint32, error) {
+	k := make([]byte, 4)
+	binary.LittleEndian.PutUint32(k, uint32(idx))
+	v, err := bpf.GetMapEntry(jumpMapFD, k, 4)
+	if err != nil {
+		return 0, err
+	}
+	return binary.LittleEndian.Uint32(v), nil
+}
+
+func (kernelPolProgArrays) removeProgram(jumpMapFD bpf.MapFD, idx int) error {
+	k := make([]byte, 4)
+	binary.LittleEndian.PutUint32(k, uint32(idx))
+	err := bpf.DeleteMapEntryIfExists(jumpMapFD, k, 4)
+	if err != nil {
+		return fmt.Errorf("failed to update jump map: %w", err)
+	}
+	return nil
+}
+
+// setJumpMapProgram puts the given program at the given index of the jump map and closes its
+// FD.
+func setJumpMapProgram(jumpMapFD bpf.MapFD, idx int, progFD bpf.ProgFD) error {
 	defer func() {
 		// Once we've put the program in the map, we don't need its FD any more.
 		err := progFD.Close()
@@ -1430,8 +2018,9 @@ func (m *bpfEndpointManager) updatePolicyProgram(jumpMapFD bpf.MapFD, rules polp
 	}()
 	k := make([]byte, 4)
 	v := make([]byte, 4)
+	binary.LittleEndian.PutUint32(k, uint32(idx))
 	binary.LittleEndian.PutUint32(v, uint32(progFD))
-	err = bpf.UpdateMapEntry(jumpMapFD, k, v)
+	err := bpf.UpdateMapEntry(jumpMapFD, k, v)
 	if err != nil {
 		return fmt.Errorf("failed to update %v=%v in jump map %v: %w", k, v, jumpMapFD, err)
 	}
@@ -1439,10 +2028,35 @@ func (m *bpfEndpointManager) updatePolicyProgram(jumpMapFD bpf.MapFD, rules polp
 }
 
 func (m *bpfEndpointManager) removePolicyProgram(jumpMapFD bpf.MapFD) error {
-	k := make([]byte, 4)
-	err := bpf.DeleteMapEntryIfExists(jumpMapFD, k, 4)
-	if err != nil {
-		return fmt.Errorf("failed to update jump map: %w", err)
+	for slotSet := polprog.PolicyChainSlotSets - 1; slotSet >= 0; slotSet-- {
+		// The first program is shared by the slot sets, remove it last.
+		from := 1
+		if slotSet == 0 {
+			from = 0
+		}
+		if err := m.removePolicyChainPrograms(jumpMapFD, slotSet, from); err != nil {
+			return err
+		}
+	}
+	if m.sharedPolProgs != nil {
+		m.sharedPolProgs.ForgetEndpoint(jumpMapFD, true)
+	}
+	return nil
+}
+
+// removePolicyChainPrograms removes the programs of the policy program chain in the given
+// slot set from the given index onwards.
+func (m *bpfEndpointManager) removePolicyChainPrograms(jumpMapFD bpf.MapFD, slotSet, from int) error {
+	for i := from; i < polprog.MaxPolicyChainLen; i++ {
+		slot := jumpMapSlot{jumpMapFD: jumpMapFD, idx: polprog.PolicyChainJumpIndex(i, slotSet)}
+		if m.polProgs.IsInstalled(slot, noPolProg) {
+			continue
+		}
+		if err := m.polProgArrays.removeProgram(jumpMapFD, slot.idx); err != nil {
+			m.polProgs.Forget(slot)
+			return err
+		}
+		m.polProgs.SetInstalled(slot, noPolProg)
 	}
 	return nil
 }
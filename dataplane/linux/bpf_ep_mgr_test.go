@@ -17,17 +17,23 @@
 package intdataplane
 
 import (
+	"errors"
+	"fmt"
 	"regexp"
 	"sync"
 
 	. "github.com/onsi/ginkgo"
 	. "github.com/onsi/gomega"
 	log "github.com/sirupsen/logrus"
+	"golang.org/x/sys/unix"
 
 	"github.com/projectcalico/felix/logutils"
 
 	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/asm"
+	"github.com/projectcalico/felix/bpf/counters"
 	bpfipsets "github.com/projectcalico/felix/bpf/ipsets"
+	"github.com/projectcalico/felix/bpf/mock"
 	"github.com/projectcalico/felix/bpf/polprog"
 	"github.com/projectcalico/felix/bpf/state"
 	"github.com/projectcalico/felix/idalloc"
@@ -42,6 +48,10 @@ type mockDataplane struct {
 	lastFD uint32
 	fds    map[string]uint32
 	state  map[uint32]polprog.Rules
+	// updateErr, if set, fails the policy program updates.
+	updateErr error
+	// onUpdate, if set, is called with the rules of each policy program update.
+	onUpdate func(rules polprog.Rules)
 }
 
 func newMockDataplane() *mockDataplane {
@@ -82,9 +92,15 @@ func (m *mockDataplane) ensureQdisc(iface string) error {
 	return nil
 }
 
-func (m *mockDataplane) updatePolicyProgram(jumpMapFD bpf.MapFD, rules polprog.Rules) error {
+func (m *mockDataplane) updatePolicyProgram(jumpMapFD bpf.MapFD, rules polprog.Rules, hook counters.Hook) error {
 	m.mutex.Lock()
 	defer m.mutex.Unlock()
+	if m.updateErr != nil {
+		return m.updateErr
+	}
+	if m.onUpdate != nil {
+		m.onUpdate(rules)
+	}
 	m.state[uint32(jumpMapFD)] = rules
 	return nil
 }
@@ -113,6 +129,53 @@ func (m *mockDataplane) getRules(key string) *polprog.Rules {
 	return nil
 }
 
+// mockPolProgArrays simulates the prog arrays that hold the policy programs and counts the
+// programs that are loaded into, or copied within, each of them.
+type mockPolProgArrays struct {
+	lastID uint32
+	progs  map[jumpMapSlot]uint32
+	loads  map[bpf.MapFD]int
+	copies map[bpf.MapFD]int
+}
+
+func newMockPolProgArrays() *mockPolProgArrays {
+	return &mockPolProgArrays{
+		progs:  map[jumpMapSlot]uint32{},
+		loads:  map[bpf.MapFD]int{},
+		copies: map[bpf.MapFD]int{},
+	}
+}
+
+func (m *mockPolProgArrays) loadProgram(fd bpf.MapFD, idx int, insns asm.Insns, progType uint32) error {
+	m.lastID++
+	m.progs[jumpMapSlot{jumpMapFD: fd, idx: idx}] = m.lastID
+	m.loads[fd]++
+	return nil
+}
+
+func (m *mockPolProgArrays) copyProgram(fd bpf.MapFD, from, to int) error {
+	id, ok := m.progs[jumpMapSlot{jumpMapFD: fd, idx: from}]
+	if !ok {
+		return errors.New("no program to copy")
+	}
+	m.progs[jumpMapSlot{jumpMapFD: fd, idx: to}] = id
+	m.copies[fd]++
+	return nil
+}
+
+func (m *mockPolProgArrays) programID(fd bpf.MapFD, idx int) (uint32, error) {
+	id, ok := m.progs[jumpMapSlot{jumpMapFD: fd, idx: idx}]
+	if !ok {
+		return 0, unix.ENOENT
+	}
+	return id, nil
+}
+
+func (m *mockPolProgArrays) removeProgram(fd bpf.MapFD, idx int) error {
+	delete(m.progs, jumpMapSlot{jumpMapFD: fd, idx: idx})
+	return nil
+}
+
 func (m *mockDataplane) setAndReturn(vari **polprog.Rules, key string) func() *polprog.Rules {
 	return func() *polprog.Rules {
 		*vari = m.getRules(key)
@@ -132,12 +195,15 @@ var _ = Describe("BPF Endpoint Manager", func() {
 		ipSetIDAllocator     *idalloc.IDAllocator
 		vxlanMTU             int
 		nodePortDSR          bool
+		cidrSetThreshold     int
 		bpfMapContext        *bpf.MapContext
 		ipSetsMap            bpf.Map
+		ipSetsHashMap        bpf.Map
 		stateMap             bpf.Map
 		rrConfigNormal       rules.Config
 		ruleRenderer         rules.RuleRenderer
 		filterTableV4        iptablesTable
+		ipSets               *mockIPSets
 	)
 
 	BeforeEach(func() {
@@ -148,10 +214,12 @@ var _ = Describe("BPF Endpoint Manager", func() {
 		ipSetIDAllocator = idalloc.New()
 		vxlanMTU = 0
 		nodePortDSR = true
+		cidrSetThreshold = 0
 		bpfMapContext = &bpf.MapContext{
 			RepinningEnabled: true,
 		}
 		ipSetsMap = bpfipsets.Map(bpfMapContext)
+		ipSetsHashMap = bpfipsets.HashMap(bpfMapContext)
 		stateMap = state.Map(bpfMapContext)
 		rrConfigNormal = rules.Config{
 			IPIPEnabled:                 true,
@@ -175,6 +243,7 @@ var _ = Describe("BPF Endpoint Manager", func() {
 
 	JustBeforeEach(func() {
 		dp = newMockDataplane()
+		ipSets = newMockIPSets()
 		bpfEpMgr = newBPFEndpointManager(
 			&Config{
 				Hostname:              "uthost",
@@ -186,13 +255,19 @@ var _ = Describe("BPF Endpoint Manager", func() {
 				RulesConfig: rules.Config{
 					EndpointToHostAction: endpointToHostAction,
 				},
-				BPFExtToServiceConnmark: 0,
+				BPFExtToServiceConnmark:   0,
+				BPFPolicyCIDRSetThreshold: cidrSetThreshold,
 			},
 			fibLookupEnabled,
 			regexp.MustCompile(workloadIfaceRegex),
 			ipSetIDAllocator,
 			ipSetsMap,
+			ipSetsHashMap,
+			ipSets,
 			stateMap,
+			nil,
+			nil,
+			nil,
 			ruleRenderer,
 			filterTableV4,
 			nil,
@@ -352,6 +427,196 @@ var _ = Describe("BPF Endpoint Manager", func() {
 		})
 	})
 
+	Context("with a workload whose policy uses an IP set", func() {
+		JustBeforeEach(func() {
+			bpfEpMgr.OnUpdate(&proto.ActivePolicyUpdate{
+				Id: &proto.PolicyID{Tier: "default", Name: "mypolicy"},
+				Policy: &proto.Policy{
+					InboundRules: []*proto.Rule{{Action: "allow", SrcIpSetIds: []string{"s:abcdef"}}},
+				},
+			})
+			bpfEpMgr.OnUpdate(&proto.WorkloadEndpointUpdate{
+				Id: &proto.WorkloadEndpointID{
+					OrchestratorId: "k8s",
+					WorkloadId:     "cali12345",
+					EndpointId:     "cali12345",
+				},
+				Endpoint: &proto.WorkloadEndpoint{
+					Name: "cali12345",
+					Tiers: []*proto.TierInfo{{
+						Name:            "default",
+						IngressPolicies: []string{"mypolicy"},
+					}},
+				},
+			})
+			genIfaceUpdate("cali12345", ifacemonitor.StateUp, 15)()
+			Expect(dp.getRules("cali12345:tc-egress")).NotTo(BeNil())
+
+			// Forget the programs so that we can see which ones are rebuilt.
+			dp.mutex.Lock()
+			dp.state = map[uint32]polprog.Rules{}
+			dp.mutex.Unlock()
+		})
+
+		It("rebuilds the programs when the member kinds of the set change", func() {
+			ipSets.MemberKindChanges = []string{"s:abcdef"}
+			err := bpfEpMgr.CompleteDeferredWork()
+			Expect(err).NotTo(HaveOccurred())
+			Expect(dp.getRules("cali12345:tc-egress")).NotTo(BeNil())
+		})
+
+		It("doesn't rebuild the programs when another set changes", func() {
+			ipSets.MemberKindChanges = []string{"s:123456"}
+			err := bpfEpMgr.CompleteDeferredWork()
+			Expect(err).NotTo(HaveOccurred())
+			Expect(dp.getRules("cali12345:tc-egress")).To(BeNil())
+		})
+
+		It("only records the policy update latency once the update is applied", func() {
+			dp.mutex.Lock()
+			dp.updateErr = errors.New("failed to load program")
+			dp.mutex.Unlock()
+			bpfEpMgr.OnUpdate(&proto.ActivePolicyUpdate{
+				Id: &proto.PolicyID{Tier: "default", Name: "mypolicy"},
+				Policy: &proto.Policy{
+					InboundRules: []*proto.Rule{{Action: "deny", SrcIpSetIds: []string{"s:abcdef"}}},
+				},
+			})
+			err := bpfEpMgr.CompleteDeferredWork()
+			Expect(err).NotTo(HaveOccurred())
+			Expect(bpfEpMgr.policyUpdatePendingSince.IsZero()).To(BeFalse())
+
+			dp.mutex.Lock()
+			dp.updateErr = nil
+			dp.mutex.Unlock()
+			err = bpfEpMgr.CompleteDeferredWork()
+			Expect(err).NotTo(HaveOccurred())
+			Expect(dp.getRules("cali12345:tc-egress")).NotTo(BeNil())
+			Expect(bpfEpMgr.policyUpdatePendingSince.IsZero()).To(BeTrue())
+		})
+	})
+
+	Context("with a workload whose policy has a long CIDR list", func() {
+		cidrs := []string{"10.0.1.0/24", "10.0.2.0/24", "10.0.3.0/24"}
+
+		BeforeEach(func() {
+			cidrSetThreshold = 2
+		})
+
+		It("writes the members of the CIDR set before it loads the program", func() {
+			setID := polprog.CIDRSetID(cidrs)
+			var numMembersAtUpdate []int
+			dp.onUpdate = func(rules polprog.Rules) {
+				n := 0
+				if members := ipSets.Applied[setID]; members != nil {
+					n = members.Len()
+				}
+				numMembersAtUpdate = append(numMembersAtUpdate, n)
+			}
+
+			bpfEpMgr.OnUpdate(&proto.ActivePolicyUpdate{
+				Id: &proto.PolicyID{Tier: "default", Name: "mypolicy"},
+				Policy: &proto.Policy{
+					InboundRules: []*proto.Rule{{Action: "allow", NotSrcNet: cidrs}},
+				},
+			})
+			bpfEpMgr.OnUpdate(&proto.WorkloadEndpointUpdate{
+				Id: &proto.WorkloadEndpointID{
+					OrchestratorId: "k8s",
+					WorkloadId:     "cali12345",
+					EndpointId:     "cali12345",
+				},
+				Endpoint: &proto.WorkloadEndpoint{
+					Name: "cali12345",
+					Tiers: []*proto.TierInfo{{
+						Name:            "default",
+						IngressPolicies: []string{"mypolicy"},
+					}},
+				},
+			})
+			genIfaceUpdate("cali12345", ifacemonitor.StateUp, 15)()
+
+			Expect(ipSets.Members).To(HaveKey(setID))
+			Expect(numMembersAtUpdate).NotTo(BeEmpty())
+			for _, n := range numMembersAtUpdate {
+				Expect(n).To(Equal(len(cidrs)))
+			}
+		})
+	})
+
+	Context("with a program per tier", func() {
+		const jumpMapFD = bpf.MapFD(20)
+
+		var (
+			progArrays *mockPolProgArrays
+			polRules   polprog.Rules
+		)
+
+		JustBeforeEach(func() {
+			progArrays = newMockPolProgArrays()
+			bpfEpMgr.polProgArrays = progArrays
+			bpfEpMgr.programPerTier = true
+			bpfEpMgr.ipSetMap = &mock.DummyMap{}
+			bpfEpMgr.ipSetHashMap = &mock.DummyMap{}
+			bpfEpMgr.stateMap = &mock.DummyMap{}
+
+			polRules = polprog.Rules{}
+			for tier := 0; tier < 3; tier++ {
+				polRules.Tiers = append(polRules.Tiers, polprog.Tier{
+					Name: fmt.Sprintf("tier-%d", tier),
+					Policies: []polprog.Policy{{
+						Name:  "pol",
+						Rules: []polprog.Rule{{Rule: &proto.Rule{Action: "Pass", DstPorts: []*proto.PortRange{{First: 80, Last: 80}}}}},
+					}},
+				})
+			}
+			polRules.Profiles = []polprog.Profile{{Name: "prof", Rules: []polprog.Rule{{Rule: &proto.Rule{Action: "Allow"}}}}}
+		})
+
+		// changeTier changes the rules of the given tier and applies them, as the next update
+		// cycle would.
+		changeTier := func(tier int) error {
+			polRules.Tiers[tier].Policies[0].Rules = []polprog.Rule{{Rule: &proto.Rule{Action: "Deny"}}}
+			bpfEpMgr.freeStalePolicyChains()
+			return bpfEpMgr.updatePolicyProgram(jumpMapFD, polRules, counters.HookFromWEP)
+		}
+
+		It("only loads the programs of the tier that changed", func() {
+			Expect(bpfEpMgr.updatePolicyProgram(jumpMapFD, polRules, counters.HookFromWEP)).To(Succeed())
+			numProgs := progArrays.loads[jumpMapFD]
+			Expect(numProgs).To(BeNumerically(">=", 4), "a program per tier plus the profiles")
+
+			progArrays.loads = map[bpf.MapFD]int{}
+			Expect(changeTier(1)).To(Succeed())
+			// The first program records where the new chain is, so it is loaded whenever
+			// the chain moves; the programs of the other tiers are copied.
+			Expect(progArrays.loads[jumpMapFD]).To(Equal(2))
+			Expect(progArrays.copies[jumpMapFD]).To(Equal(numProgs - 2))
+		})
+
+		Context("with shared programs", func() {
+			const progArrayFD = bpf.MapFD(0) // The FD of the DummyMap.
+
+			JustBeforeEach(func() {
+				bpfEpMgr.sharedPolProgs = newSharedPolProgs(&mock.DummyMap{}, 64)
+			})
+
+			It("only loads the program of the tier that changed", func() {
+				Expect(bpfEpMgr.updatePolicyProgram(jumpMapFD, polRules, counters.HookFromWEP)).To(Succeed())
+				// The chain and the return trampoline.
+				numProgs := progArrays.loads[progArrayFD] - 1
+				Expect(numProgs).To(BeNumerically(">=", 4))
+
+				progArrays.loads = map[bpf.MapFD]int{}
+				Expect(changeTier(2)).To(Succeed())
+				Expect(progArrays.loads[progArrayFD]).To(Equal(1))
+				Expect(progArrays.copies[progArrayFD]).To(Equal(numProgs - 1))
+				// The endpoint's entry point moves to the new chain.
+				Expect(progArrays.loads[jumpMapFD]).To(Equal(1))
+			})
+		})
+	})
+
 	Context("with eth0 up", func() {
 		JustBeforeEach(func() {
 			genPolicy("default", "mypolicy")()
@@ -0,0 +1,157 @@
+// +build !windows
+
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package intdataplane
+
+import (
+	"crypto/sha256"
+	"encoding/binary"
+	"sync"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/asm"
+)
+
+// polProgHash identifies the content of a policy program.
+type polProgHash [sha256.Size]byte
+
+// noPolProg is the hash we record for a jump map slot that we emptied.
+var noPolProg polProgHash
+
+func hashPolicyProgram(insns asm.Insns, progType uint32) polProgHash {
+	h := sha256.New()
+	_ = binary.Write(h, binary.LittleEndian, progType)
+	_, _ = h.Write(insns.AsBytes())
+	var hash polProgHash
+	copy(hash[:], h.Sum(nil))
+	return hash
+}
+
+type jumpMapSlot struct {
+	jumpMapFD bpf.MapFD
+	idx       int
+}
+
+// chainSlotSetRef identifies a slot set of the policy program chain of a jump map.
+type chainSlotSetRef struct {
+	jumpMapFD bpf.MapFD
+	slotSet   int
+}
+
+// polProgCache records the content of the policy programs that we installed in each jump
+// map slot.  Policy updates often regenerate identical programs for an endpoint (for
+// example, when a policy changes in a way that doesn't affect the endpoint's rules); we
+// then skip loading the program, and the verifier run that comes with it.
+//
+// Programs that are shared between endpoints are tracked by sharedPolProgs instead, only
+// the entry point to the shared chain is in the endpoint's jump map.
+type polProgCache struct {
+	lock  sync.Mutex
+	slots map[jumpMapSlot]polProgHash
+	// chainSlotSets records the slot set that the chain of each jump map is in, see
+	// polprog.WithChainSlotSet.
+	chainSlotSets map[bpf.MapFD]int
+	// staleSlotSets holds the slot sets of the chains that we switched away from.  Packets
+	// that started on the old chain may still be running it, so its programs are only
+	// removed on the next update cycle.
+	staleSlotSets map[chainSlotSetRef]struct{}
+}
+
+func newPolProgCache() *polProgCache {
+	return &polProgCache{
+		slots:         map[jumpMapSlot]polProgHash{},
+		chainSlotSets: map[bpf.MapFD]int{},
+		staleSlotSets: map[chainSlotSetRef]struct{}{},
+	}
+}
+
+// ChainSlotSet returns the slot set that the policy program chain of the jump map is in, if
+// known.
+func (c *polProgCache) ChainSlotSet(jumpMapFD bpf.MapFD) (slotSet int, known bool) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	slotSet, known = c.chainSlotSets[jumpMapFD]
+	return
+}
+
+// SetChainSlotSet records that the policy program chain of the jump map is in the given
+// slot set.
+func (c *polProgCache) SetChainSlotSet(jumpMapFD bpf.MapFD, slotSet int) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	c.chainSlotSets[jumpMapFD] = slotSet
+}
+
+// AddStaleSlotSet records that the chain in the given slot set of the jump map is no longer
+// the one that the jump map's first program runs.
+func (c *polProgCache) AddStaleSlotSet(jumpMapFD bpf.MapFD, slotSet int) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	c.staleSlotSets[chainSlotSetRef{jumpMapFD: jumpMapFD, slotSet: slotSet}] = struct{}{}
+}
+
+// TakeStaleSlotSets returns the slot sets recorded by AddStaleSlotSet and forgets them.
+func (c *polProgCache) TakeStaleSlotSets() []chainSlotSetRef {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	var stale []chainSlotSetRef
+	for ref := range c.staleSlotSets {
+		stale = append(stale, ref)
+	}
+	c.staleSlotSets = map[chainSlotSetRef]struct{}{}
+	return stale
+}
+
+// IsInstalled returns true if the slot is known to hold the program with the given hash
+// (or to be empty, for noPolProg).
+func (c *polProgCache) IsInstalled(slot jumpMapSlot, hash polProgHash) bool {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	installed, ok := c.slots[slot]
+	return ok && installed == hash
+}
+
+// SetInstalled records that the slot holds the program with the given hash.
+func (c *polProgCache) SetInstalled(slot jumpMapSlot, hash polProgHash) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	c.slots[slot] = hash
+}
+
+// Forget drops what we know about the slot, for example, after failing to update it.
+func (c *polProgCache) Forget(slot jumpMapSlot) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	delete(c.slots, slot)
+}
+
+// ForgetJumpMap drops what we know about the slots of the given jump map.  It must be
+// called when closing the jump map since the FD may then be reused for another map.
+func (c *polProgCache) ForgetJumpMap(jumpMapFD bpf.MapFD) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	for slot := range c.slots {
+		if slot.jumpMapFD == jumpMapFD {
+			delete(c.slots, slot)
+		}
+	}
+	delete(c.chainSlotSets, jumpMapFD)
+	for ref := range c.staleSlotSets {
+		if ref.jumpMapFD == jumpMapFD {
+			delete(c.staleSlotSets, ref)
+		}
+	}
+}
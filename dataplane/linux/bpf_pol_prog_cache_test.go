@@ -0,0 +1,95 @@
+// +build !windows
+
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package intdataplane
+
+import (
+	. "github.com/onsi/ginkgo"
+	. "github.com/onsi/gomega"
+
+	"github.com/projectcalico/felix/bpf/asm"
+)
+
+var _ = Describe("Policy program cache", func() {
+	var (
+		cache       *polProgCache
+		progA       polProgHash
+		progB       polProgHash
+		slot, slot2 jumpMapSlot
+	)
+
+	BeforeEach(func() {
+		cache = newPolProgCache()
+
+		b := asm.NewBlock()
+		b.MovImm64(asm.R0, 1)
+		b.Exit()
+		insns, err := b.Assemble()
+		Expect(err).NotTo(HaveOccurred())
+		progA = hashPolicyProgram(insns, 3)
+		progB = hashPolicyProgram(insns, 6)
+
+		slot = jumpMapSlot{jumpMapFD: 10, idx: 0}
+		slot2 = jumpMapSlot{jumpMapFD: 11, idx: 0}
+	})
+
+	It("should hash the program type", func() {
+		Expect(progA).NotTo(Equal(progB))
+	})
+
+	It("should track the installed programs", func() {
+		Expect(cache.IsInstalled(slot, progA)).To(BeFalse())
+		Expect(cache.IsInstalled(slot, noPolProg)).To(BeFalse(), "unknown slots shouldn't be assumed empty")
+
+		cache.SetInstalled(slot, progA)
+		cache.SetInstalled(slot2, progA)
+		Expect(cache.IsInstalled(slot, progA)).To(BeTrue())
+		Expect(cache.IsInstalled(slot, progB)).To(BeFalse())
+
+		cache.Forget(slot)
+		Expect(cache.IsInstalled(slot, progA)).To(BeFalse())
+		Expect(cache.IsInstalled(slot2, progA)).To(BeTrue())
+	})
+
+	It("should forget the slots of a closed jump map", func() {
+		cache.SetInstalled(slot, progA)
+		cache.SetInstalled(jumpMapSlot{jumpMapFD: 10, idx: 8}, noPolProg)
+		cache.SetInstalled(slot2, progA)
+
+		cache.ForgetJumpMap(10)
+		Expect(cache.IsInstalled(slot, progA)).To(BeFalse())
+		Expect(cache.IsInstalled(jumpMapSlot{jumpMapFD: 10, idx: 8}, noPolProg)).To(BeFalse())
+		Expect(cache.IsInstalled(slot2, progA)).To(BeTrue())
+	})
+
+	It("should hand out the stale slot sets once", func() {
+		cache.AddStaleSlotSet(10, 1)
+		cache.AddStaleSlotSet(10, 1)
+		cache.AddStaleSlotSet(11, 0)
+		Expect(cache.TakeStaleSlotSets()).To(ConsistOf(
+			chainSlotSetRef{jumpMapFD: 10, slotSet: 1},
+			chainSlotSetRef{jumpMapFD: 11, slotSet: 0},
+		))
+		Expect(cache.TakeStaleSlotSets()).To(BeEmpty())
+	})
+
+	It("should forget the stale slot sets of a closed jump map", func() {
+		cache.AddStaleSlotSet(10, 1)
+		cache.AddStaleSlotSet(11, 0)
+		cache.ForgetJumpMap(10)
+		Expect(cache.TakeStaleSlotSets()).To(ConsistOf(chainSlotSetRef{jumpMapFD: 11, slotSet: 0}))
+	})
+})
@@ -0,0 +1,415 @@
+// +build !windows
+
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package intdataplane
+
+import (
+	"crypto/sha256"
+	"encoding/binary"
+	"errors"
+	"sync"
+
+	"github.com/prometheus/client_golang/prometheus"
+	log "github.com/sirupsen/logrus"
+
+	"github.com/projectcalico/felix/bpf"
+	"github.com/projectcalico/felix/bpf/asm"
+)
+
+var (
+	bpfSharedPolicyChainsGauge = prometheus.NewGauge(prometheus.GaugeOpts{
+		Name: "felix_bpf_policy_chains_shared",
+		Help: "Number of distinct BPF policy program chains, each shared by the endpoints that have the same rules.",
+	})
+	bpfSharedPolicySlotsFreeGauge = prometheus.NewGauge(prometheus.GaugeOpts{
+		Name: "felix_bpf_policy_chain_slots_free",
+		Help: "Number of free slots in the prog array of the shared BPF policy programs.",
+	})
+)
+
+func init() {
+	prometheus.MustRegister(bpfSharedPolicyChainsGauge)
+	prometheus.MustRegister(bpfSharedPolicySlotsFreeGauge)
+}
+
+var errNoFreePolicySlots = errors.New("no free slots in the shared policy program map")
+
+// hashPolicyChain identifies a shared policy program chain, see polprog.WithSharedProgArray.
+func hashPolicyChain(progs []asm.Insns) polProgHash {
+	h := sha256.New()
+	_ = binary.Write(h, binary.LittleEndian, uint32(len(progs)))
+	for _, insns := range progs {
+		_ = binary.Write(h, binary.LittleEndian, uint32(len(insns)))
+		_, _ = h.Write(insns.AsBytes())
+	}
+	var hash polProgHash
+	copy(hash[:], h.Sum(nil))
+	return hash
+}
+
+// sharedPolChain is a policy program chain that is loaded in the shared prog array.
+type sharedPolChain struct {
+	key polProgHash
+	// slots are consecutive, the programs of the chain tail call each other relative to the
+	// first one.
+	slots []int
+	progs []polProgHash
+	// refs is the number of endpoints that use the chain, plus those that are waiting for
+	// it to load.
+	refs int
+	// loaded is closed once the programs are loaded or have failed to load, err is then set.
+	loaded chan struct{}
+	err    error
+}
+
+// sharedPolEndpoint records the shared programs that an endpoint uses.
+type sharedPolEndpoint struct {
+	chain      *sharedPolChain
+	retSlot    int
+	hasRetSlot bool
+}
+
+// sharedPolProgs tracks the policy program chains that are shared between the endpoints that
+// have the same rules (see polprog.WithSharedProgArray).  The chains are in a global prog
+// array, keyed by the hash of their programs, and are refcounted by the endpoints that use
+// them: each chain is loaded, and goes through the verifier, once however many endpoints use
+// it and its slots are retired when the last of them moves to another chain.  The prog array
+// also holds a return trampoline per endpoint, which the chains tail call to get back to the
+// endpoint's own programs.
+//
+// The programs don't depend on where they are so a new chain can reuse the programs that it
+// has in common with the chains that are loaded, see ProgramSlot; when a policy changes, only
+// the programs of its tier are loaded.
+//
+// No new packet enters the programs in retired slots but packets that entered them before may
+// still be running them; FreeRetiredSlots removes them on the next update cycle.
+type sharedPolProgs struct {
+	lock      sync.Mutex
+	progArray bpf.Map
+	// free records the free slots.  They are allocated from nextSlot onwards, wrapping
+	// around, so that a freed slot is reused as late as possible, by which time the packets
+	// that were running the program that it held are long gone.
+	free     []bool
+	numFree  int
+	nextSlot int
+	// staleSlots were in use when we started; the endpoints that we haven't updated yet may
+	// still use them.
+	staleSlots []int
+	// retiredSlots hold programs that no endpoint enters any more, see FreeRetiredSlots.
+	retiredSlots []int
+	chains       map[polProgHash]*sharedPolChain
+	endpoints    map[bpf.MapFD]*sharedPolEndpoint
+	// progSlots maps the hash of each program that is in the prog array to the slots that
+	// hold it.
+	progSlots map[polProgHash]map[int]bool
+	slotProgs map[int]polProgHash
+}
+
+// newSharedPolProgs returns a sharedPolProgs for the given, open, prog array, which has
+// maxEntries slots.
+func newSharedPolProgs(progArray bpf.Map, maxEntries int) *sharedPolProgs {
+	s := &sharedPolProgs{
+		progArray: progArray,
+		free:      make([]bool, maxEntries),
+		chains:    map[polProgHash]*sharedPolChain{},
+		endpoints: map[bpf.MapFD]*sharedPolEndpoint{},
+		progSlots: map[polProgHash]map[int]bool{},
+		slotProgs: map[int]polProgHash{},
+	}
+	k := make([]byte, 4)
+	for slot := 0; slot < maxEntries; slot++ {
+		binary.LittleEndian.PutUint32(k, uint32(slot))
+		if _, err := progArray.Get(k); err == nil {
+			s.staleSlots = append(s.staleSlots, slot)
+		} else {
+			s.free[slot] = true
+			s.numFree++
+		}
+	}
+	log.WithField("numStale", len(s.staleSlots)).Info("Loaded shared policy program map.")
+	bpfSharedPolicySlotsFreeGauge.Set(float64(s.numFree))
+	return s
+}
+
+// MapFD returns the FD of the shared prog array.
+func (s *sharedPolProgs) MapFD() bpf.MapFD {
+	return s.progArray.MapFD()
+}
+
+// AcquireChain returns the chain with the given key, taking a reference to it.  If no
+// endpoint uses the chain yet, it allocates consecutive slots for the programs with the given
+// hashes and calls load to load the programs into them.  Concurrent callers for the same chain
+// wait for the load to finish.
+func (s *sharedPolProgs) AcquireChain(key polProgHash, progs []polProgHash, load func(slots []int) error) (*sharedPolChain, error) {
+	s.lock.Lock()
+	c := s.chains[key]
+	if c != nil {
+		c.refs++
+		s.lock.Unlock()
+		<-c.loaded
+		if c.err != nil {
+			s.ReleaseChain(c)
+			return nil, c.err
+		}
+		return c, nil
+	}
+	slots, err := s.allocSlots(len(progs))
+	if err != nil {
+		s.lock.Unlock()
+		return nil, err
+	}
+	c = &sharedPolChain{key: key, slots: slots, progs: progs, refs: 1, loaded: make(chan struct{})}
+	s.chains[key] = c
+	bpfSharedPolicyChainsGauge.Set(float64(len(s.chains)))
+	s.lock.Unlock()
+
+	c.err = load(slots)
+	s.lock.Lock()
+	if c.err != nil {
+		// Stop handing out the chain, the callers that are waiting for it release it.
+		if s.chains[key] == c {
+			delete(s.chains, key)
+			bpfSharedPolicyChainsGauge.Set(float64(len(s.chains)))
+		}
+	} else {
+		for i, slot := range slots {
+			s.setSlotProg(slot, progs[i])
+		}
+	}
+	s.lock.Unlock()
+	close(c.loaded)
+	if c.err != nil {
+		s.ReleaseChain(c)
+		return nil, c.err
+	}
+	return c, nil
+}
+
+// ProgramSlot returns a slot that holds the program with the given hash, if any.  The program
+// stays in the slot until the next call to FreeRetiredSlots, at least.
+func (s *sharedPolProgs) ProgramSlot(hash polProgHash) (slot int, ok bool) {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	for slot := range s.progSlots[hash] {
+		return slot, true
+	}
+	return 0, false
+}
+
+// ReleaseChain drops a reference to the chain, removing its programs and freeing its slots
+// when it was the last one.
+func (s *sharedPolProgs) ReleaseChain(c *sharedPolChain) {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	s.releaseChain(c)
+}
+
+func (s *sharedPolProgs) releaseChain(c *sharedPolChain) {
+	c.refs--
+	if c.refs > 0 {
+		return
+	}
+	if s.chains[c.key] == c {
+		delete(s.chains, c.key)
+		bpfSharedPolicyChainsGauge.Set(float64(len(s.chains)))
+	}
+	if c.err != nil {
+		// Never ran.
+		s.freeSlotsAndPrograms(c.slots)
+		return
+	}
+	log.WithField("slots", c.slots).Debug("Shared policy program chain no longer used, retiring it.")
+	s.retiredSlots = append(s.retiredSlots, c.slots...)
+}
+
+// ReturnSlot returns the slot of the return trampoline of the endpoint with the given jump
+// map, calling load to load the trampoline into a new slot if the endpoint doesn't have one
+// yet.
+func (s *sharedPolProgs) ReturnSlot(jumpMapFD bpf.MapFD, load func(slot int) error) (int, error) {
+	s.lock.Lock()
+	ep := s.endpoint(jumpMapFD)
+	if ep.hasRetSlot {
+		s.lock.Unlock()
+		return ep.retSlot, nil
+	}
+	slots, err := s.allocSlots(1)
+	s.lock.Unlock()
+	if err != nil {
+		return 0, err
+	}
+
+	err = load(slots[0])
+
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	if err != nil {
+		s.freeSlotsAndPrograms(slots)
+		return 0, err
+	}
+	ep.retSlot = slots[0]
+	ep.hasRetSlot = true
+	return ep.retSlot, nil
+}
+
+// SetEndpointChain records that the endpoint with the given jump map now uses the given
+// chain, which the caller acquired, and releases the chain that it used before.
+func (s *sharedPolProgs) SetEndpointChain(jumpMapFD bpf.MapFD, c *sharedPolChain) {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	ep := s.endpoint(jumpMapFD)
+	if ep.chain != nil {
+		s.releaseChain(ep.chain)
+	}
+	ep.chain = c
+}
+
+// HasEndpoint returns true if the endpoint with the given jump map uses shared programs.
+func (s *sharedPolProgs) HasEndpoint(jumpMapFD bpf.MapFD) bool {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	_, ok := s.endpoints[jumpMapFD]
+	return ok
+}
+
+// ForgetEndpoint drops the record of the endpoint with the given jump map, which is about to
+// be closed.  If release is set, the endpoint's entry point to its chain is gone so we can
+// release its chain and free its return slot; otherwise, they are leaked since the endpoint
+// may still use them.
+func (s *sharedPolProgs) ForgetEndpoint(jumpMapFD bpf.MapFD, release bool) {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	ep, ok := s.endpoints[jumpMapFD]
+	if !ok {
+		return
+	}
+	delete(s.endpoints, jumpMapFD)
+	if !release {
+		log.WithField("jumpMapFD", jumpMapFD).Warn("Leaking the shared policy programs of an endpoint.")
+		return
+	}
+	if ep.chain != nil {
+		s.releaseChain(ep.chain)
+	}
+	if ep.hasRetSlot {
+		s.retiredSlots = append(s.retiredSlots, ep.retSlot)
+	}
+}
+
+// ReleaseStaleSlots retires the slots that were in use when we started.  It must only be
+// called once all the endpoints have moved to programs that we loaded.
+func (s *sharedPolProgs) ReleaseStaleSlots() {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	if len(s.staleSlots) == 0 {
+		return
+	}
+	log.WithField("numStale", len(s.staleSlots)).Info("Retiring stale shared policy programs.")
+	s.retiredSlots = append(s.retiredSlots, s.staleSlots...)
+	s.staleSlots = nil
+}
+
+// FreeRetiredSlots removes the programs in the slots that were retired before the previous
+// call and makes the slots available again.  It must be called once per update cycle, before
+// the endpoints are updated, so that the packets that were running the retired programs have
+// had a whole cycle to finish.
+func (s *sharedPolProgs) FreeRetiredSlots() {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	if len(s.retiredSlots) == 0 {
+		return
+	}
+	log.WithField("slots", s.retiredSlots).Debug("Removing retired shared policy programs.")
+	s.freeSlotsAndPrograms(s.retiredSlots)
+	s.retiredSlots = nil
+}
+
+func (s *sharedPolProgs) endpoint(jumpMapFD bpf.MapFD) *sharedPolEndpoint {
+	ep := s.endpoints[jumpMapFD]
+	if ep == nil {
+		ep = &sharedPolEndpoint{}
+		s.endpoints[jumpMapFD] = ep
+	}
+	return ep
+}
+
+// allocSlots allocates n consecutive slots, from the first run of free slots at or after
+// nextSlot.
+func (s *sharedPolProgs) allocSlots(n int) ([]int, error) {
+	if n > s.numFree {
+		return nil, errNoFreePolicySlots
+	}
+	start := s.nextSlot
+	for tried := 0; tried < len(s.free); {
+		if start+n > len(s.free) {
+			// The run can't wrap around, start again from the first slot.
+			tried += len(s.free) - start
+			start = 0
+			continue
+		}
+		run := 0
+		for run < n && s.free[start+run] {
+			run++
+		}
+		if run == n {
+			slots := make([]int, n)
+			for i := range slots {
+				slots[i] = start + i
+				s.free[start+i] = false
+			}
+			s.numFree -= n
+			s.nextSlot = (start + n) % len(s.free)
+			bpfSharedPolicySlotsFreeGauge.Set(float64(s.numFree))
+			return slots, nil
+		}
+		// Skip past the slot that is in use.
+		tried += run + 1
+		start += run + 1
+	}
+	return nil, errNoFreePolicySlots
+}
+
+func (s *sharedPolProgs) setSlotProg(slot int, hash polProgHash) {
+	if s.progSlots[hash] == nil {
+		s.progSlots[hash] = map[int]bool{}
+	}
+	s.progSlots[hash][slot] = true
+	s.slotProgs[slot] = hash
+}
+
+func (s *sharedPolProgs) freeSlotsAndPrograms(slots []int) {
+	k := make([]byte, 4)
+	for _, slot := range slots {
+		if hash, ok := s.slotProgs[slot]; ok {
+			delete(s.slotProgs, slot)
+			delete(s.progSlots[hash], slot)
+			if len(s.progSlots[hash]) == 0 {
+				delete(s.progSlots, hash)
+			}
+		}
+		binary.LittleEndian.PutUint32(k, uint32(slot))
+		if err := s.progArray.Delete(k); err != nil && !bpf.IsNotExists(err) {
+			// Don't reuse a slot that may still hold a program that an endpoint uses.
+			log.WithError(err).WithField("slot", slot).Error(
+				"Failed to remove shared policy program, leaking its slot.")
+			continue
+		}
+		if !s.free[slot] {
+			s.free[slot] = true
+			s.numFree++
+		}
+	}
+	bpfSharedPolicySlotsFreeGauge.Set(float64(s.numFree))
+}
@@ -0,0 +1,227 @@
+// +build !windows
+
+// Copyright (c) 2021 Tigera, Inc. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package intdataplane
+
+import (
+	"encoding/binary"
+	"errors"
+	"sort"
+
+	. "github.com/onsi/ginkgo"
+	. "github.com/onsi/gomega"
+
+	"github.com/projectcalico/felix/bpf/jump"
+	"github.com/projectcalico/felix/bpf/mock"
+)
+
+var _ = Describe("Shared policy programs", func() {
+	const numSlots = 8
+
+	var (
+		progArray    *mock.Map
+		shared       *sharedPolProgs
+		keyA, keyB   polProgHash
+		loads        int
+		loadPrograms func(slots []int) error
+	)
+
+	slotKey := func(slot int) string {
+		k := make([]byte, 4)
+		binary.LittleEndian.PutUint32(k, uint32(slot))
+		return string(k)
+	}
+	usedSlots := func() []int {
+		var slots []int
+		for k := range progArray.Contents {
+			slots = append(slots, int(binary.LittleEndian.Uint32([]byte(k))))
+		}
+		sort.Ints(slots)
+		return slots
+	}
+
+	BeforeEach(func() {
+		progArray = mock.NewMockMap(jump.PolicyProgsMapParameters)
+		// A program left over from before we started.
+		progArray.Contents[slotKey(0)] = "prog"
+		shared = newSharedPolProgs(progArray, numSlots)
+
+		keyA[0] = 1
+		keyB[0] = 2
+		loads = 0
+		loadPrograms = func(slots []int) error {
+			loads++
+			for _, slot := range slots {
+				progArray.Contents[slotKey(slot)] = "prog"
+			}
+			return nil
+		}
+	})
+
+	It("should load each chain once and share it", func() {
+		c1, err := shared.AcquireChain(keyA, make([]polProgHash, 2), loadPrograms)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(c1.slots).To(Equal([]int{1, 2}), "should skip the stale slot")
+		c2, err := shared.AcquireChain(keyA, make([]polProgHash, 2), loadPrograms)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(c2 == c1).To(BeTrue(), "should be the same chain")
+		Expect(loads).To(Equal(1))
+
+		c3, err := shared.AcquireChain(keyB, make([]polProgHash, 1), loadPrograms)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(c3.slots).To(Equal([]int{3}))
+		Expect(loads).To(Equal(2))
+
+		shared.SetEndpointChain(10, c1)
+		shared.SetEndpointChain(11, c2)
+		shared.SetEndpointChain(12, c3)
+		Expect(usedSlots()).To(Equal([]int{0, 1, 2, 3}))
+
+		// Moving the last user of a chain to another chain frees it, once the packets that
+		// were running it are done.
+		c4, err := shared.AcquireChain(keyA, make([]polProgHash, 2), loadPrograms)
+		Expect(err).NotTo(HaveOccurred())
+		shared.SetEndpointChain(12, c4)
+		Expect(usedSlots()).To(Equal([]int{0, 1, 2, 3}))
+		shared.FreeRetiredSlots()
+		Expect(usedSlots()).To(Equal([]int{0, 1, 2}))
+
+		shared.ForgetEndpoint(10, true)
+		shared.ForgetEndpoint(11, true)
+		shared.FreeRetiredSlots()
+		Expect(usedSlots()).To(Equal([]int{0, 1, 2}))
+		shared.ForgetEndpoint(12, true)
+		Expect(usedSlots()).To(Equal([]int{0, 1, 2}))
+		shared.FreeRetiredSlots()
+		Expect(usedSlots()).To(Equal([]int{0}))
+
+		// The chain is reloaded, in slots that weren't used recently.
+		c5, err := shared.AcquireChain(keyA, make([]polProgHash, 2), loadPrograms)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(c5.slots).To(Equal([]int{4, 5}))
+		Expect(loads).To(Equal(3))
+	})
+
+	It("should find the programs that the loaded chains have", func() {
+		var prog1, prog2 polProgHash
+		prog1[0] = 1
+		prog2[0] = 2
+		_, ok := shared.ProgramSlot(prog1)
+		Expect(ok).To(BeFalse())
+
+		c1, err := shared.AcquireChain(keyA, []polProgHash{prog1, prog2}, loadPrograms)
+		Expect(err).NotTo(HaveOccurred())
+		shared.SetEndpointChain(10, c1)
+		slot, ok := shared.ProgramSlot(prog2)
+		Expect(ok).To(BeTrue())
+		Expect(slot).To(Equal(c1.slots[1]))
+
+		// Once the chain's slots are freed, its programs are gone.
+		shared.ForgetEndpoint(10, true)
+		_, ok = shared.ProgramSlot(prog2)
+		Expect(ok).To(BeTrue(), "retired programs stay until the next cycle")
+		shared.FreeRetiredSlots()
+		_, ok = shared.ProgramSlot(prog2)
+		Expect(ok).To(BeFalse())
+	})
+
+	It("should give each chain consecutive slots", func() {
+		c1, err := shared.AcquireChain(keyA, make([]polProgHash, 3), loadPrograms)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(c1.slots).To(Equal([]int{1, 2, 3}))
+		shared.SetEndpointChain(10, c1)
+		c2, err := shared.AcquireChain(keyB, make([]polProgHash, 3), loadPrograms)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(c2.slots).To(Equal([]int{4, 5, 6}))
+		shared.SetEndpointChain(11, c2)
+
+		// Slots 1-3 are free again; there's no room for 3 slots after slot 6 so the chain
+		// goes back to the start.
+		shared.ForgetEndpoint(10, true)
+		shared.FreeRetiredSlots()
+		var keyC polProgHash
+		keyC[0] = 3
+		c3, err := shared.AcquireChain(keyC, make([]polProgHash, 3), loadPrograms)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(c3.slots).To(Equal([]int{1, 2, 3}))
+
+		// Slots 7 and 0 are free but a chain can't wrap around.
+		shared.ReleaseStaleSlots()
+		shared.FreeRetiredSlots()
+		var keyD polProgHash
+		keyD[0] = 4
+		_, err = shared.AcquireChain(keyD, make([]polProgHash, 2), loadPrograms)
+		Expect(err).To(Equal(errNoFreePolicySlots))
+	})
+
+	It("should not cache a chain that failed to load", func() {
+		_, err := shared.AcquireChain(keyA, make([]polProgHash, 2), func(slots []int) error {
+			progArray.Contents[slotKey(slots[1])] = "prog"
+			return errors.New("verifier says no")
+		})
+		Expect(err).To(HaveOccurred())
+		Expect(usedSlots()).To(Equal([]int{0}))
+
+		_, err = shared.AcquireChain(keyA, make([]polProgHash, 2), loadPrograms)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(loads).To(Equal(1))
+	})
+
+	It("should give each endpoint its own return slot", func() {
+		load := func(slot int) error {
+			progArray.Contents[slotKey(slot)] = "ret"
+			return nil
+		}
+		s1, err := shared.ReturnSlot(10, load)
+		Expect(err).NotTo(HaveOccurred())
+		s2, err := shared.ReturnSlot(11, load)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(s2).NotTo(Equal(s1))
+		again, err := shared.ReturnSlot(10, load)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(again).To(Equal(s1))
+		Expect(shared.HasEndpoint(10)).To(BeTrue())
+
+		shared.ForgetEndpoint(10, true)
+		Expect(shared.HasEndpoint(10)).To(BeFalse())
+		shared.FreeRetiredSlots()
+		Expect(usedSlots()).To(Equal([]int{0, s2}))
+
+		// If the endpoint may still use its slots, they're leaked.
+		shared.ForgetEndpoint(11, false)
+		Expect(shared.HasEndpoint(11)).To(BeFalse())
+		shared.FreeRetiredSlots()
+		Expect(usedSlots()).To(Equal([]int{0, s2}))
+	})
+
+	It("should free the stale slots once released", func() {
+		_, err := shared.AcquireChain(keyA, make([]polProgHash, numSlots-1), loadPrograms)
+		Expect(err).NotTo(HaveOccurred())
+		_, err = shared.AcquireChain(keyB, make([]polProgHash, 1), loadPrograms)
+		Expect(err).To(Equal(errNoFreePolicySlots))
+
+		shared.ReleaseStaleSlots()
+		Expect(progArray.Contents).To(HaveKey(slotKey(0)), "endpoints may still be running it")
+		_, err = shared.AcquireChain(keyB, make([]polProgHash, 1), loadPrograms)
+		Expect(err).To(Equal(errNoFreePolicySlots))
+
+		shared.FreeRetiredSlots()
+		Expect(progArray.Contents).NotTo(HaveKey(slotKey(0)))
+		c, err := shared.AcquireChain(keyB, make([]polProgHash, 1), loadPrograms)
+		Expect(err).NotTo(HaveOccurred())
+		Expect(c.slots).To(Equal([]int{0}))
+	})
+})
@@ -35,11 +35,16 @@ import (
 	"github.com/projectcalico/felix/bpf"
 	"github.com/projectcalico/felix/bpf/arp"
 	"github.com/projectcalico/felix/bpf/conntrack"
+	"github.com/projectcalico/felix/bpf/counters"
+	"github.com/projectcalico/felix/bpf/eventlog"
 	"github.com/projectcalico/felix/bpf/failsafes"
 	bpfipsets "github.com/projectcalico/felix/bpf/ipsets"
+	"github.com/projectcalico/felix/bpf/jump"
+	"github.com/projectcalico/felix/bpf/mapstats"
 	"github.com/projectcalico/felix/bpf/nat"
 	bpfproxy "github.com/projectcalico/felix/bpf/proxy"
 	"github.com/projectcalico/felix/bpf/routes"
+	"github.com/projectcalico/felix/bpf/sampling"
 	"github.com/projectcalico/felix/bpf/state"
 	"github.com/projectcalico/felix/bpf/tc"
 	"github.com/projectcalico/felix/config"
@@ -165,6 +170,13 @@ type Config struct {
 	BPFKubeProxyIptablesCleanupEnabled bool
 	BPFLogLevel                        string
 	BPFExtToServiceConnmark            int
+	BPFPolicyCIDRSetThreshold          int
+	BPFPolicyRuleCountersEnabled       bool
+	BPFPolicyProgramPerTierEnabled     bool
+	BPFLatencySampleRate               int
+	BPFFlowLogsEnabled                 bool
+	BPFPacketSampleRate                int
+	BPFMapHighWatermarkPercent         int
 	BPFDataIfacePattern                *regexp.Regexp
 	XDPEnabled                         bool
 	XDPAllowGeneric                    bool
@@ -269,6 +281,8 @@ type InternalDataplane struct {
 	// doneFirstApply is set after we finish the first update to the dataplane. It indicates
 	// that the dataplane should now be in sync.
 	doneFirstApply bool
+	// firstApplyDone is closed after the first update to the dataplane.
+	firstApplyDone chan struct{}
 
 	reschedTimer *time.Timer
 	reschedC     <-chan time.Time
@@ -286,6 +300,15 @@ type InternalDataplane struct {
 	callbacks         *callbacks
 
 	loopSummarizer *logutils.Summarizer
+
+	// backgroundWorkers are the threads, other than the managers', that read from or write to
+	// the dataplane.  Start() starts them and Stop() stops them.
+	backgroundWorkers []backgroundWorker
+}
+
+type backgroundWorker interface {
+	Start()
+	Stop()
 }
 
 const (
@@ -330,6 +353,7 @@ func NewIntDataplaneDriver(config Config) *InternalDataplane {
 		config:           config,
 		applyThrottle:    throttle.New(10),
 		loopSummarizer:   logutils.NewSummarizer("dataplane reconciliation loops"),
+		firstApplyDone:   make(chan struct{}),
 	}
 	dp.applyThrottle.Refill() // Allow the first apply() immediately.
 	dp.ifaceMonitor.StateCallback = dp.onIfaceStateChange
@@ -554,10 +578,16 @@ func NewIntDataplaneDriver(config Config) *InternalDataplane {
 		if err != nil {
 			log.WithError(err).Panic("Failed to create ipsets BPF map.")
 		}
+		ipSetsHashMap := bpfipsets.HashMap(bpfMapContext)
+		err = ipSetsHashMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create ipsets BPF hash map.")
+		}
 		ipSetsV4 := bpfipsets.NewBPFIPSets(
 			ipSetsConfigV4,
 			ipSetIDAllocator,
 			ipSetsMap,
+			ipSetsHashMap,
 			dp.loopSummarizer,
 		)
 		dp.ipSets = append(dp.ipSets, ipSetsV4)
@@ -580,6 +610,43 @@ func NewIntDataplaneDriver(config Config) *InternalDataplane {
 			log.WithError(err).Panic("Failed to create ARP BPF map.")
 		}
 
+		// The BPF programs log to per-CPU rings in the log maps, up to the level in the log
+		// level map, rather than to the trace pipe.  The cgroup programs have maps of their own.
+		logMap := eventlog.Map(bpfMapContext)
+		err = logMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create BPF log map.")
+		}
+		cgroupLogMap := eventlog.CgroupMap(bpfMapContext)
+		err = cgroupLogMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create BPF cgroup log map.")
+		}
+		logLevelMap := eventlog.LevelMap(bpfMapContext)
+		err = logLevelMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create BPF log level map.")
+		}
+		logLevel := eventlog.LevelFromString(strings.ToLower(config.BPFLogLevel))
+		err = eventlog.SetLevel(logLevelMap, logLevel)
+		if err != nil {
+			log.WithError(err).Panic("Failed to set BPF log level.")
+		}
+		// Packets that match the trace filter are logged whatever the log level.  The filter
+		// is set by calico-bpf, so the reader checks both maps and only reads the rings
+		// while either lets the programs log.
+		traceMap := eventlog.TraceMap(bpfMapContext)
+		err = traceMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create BPF trace filter map.")
+		}
+		dp.backgroundWorkers = append(dp.backgroundWorkers, eventlog.NewReader(
+			[]bpf.Map{logMap, cgroupLogMap}, logLevelMap, traceMap, nil))
+
+		// Mirror the kernel's neighbour table for the host interfaces into the ARP map so that
+		// the BPF programs can redirect straight to a neighbour from the first packet.
+		dp.backgroundWorkers = append(dp.backgroundWorkers, arp.NewNeighMirror(arpMap, config.BPFDataIfacePattern))
+
 		// The failsafe manager sets up the failsafe port map.  It's important that it is registered before the
 		// endpoint managers so that the map is brought up to date before they run for the first time.
 		failsafesMap := failsafes.Map(bpfMapContext)
@@ -595,6 +662,64 @@ func NewIntDataplaneDriver(config Config) *InternalDataplane {
 		)
 		dp.RegisterManager(failsafeMgr)
 
+		var ruleCounters *counters.RuleCounters
+		if config.BPFPolicyRuleCountersEnabled {
+			ruleCountersMap := counters.RuleMap(bpfMapContext)
+			err = ruleCountersMap.EnsureExists()
+			if err != nil {
+				log.WithError(err).Panic("Failed to create rule counters BPF map.")
+			}
+			ruleCounters = counters.NewRuleCounters(ruleCountersMap)
+			prometheus.MustRegister(ruleCounters)
+		}
+
+		verdictCountersMap := counters.VerdictMap(bpfMapContext)
+		err = verdictCountersMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create verdict counters BPF map.")
+		}
+		verdictCounters := counters.NewVerdictCounters(verdictCountersMap)
+		prometheus.MustRegister(verdictCounters)
+
+		latencyMap := counters.LatencyMap(bpfMapContext)
+		err = latencyMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create latency BPF map.")
+		}
+		latencyCfgMap := counters.LatencyCfgMap(bpfMapContext)
+		err = latencyCfgMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create latency config BPF map.")
+		}
+		err = counters.SetLatencySampling(latencyCfgMap, config.BPFLatencySampleRate)
+		if err != nil {
+			log.WithError(err).Panic("Failed to configure BPF latency sampling.")
+		}
+		prometheus.MustRegister(counters.NewLatencyHistograms(latencyMap))
+
+		// The packet samples are read by calico-bpf, which can also change the rate.
+		sampleMap := sampling.Map(bpfMapContext)
+		err = sampleMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create packet sample BPF map.")
+		}
+		sampleCfgMap := sampling.CfgMap(bpfMapContext)
+		err = sampleCfgMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create packet sample config BPF map.")
+		}
+		err = sampling.SetRate(sampleCfgMap, uint32(config.BPFPacketSampleRate))
+		if err != nil {
+			log.WithError(err).Panic("Failed to set BPF packet sampling rate.")
+		}
+
+		polProgsMap := jump.PolicyProgsMap(bpfMapContext)
+		err = polProgsMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create shared policy program BPF map.")
+		}
+		sharedPolProgs := newSharedPolProgs(polProgsMap, jump.PolicyProgsMapParameters.MaxEntries)
+
 		workloadIfaceRegex := regexp.MustCompile(strings.Join(interfaceRegexes, "|"))
 		bpfEndpointManager = newBPFEndpointManager(
 			&config,
@@ -602,7 +727,12 @@ func NewIntDataplaneDriver(config Config) *InternalDataplane {
 			workloadIfaceRegex,
 			ipSetIDAllocator,
 			ipSetsMap,
+			ipSetsHashMap,
+			ipSetsV4,
 			stateMap,
+			sharedPolProgs,
+			ruleCounters,
+			verdictCounters,
 			ruleRenderer,
 			filterTableV4,
 			dp.reportHealth,
@@ -642,6 +772,61 @@ func NewIntDataplaneDriver(config Config) *InternalDataplane {
 		conntrackScanner := conntrack.NewScanner(ctMap,
 			conntrack.NewLivenessScanner(config.BPFConntrackTimeouts, config.BPFNodePortDSREnabled))
 
+		// When flow logs are enabled, the BPF programs write flow-start records and count the
+		// packets of each flow; the flow log adds the flow-end records as the scanner deletes
+		// the conntrack entries.
+		flowRingMap := conntrack.FlowRingMap(bpfMapContext)
+		err = flowRingMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create flow ring BPF map.")
+		}
+		flowCountersMap := conntrack.FlowCountersMap(bpfMapContext)
+		err = flowCountersMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create flow counters BPF map.")
+		}
+		flowCfgMap := conntrack.FlowCfgMap(bpfMapContext)
+		err = flowCfgMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create flow config BPF map.")
+		}
+		err = conntrack.SetFlowsEnabled(flowCfgMap, config.BPFFlowLogsEnabled)
+		if err != nil {
+			log.WithError(err).Panic("Failed to configure BPF flow logs.")
+		}
+		if config.BPFFlowLogsEnabled {
+			flowLog := conntrack.NewFlowLog(flowRingMap, flowCountersMap)
+			conntrackScanner.AddUnlocked(flowLog)
+			dp.backgroundWorkers = append(dp.backgroundWorkers, flowLog, conntrack.NewFlowStats(flowLog.Records()))
+		}
+
+		// Export the occupancy of the maps that the BPF programs or Felix add entries to, and
+		// the entries that the programs failed to insert, so that we hear about full maps
+		// before they cause drops.
+		mapErrMap := mapstats.ErrMap(bpfMapContext)
+		err = mapErrMap.EnsureExists()
+		if err != nil {
+			log.WithError(err).Panic("Failed to create map insert failures BPF map.")
+		}
+		// The collector opens its own handles on the maps, including the insert failures map;
+		// some of them are only created by the first apply.
+		mapStats := mapstats.NewCollector(float64(config.BPFMapHighWatermarkPercent) / 100)
+		mapStats.AddMap(conntrack.MapParams)
+		mapStats.AddMap(nat.FrontendMapParameters)
+		mapStats.AddMap(nat.BackendMapParameters)
+		mapStats.AddMap(nat.AffinityMapParameters)
+		mapStats.AddMap(routes.MapParameters)
+		mapStats.AddMap(bpfipsets.MapParameters)
+		mapStats.AddMap(bpfipsets.HashMapParameters)
+		mapStats.AddMap(arp.MapParams)
+		// Only created if connect-time load balancing is enabled.
+		mapStats.AddMap(nat.SendRecvMsgMapParameters)
+		mapStats.AddMap(nat.CTNATsMapParameters)
+		mapStats.AddMap(conntrack.FlowCountersMapParams)
+		mapStats.StartAfter(dp.firstApplyDone)
+		dp.backgroundWorkers = append(dp.backgroundWorkers, mapStats)
+		prometheus.MustRegister(mapStats)
+
 		// Before we start, scan for all finished / timed out connections to
 		// free up the conntrack table asap as it may take time to sync up the
 		// proxy and kick off the first full cleaner scan.
@@ -683,7 +868,7 @@ func NewIntDataplaneDriver(config Config) *InternalDataplane {
 
 		if config.BPFConnTimeLBEnabled {
 			// Activate the connect-time load balancer.
-			err = nat.InstallConnectTimeLoadBalancer(frontendMap, backendMap, routeMap, config.BPFCgroupV2, config.BPFLogLevel)
+			err = nat.InstallConnectTimeLoadBalancer(frontendMap, backendMap, routeMap, config.BPFCgroupV2)
 			if err != nil {
 				log.WithError(err).Panic("BPFConnTimeLBEnabled but failed to attach connect-time load balancer, bailing out.")
 			}
@@ -1014,6 +1199,18 @@ func (d *InternalDataplane) Start() {
 	go d.loopReportingStatus()
 	go d.ifaceMonitor.MonitorInterfaces()
 	go d.monitorHostMTU()
+
+	for _, w := range d.backgroundWorkers {
+		w.Start()
+	}
+}
+
+// Stop stops the background workers, as part of Felix's graceful shutdown.  The dataplane
+// isn't usable after that.
+func (d *InternalDataplane) Stop() {
+	for i := len(d.backgroundWorkers) - 1; i >= 0; i-- {
+		d.backgroundWorkers[i].Stop()
+	}
 }
 
 // onIfaceStateChange is our interface monitor callback.  It gets called from the monitor's thread.
@@ -1632,6 +1829,7 @@ func (d *InternalDataplane) loopUpdatingDataplane() {
 					).Info("Completed first update to dataplane.")
 					d.loopSummarizer.RecordOperation("first-update")
 					d.doneFirstApply = true
+					close(d.firstApplyDone)
 					if d.config.PostInSyncCallback != nil {
 						d.config.PostInSyncCallback()
 					}
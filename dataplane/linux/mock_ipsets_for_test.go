@@ -16,6 +16,7 @@ package intdataplane
 
 import (
 	"net"
+	"strings"
 
 	. "github.com/onsi/gomega"
 
@@ -27,12 +28,16 @@ type mockIPSets struct {
 	Members            map[string]set.Set
 	Metadata           map[string]ipsets.IPSetMetadata
 	AddOrReplaceCalled bool
+	MemberKindChanges  []string
+	// Applied holds the members that ApplyAdds has written to the "dataplane".
+	Applied map[string]set.Set
 }
 
 func newMockIPSets() *mockIPSets {
 	return &mockIPSets{
 		Members:  map[string]set.Set{},
 		Metadata: map[string]ipsets.IPSetMetadata{},
+		Applied:  map[string]set.Set{},
 	}
 }
 
@@ -95,6 +100,40 @@ func (s *mockIPSets) ApplyUpdates() {
 	// Not implemented for UT.
 }
 
+func (s *mockIPSets) ApplyAdds() {
+	for setID, members := range s.Members {
+		if s.Applied[setID] == nil {
+			s.Applied[setID] = set.New()
+		}
+		members.Iter(func(item interface{}) error {
+			s.Applied[setID].Add(item)
+			return nil
+		})
+	}
+}
+
 func (s *mockIPSets) ApplyDeletions() {
 	// Not implemented for UT.
 }
+
+func (s *mockIPSets) MemberKinds(setID string) (exact, cidr bool) {
+	members := s.Members[setID]
+	if members == nil {
+		return false, false
+	}
+	members.Iter(func(item interface{}) error {
+		if m := item.(string); strings.Contains(m, "/") && !strings.HasSuffix(m, "/32") {
+			cidr = true
+		} else {
+			exact = true
+		}
+		return nil
+	})
+	return
+}
+
+func (s *mockIPSets) TakeMemberKindChanges() []string {
+	changes := s.MemberKindChanges
+	s.MemberKindChanges = nil
+	return changes
+}